@@ -161,6 +161,17 @@ wss.on('connection', function(ws) {
 
   stream.on('readable', tryRead)
 
+  ws.on('message', function(message) {
+    // The browser tells us its viewport size as <w>x<h>/{0|90|180|270}.
+    // Wrap it into a viewport message so that minicap scales frames down
+    // for us.
+    var payload = new Buffer(String(message))
+    var header = new Buffer(5)
+    header.writeUInt32LE(payload.length + 1, 0)
+    header[4] = 0x01
+    stream.write(Buffer.concat([header, payload]))
+  })
+
   ws.on('close', function() {
     console.info('Lost a client')
     stream.end()
@@ -9,6 +9,7 @@ public:
     METHOD_FRAMEBUFFER      = 1,
     METHOD_SCREENSHOT       = 2,
     METHOD_VIRTUAL_DISPLAY  = 3,
+    METHOD_SYNTHETIC        = 4,
   };
 
   enum Format {
@@ -24,6 +25,11 @@ public:
     FORMAT_BGRA_8888     = 0x0a,
     FORMAT_RGBA_5551     = 0x0b,
     FORMAT_RGBA_4444     = 0x0c,
+    FORMAT_RGBA_1010102  = 0x0d,
+    FORMAT_RGBA_FP16     = 0x0e,
+    FORMAT_NV12          = 0x0f,
+    FORMAT_NV21          = 0x10,
+    FORMAT_I420          = 0x11,
     FORMAT_UNKNOWN       = 0x00,
   };
 
@@ -46,6 +52,11 @@ public:
     bool secure;
   };
 
+  // YUV frames are 4:2:0 in full range BT.601, like JPG itself. For them,
+  // data, stride and bpp describe the luma plane, and planes and strides
+  // (in bytes) describe all of them: Y, then interleaved chroma for NV12
+  // (CbCr) and NV21 (CrCb), or Y, Cb and Cr for I420. Other formats leave
+  // planes and strides alone.
   struct Frame {
     void const* data;
     Format format;
@@ -54,6 +65,8 @@ public:
     uint32_t stride;
     uint32_t bpp;
     size_t size;
+    void const* planes[3];
+    uint32_t strides[3];
   };
 
   struct FrameAvailableListener {
@@ -114,8 +127,35 @@ public:
   // used: width and height.
   virtual int
   setRealInfo(const DisplayInfo& info) = 0;
+
+  // Everything below was added in backend version 2. Methods only ever get
+  // added here, so that older builds of minicap.so keep working; check
+  // minicap_backend_version() before calling any of them.
+
+  // Peek behind the scenes to see which format frames are actually
+  // delivered in, which may differ from the preferred format. Backends that
+  // can't tell before capturing return FORMAT_UNKNOWN until the first frame.
+  virtual Format
+  getCaptureFormat() = 0;
+
+  // Sets the format frames should preferably be delivered in, so that the
+  // consumer doesn't have to deal with channels it doesn't need. Backends
+  // that can choose use it once the configuration has been applied; others
+  // keep delivering whatever the system gives them. Either way, check
+  // Frame::format.
+  virtual int
+  setPreferredFormat(Format format) = 0;
 };
 
+// The version of this interface the backend implements.
+#define MINICAP_BACKEND_VERSION 2
+
+// Returns MINICAP_BACKEND_VERSION as of when the backend was built. Builds
+// from before version 2 don't have it at all, and the weak reference makes
+// it NULL instead of failing to load.
+int
+minicap_backend_version() __attribute__((weak));
+
 // Attempt to get information about the given display. This may segfault
 // on some devices due to manufacturer (mainly Samsung) customizations.
 int
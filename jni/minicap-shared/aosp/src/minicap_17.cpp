@@ -93,6 +93,7 @@ public:
       mDesiredWidth(0),
       mDesiredHeight(0),
       mDesiredOrientation(0),
+      mCaptureFormat(android::PIXEL_FORMAT_RGBA_8888),
       mHaveBuffer(false),
       mHaveRunningDisplay(false) {
   }
@@ -138,6 +139,11 @@ public:
     return 0;
   }
 
+  virtual Minicap::Format
+  getCaptureFormat() {
+    return convertFormat(mCaptureFormat);
+  }
+
   virtual Minicap::CaptureMethod
   getCaptureMethod() {
     return METHOD_VIRTUAL_DISPLAY;
@@ -174,6 +180,33 @@ public:
     mUserFrameAvailableListener = listener;
   }
 
+  virtual int
+  setPreferredFormat(Minicap::Format format) {
+    // Formats we can't ask for simply keep the current one, the consumer
+    // will see what it gets.
+    switch (format) {
+    case FORMAT_RGBA_8888:
+      mCaptureFormat = android::PIXEL_FORMAT_RGBA_8888;
+      break;
+    case FORMAT_RGBX_8888:
+      mCaptureFormat = android::PIXEL_FORMAT_RGBX_8888;
+      break;
+    case FORMAT_RGB_888:
+      mCaptureFormat = android::PIXEL_FORMAT_RGB_888;
+      break;
+    case FORMAT_RGB_565:
+      mCaptureFormat = android::PIXEL_FORMAT_RGB_565;
+      break;
+    case FORMAT_BGRA_8888:
+      mCaptureFormat = android::PIXEL_FORMAT_BGRA_8888;
+      break;
+    default:
+      break;
+    }
+
+    return 0;
+  }
+
   virtual int
   setRealInfo(const Minicap::DisplayInfo& info) {
     mRealWidth = info.width;
@@ -188,6 +221,7 @@ private:
   uint32_t mDesiredWidth;
   uint32_t mDesiredHeight;
   uint8_t mDesiredOrientation;
+  android::PixelFormat mCaptureFormat;
   android::sp<android::BufferQueue> mBufferQueue;
   android::sp<android::CpuConsumer> mConsumer;
   android::sp<android::IBinder> mVirtualDisplay;
@@ -262,7 +296,7 @@ private:
     mBufferQueue = mConsumer->getBufferQueue();
     mBufferQueue->setSynchronousMode(false);
     mBufferQueue->setDefaultBufferSize(targetWidth, targetHeight);
-    mBufferQueue->setDefaultBufferFormat(android::PIXEL_FORMAT_RGBA_8888);
+    mBufferQueue->setDefaultBufferFormat(mCaptureFormat);
 
     MCINFO("Creating frame waiter");
     mFrameProxy = new FrameProxy(mUserFrameAvailableListener);
@@ -366,6 +400,11 @@ minicap_free(Minicap* mc) {
   delete mc;
 }
 
+int
+minicap_backend_version() {
+  return MINICAP_BACKEND_VERSION;
+}
+
 void
 minicap_start_thread_pool() {
   android::ProcessState::self()->startThreadPool();
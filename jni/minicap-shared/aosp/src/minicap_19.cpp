@@ -99,6 +99,7 @@ public:
       mDesiredWidth(0),
       mDesiredHeight(0),
       mDesiredOrientation(0),
+      mCaptureFormat(android::PIXEL_FORMAT_RGBA_8888),
       mHaveBuffer(false),
       mHaveRunningDisplay(false) {
   }
@@ -144,6 +145,11 @@ public:
     return 0;
   }
 
+  virtual Minicap::Format
+  getCaptureFormat() {
+    return convertFormat(mCaptureFormat);
+  }
+
   virtual Minicap::CaptureMethod
   getCaptureMethod() {
     return METHOD_VIRTUAL_DISPLAY;
@@ -180,6 +186,33 @@ public:
     mUserFrameAvailableListener = listener;
   }
 
+  virtual int
+  setPreferredFormat(Minicap::Format format) {
+    // Formats we can't ask for simply keep the current one, the consumer
+    // will see what it gets.
+    switch (format) {
+    case FORMAT_RGBA_8888:
+      mCaptureFormat = android::PIXEL_FORMAT_RGBA_8888;
+      break;
+    case FORMAT_RGBX_8888:
+      mCaptureFormat = android::PIXEL_FORMAT_RGBX_8888;
+      break;
+    case FORMAT_RGB_888:
+      mCaptureFormat = android::PIXEL_FORMAT_RGB_888;
+      break;
+    case FORMAT_RGB_565:
+      mCaptureFormat = android::PIXEL_FORMAT_RGB_565;
+      break;
+    case FORMAT_BGRA_8888:
+      mCaptureFormat = android::PIXEL_FORMAT_BGRA_8888;
+      break;
+    default:
+      break;
+    }
+
+    return 0;
+  }
+
   virtual int
   setRealInfo(const Minicap::DisplayInfo& info) {
     mRealWidth = info.width;
@@ -194,6 +227,7 @@ private:
   uint32_t mDesiredWidth;
   uint32_t mDesiredHeight;
   uint8_t mDesiredOrientation;
+  android::PixelFormat mCaptureFormat;
   android::sp<android::BufferQueue> mBufferQueue;
   android::sp<android::CpuConsumer> mConsumer;
   android::sp<android::IBinder> mVirtualDisplay;
@@ -273,7 +307,7 @@ private:
     mConsumer = new(operator new(sizeof(android::CpuConsumer) + 100)) android::CpuConsumer(mBufferQueue, 3, false);
     mConsumer->setName(android::String8("minicap"));
     mConsumer->setDefaultBufferSize(targetWidth, targetHeight);
-    mConsumer->setDefaultBufferFormat(android::PIXEL_FORMAT_RGBA_8888);
+    mConsumer->setDefaultBufferFormat(mCaptureFormat);
 
     MCINFO("Creating frame waiter");
     mFrameProxy = new FrameProxy(mUserFrameAvailableListener);
@@ -378,6 +412,11 @@ minicap_free(Minicap* mc) {
   delete mc;
 }
 
+int
+minicap_backend_version() {
+  return MINICAP_BACKEND_VERSION;
+}
+
 void
 minicap_start_thread_pool() {
   android::ProcessState::self()->startThreadPool();
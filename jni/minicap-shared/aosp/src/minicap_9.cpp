@@ -67,7 +67,8 @@ public:
     : mDisplayId(displayId),
       mComposer(android::ComposerService::getComposerService()),
       mDesiredWidth(0),
-      mDesiredHeight(0) {
+      mDesiredHeight(0),
+      mCaptureFormat(FORMAT_UNKNOWN) {
   }
 
   virtual
@@ -100,6 +101,7 @@ public:
     frame->width = width;
     frame->height = height;
     frame->format = convertFormat(format);
+    mCaptureFormat = frame->format;
     frame->stride = width;
     frame->bpp = android::bytesPerPixel(format);
     frame->size = mHeap->getSize();
@@ -107,6 +109,11 @@ public:
     return 0;
   }
 
+  virtual Minicap::Format
+  getCaptureFormat() {
+    return mCaptureFormat;
+  }
+
   virtual Minicap::CaptureMethod
   getCaptureMethod() {
     return METHOD_SCREENSHOT;
@@ -140,6 +147,12 @@ public:
     mUserFrameAvailableListener = listener;
   }
 
+  virtual int
+  setPreferredFormat(Minicap::Format /* format */) {
+    // Screenshots always come in whatever format the system chooses.
+    return 0;
+  }
+
   virtual int
   setRealInfo(const Minicap::DisplayInfo& info) {
     return 0;
@@ -151,6 +164,7 @@ private:
   android::sp<android::IMemoryHeap> mHeap;
   uint32_t mDesiredWidth;
   uint32_t mDesiredHeight;
+  Minicap::Format mCaptureFormat;
   Minicap::FrameAvailableListener* mUserFrameAvailableListener;
 
   static Minicap::Format
@@ -219,6 +233,11 @@ minicap_free(Minicap* mc) {
   delete mc;
 }
 
+int
+minicap_backend_version() {
+  return MINICAP_BACKEND_VERSION;
+}
+
 void
 minicap_start_thread_pool() {
   android::ProcessState::self()->startThreadPool();
@@ -20,6 +20,11 @@ void
 minicap_free(Minicap* mc) {
 }
 
+int
+minicap_backend_version() {
+  return MINICAP_BACKEND_VERSION;
+}
+
 void
 minicap_start_thread_pool() {
 }
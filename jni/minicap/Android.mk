@@ -4,16 +4,43 @@ include $(CLEAR_VARS)
 LOCAL_MODULE := minicap-common
 
 LOCAL_SRC_FILES := \
+	CaptureProbe.cpp \
+	CaptureSession.cpp \
+	CaptureWatchdog.cpp \
+	ClientCapacity.cpp \
+	FrameConverter.cpp \
+	FrameScaler.cpp \
+	FrameSnapshot.cpp \
+	FrameStreamer.cpp \
+	HugePageBuffer.cpp \
+	JankMonitor.cpp \
 	JpgEncoder.cpp \
+	LumaImage.cpp \
+	QuantTables.cpp \
+	RegionTracker.cpp \
+	RegionWatcher.cpp \
+	ScreenIndex.cpp \
 	SimpleServer.cpp \
+	SyntheticMinicap.cpp \
+	TemplateMatcher.cpp \
+	TileWalker.cpp \
+	UdpTransport.cpp \
+	VisualDiff.cpp \
+	Watermark.cpp \
 	minicap.cpp \
 
+LOCAL_C_INCLUDES := \
+	$(LOCAL_PATH)/include \
+
 LOCAL_STATIC_LIBRARIES := \
 	libjpeg-turbo \
 
 LOCAL_SHARED_LIBRARIES := \
 	minicap-shared \
 
+# For loading other builds of minicap.so with -M.
+LOCAL_EXPORT_LDLIBS := -ldl
+
 include $(BUILD_STATIC_LIBRARY)
 
 include $(CLEAR_VARS)
@@ -24,14 +51,179 @@ LOCAL_LDFLAGS += -fPIE -pie
 
 LOCAL_MODULE := minicap
 
+# Screenshots go through the same C API as libminicap.so.
+LOCAL_SRC_FILES := \
+	libminicap.cpp \
+
+LOCAL_C_INCLUDES := \
+	$(LOCAL_PATH)/include \
+
 LOCAL_STATIC_LIBRARIES := minicap-common
 
 include $(BUILD_EXECUTABLE)
 
 include $(CLEAR_VARS)
 
+LOCAL_MODULE := libminicap
+
+LOCAL_SRC_FILES := \
+	libminicap.cpp \
+
+LOCAL_C_INCLUDES := \
+	$(LOCAL_PATH)/include \
+
+LOCAL_EXPORT_C_INCLUDES := \
+	$(LOCAL_PATH)/include \
+
+LOCAL_STATIC_LIBRARIES := \
+	minicap-common \
+	libjpeg-turbo \
+
+LOCAL_SHARED_LIBRARIES := \
+	minicap-shared \
+
+include $(BUILD_SHARED_LIBRARY)
+
+include $(CLEAR_VARS)
+
 LOCAL_MODULE := minicap-nopie
 
+# Screenshots go through the same C API as libminicap.so.
+LOCAL_SRC_FILES := \
+	libminicap.cpp \
+
+LOCAL_C_INCLUDES := \
+	$(LOCAL_PATH)/include \
+
+LOCAL_STATIC_LIBRARIES := minicap-common
+
+include $(BUILD_EXECUTABLE)
+
+include $(CLEAR_VARS)
+
+# Enable PIE manually. Will get reset on $(CLEAR_VARS).
+LOCAL_CFLAGS += -fPIE
+LOCAL_LDFLAGS += -fPIE -pie
+
+LOCAL_MODULE := minicap-udp-test
+
+LOCAL_SRC_FILES := \
+	test/udp-test.cpp \
+
+LOCAL_C_INCLUDES := \
+	$(LOCAL_PATH) \
+
+LOCAL_STATIC_LIBRARIES := minicap-common
+
+include $(BUILD_EXECUTABLE)
+
+include $(CLEAR_VARS)
+
+# Enable PIE manually. Will get reset on $(CLEAR_VARS).
+LOCAL_CFLAGS += -fPIE
+LOCAL_LDFLAGS += -fPIE -pie
+
+LOCAL_MODULE := minicap-vsock-test
+
+LOCAL_SRC_FILES := \
+	test/vsock-test.cpp \
+
+LOCAL_C_INCLUDES := \
+	$(LOCAL_PATH) \
+
+LOCAL_STATIC_LIBRARIES := minicap-common
+
+include $(BUILD_EXECUTABLE)
+
+include $(CLEAR_VARS)
+
+# Enable PIE manually. Will get reset on $(CLEAR_VARS).
+LOCAL_CFLAGS += -fPIE
+LOCAL_LDFLAGS += -fPIE -pie
+
+LOCAL_MODULE := minicap-bench
+
+LOCAL_SRC_FILES := \
+	bench/minicap-bench.cpp \
+	Watermark.cpp \
+
+LOCAL_C_INCLUDES := \
+	$(LOCAL_PATH) \
+
+LOCAL_STATIC_LIBRARIES := \
+	libjpeg-turbo \
+
+include $(BUILD_EXECUTABLE)
+
+include $(CLEAR_VARS)
+
+# Enable PIE manually. Will get reset on $(CLEAR_VARS).
+LOCAL_CFLAGS += -fPIE
+LOCAL_LDFLAGS += -fPIE -pie
+
+LOCAL_MODULE := minicap-quant-rd
+
+LOCAL_SRC_FILES := \
+	bench/quant-rd.cpp \
+	HugePageBuffer.cpp \
+	JpgEncoder.cpp \
+	QuantTables.cpp \
+
+# Only the headers of minicap-shared are needed.
+LOCAL_C_INCLUDES := \
+	$(LOCAL_PATH) \
+	$(LOCAL_PATH)/../minicap-shared/aosp/include \
+
+LOCAL_STATIC_LIBRARIES := \
+	libjpeg-turbo \
+
+include $(BUILD_EXECUTABLE)
+
+include $(CLEAR_VARS)
+
+# Enable PIE manually. Will get reset on $(CLEAR_VARS).
+LOCAL_CFLAGS += -fPIE
+LOCAL_LDFLAGS += -fPIE -pie
+
+LOCAL_MODULE := minicap-microbench
+
+LOCAL_SRC_FILES := \
+	bench/microbench.cpp \
+	FrameConverter.cpp \
+	FrameScaler.cpp \
+	HugePageBuffer.cpp \
+	JankMonitor.cpp \
+	JpgEncoder.cpp \
+	LumaImage.cpp \
+	QuantTables.cpp \
+	RegionWatcher.cpp \
+	TemplateMatcher.cpp \
+	VisualDiff.cpp \
+
+# Only the headers of minicap-shared are needed.
+LOCAL_C_INCLUDES := \
+	$(LOCAL_PATH) \
+	$(LOCAL_PATH)/../minicap-shared/aosp/include \
+
+LOCAL_STATIC_LIBRARIES := \
+	libjpeg-turbo \
+
+include $(BUILD_EXECUTABLE)
+
+include $(CLEAR_VARS)
+
+# Enable PIE manually. Will get reset on $(CLEAR_VARS).
+LOCAL_CFLAGS += -fPIE
+LOCAL_LDFLAGS += -fPIE -pie
+
+LOCAL_MODULE := minicap-probe-test
+
+LOCAL_SRC_FILES := \
+	test/probe-test.cpp \
+
+LOCAL_C_INCLUDES := \
+	$(LOCAL_PATH) \
+
 LOCAL_STATIC_LIBRARIES := minicap-common
 
 include $(BUILD_EXECUTABLE)
@@ -0,0 +1,36 @@
+#ifndef MINICAP_BANNER_HPP
+#define MINICAP_BANNER_HPP
+
+#include <stdint.h>
+#include <string.h>
+
+#include <Minicap.hpp>
+
+#include "util/pump.hpp"
+
+// The global header that every client gets before anything else. See the
+// README for the layout.
+class Banner {
+public:
+  static const unsigned char VERSION = 1;
+  static const size_t SIZE = 32;
+  // The resume token is filled in separately for each client.
+  static const size_t TOKEN_OFFSET = 24;
+
+  static void
+  write(unsigned char* banner, uint32_t pid, const Minicap::DisplayInfo& realInfo,
+      const Minicap::DisplayInfo& desiredInfo, unsigned char quirks) {
+    banner[0] = VERSION;
+    banner[1] = SIZE;
+    putUInt32LE(banner + 2, pid);
+    putUInt32LE(banner + 6, realInfo.width);
+    putUInt32LE(banner + 10, realInfo.height);
+    putUInt32LE(banner + 14, desiredInfo.width);
+    putUInt32LE(banner + 18, desiredInfo.height);
+    banner[22] = (unsigned char) desiredInfo.orientation;
+    banner[23] = quirks;
+    memset(banner + TOKEN_OFFSET, 0, 8);
+  }
+};
+
+#endif
@@ -0,0 +1,149 @@
+#include "CaptureProbe.hpp"
+
+#include <poll.h>
+
+#include <algorithm>
+#include <chrono>
+
+#include "util/debug.h"
+#include "FrameWaiter.hpp"
+
+typedef std::chrono::steady_clock Clock;
+
+static float
+toMillis(Clock::duration duration) {
+  return std::chrono::duration_cast<std::chrono::microseconds>(duration).count() / 1000.0f;
+}
+
+// How long the source needs per frame at best. Dumb capture methods send
+// a frame whenever the last one was consumed, so their frame rate is what
+// they can do. Others only send frames when the screen changes, and their
+// frame rate says more about the screen than about them.
+static float
+frameCost(const CaptureProbe::Result& result) {
+  if (result.quirks & CaptureSession::QUIRK_DUMB) {
+    return std::max(result.frameMs, 1000.0f / result.fps);
+  }
+
+  return result.frameMs;
+}
+
+// Whether a is better than b, both of which got frames.
+static bool
+isBetter(const CaptureProbe::Result& a, const CaptureProbe::Result& b) {
+  float costA = frameCost(a);
+  float costB = frameCost(b);
+
+  if (costA * 1.1f < costB) {
+    return true;
+  }
+
+  if (costB * 1.1f < costA) {
+    return false;
+  }
+
+  return a.firstFrameMs < b.firstFrameMs;
+}
+
+CaptureProbe::CaptureProbe(uint32_t displayId, uint32_t durationMs)
+  : mDisplayId(displayId),
+    mDurationMs(durationMs)
+{
+}
+
+void
+CaptureProbe::run(const CaptureSession::Source& source, const Minicap::DisplayInfo& realInfo,
+    const Minicap::DisplayInfo& desiredInfo, Minicap::Format preferredFormat) {
+  Result result;
+  result.name = source.getName();
+  result.method = "unknown";
+  result.ok = false;
+  result.quirks = 0;
+  result.frames = 0;
+  result.fps = 0;
+  result.firstFrameMs = 0;
+  result.frameMs = 0;
+
+  // Declared first so that it outlives the session, which may still
+  // announce frames while shutting down.
+  FrameWaiter waiter;
+  CaptureSession session;
+
+  if (!session.create(mDisplayId, source)) {
+    MCWARN("Capture source '%s' is not available", result.name.c_str());
+    mResults.push_back(result);
+    return;
+  }
+
+  result.method = session.getMethodName();
+  result.quirks = session.getQuirks();
+
+  Clock::time_point start = Clock::now();
+
+  if (!session.configure(realInfo, desiredInfo, preferredFormat, &waiter)) {
+    MCWARN("Capture source '%s' did not start", result.name.c_str());
+    mResults.push_back(result);
+    return;
+  }
+
+  Clock::time_point end = start + std::chrono::milliseconds(mDurationMs);
+  Clock::time_point first;
+  Clock::duration busy = Clock::duration::zero();
+  Minicap::Frame frame;
+
+  while (Clock::now() < end) {
+    if (waiter.tryWaitForFrame() <= 0) {
+      struct pollfd pfd = { waiter.getWakeFd(), POLLIN, 0 };
+      int left = std::chrono::duration_cast<std::chrono::milliseconds>(end - Clock::now()).count();
+      poll(&pfd, 1, left > 0 ? left : 0);
+      waiter.drain();
+      continue;
+    }
+
+    Clock::time_point before = Clock::now();
+
+    if (session.consume(&frame) != 0) {
+      continue;
+    }
+
+    session.release(&frame);
+
+    Clock::time_point after = Clock::now();
+    busy += after - before;
+
+    if (result.frames++ == 0) {
+      first = after;
+    }
+  }
+
+  if (result.frames > 0) {
+    result.ok = true;
+    result.firstFrameMs = toMillis(first - start);
+    result.frameMs = toMillis(busy) / result.frames;
+    result.fps = result.frames * 1000.0f / mDurationMs;
+  }
+
+  MCINFO("Capture source '%s' (%s): %u frames, %.1ffps, first after %.2fms, %.2fms per frame",
+    result.name.c_str(), result.method.c_str(), result.frames, result.fps,
+    result.firstFrameMs, result.frameMs);
+
+  mResults.push_back(result);
+}
+
+const std::vector<CaptureProbe::Result>&
+CaptureProbe::getResults() {
+  return mResults;
+}
+
+int
+CaptureProbe::pick(const std::vector<Result>& results) {
+  int best = -1;
+
+  for (size_t i = 0; i < results.size(); ++i) {
+    if (results[i].ok && (best < 0 || isBetter(results[i], results[best]))) {
+      best = i;
+    }
+  }
+
+  return best;
+}
@@ -0,0 +1,57 @@
+#ifndef MINICAP_CAPTURE_PROBE_HPP
+#define MINICAP_CAPTURE_PROBE_HPP
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+#include <Minicap.hpp>
+
+#include "CaptureSession.hpp"
+
+// Runs each of several capture sources for a moment, consuming frames as
+// fast as they come, and picks the one that works best. Some vendor builds
+// have a virtual display that works but is slower than screenshots, or the
+// other way round, and only trying them out tells.
+class CaptureProbe {
+public:
+  struct Result {
+    std::string name;
+    std::string method;
+    bool ok;
+    unsigned char quirks;
+    uint32_t frames;
+    float fps;
+    // From starting the capture method to the first frame, and the average
+    // time consuming and releasing a frame took.
+    float firstFrameMs;
+    float frameMs;
+  };
+
+  CaptureProbe(uint32_t displayId, uint32_t durationMs);
+
+  // Tries out the source and adds the result to the list, even if it
+  // doesn't work at all.
+  void
+  run(const CaptureSession::Source& source, const Minicap::DisplayInfo& realInfo,
+    const Minicap::DisplayInfo& desiredInfo, Minicap::Format preferredFormat);
+
+  const std::vector<Result>&
+  getResults();
+
+  // The index of the best result, or -1 if none worked. Sources that got
+  // frames win by how long a frame takes: the time between frames for dumb
+  // capture methods, and the time consuming one took for the others, whose
+  // frame rate only depends on the screen. Within 10%, the one that
+  // started faster wins.
+  static int
+  pick(const std::vector<Result>& results);
+
+private:
+  uint32_t mDisplayId;
+  uint32_t mDurationMs;
+  std::vector<Result> mResults;
+};
+
+#endif
@@ -0,0 +1,312 @@
+#include "CaptureSession.hpp"
+
+#include <dlfcn.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "util/debug.h"
+#include "SyntheticMinicap.hpp"
+
+// The entry points of minicap.so are C++ functions, so other builds of it
+// have to be looked up by their mangled names.
+#define MINICAP_CREATE_SYMBOL "_Z14minicap_createi"
+#define MINICAP_FREE_SYMBOL "_Z12minicap_freeP7Minicap"
+#define MINICAP_BACKEND_VERSION_SYMBOL "_Z23minicap_backend_versionv"
+
+CaptureSession::Source::Source()
+  : syntheticFps(0),
+    watermark(false)
+{
+}
+
+bool
+CaptureSession::Source::parse(const std::string& value) {
+  *this = Source();
+
+  if (value.empty()) {
+    return false;
+  }
+
+  if (value == "default") {
+    return true;
+  }
+
+  if (value.compare(0, 10, "synthetic:") == 0) {
+    syntheticFps = atof(value.c_str() + 10);
+    return syntheticFps > 0;
+  }
+
+  library = value;
+
+  return true;
+}
+
+std::string
+CaptureSession::Source::getName() const {
+  if (syntheticFps > 0) {
+    char name[32];
+    snprintf(name, sizeof(name), "synthetic:%g", syntheticFps);
+    return name;
+  }
+
+  return library.empty() ? "default" : library;
+}
+
+CaptureSession::CaptureSession()
+  : mMinicap(NULL),
+    mBackendVersion(1),
+    mLastFormat(Minicap::FORMAT_UNKNOWN),
+    mFree(NULL),
+    mDisplayId(0),
+    mPreferredFormat(Minicap::FORMAT_UNKNOWN),
+    mWaiter(NULL),
+    mDisplayChanges(0)
+{
+  memset(&mDisplayInfo, 0, sizeof(mDisplayInfo));
+}
+
+CaptureSession::~CaptureSession() {
+  destroy();
+}
+
+bool
+CaptureSession::create(uint32_t displayId, const Source& source) {
+  mDisplayId = displayId;
+  mSource = source;
+  mFree = NULL;
+  mBackendVersion = 1;
+  mLastFormat = Minicap::FORMAT_UNKNOWN;
+
+  if (source.syntheticFps > 0) {
+    mMinicap = new SyntheticMinicap(source.syntheticFps, source.watermark);
+    mBackendVersion = MINICAP_BACKEND_VERSION;
+  }
+  else if (!source.library.empty()) {
+    // Never closed again, as the Android libraries it pulls in don't take
+    // well to being unloaded.
+    void* library = dlopen(source.library.c_str(), RTLD_NOW | RTLD_LOCAL);
+    if (library == NULL) {
+      MCERROR("Unable to load %s: %s", source.library.c_str(), dlerror());
+      return false;
+    }
+
+    Minicap* (*create)(int32_t) = reinterpret_cast<Minicap* (*)(int32_t)>(
+      dlsym(library, MINICAP_CREATE_SYMBOL));
+    mFree = reinterpret_cast<void (*)(Minicap*)>(dlsym(library, MINICAP_FREE_SYMBOL));
+    int (*version)() = reinterpret_cast<int (*)()>(
+      dlsym(library, MINICAP_BACKEND_VERSION_SYMBOL));
+
+    if (create == NULL || mFree == NULL) {
+      MCERROR("%s doesn't look like minicap.so", source.library.c_str());
+      mFree = NULL;
+      return false;
+    }
+
+    mMinicap = create(displayId);
+    mBackendVersion = version != NULL ? version() : 1;
+  }
+  else {
+    mMinicap = minicap_create(displayId);
+    mBackendVersion = minicap_backend_version != NULL ? minicap_backend_version() : 1;
+  }
+
+  if (mMinicap != NULL && mBackendVersion < MINICAP_BACKEND_VERSION) {
+    MCINFO("Capture backend implements version %d, some features are unavailable",
+      mBackendVersion);
+  }
+
+  return mMinicap != NULL;
+}
+
+bool
+CaptureSession::create(uint32_t displayId, float syntheticFps, bool watermark) {
+  Source source;
+  source.syntheticFps = syntheticFps;
+  source.watermark = watermark;
+
+  return create(displayId, source);
+}
+
+bool
+CaptureSession::configure(const Minicap::DisplayInfo& realInfo,
+    const Minicap::DisplayInfo& desiredInfo, Minicap::Format preferredFormat,
+    FrameWaiter* waiter) {
+  mRealInfo = realInfo;
+  mDesiredInfo = desiredInfo;
+  mPreferredFormat = preferredFormat;
+  mWaiter = waiter;
+
+  if (mMinicap->setRealInfo(realInfo) != 0) {
+    MCERROR("Minicap did not accept real display info");
+    return false;
+  }
+
+  if (mMinicap->setDesiredInfo(desiredInfo) != 0) {
+    MCERROR("Minicap did not accept desired display info");
+    return false;
+  }
+
+  // Backends that can't deliver the preferred format keep their own, which
+  // works too, just not as well.
+  if (mBackendVersion >= 2 && mMinicap->setPreferredFormat(preferredFormat) != 0) {
+    MCERROR("Minicap did not accept preferred format");
+    return false;
+  }
+
+  mMinicap->setFrameAvailableListener(waiter);
+
+  if (mMinicap->applyConfigChanges() != 0) {
+    MCERROR("Unable to start minicap with current config");
+    return false;
+  }
+
+  return true;
+}
+
+bool
+CaptureSession::rebuild() {
+  // Tearing down and setting up the virtual display again is usually
+  // enough, and a lot quicker than starting over.
+  mMinicap->release();
+  mWaiter->reset();
+
+  if (mMinicap->applyConfigChanges() == 0) {
+    return true;
+  }
+
+  MCWARN("Unable to restart capture in place, creating it again");
+
+  destroy();
+  mWaiter->reset();
+
+  if (!create(mDisplayId, mSource)) {
+    MCERROR("Unable to create capture again");
+    return false;
+  }
+
+  return configure(mRealInfo, mDesiredInfo, mPreferredFormat, mWaiter);
+}
+
+void
+CaptureSession::stop() {
+  mMinicap->release();
+}
+
+bool
+CaptureSession::simulateStall(uint32_t frames) {
+  if (mMinicap->getCaptureMethod() != Minicap::METHOD_SYNTHETIC) {
+    return false;
+  }
+
+  static_cast<SyntheticMinicap*>(mMinicap)->setStallAfter(frames);
+
+  return true;
+}
+
+uint64_t
+CaptureSession::getDisplayActivity() {
+  if (mMinicap->getCaptureMethod() == Minicap::METHOD_SYNTHETIC) {
+    return static_cast<SyntheticMinicap*>(mMinicap)->getTicks();
+  }
+
+  Minicap::DisplayInfo info;
+  if (minicap_try_get_display_info(mDisplayId, &info) != 0) {
+    return mDisplayChanges;
+  }
+
+  if (info.width != mDisplayInfo.width || info.height != mDisplayInfo.height ||
+      info.orientation != mDisplayInfo.orientation || info.fps != mDisplayInfo.fps ||
+      info.density != mDisplayInfo.density) {
+    mDisplayInfo = info;
+    mDisplayChanges += 1;
+  }
+
+  return mDisplayChanges;
+}
+
+unsigned char
+CaptureSession::getQuirks() {
+  switch (mMinicap->getCaptureMethod()) {
+  case Minicap::METHOD_FRAMEBUFFER:
+    return QUIRK_DUMB | QUIRK_TEAR;
+  case Minicap::METHOD_SCREENSHOT:
+    return QUIRK_DUMB;
+  case Minicap::METHOD_VIRTUAL_DISPLAY:
+    return QUIRK_ALWAYS_UPRIGHT;
+  case Minicap::METHOD_SYNTHETIC:
+  default:
+    return 0;
+  }
+}
+
+Minicap::Format
+CaptureSession::getCaptureFormat() {
+  if (mBackendVersion < 2) {
+    return mLastFormat;
+  }
+
+  return mMinicap->getCaptureFormat();
+}
+
+const char*
+CaptureSession::getMethodName() {
+  switch (mMinicap->getCaptureMethod()) {
+  case Minicap::METHOD_FRAMEBUFFER:
+    return "framebuffer";
+  case Minicap::METHOD_SCREENSHOT:
+    return "screenshot";
+  case Minicap::METHOD_VIRTUAL_DISPLAY:
+    return "virtual_display";
+  case Minicap::METHOD_SYNTHETIC:
+    return "synthetic";
+  default:
+    return "unknown";
+  }
+}
+
+int
+CaptureSession::consume(Minicap::Frame* frame) {
+  int err = mMinicap->consumePendingFrame(frame);
+
+  if (err == 0) {
+    mLastFormat = frame->format;
+  }
+
+  return err;
+}
+
+void
+CaptureSession::release(Minicap::Frame* frame) {
+  mMinicap->releaseConsumedFrame(frame);
+}
+
+bool
+CaptureSession::normalize(const Minicap::Frame* frame, Minicap::Frame* target) {
+  *target = *frame;
+
+  if (FrameConverter::needsConversion(frame->format) && !mConverter.convert(frame, target)) {
+    MCERROR("Unable to convert frame");
+    return false;
+  }
+
+  return true;
+}
+
+void
+CaptureSession::destroy() {
+  if (mMinicap == NULL) {
+    return;
+  }
+
+  if (mMinicap->getCaptureMethod() == Minicap::METHOD_SYNTHETIC) {
+    delete mMinicap;
+  }
+  else if (mFree != NULL) {
+    mFree(mMinicap);
+  }
+  else {
+    minicap_free(mMinicap);
+  }
+
+  mMinicap = NULL;
+}
@@ -0,0 +1,142 @@
+#ifndef MINICAP_CAPTURE_SESSION_HPP
+#define MINICAP_CAPTURE_SESSION_HPP
+
+#include <stdint.h>
+
+#include <string>
+
+#include <Minicap.hpp>
+
+#include "FrameConverter.hpp"
+#include "FrameWaiter.hpp"
+
+// Owns a capture backend from creation to release: picks the backend,
+// configures it and hands out frames that everything downstream can take.
+// Both the minicap binary and libminicap drive capture through this, so
+// that neither has to know which backend is behind it.
+class CaptureSession {
+public:
+  enum {
+    QUIRK_DUMB            = 1,
+    QUIRK_ALWAYS_UPRIGHT  = 2,
+    QUIRK_TEAR            = 4,
+  };
+
+  // Where frames come from. By default, that's the minicap.so we're linked
+  // against. A path loads another build of it at runtime, which may use a
+  // different capture method, and a frame rate makes frames up instead.
+  struct Source {
+    std::string library;
+    float syntheticFps;
+    bool watermark;
+
+    Source();
+
+    // Takes "default", "synthetic:<fps>" or the path of a minicap.so.
+    bool
+    parse(const std::string& value);
+
+    std::string
+    getName() const;
+  };
+
+  CaptureSession();
+
+  ~CaptureSession();
+
+  bool
+  create(uint32_t displayId, const Source& source);
+
+  // Creates the backend for the display, or a synthetic one if a frame
+  // rate is given.
+  bool
+  create(uint32_t displayId, float syntheticFps, bool watermark);
+
+  // Configures and starts the backend. Frame arrivals go to the waiter,
+  // which must outlive the session.
+  bool
+  configure(const Minicap::DisplayInfo& realInfo, const Minicap::DisplayInfo& desiredInfo,
+    Minicap::Format preferredFormat, FrameWaiter* waiter);
+
+  // Restarts the capture method with the same config, or creates it from
+  // scratch if that doesn't work. Frames consumed before must have been
+  // released. Frames announced before are gone, and the waiter forgets
+  // about them.
+  bool
+  rebuild();
+
+  // Stops the capture method until it's configured again. Frames consumed
+  // before must have been released.
+  void
+  stop();
+
+  // Makes the synthetic backend stop producing frames after this many, to
+  // try out stall recovery. Returns false for real backends.
+  bool
+  simulateStall(uint32_t frames);
+
+  // Counts what the display did that the capture method should have sent
+  // frames for, whether it did or not: reconfigurations of a real display,
+  // or every frame of a synthetic one. Stays put while the screen is idle.
+  // Asks the display every time, so don't call it for every frame.
+  uint64_t
+  getDisplayActivity();
+
+  // The quirks of the capture method, as sent in the banner.
+  unsigned char
+  getQuirks();
+
+  Minicap::Format
+  getCaptureFormat();
+
+  // Names the capture method, e.g. "virtual_display".
+  const char*
+  getMethodName();
+
+  // Same as the backend's consumePendingFrame(), returns 0 or a negative
+  // errno. Every consumed frame has to be released.
+  int
+  consume(Minicap::Frame* frame);
+
+  void
+  release(Minicap::Frame* frame);
+
+  // Describes the frame in target as something with 8 bits per channel,
+  // converting it if it isn't already. YUV frames are left as they are.
+  // Converted frames stay valid until the next call.
+  bool
+  normalize(const Minicap::Frame* frame, Minicap::Frame* target);
+
+private:
+  Minicap* mMinicap;
+  FrameConverter mConverter;
+
+  // What the backend implements, see minicap_backend_version(). Older ones
+  // can't be asked for their format, so it's taken from the frames.
+  int mBackendVersion;
+  Minicap::Format mLastFormat;
+
+  // Set when the backend came from a library loaded at runtime, which
+  // has to free it too.
+  void (*mFree)(Minicap*);
+
+  // Everything needed to create the backend again.
+  uint32_t mDisplayId;
+  Source mSource;
+  Minicap::DisplayInfo mRealInfo;
+  Minicap::DisplayInfo mDesiredInfo;
+  Minicap::Format mPreferredFormat;
+  FrameWaiter* mWaiter;
+
+  // The display as last seen by getDisplayActivity().
+  Minicap::DisplayInfo mDisplayInfo;
+  uint64_t mDisplayChanges;
+
+  void
+  destroy();
+
+  CaptureSession(const CaptureSession&);
+  CaptureSession& operator=(const CaptureSession&);
+};
+
+#endif
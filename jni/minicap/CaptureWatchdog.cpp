@@ -0,0 +1,103 @@
+#include "CaptureWatchdog.hpp"
+
+#include <algorithm>
+#include <string.h>
+
+static uint32_t
+toMillis(CaptureWatchdog::Clock::duration duration) {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(duration).count();
+}
+
+CaptureWatchdog::CaptureWatchdog(uint32_t timeoutMs)
+  : mTimeoutMs(timeoutMs),
+    mLastFrame(Clock::now()),
+    mRecovering(false),
+    mHaveActivity(false),
+    mActivity(0),
+    mActive(false)
+{
+  memset(&mStats, 0, sizeof(mStats));
+  mStats.timeoutMs = timeoutMs;
+}
+
+bool
+CaptureWatchdog::isEnabled() {
+  return mTimeoutMs > 0;
+}
+
+bool
+CaptureWatchdog::onFrame(Clock::time_point now) {
+  bool recovered = mRecovering;
+
+  if (mRecovering) {
+    mStats.recoveries += 1;
+    mStats.lastRecoveryMs = toMillis(now - mRebuiltAt);
+    mRecovering = false;
+  }
+
+  mLastFrame = now;
+  mActive = false;
+
+  return recovered;
+}
+
+void
+CaptureWatchdog::onIdle(Clock::time_point now) {
+  mLastFrame = now;
+  mActive = false;
+}
+
+bool
+CaptureWatchdog::wantsDisplayActivity(Clock::time_point now) {
+  return isEnabled() && (!mHaveActivity ||
+    now - mActivityPolledAt >= std::chrono::milliseconds(ACTIVITY_INTERVAL_MS));
+}
+
+void
+CaptureWatchdog::onDisplayActivity(Clock::time_point now, uint64_t activity) {
+  mActivityPolledAt = now;
+
+  if (mHaveActivity && activity != mActivity && !mActive) {
+    mActive = true;
+    mActiveSince = now;
+  }
+
+  mHaveActivity = true;
+  mActivity = activity;
+}
+
+bool
+CaptureWatchdog::isStalled(Clock::time_point now) {
+  return isEnabled() && mActive &&
+    now - mActiveSince >= std::chrono::milliseconds(mTimeoutMs);
+}
+
+void
+CaptureWatchdog::onRebuilt(Clock::time_point now) {
+  mStats.stalls += 1;
+  mStats.lastStallMs = toMillis(now - mLastFrame);
+  mRecovering = true;
+  mRebuiltAt = now;
+  mLastFrame = now;
+  mActive = false;
+}
+
+int
+CaptureWatchdog::getTimeout(Clock::time_point now, int timeout) {
+  if (!isEnabled()) {
+    return timeout;
+  }
+
+  Clock::duration left = mActive
+    ? mActiveSince + std::chrono::milliseconds(mTimeoutMs) - now
+    : mActivityPolledAt + std::chrono::milliseconds(ACTIVITY_INTERVAL_MS) - now;
+  int leftMs = std::max<int>(0,
+    std::chrono::duration_cast<std::chrono::milliseconds>(left).count() + 1);
+
+  return timeout < 0 ? leftMs : std::min(timeout, leftMs);
+}
+
+void
+CaptureWatchdog::getStats(Stats* stats) {
+  *stats = mStats;
+}
@@ -0,0 +1,89 @@
+#ifndef MINICAP_CAPTURE_WATCHDOG_HPP
+#define MINICAP_CAPTURE_WATCHDOG_HPP
+
+#include <stdint.h>
+
+#include <chrono>
+
+// Notices when the capture method stops delivering frames while someone is
+// waiting for them, as happens when SurfaceFlinger loses track of our
+// virtual display after a display reconfiguration. The capture method can
+// then be rebuilt in place instead of leaving clients with a frozen screen.
+//
+// A screen that doesn't change sends no frames either, so only the time
+// after the display did something (see CaptureSession::getDisplayActivity())
+// without a frame following counts as a stall. An idle screen never does.
+class CaptureWatchdog {
+public:
+  typedef std::chrono::steady_clock Clock;
+
+  // How often to look at the display's activity while waiting for frames.
+  static const uint32_t ACTIVITY_INTERVAL_MS = 250;
+
+  struct Stats {
+    uint32_t timeoutMs;
+    // Stalls detected, and how many of them a rebuild fixed.
+    uint64_t stalls;
+    uint64_t recoveries;
+    // Time without frames before the last stall was detected, and from
+    // its rebuild to the first frame after.
+    uint32_t lastStallMs;
+    uint32_t lastRecoveryMs;
+  };
+
+  // A timeout of 0 disables the watchdog.
+  CaptureWatchdog(uint32_t timeoutMs);
+
+  bool
+  isEnabled();
+
+  // Records a consumed frame. Returns true if it's the first one after a
+  // rebuild.
+  bool
+  onFrame(Clock::time_point now);
+
+  // Nobody wants frames, so their absence says nothing.
+  void
+  onIdle(Clock::time_point now);
+
+  // Whether it's time to pass the display's activity again.
+  bool
+  wantsDisplayActivity(Clock::time_point now);
+
+  // Takes the display's activity counter. A change since the last frame
+  // starts the timeout.
+  void
+  onDisplayActivity(Clock::time_point now, uint64_t activity);
+
+  bool
+  isStalled(Clock::time_point now);
+
+  // Records a detected stall, after the capture method was rebuilt.
+  void
+  onRebuilt(Clock::time_point now);
+
+  // Shortens a poll() timeout so that the loop is awake when the current
+  // wait turns into a stall, or when the display's activity is due.
+  int
+  getTimeout(Clock::time_point now, int timeout);
+
+  void
+  getStats(Stats* stats);
+
+private:
+  uint32_t mTimeoutMs;
+  Clock::time_point mLastFrame;
+  bool mRecovering;
+  Clock::time_point mRebuiltAt;
+  Stats mStats;
+
+  // The display's activity as last seen, and since when it has been
+  // waiting for a frame.
+  bool mHaveActivity;
+  uint64_t mActivity;
+  Clock::time_point mActivityPolledAt;
+  bool mActive;
+  Clock::time_point mActiveSince;
+};
+
+#endif
@@ -0,0 +1,79 @@
+#include "ClientCapacity.hpp"
+
+#include <algorithm>
+
+// Frames go out this much slower than the client renders them, so that it
+// gets a little slack instead of running at the limit.
+#define HEADROOM 1.25f
+
+// Each report with drops stretches the interval by this much, up to the
+// maximum, and each clean one takes some of it back.
+#define DROP_PENALTY 1.5f
+#define MAX_PENALTY 4.0f
+#define PENALTY_DECAY 0.9f
+
+// Each scale step changes width and height by this factor.
+#define SCALE_STEP 0.75f
+#define MIN_SCALE 0.25f
+
+ClientCapacity::ClientCapacity()
+  : mHaveReport(false),
+    mRenderUs(0),
+    mPenalty(1),
+    mScale(1)
+{
+}
+
+bool
+ClientCapacity::report(uint32_t renderUs, uint32_t dropped, Clock::time_point now) {
+  // Smooth out single slow frames, but follow real changes within a few
+  // reports.
+  mRenderUs = mHaveReport ? (mRenderUs * 3 + renderUs) / 4 : renderUs;
+  mHaveReport = true;
+
+  if (dropped > 0) {
+    mPenalty = std::min(mPenalty * DROP_PENALTY, MAX_PENALTY);
+  }
+  else {
+    mPenalty = std::max(mPenalty * PENALTY_DECAY, 1.0f);
+  }
+
+  if (now - mScaledAt < std::chrono::milliseconds(SCALE_HOLD_MS)) {
+    return false;
+  }
+
+  float scale = mScale;
+
+  if (mRenderUs > MAX_RENDER_US) {
+    scale = std::max(mScale * SCALE_STEP, MIN_SCALE);
+  }
+  else if (mRenderUs < MAX_RENDER_US / 3) {
+    scale = std::min(mScale / SCALE_STEP, 1.0f);
+  }
+
+  if (scale == mScale) {
+    return false;
+  }
+
+  // Render times at the old size say nothing about the new one.
+  mScale = scale;
+  mScaledAt = now;
+  mHaveReport = false;
+
+  return true;
+}
+
+bool
+ClientCapacity::isLimited() {
+  return mHaveReport || mScale < 1;
+}
+
+ClientCapacity::Clock::duration
+ClientCapacity::getMinInterval() {
+  return std::chrono::microseconds(static_cast<int64_t>(mRenderUs * HEADROOM * mPenalty));
+}
+
+float
+ClientCapacity::getScale() {
+  return mScale;
+}
@@ -0,0 +1,54 @@
+#ifndef MINICAP_CLIENT_CAPACITY_HPP
+#define MINICAP_CLIENT_CAPACITY_HPP
+
+#include <stdint.h>
+
+#include <chrono>
+
+// Works out how many frames, and how large, a client can actually show,
+// from what it reports about its own decoding and rendering. A client that
+// takes longer to put a frame on screen than we take to send the next one
+// only piles up frames in socket buffers, which makes everything it shows
+// late. Frames are then spaced out to match the client, and if even that
+// leaves it below a usable frame rate, they're scaled down too.
+class ClientCapacity {
+public:
+  typedef std::chrono::steady_clock Clock;
+
+  // Render times above this (15fps) make us scale down, and below a third
+  // of it we scale back up.
+  static const uint32_t MAX_RENDER_US = 66666;
+
+  // Scale changes are this far apart at least, so that reports about the
+  // new size have time to arrive.
+  static const uint32_t SCALE_HOLD_MS = 2000;
+
+  ClientCapacity();
+
+  // Takes a report with the average time the client spent decoding and
+  // rendering each frame, and the number of frames it dropped since its
+  // previous report. Returns true if the scale changed.
+  bool
+  report(uint32_t renderUs, uint32_t dropped, Clock::time_point now);
+
+  // Whether the client has reported anything at all.
+  bool
+  isLimited();
+
+  // The shortest time between two frames the client keeps up with.
+  Clock::duration
+  getMinInterval();
+
+  // How much of the viewport to fill, between 0.25 and 1.
+  float
+  getScale();
+
+private:
+  bool mHaveReport;
+  uint32_t mRenderUs;
+  float mPenalty;
+  float mScale;
+  Clock::time_point mScaledAt;
+};
+
+#endif
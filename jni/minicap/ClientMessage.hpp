@@ -0,0 +1,122 @@
+#ifndef MINICAP_CLIENT_MESSAGE_HPP
+#define MINICAP_CLIENT_MESSAGE_HPP
+
+#include <stdint.h>
+
+#include <string>
+
+// A message sent by a client to the server. On the wire, each message is
+// a 4-byte little endian size (counting the type and the payload) followed
+// by a 1-byte type and the payload itself.
+class ClientMessage {
+public:
+  enum Type {
+    TYPE_VIEWPORT     = 0x01,
+    TYPE_PACKETS      = 0x02,
+    TYPE_RESUME       = 0x03,
+    TYPE_TEMPLATE     = 0x04,
+    TYPE_MATCH        = 0x05,
+    TYPE_SCREENSHOT   = 0x06,
+    TYPE_QUANT_TABLES = 0x07,
+    TYPE_REFERENCE    = 0x08,
+    TYPE_DIFF         = 0x09,
+    TYPE_STATS        = 0x0A,
+    TYPE_REGIONS      = 0x0B,
+    TYPE_FEEDBACK     = 0x0C,
+    TYPE_DIRTY_RECTS  = 0x0D,
+    TYPE_WATCH        = 0x0E,
+    TYPE_INDEX_SCREEN = 0x0F,
+    TYPE_CLASSIFY     = 0x10,
+  };
+
+  // Larger messages are considered a protocol error.
+  static const uint32_t MAX_SIZE = 64 * 1024;
+
+  class Parser {
+  public:
+    Parser(): mState(size_start), mSize(0), mRead(0) {
+    }
+
+    // Consumes input until a full message is available or the input runs
+    // out. Returns the number of bytes consumed, or -1 on a protocol error.
+    // Once ready() returns true, the message has been filled in and the
+    // next call starts a new one.
+    int
+    parse(ClientMessage& msg, const unsigned char* lo, const unsigned char* hi) {
+      const unsigned char* start = lo;
+
+      if (mState == complete) {
+        mState = size_start;
+      }
+
+      while (lo < hi && mState != complete) {
+        switch (mState) {
+        case size_start:
+          mSize = 0;
+          mRead = 0;
+          msg.type = 0;
+          msg.payload.clear();
+          mState = size_continued;
+          // Fall through.
+        case size_continued:
+          mSize |= static_cast<uint32_t>(*lo++) << (mRead * 8);
+          if (++mRead == 4) {
+            if (mSize == 0 || mSize > MAX_SIZE) {
+              return -1;
+            }
+            mState = type;
+          }
+          break;
+        case type:
+          msg.type = *lo++;
+          mSize -= 1;
+          mState = mSize > 0 ? payload : complete;
+          break;
+        case payload: {
+          size_t chunk = hi - lo;
+          if (chunk > mSize) {
+            chunk = mSize;
+          }
+          msg.payload.append(reinterpret_cast<const char*>(lo), chunk);
+          lo += chunk;
+          mSize -= chunk;
+          if (mSize == 0) {
+            mState = complete;
+          }
+          break;
+        }
+        case complete:
+          break;
+        }
+      }
+
+      return lo - start;
+    }
+
+    bool
+    ready() {
+      return mState == complete;
+    }
+
+  private:
+    enum State {
+      size_start,
+      size_continued,
+      type,
+      payload,
+      complete,
+    };
+
+    State mState;
+    uint32_t mSize;
+    uint32_t mRead;
+  };
+
+  unsigned char type;
+  std::string payload;
+
+  ClientMessage(): type(0) {
+  }
+};
+
+#endif
@@ -0,0 +1,195 @@
+#include "FrameConverter.hpp"
+
+#include <math.h>
+
+#include "util/debug.h"
+
+// Each RGBA_1010102 pixel is a little endian 32-bit word with red in the
+// lowest 10 bits, then green, blue and 2 bits of alpha. Scaling by 255/1023
+// with rounding is done with a multiply and shift instead of a division so
+// that the loop vectorizes; the result is exact for all 10-bit values.
+static void
+convertRow1010102(const uint32_t* src, uint32_t* dst, uint32_t width) {
+  for (uint32_t x = 0; x < width; ++x) {
+    uint32_t v = src[x];
+    uint32_t r = ((v & 0x3FF) * 255 + 511) * 1025 >> 20;
+    uint32_t g = (((v >> 10) & 0x3FF) * 255 + 511) * 1025 >> 20;
+    uint32_t b = (((v >> 20) & 0x3FF) * 255 + 511) * 1025 >> 20;
+    dst[x] = r | (g << 8) | (b << 16) | 0xFF000000;
+  }
+}
+
+// RGBA_FP16 pixels are four half floats. Half floats only have 65536
+// values, so a table lookup per channel replaces all of the float math,
+// including the transfer function. The lookups are gathers, which none of
+// our ABIs can vectorize, so this runs one pixel at a time and costs about
+// twice as much as the 10-bit kernel per frame.
+static void
+convertRowFp16(const uint16_t* src, uint32_t* dst, uint32_t width,
+    const unsigned char* table) {
+  for (uint32_t x = 0; x < width; ++x) {
+    const uint16_t* p = src + x * 4;
+    dst[x] = table[p[0]] | (table[p[1]] << 8) | (table[p[2]] << 16) | 0xFF000000;
+  }
+}
+
+static inline uint32_t
+clampByte(int32_t value) {
+  return value < 0 ? 0 : value > 255 ? 255 : value;
+}
+
+// Full range BT.601 to RGB in 16.16 fixed point. The chroma row holds one
+// Cb and Cr per two pixels, at the given offsets and distance apart, which
+// covers both interleaved and separate planes.
+static void
+convertRowYuv(const unsigned char* luma, const unsigned char* cb, const unsigned char* cr,
+    uint32_t chromaStep, uint32_t* dst, uint32_t width) {
+  for (uint32_t x = 0; x < width; ++x) {
+    int32_t y = luma[x] << 16;
+    int32_t u = cb[(x >> 1) * chromaStep] - 128;
+    int32_t v = cr[(x >> 1) * chromaStep] - 128;
+    uint32_t r = clampByte((y + 91881 * v + 32768) >> 16);
+    uint32_t g = clampByte((y - 22554 * u - 46802 * v + 32768) >> 16);
+    uint32_t b = clampByte((y + 116130 * u + 32768) >> 16);
+    dst[x] = r | (g << 8) | (b << 16) | 0xFF000000;
+  }
+}
+
+static float
+halfToFloat(uint16_t half) {
+  int sign = half >> 15;
+  int exponent = (half >> 10) & 0x1F;
+  int mantissa = half & 0x3FF;
+  float value;
+
+  if (exponent == 0) {
+    value = ldexpf(mantissa, -24);
+  }
+  else if (exponent == 31) {
+    value = mantissa == 0 ? INFINITY : NAN;
+  }
+  else {
+    value = ldexpf(mantissa + 1024, exponent - 25);
+  }
+
+  return sign ? -value : value;
+}
+
+FrameConverter::FrameConverter() {
+}
+
+bool
+FrameConverter::needsConversion(Minicap::Format format) {
+  switch (format) {
+  case Minicap::FORMAT_RGBA_1010102:
+  case Minicap::FORMAT_RGBA_FP16:
+    return true;
+  default:
+    return false;
+  }
+}
+
+bool
+FrameConverter::isYuv(Minicap::Format format) {
+  switch (format) {
+  case Minicap::FORMAT_NV12:
+  case Minicap::FORMAT_NV21:
+  case Minicap::FORMAT_I420:
+    return true;
+  default:
+    return false;
+  }
+}
+
+bool
+FrameConverter::convert(const Minicap::Frame* frame, Minicap::Frame* target) {
+  if (!mData.reserve(frame->width * frame->height * 4)) {
+    MCERROR("Unable to reserve data for frame conversion");
+    return false;
+  }
+
+  const unsigned char* src = static_cast<const unsigned char*>(frame->data);
+  uint32_t* dst = reinterpret_cast<uint32_t*>(mData.data());
+  size_t rowSize = frame->stride * frame->bpp;
+
+  switch (frame->format) {
+  case Minicap::FORMAT_RGBA_1010102:
+    for (uint32_t y = 0; y < frame->height; ++y) {
+      convertRow1010102(reinterpret_cast<const uint32_t*>(src + y * rowSize),
+        dst + y * frame->width, frame->width);
+    }
+    break;
+  case Minicap::FORMAT_RGBA_FP16:
+    if (mHalfTable.empty()) {
+      buildHalfTable();
+    }
+
+    for (uint32_t y = 0; y < frame->height; ++y) {
+      convertRowFp16(reinterpret_cast<const uint16_t*>(src + y * rowSize),
+        dst + y * frame->width, frame->width, mHalfTable.data());
+    }
+    break;
+  case Minicap::FORMAT_NV12:
+  case Minicap::FORMAT_NV21:
+  case Minicap::FORMAT_I420:
+    for (uint32_t y = 0; y < frame->height; ++y) {
+      const unsigned char* luma = static_cast<const unsigned char*>(frame->planes[0]) +
+        y * frame->strides[0];
+      const unsigned char* chroma = static_cast<const unsigned char*>(frame->planes[1]) +
+        (y >> 1) * frame->strides[1];
+
+      if (frame->format == Minicap::FORMAT_I420) {
+        const unsigned char* cr = static_cast<const unsigned char*>(frame->planes[2]) +
+          (y >> 1) * frame->strides[2];
+        convertRowYuv(luma, chroma, cr, 1, dst + y * frame->width, frame->width);
+      }
+      else if (frame->format == Minicap::FORMAT_NV12) {
+        convertRowYuv(luma, chroma, chroma + 1, 2, dst + y * frame->width, frame->width);
+      }
+      else {
+        convertRowYuv(luma, chroma + 1, chroma, 2, dst + y * frame->width, frame->width);
+      }
+    }
+    break;
+  default:
+    MCERROR("Unable to convert frames of format %d", frame->format);
+    return false;
+  }
+
+  target->data = mData.data();
+  target->format = Minicap::FORMAT_RGBX_8888;
+  target->width = frame->width;
+  target->height = frame->height;
+  target->stride = frame->width;
+  target->bpp = 4;
+  target->size = frame->width * frame->height * 4;
+
+  return true;
+}
+
+void
+FrameConverter::buildHalfTable() {
+  mHalfTable.resize(65536);
+
+  // FP16 buffers hold linear extended sRGB, where 1.0 is SDR white and
+  // anything outside of 0-1 is out of gamut or brighter than white. We
+  // clip to SDR and encode with the sRGB transfer function.
+  for (uint32_t i = 0; i < 65536; ++i) {
+    float value = halfToFloat(i);
+
+    if (!(value > 0)) {
+      value = 0;
+    }
+    else if (value >= 1) {
+      value = 1;
+    }
+    else if (value <= 0.0031308f) {
+      value *= 12.92f;
+    }
+    else {
+      value = 1.055f * powf(value, 1 / 2.4f) - 0.055f;
+    }
+
+    mHalfTable[i] = static_cast<unsigned char>(value * 255 + 0.5f);
+  }
+}
@@ -0,0 +1,49 @@
+#ifndef MINICAP_FRAME_CONVERTER_HPP
+#define MINICAP_FRAME_CONVERTER_HPP
+
+#include <stdint.h>
+
+#include <vector>
+
+#include "Minicap.hpp"
+
+#include "HugePageBuffer.hpp"
+
+// Brings frames in wide gamut and HDR formats down to RGBX_8888, which is
+// what the encoder and everything else that looks at pixels understands.
+// YUV frames can be converted too, for when something other than the
+// encoder needs them. The kernels are plain loops over whole rows. Only the
+// 10-bit one vectorizes; the half float lookups and the YUV chroma reads
+// stay scalar.
+class FrameConverter {
+public:
+  FrameConverter();
+
+  // Whether frames of this format have to go through convert() first.
+  static bool
+  needsConversion(Minicap::Format format);
+
+  // Whether the format is one of the YUV layouts. The encoder takes those
+  // as they are, but nothing else does.
+  static bool
+  isYuv(Minicap::Format format);
+
+  // Converts the frame into a buffer of our own and describes the result in
+  // target. The result stays valid until the next call.
+  bool
+  convert(const Minicap::Frame* frame, Minicap::Frame* target);
+
+private:
+  HugePageBuffer mData;
+  // Maps each possible half float to its 8-bit sRGB value. Only built once
+  // the first FP16 frame shows up.
+  std::vector<unsigned char> mHalfTable;
+
+  void
+  buildHalfTable();
+
+  FrameConverter(const FrameConverter&);
+  FrameConverter& operator=(const FrameConverter&);
+};
+
+#endif
@@ -0,0 +1,68 @@
+#ifndef MINICAP_FRAME_SCALER_HPP
+#define MINICAP_FRAME_SCALER_HPP
+
+#include <vector>
+
+#include "Minicap.hpp"
+
+#include "HugePageBuffer.hpp"
+#include "TileWalker.hpp"
+
+// Downscales frames with a box filter so that every source pixel gets
+// read exactly once. Only formats with 8-bit channels are supported.
+// Works row by row, so it can also run as a TileWalker kernel.
+class FrameScaler: public TileKernel {
+public:
+  FrameScaler();
+
+  // Sets the size of the scaled frame. Upscaling is not supported.
+  void
+  setTargetSize(uint32_t width, uint32_t height);
+
+  // Scales the frame on its own, in a separate pass.
+  bool
+  scale(const Minicap::Frame* frame, Minicap::Frame* target);
+
+  // Points the target frame to the result of the last scaled frame, which
+  // stays valid until the next frame is scaled. Returns false if the last
+  // frame could not be scaled.
+  bool
+  getScaledFrame(Minicap::Frame* target);
+
+  static bool
+  supportsFormat(Minicap::Format format);
+
+  virtual bool
+  beginFrame(const Minicap::Frame* frame);
+
+  virtual void
+  processTile(const Minicap::Frame* frame, uint32_t y0, uint32_t y1);
+
+private:
+  HugePageBuffer mData;
+  std::vector<uint32_t> mRowSums;
+  std::vector<uint32_t> mColumnStarts;
+  // Indexed by the number of source pixels in a target pixel, empty if
+  // some of them have too many.
+  std::vector<uint64_t> mReciprocals;
+  Minicap::Format mFormat;
+  uint32_t mBpp;
+  uint32_t mWidth;
+  uint32_t mHeight;
+  uint32_t mSourceWidth;
+  uint32_t mSourceHeight;
+  uint32_t mTargetWidth;
+  uint32_t mTargetHeight;
+  bool mValid;
+
+  // The target row currently being accumulated, and the source row that
+  // ends it.
+  uint32_t mRow;
+  uint32_t mRowEnd;
+  uint32_t mRowStart;
+
+  void
+  emitRow();
+};
+
+#endif
@@ -0,0 +1,79 @@
+#include "FrameSnapshot.hpp"
+
+#include <string.h>
+
+FrameSnapshot::FrameSnapshot()
+  : mValid(false),
+    mGeneration(0)
+{
+  memset(&mFrame, 0, sizeof(mFrame));
+}
+
+bool
+FrameSnapshot::hasFrame() {
+  return mValid;
+}
+
+bool
+FrameSnapshot::getFrame(Minicap::Frame* target) {
+  if (!mValid) {
+    return false;
+  }
+
+  *target = mFrame;
+
+  return true;
+}
+
+void
+FrameSnapshot::reset() {
+  mValid = false;
+}
+
+uint64_t
+FrameSnapshot::getGeneration() {
+  return mGeneration;
+}
+
+bool
+FrameSnapshot::beginFrame(const Minicap::Frame* frame) {
+  mValid = false;
+
+  // Padding at the end of each row is dropped.
+  size_t size = static_cast<size_t>(frame->width) * frame->height * frame->bpp;
+
+  if (!mData.reserve(size)) {
+    return false;
+  }
+
+  mFrame.data = mData.data();
+  mFrame.format = frame->format;
+  mFrame.width = frame->width;
+  mFrame.height = frame->height;
+  mFrame.stride = frame->width;
+  mFrame.bpp = frame->bpp;
+  mFrame.size = size;
+
+  return true;
+}
+
+void
+FrameSnapshot::processTile(const Minicap::Frame* frame, uint32_t y0, uint32_t y1) {
+  const unsigned char* source = static_cast<const unsigned char*>(frame->data);
+  size_t rowSize = frame->width * frame->bpp;
+
+  if (frame->stride == frame->width) {
+    memcpy(mData.data() + y0 * rowSize, source + y0 * rowSize, (y1 - y0) * rowSize);
+    return;
+  }
+
+  for (uint32_t y = y0; y < y1; ++y) {
+    memcpy(mData.data() + y * rowSize, source + y * frame->stride * frame->bpp, rowSize);
+  }
+}
+
+void
+FrameSnapshot::endFrame(const Minicap::Frame* /* frame */) {
+  mValid = true;
+  mGeneration += 1;
+}
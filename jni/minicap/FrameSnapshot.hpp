@@ -0,0 +1,48 @@
+#ifndef MINICAP_FRAME_SNAPSHOT_HPP
+#define MINICAP_FRAME_SNAPSHOT_HPP
+
+#include "Minicap.hpp"
+
+#include "HugePageBuffer.hpp"
+#include "TileWalker.hpp"
+
+// Keeps a copy of the latest frame after the capture buffer has been
+// handed back, so that requests can still be answered when the screen
+// doesn't change. Runs as a TileWalker kernel so that the copy shares its
+// pass over the frame with everything else.
+class FrameSnapshot: public TileKernel {
+public:
+  FrameSnapshot();
+
+  bool
+  hasFrame();
+
+  // Points the target frame to the copy. Returns false if there's none.
+  bool
+  getFrame(Minicap::Frame* target);
+
+  // Forgets the copy, e.g. when it won't be kept up to date anymore.
+  void
+  reset();
+
+  // Increases every time a new frame has been copied.
+  uint64_t
+  getGeneration();
+
+  virtual bool
+  beginFrame(const Minicap::Frame* frame);
+
+  virtual void
+  processTile(const Minicap::Frame* frame, uint32_t y0, uint32_t y1);
+
+  virtual void
+  endFrame(const Minicap::Frame* frame);
+
+private:
+  HugePageBuffer mData;
+  Minicap::Frame mFrame;
+  bool mValid;
+  uint64_t mGeneration;
+};
+
+#endif
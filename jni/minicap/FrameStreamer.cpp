@@ -0,0 +1,2265 @@
+#include "FrameStreamer.hpp"
+
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <sstream>
+
+#include "Projection.hpp"
+#include "util/debug.h"
+#include "util/pump.hpp"
+
+// Viewport changes only take effect once a client has stopped sending
+// them for this long, so that resizing a browser window doesn't make us
+// reallocate encoders for every intermediate size.
+#define VIEWPORT_DEBOUNCE_MS 150
+
+// Frames are pushed synchronously, so the slowest client sets the pace for
+// everyone. A client that doesn't read anything for this long is dropped
+// instead of stalling the others forever.
+#define CLIENT_SEND_TIMEOUT_MS 2000
+
+// How long the session of a disconnected client in packet mode is kept
+// around so that it can be resumed.
+#define RESUME_GRACE_MS 15000
+
+// Sessions kept around for resuming at the same time. Beyond that, the
+// oldest ones go first, so that clients reconnecting without resuming
+// can't pile them up.
+#define MAX_DETACHED_SESSIONS 16
+
+// References and templates are by far the largest part of a session, and
+// each detached one could otherwise hold up to 4 full frames for the whole
+// grace period. Beyond this many bytes in total, they're dropped from the
+// oldest detached sessions, which can still be resumed without them.
+#define DETACHED_SESSION_BUDGET (32 * 1024 * 1024)
+
+// Templates a single client may have uploaded at the same time.
+#define MAX_TEMPLATES 32
+
+// Same for region watches.
+#define MAX_WATCHES 32
+
+// Known screens a single client may have in its index.
+#define MAX_INDEXED_SCREENS 4096
+
+// Same for reference images, which are full frames and thus a lot larger.
+#define MAX_REFERENCES 4
+
+// How often static regions are updated for clients in region mode that
+// don't say otherwise.
+#define DEFAULT_STATIC_INTERVAL_MS 500
+
+// Region updates with more rectangles than this send their bounding box
+// instead, since every rectangle is a separate JPG with its own headers.
+#define MAX_REGION_RECTS 16
+
+// Dirty rectangles are only metadata, so there can be more of them, but a
+// client won't gain much from repainting that many pieces separately.
+#define MAX_DIRTY_RECTS 32
+
+// Dirty rectangles are grown to this alignment in output coordinates to
+// cover whole JPG MCUs with 4:2:0 subsampling, which is also what partial
+// decoders work in.
+#define DIRTY_RECT_ALIGN 16
+
+// Screenshot requests arriving within this long of each other are
+// answered from the same capture.
+#define SCREENSHOT_COALESCE_MS 10
+
+// How often to log the screenshot latency distribution, in requests.
+#define SCREENSHOT_REPORT_INTERVAL 100
+
+// How often to log the number of passes over frame memory, in frames.
+#define PASS_REPORT_INTERVAL 300
+
+FrameStreamer::FrameStreamer(unsigned int quality)
+  : mQuality(quality),
+    mQuantTables(NULL),
+    mTokenOffset(0),
+    mUdpTransport(NULL),
+    mJankMonitor(NULL),
+    mWatchdog(NULL),
+    mLumaCapture(0),
+    mSnapshotCapture(0),
+    mFingerprintCapture(0),
+    mRegionEncoder(0, 0),
+    mRegionCacheGeneration(0),
+    mKeepSnapshot(false),
+    mScreenshotEncodes(0),
+    mFrames(0),
+    mFramePasses(0)
+{
+  std::random_device seed;
+  mRandom.seed((static_cast<uint64_t>(seed()) << 32) | seed());
+}
+
+FrameStreamer::~FrameStreamer() {
+  for (size_t i = 0; i < mClients.size(); ++i) {
+    close(mClients[i]->fd);
+  }
+}
+
+void
+FrameStreamer::setBanner(const unsigned char* banner, size_t size, size_t tokenOffset) {
+  mBanner.assign(reinterpret_cast<const char*>(banner), size);
+  mTokenOffset = tokenOffset;
+}
+
+void
+FrameStreamer::setUdpTransport(UdpTransport* transport) {
+  mUdpTransport = transport;
+}
+
+void
+FrameStreamer::setJankMonitor(JankMonitor* monitor) {
+  mJankMonitor = monitor;
+}
+
+void
+FrameStreamer::setCaptureWatchdog(CaptureWatchdog* watchdog) {
+  mWatchdog = watchdog;
+}
+
+void
+FrameStreamer::setCaptureMethod(const std::string& source, const std::string& method,
+    const std::vector<CaptureProbe::Result>& probe) {
+  mCaptureSource = source;
+  mCaptureMethod = method;
+  mCaptureProbe = probe;
+}
+
+void
+FrameStreamer::setKeepSnapshot(bool keep) {
+  mKeepSnapshot = keep;
+}
+
+void
+FrameStreamer::setQuantTables(const QuantTables* tables) {
+  mQuantTables = tables;
+}
+
+bool
+FrameStreamer::prepare(uint32_t width, uint32_t height) {
+  Output* output = getOutput(mOutputs, width, height, mQuantTables);
+  return output != NULL && output->encoder.warmUp();
+}
+
+bool
+FrameStreamer::addClient(int fd) {
+  struct timeval timeout;
+  timeout.tv_sec = CLIENT_SEND_TIMEOUT_MS / 1000;
+  timeout.tv_usec = (CLIENT_SEND_TIMEOUT_MS % 1000) * 1000;
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+  uint64_t token;
+  do {
+    token = mRandom();
+  }
+  while (token == 0);
+
+  std::string banner = mBanner;
+  putUInt64LE(reinterpret_cast<unsigned char*>(&banner[mTokenOffset]), token);
+
+  if (pumps(fd, reinterpret_cast<const unsigned char*>(banner.data()), banner.size()) < 0) {
+    close(fd);
+    return false;
+  }
+
+  std::unique_ptr<Client> client(new Client());
+  client->fd = fd;
+  client->session.token = token;
+  client->session.viewportWidth = 0;
+  client->session.viewportHeight = 0;
+  client->session.quantTables = mQuantTables;
+  client->session.sequence = 0;
+  client->pendingWidth = 0;
+  client->pendingHeight = 0;
+  client->havePendingViewport = false;
+  client->packets = false;
+  client->session.streaming = true;
+  client->session.regions = false;
+  client->session.regionSequence = 0;
+  client->session.staticInterval = std::chrono::milliseconds(DEFAULT_STATIC_INTERVAL_MS);
+  client->session.dirtyRects = false;
+  client->session.classifying = false;
+  client->frameDeferred = false;
+  client->output = NULL;
+
+  mClients.push_back(std::move(client));
+  updateUdpTokens();
+
+  return true;
+}
+
+bool
+FrameStreamer::hasClients() {
+  return !mClients.empty() || (mUdpTransport != NULL && mUdpTransport->hasPeers());
+}
+
+bool
+FrameStreamer::wantsFrames() {
+  return mKeepSnapshot || hasClients();
+}
+
+void
+FrameStreamer::fillPollSet(std::vector<struct pollfd>& fds) {
+  for (size_t i = 0; i < mClients.size(); ++i) {
+    struct pollfd pfd;
+    pfd.fd = mClients[i]->fd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    fds.push_back(pfd);
+  }
+}
+
+void
+FrameStreamer::handlePollSet(const std::vector<struct pollfd>& fds, size_t offset) {
+  // Go backwards so that removing clients doesn't mess up the indexes.
+  for (size_t i = mClients.size(); i-- > 0;) {
+    if (offset + i >= fds.size() || fds[offset + i].fd != mClients[i]->fd) {
+      continue;
+    }
+
+    short revents = fds[offset + i].revents;
+
+    if (revents & (POLLIN | POLLHUP | POLLERR)) {
+      if (!readClient(mClients[i].get())) {
+        MCINFO("Closing client connection");
+        removeClient(i);
+      }
+    }
+  }
+
+  applyPendingViewports();
+  expireSessions();
+
+  if (mSnapshot.hasFrame() && hasPendingScreenshots() && Clock::now() >= mScreenshotsDue) {
+    Minicap::Frame frame;
+    mSnapshot.getFrame(&frame);
+
+    if (!serveScreenshots(&frame, mSnapshotCapture)) {
+      MCERROR("Unable to serve screenshots");
+    }
+  }
+
+  // Static regions may be due even though the screen hasn't changed.
+  if (mSnapshot.hasFrame() && wantsRegions()) {
+    Minicap::Frame frame;
+    mSnapshot.getFrame(&frame);
+    streamRegions(&frame, false);
+  }
+
+  if (mSnapshot.hasFrame()) {
+    sendDeferredFrames();
+  }
+}
+
+int
+FrameStreamer::getTimeout(int defaultTimeout) {
+  Clock::time_point now = Clock::now();
+  int timeout = defaultTimeout;
+
+  for (size_t i = 0; i < mClients.size(); ++i) {
+    Client* client = mClients[i].get();
+
+    if (!client->havePendingViewport) {
+      continue;
+    }
+
+    int remaining = VIEWPORT_DEBOUNCE_MS - std::chrono::duration_cast<std::chrono::milliseconds>(
+      now - client->pendingSince).count();
+
+    if (remaining < 0) {
+      remaining = 0;
+    }
+
+    if (timeout < 0 || remaining < timeout) {
+      timeout = remaining;
+    }
+  }
+
+  // Without a snapshot, screenshots have to wait for the next frame anyway.
+  if (mSnapshot.hasFrame() && hasPendingScreenshots()) {
+    int remaining = std::chrono::duration_cast<std::chrono::milliseconds>(
+      mScreenshotsDue - now).count();
+
+    if (remaining < 0) {
+      remaining = 0;
+    }
+
+    if (timeout < 0 || remaining < timeout) {
+      timeout = remaining;
+    }
+  }
+
+  if (mSnapshot.hasFrame()) {
+    for (size_t i = 0; i < mClients.size(); ++i) {
+      Client* client = mClients[i].get();
+
+      if (!client->session.regions || std::find(client->session.pendingCells.begin(),
+          client->session.pendingCells.end(), 1) == client->session.pendingCells.end()) {
+        continue;
+      }
+
+      int remaining = std::chrono::duration_cast<std::chrono::milliseconds>(
+        client->session.lastStaticUpdate + client->session.staticInterval - now).count();
+
+      if (remaining < 0) {
+        remaining = 0;
+      }
+
+      if (timeout < 0 || remaining < timeout) {
+        timeout = remaining;
+      }
+    }
+
+    for (size_t i = 0; i < mClients.size(); ++i) {
+      Client* client = mClients[i].get();
+
+      if (!client->frameDeferred) {
+        continue;
+      }
+
+      // Rounded up, or we'd keep waking up a little too early.
+      int remaining = std::chrono::duration_cast<std::chrono::microseconds>(
+        client->lastFrameAt + client->session.capacity.getMinInterval() - now).count() / 1000 + 1;
+
+      if (remaining < 0) {
+        remaining = 0;
+      }
+
+      if (timeout < 0 || remaining < timeout) {
+        timeout = remaining;
+      }
+    }
+  }
+
+  return timeout;
+}
+
+bool
+FrameStreamer::readClient(Client* client) {
+  unsigned char buffer[4096];
+
+  ssize_t len = recv(client->fd, buffer, sizeof(buffer), MSG_DONTWAIT);
+
+  if (len < 0) {
+    return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+  }
+
+  if (len == 0) {
+    return false;
+  }
+
+  const unsigned char* lo = buffer;
+  const unsigned char* hi = buffer + len;
+
+  while (lo < hi) {
+    int consumed = client->parser.parse(client->message, lo, hi);
+
+    if (consumed < 0) {
+      MCERROR("Invalid message from client");
+      return false;
+    }
+
+    lo += consumed;
+
+    if (client->parser.ready() && !handleMessage(client, client->message)) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+bool
+FrameStreamer::handleMessage(Client* client, const ClientMessage& msg) {
+  switch (msg.type) {
+  case ClientMessage::TYPE_VIEWPORT: {
+    // The payload uses the same <w>x<h>/{0|90|180|270} format as the
+    // virtual part of -P. We borrow the projection parser by giving it a
+    // dummy real size; only the virtual size is used.
+    std::string input = "1x1@" + msg.payload;
+    Projection proj;
+    Projection::Parser parser;
+
+    if (!parser.parse(proj, input.data(), input.data() + input.size()) ||
+        proj.virtualWidth == 0 || proj.virtualHeight == 0) {
+      MCWARN("Ignoring invalid viewport '%s'", msg.payload.c_str());
+      break;
+    }
+
+    if (client->session.viewportWidth == 0) {
+      // Nothing to debounce for the very first viewport.
+      client->session.viewportWidth = proj.virtualWidth;
+      client->session.viewportHeight = proj.virtualHeight;
+      client->havePendingViewport = false;
+      MCINFO("Client viewport set to %ux%u", proj.virtualWidth, proj.virtualHeight);
+      break;
+    }
+
+    client->pendingWidth = proj.virtualWidth;
+    client->pendingHeight = proj.virtualHeight;
+    client->pendingSince = Clock::now();
+    client->havePendingViewport = true;
+    break;
+  }
+  case ClientMessage::TYPE_PACKETS:
+    if (!enablePackets(client)) {
+      return false;
+    }
+    break;
+  case ClientMessage::TYPE_RESUME: {
+    if (msg.payload.size() < 12) {
+      MCWARN("Ignoring invalid resume message");
+      break;
+    }
+
+    const unsigned char* data = reinterpret_cast<const unsigned char*>(msg.payload.data());
+
+    if (!resumeSession(client, getUInt64LE(data), getUInt32LE(data + 8))) {
+      return false;
+    }
+    break;
+  }
+  case ClientMessage::TYPE_TEMPLATE:
+    setTemplate(client, msg);
+    break;
+  case ClientMessage::TYPE_MATCH:
+    if (!matchTemplate(client, msg)) {
+      return false;
+    }
+    break;
+  case ClientMessage::TYPE_SCREENSHOT:
+    if (!queueScreenshot(client, msg)) {
+      return false;
+    }
+    break;
+  case ClientMessage::TYPE_QUANT_TABLES:
+    setClientQuantTables(client, msg);
+    break;
+  case ClientMessage::TYPE_REFERENCE:
+    setReference(client, msg);
+    break;
+  case ClientMessage::TYPE_DIFF:
+    if (!diffReference(client, msg)) {
+      return false;
+    }
+    break;
+  case ClientMessage::TYPE_STATS:
+    if (!sendStats(client, msg)) {
+      return false;
+    }
+    break;
+  case ClientMessage::TYPE_REGIONS:
+    if (!setRegionMode(client, msg)) {
+      return false;
+    }
+    break;
+  case ClientMessage::TYPE_DIRTY_RECTS:
+    if (!setDirtyRects(client, msg)) {
+      return false;
+    }
+    break;
+  case ClientMessage::TYPE_WATCH:
+    if (!setWatch(client, msg)) {
+      return false;
+    }
+    break;
+  case ClientMessage::TYPE_INDEX_SCREEN:
+    indexScreen(client, msg);
+    break;
+  case ClientMessage::TYPE_CLASSIFY:
+    if (!classifyScreen(client, msg)) {
+      return false;
+    }
+    break;
+  case ClientMessage::TYPE_FEEDBACK:
+    if (!takeFeedback(client, msg)) {
+      return false;
+    }
+    break;
+  default:
+    MCWARN("Ignoring unknown message type %d from client", msg.type);
+    break;
+  }
+
+  return true;
+}
+
+void
+FrameStreamer::applyPendingViewports() {
+  Clock::time_point now = Clock::now();
+  Clock::duration debounce = std::chrono::milliseconds(VIEWPORT_DEBOUNCE_MS);
+
+  for (size_t i = 0; i < mClients.size(); ++i) {
+    Client* client = mClients[i].get();
+
+    if (client->havePendingViewport && now - client->pendingSince >= debounce) {
+      client->session.viewportWidth = client->pendingWidth;
+      client->session.viewportHeight = client->pendingHeight;
+      client->havePendingViewport = false;
+      MCINFO("Client viewport changed to %ux%u", client->session.viewportWidth,
+        client->session.viewportHeight);
+    }
+  }
+}
+
+bool
+FrameStreamer::enablePackets(Client* client) {
+  if (client->packets) {
+    return true;
+  }
+
+  // An empty frame tells the client exactly where packets start.
+  unsigned char marker[4] = { 0, 0, 0, 0 };
+
+  if (pumps(client->fd, marker, sizeof(marker)) < 0) {
+    return false;
+  }
+
+  client->packets = true;
+
+  return true;
+}
+
+bool
+FrameStreamer::resumeSession(Client* client, uint64_t token, uint32_t sequence) {
+  if (!enablePackets(client)) {
+    return false;
+  }
+
+  expireSessions();
+
+  // The session may still be attached to an earlier connection, e.g. one
+  // that went half-open and would otherwise only go away once a frame
+  // can't be sent to it, which on a static screen may be never. Detach it
+  // from there and shut that connection down, so that it goes away on the
+  // next poll without leaving a session of its own behind.
+  for (size_t i = 0; i < mClients.size(); ++i) {
+    Client* other = mClients[i].get();
+
+    if (other == client || other->session.token != token) {
+      continue;
+    }
+
+    MCINFO("Taking over a session that's still attached to another connection");
+    other->session.detachedAt = Clock::now();
+    mDetachedSessions.push_back(std::move(other->session));
+    other->session = Session();
+    other->packets = false;
+    shutdown(other->fd, SHUT_RDWR);
+    break;
+  }
+
+  bool resumed = false;
+
+  for (size_t i = 0; i < mDetachedSessions.size(); ++i) {
+    Session& session = mDetachedSessions[i];
+
+    // A client can't have seen frames we never sent.
+    if (session.token != token || sequence > session.sequence) {
+      continue;
+    }
+
+    client->session = std::move(session);
+    client->havePendingViewport = false;
+    mDetachedSessions.erase(mDetachedSessions.begin() + i);
+    updateUdpTokens();
+    resumed = true;
+
+    // Changes aren't tracked while detached, and region packets sent
+    // after the connection dropped may never have made it, so the next
+    // update covers the whole frame again.
+    client->session.dirtyCells.clear();
+
+    if (client->session.regions) {
+      client->session.pendingCells.clear();
+      client->session.lastStaticUpdate = Clock::time_point();
+    }
+    break;
+  }
+
+  MCINFO("Client %s session", resumed ? "resumed its" : "was unable to resume its");
+
+  unsigned char payload[13];
+  payload[0] = resumed ? 1 : 0;
+  putUInt32LE(payload + 1, client->session.sequence);
+  putUInt64LE(payload + 5, client->session.token);
+
+  if (!sendPacket(client, PACKET_RESUMED, payload, sizeof(payload), NULL, 0)) {
+    return false;
+  }
+
+  // If the client already has our latest frame, there's nothing else to
+  // do. Otherwise it missed the last one(s) when the connection dropped,
+  // so give it the newest one right away instead of waiting for the screen
+  // to change.
+  if (resumed && sequence < client->session.sequence && client->session.lastFrame) {
+    const std::string& lastFrame = *client->session.lastFrame;
+    unsigned char header[4];
+    putUInt32LE(header, client->session.sequence);
+
+    return sendPacket(client, PACKET_FRAME, header, sizeof(header),
+      reinterpret_cast<const unsigned char*>(lastFrame.data()), lastFrame.size());
+  }
+
+  return true;
+}
+
+void
+FrameStreamer::expireSessions() {
+  Clock::time_point now = Clock::now();
+  Clock::duration grace = std::chrono::milliseconds(RESUME_GRACE_MS);
+
+  size_t count = mDetachedSessions.size();
+
+  for (size_t i = mDetachedSessions.size(); i-- > 0;) {
+    if (now - mDetachedSessions[i].detachedAt > grace) {
+      mDetachedSessions.erase(mDetachedSessions.begin() + i);
+    }
+  }
+
+  if (mDetachedSessions.size() != count) {
+    updateUdpTokens();
+  }
+}
+
+static size_t
+getMemoryUsage(const std::map<uint32_t, TemplateMatcher::Template>& templates,
+    const std::map<uint32_t, VisualDiff::Reference>& references) {
+  size_t size = 0;
+
+  std::map<uint32_t, TemplateMatcher::Template>::const_iterator t;
+  for (t = templates.begin(); t != templates.end(); ++t) {
+    size += t->second.getMemoryUsage();
+  }
+
+  std::map<uint32_t, VisualDiff::Reference>::const_iterator r;
+  for (r = references.begin(); r != references.end(); ++r) {
+    size += r->second.getMemoryUsage();
+  }
+
+  return size;
+}
+
+void
+FrameStreamer::limitSessions() {
+  // Sessions are detached in order, so the oldest one comes first.
+  while (mDetachedSessions.size() > MAX_DETACHED_SESSIONS) {
+    MCINFO("Dropping the oldest detached session");
+    mDetachedSessions.erase(mDetachedSessions.begin());
+  }
+
+  size_t total = 0;
+
+  for (size_t i = 0; i < mDetachedSessions.size(); ++i) {
+    total += getMemoryUsage(mDetachedSessions[i].templates, mDetachedSessions[i].references);
+  }
+
+  for (size_t i = 0; i < mDetachedSessions.size() && total > DETACHED_SESSION_BUDGET; ++i) {
+    Session& session = mDetachedSessions[i];
+    size_t size = getMemoryUsage(session.templates, session.references);
+
+    if (size > 0) {
+      MCINFO("Dropping templates and references of a detached session to free %u bytes",
+        (unsigned int) size);
+      session.templates.clear();
+      session.references.clear();
+      total -= size;
+    }
+  }
+}
+
+void
+FrameStreamer::setTemplate(Client* client, const ClientMessage& msg) {
+  if (msg.payload.size() < 8) {
+    MCWARN("Ignoring invalid template message");
+    return;
+  }
+
+  const unsigned char* data = reinterpret_cast<const unsigned char*>(msg.payload.data());
+  uint32_t id = getUInt32LE(data);
+  uint32_t width = data[4] | (data[5] << 8);
+  uint32_t height = data[6] | (data[7] << 8);
+
+  if (width == 0 || height == 0) {
+    client->session.templates.erase(id);
+    return;
+  }
+
+  if (msg.payload.size() != 8 + width * height) {
+    MCWARN("Ignoring template %u with invalid size", id);
+    return;
+  }
+
+  if (client->session.templates.size() >= MAX_TEMPLATES && client->session.templates.count(id) == 0) {
+    MCWARN("Ignoring template %u, too many templates", id);
+    return;
+  }
+
+  TemplateMatcher::Template tmpl;
+
+  if (!tmpl.set(data + 8, width, height)) {
+    MCWARN("Ignoring template %u, it's either too small or completely flat", id);
+    return;
+  }
+
+  client->session.templates[id] = tmpl;
+}
+
+bool
+FrameStreamer::matchTemplate(Client* client, const ClientMessage& msg) {
+  if (!enablePackets(client)) {
+    return false;
+  }
+
+  if (msg.payload.size() < 14) {
+    MCWARN("Ignoring invalid match message");
+    return true;
+  }
+
+  Clock::time_point start = Clock::now();
+  const unsigned char* data = reinterpret_cast<const unsigned char*>(msg.payload.data());
+  uint32_t id = getUInt32LE(data);
+
+  TemplateMatcher::Region region;
+  region.x = data[4] | (data[5] << 8);
+  region.y = data[6] | (data[7] << 8);
+  region.width = data[8] | (data[9] << 8);
+  region.height = data[10] | (data[11] << 8);
+
+  size_t maxResults = data[12] > 0 ? data[12] : 1;
+  float minScore = data[13] / 100.0f;
+
+  std::vector<TemplateMatcher::Match> matches;
+  std::map<uint32_t, TemplateMatcher::Template>::const_iterator it = client->session.templates.find(id);
+  unsigned char status;
+
+  if (it == client->session.templates.end()) {
+    status = MATCH_UNKNOWN_TEMPLATE;
+  }
+  else if (!mLuma.hasImage() && !walkSnapshot(&mLuma)) {
+    status = MATCH_NO_FRAME;
+  }
+  else {
+    mMatcher.setImage(&mLuma.getImage(), mLuma.getGeneration());
+    mMatcher.match(it->second, region, minScore, maxResults, matches);
+    status = MATCH_OK;
+  }
+
+  uint32_t elapsed = std::chrono::duration_cast<std::chrono::microseconds>(
+    Clock::now() - start).count();
+
+  unsigned char header[14];
+  putUInt32LE(header, id);
+  putUInt32LE(header + 4, status == MATCH_OK ? mLumaCapture : 0);
+  header[8] = status;
+  header[9] = matches.size();
+  putUInt32LE(header + 10, elapsed);
+
+  std::vector<unsigned char> body(matches.size() * 6);
+
+  for (size_t i = 0; i < matches.size(); ++i) {
+    unsigned char* entry = body.data() + i * 6;
+    uint16_t score = matches[i].score > 0 ? matches[i].score * 10000 + 0.5f : 0;
+    entry[0] = matches[i].x & 0xFF;
+    entry[1] = matches[i].x >> 8;
+    entry[2] = matches[i].y & 0xFF;
+    entry[3] = matches[i].y >> 8;
+    entry[4] = score & 0xFF;
+    entry[5] = score >> 8;
+  }
+
+  return sendPacket(client, PACKET_MATCHES, header, sizeof(header), body.data(), body.size());
+}
+
+bool
+FrameStreamer::wantsLuma() {
+  for (size_t i = 0; i < mClients.size(); ++i) {
+    if (!mClients[i]->session.templates.empty()) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+void
+FrameStreamer::setReference(Client* client, const ClientMessage& msg) {
+  if (msg.payload.size() < 12) {
+    MCWARN("Ignoring invalid reference message");
+    return;
+  }
+
+  const unsigned char* data = reinterpret_cast<const unsigned char*>(msg.payload.data());
+  uint32_t id = getUInt32LE(data);
+  uint32_t width = data[4] | (data[5] << 8);
+  uint32_t height = data[6] | (data[7] << 8);
+  uint32_t offset = getUInt32LE(data + 8);
+
+  if (width == 0 || height == 0) {
+    client->session.references.erase(id);
+    return;
+  }
+
+  std::map<uint32_t, VisualDiff::Reference>::iterator it = client->session.references.find(id);
+
+  if (offset == 0) {
+    if (it == client->session.references.end()) {
+      if (client->session.references.size() >= MAX_REFERENCES) {
+        MCWARN("Ignoring reference %u, too many references", id);
+        return;
+      }
+
+      it = client->session.references.insert(std::make_pair(id, VisualDiff::Reference())).first;
+    }
+
+    it->second.begin(width, height);
+  }
+  else if (it == client->session.references.end() || it->second.getWidth() != width ||
+      it->second.getHeight() != height) {
+    MCWARN("Ignoring chunk of unknown reference %u", id);
+    return;
+  }
+
+  // A broken upload is worse than none, so the reference is dropped and
+  // diffs will say so.
+  if (!it->second.append(offset, data + 12, msg.payload.size() - 12)) {
+    MCWARN("Dropping reference %u, chunk at %u is out of order or too large", id, offset);
+    client->session.references.erase(it);
+  }
+}
+
+bool
+FrameStreamer::diffReference(Client* client, const ClientMessage& msg) {
+  if (!enablePackets(client)) {
+    return false;
+  }
+
+  if (msg.payload.size() < 14) {
+    MCWARN("Ignoring invalid diff message");
+    return true;
+  }
+
+  Clock::time_point start = Clock::now();
+  const unsigned char* data = reinterpret_cast<const unsigned char*>(msg.payload.data());
+  uint32_t id = getUInt32LE(data);
+  unsigned char tolerance = data[4];
+  uint32_t cellSize = data[5];
+
+  VisualDiff::Region region;
+  region.x = data[6] | (data[7] << 8);
+  region.y = data[8] | (data[9] << 8);
+  region.width = data[10] | (data[11] << 8);
+  region.height = data[12] | (data[13] << 8);
+
+  VisualDiff::Result result = VisualDiff::Result();
+
+  std::map<uint32_t, VisualDiff::Reference>::iterator it = client->session.references.find(id);
+  Minicap::Frame frame;
+  unsigned char status;
+
+  if (it == client->session.references.end() || !it->second.isComplete()) {
+    status = DIFF_UNKNOWN_REFERENCE;
+  }
+  else if (!mSnapshot.getFrame(&frame)) {
+    status = DIFF_NO_FRAME;
+  }
+  else if (it->second.getWidth() != frame.width || it->second.getHeight() != frame.height) {
+    status = DIFF_SIZE_MISMATCH;
+  }
+  else if (!VisualDiff::compare(it->second, &frame, region, tolerance, cellSize, &result)) {
+    status = DIFF_NO_FRAME;
+  }
+  else {
+    status = DIFF_OK;
+  }
+
+  uint32_t elapsed = std::chrono::duration_cast<std::chrono::microseconds>(
+    Clock::now() - start).count();
+
+  unsigned char header[34];
+  putUInt32LE(header, id);
+  putUInt32LE(header + 4, status == DIFF_OK ? mSnapshotCapture : 0);
+  header[8] = status;
+  header[9] = result.maskColumns > 0 ? cellSize : 0;
+  putUInt32LE(header + 10, result.mismatched);
+  putUInt32LE(header + 14, result.compared);
+  putUInt16LE(header + 18, result.x);
+  putUInt16LE(header + 20, result.y);
+  putUInt16LE(header + 22, result.width);
+  putUInt16LE(header + 24, result.height);
+  putUInt32LE(header + 26, elapsed);
+  putUInt16LE(header + 30, result.maskColumns);
+  putUInt16LE(header + 32, result.maskRows);
+
+  return sendPacket(client, PACKET_DIFF, header, sizeof(header),
+    result.mask.data(), result.mask.size());
+}
+
+bool
+FrameStreamer::wantsSnapshot() {
+  if (mKeepSnapshot || hasPendingScreenshots()) {
+    return true;
+  }
+
+  // Streaming alone doesn't need a copy, and making one would also pull
+  // YUV frames through conversion. Anything that works on the latest frame
+  // while the screen is idle does, though. Besides screenshots, diffs,
+  // matches and classifications, that's the full size frames held back
+  // from slow clients, and the frame region mode sends static regions
+  // from.
+  for (size_t i = 0; i < mClients.size(); ++i) {
+    Session& session = mClients[i]->session;
+
+    if (!session.streaming || session.regions || session.classifying ||
+        !session.templates.empty() || !session.references.empty() ||
+        session.capacity.isLimited()) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+bool
+FrameStreamer::walkSnapshot(TileKernel* kernel) {
+  Minicap::Frame frame;
+
+  if (!mSnapshot.getFrame(&frame)) {
+    return false;
+  }
+
+  mWalker.clearKernels();
+  mWalker.addKernel(kernel);
+  mWalker.walk(&frame);
+
+  if (kernel == &mLuma) {
+    mLumaCapture = mSnapshotCapture;
+  }
+  else if (kernel == &mFingerprinter) {
+    mFingerprintCapture = mSnapshotCapture;
+  }
+
+  return true;
+}
+
+void
+FrameStreamer::setClientQuantTables(Client* client, const ClientMessage& msg) {
+  // An empty name goes back to whatever the server was started with.
+  if (msg.payload.empty()) {
+    client->session.quantTables = mQuantTables;
+    MCINFO("Client quantization tables reset");
+    return;
+  }
+
+  const QuantTables* tables;
+
+  if (!QuantTables::findPreset(msg.payload, &tables)) {
+    MCWARN("Ignoring unknown quantization table preset '%s'", msg.payload.c_str());
+    return;
+  }
+
+  client->session.quantTables = tables;
+  MCINFO("Client quantization tables set to '%s'", msg.payload.c_str());
+}
+
+// Source names may be paths, which could hold anything.
+static void
+writeJsonString(std::ostringstream& json, const std::string& value) {
+  json << '"';
+
+  for (size_t i = 0; i < value.size(); ++i) {
+    unsigned char c = value[i];
+
+    if (c == '"' || c == '\\') {
+      json << '\\' << c;
+    }
+    else if (c >= 0x20) {
+      json << c;
+    }
+  }
+
+  json << '"';
+}
+
+bool
+FrameStreamer::sendStats(Client* client, const ClientMessage& msg) {
+  if (!enablePackets(client)) {
+    return false;
+  }
+
+  bool reset = !msg.payload.empty() && (msg.payload[0] & 1);
+
+  // JSON, so that sections can be added without breaking anyone.
+  std::ostringstream json;
+
+  json << "{\"server\":{"
+       << "\"frames\":" << mFrames
+       << ",\"clients\":" << mClients.size()
+       << "}";
+
+  if (mJankMonitor != NULL) {
+    JankMonitor::Stats stats;
+    mJankMonitor->getStats(&stats, reset);
+
+    json << ",\"jank\":{"
+         << "\"refresh_rate\":" << stats.refreshRate
+         << ",\"frames\":" << stats.frames
+         << ",\"janky_frames\":" << stats.jankyFrames
+         << ",\"dropped_frames\":" << stats.droppedFrames
+         << ",\"idle_gaps\":" << stats.idleGaps
+         << ",\"bursts\":" << stats.bursts
+         << ",\"longest_burst\":" << stats.longestBurst
+         << ",\"intervals_us\":{"
+         << "\"count\":" << stats.intervals
+         << ",\"p50\":" << stats.p50
+         << ",\"p90\":" << stats.p90
+         << ",\"p95\":" << stats.p95
+         << ",\"p99\":" << stats.p99
+         << ",\"max\":" << stats.max
+         << "}}";
+  }
+
+  if (!mCaptureMethod.empty() || mWatchdog != NULL) {
+    json << ",\"capture\":{\"method\":";
+    writeJsonString(json, mCaptureMethod);
+    json << ",\"source\":";
+    writeJsonString(json, mCaptureSource);
+
+    if (!mCaptureProbe.empty()) {
+      json << ",\"probe\":[";
+
+      for (size_t i = 0; i < mCaptureProbe.size(); ++i) {
+        const CaptureProbe::Result& result = mCaptureProbe[i];
+
+        json << (i > 0 ? "," : "") << "{\"source\":";
+        writeJsonString(json, result.name);
+        json << ",\"method\":";
+        writeJsonString(json, result.method);
+        json << ",\"ok\":" << (result.ok ? "true" : "false")
+             << ",\"quirks\":" << static_cast<int>(result.quirks)
+             << ",\"frames\":" << result.frames
+             << ",\"fps\":" << result.fps
+             << ",\"first_frame_ms\":" << result.firstFrameMs
+             << ",\"frame_ms\":" << result.frameMs
+             << "}";
+      }
+
+      json << "]";
+    }
+
+    if (mWatchdog != NULL) {
+      CaptureWatchdog::Stats stats;
+      mWatchdog->getStats(&stats);
+
+      json << ",\"stall_timeout_ms\":" << stats.timeoutMs
+           << ",\"stalls\":" << stats.stalls
+           << ",\"recoveries\":" << stats.recoveries
+           << ",\"last_stall_ms\":" << stats.lastStallMs
+           << ",\"last_recovery_ms\":" << stats.lastRecoveryMs;
+    }
+
+    json << "}";
+  }
+
+  json << "}";
+
+  std::string body = json.str();
+
+  return sendPacket(client, PACKET_STATS, NULL, 0,
+    reinterpret_cast<const unsigned char*>(body.data()), body.size());
+}
+
+bool
+FrameStreamer::setRegionMode(Client* client, const ClientMessage& msg) {
+  if (!enablePackets(client)) {
+    return false;
+  }
+
+  const unsigned char* data = reinterpret_cast<const unsigned char*>(msg.payload.data());
+  bool enable = msg.payload.size() >= 1 && data[0] != 0;
+  uint32_t interval = msg.payload.size() >= 3 ? getUInt16LE(data + 1) : 0;
+
+  client->session.regions = enable;
+  client->session.regionSequence = 0;
+  client->session.staticInterval = std::chrono::milliseconds(
+    interval > 0 ? interval : DEFAULT_STATIC_INTERVAL_MS);
+
+  // The first update covers everything, and goes out right away.
+  client->session.lastStaticUpdate = Clock::time_point();
+  client->session.pendingCells.clear();
+
+  MCINFO("Client region mode %s", enable ? "enabled" : "disabled");
+
+  return true;
+}
+
+bool
+FrameStreamer::wantsRegions() {
+  for (size_t i = 0; i < mClients.size(); ++i) {
+    if (mClients[i]->session.regions) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+bool
+FrameStreamer::setDirtyRects(Client* client, const ClientMessage& msg) {
+  if (!enablePackets(client)) {
+    return false;
+  }
+
+  const unsigned char* data = reinterpret_cast<const unsigned char*>(msg.payload.data());
+  bool enable = msg.payload.size() >= 1 && data[0] != 0;
+
+  client->session.dirtyRects = enable;
+
+  // The first frame counts as changed everywhere.
+  client->session.dirtyCells.clear();
+
+  MCINFO("Client dirty rectangles %s", enable ? "enabled" : "disabled");
+
+  return true;
+}
+
+bool
+FrameStreamer::wantsChanges() {
+  if (wantsRegions()) {
+    return true;
+  }
+
+  for (size_t i = 0; i < mClients.size(); ++i) {
+    if (mClients[i]->session.dirtyRects) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+void
+FrameStreamer::trackDirtyCells() {
+  const std::vector<unsigned char>& changed = mRegions.getChanged();
+  size_t cells = mRegions.getCellCount();
+
+  for (size_t i = 0; i < mClients.size(); ++i) {
+    Client* client = mClients[i].get();
+
+    if (!client->session.dirtyRects) {
+      continue;
+    }
+
+    if (client->session.dirtyCells.size() != cells) {
+      client->session.dirtyCells.assign(cells, 1);
+    }
+    else {
+      for (size_t c = 0; c < cells; ++c) {
+        client->session.dirtyCells[c] |= changed[c];
+      }
+    }
+  }
+}
+
+static uint32_t
+alignDown(uint32_t value, uint32_t alignment) {
+  return value / alignment * alignment;
+}
+
+static uint32_t
+alignUp(uint32_t value, uint32_t alignment, uint32_t limit) {
+  value = (value + alignment - 1) / alignment * alignment;
+  return value < limit ? value : limit;
+}
+
+bool
+FrameStreamer::sendDirtyRects(Client* client, uint32_t width, uint32_t height) {
+  uint32_t frameWidth = mRegions.getWidth();
+  uint32_t frameHeight = mRegions.getHeight();
+
+  if (frameWidth == 0 || client->session.dirtyCells.size() != mRegions.getCellCount()) {
+    // Nothing to go by, so the whole frame is dirty.
+    RegionTracker::Rect all = { 0, 0, width, height };
+    mRegionRects.assign(1, all);
+    frameWidth = width;
+    frameHeight = height;
+  }
+  else {
+    mRegions.getRects(client->session.dirtyCells, MAX_DIRTY_RECTS, mRegionRects);
+  }
+
+  std::string body;
+
+  for (size_t i = 0; i < mRegionRects.size(); ++i) {
+    const RegionTracker::Rect& rect = mRegionRects[i];
+
+    // Scale to the output, rounding outwards so that every pixel the box
+    // filter mixed a changed pixel into is covered.
+    uint32_t x0 = static_cast<uint64_t>(rect.x) * width / frameWidth;
+    uint32_t y0 = static_cast<uint64_t>(rect.y) * height / frameHeight;
+    uint32_t x1 = (static_cast<uint64_t>(rect.x + rect.width) * width + frameWidth - 1) / frameWidth;
+    uint32_t y1 = (static_cast<uint64_t>(rect.y + rect.height) * height + frameHeight - 1) / frameHeight;
+
+    x0 = alignDown(x0, DIRTY_RECT_ALIGN);
+    y0 = alignDown(y0, DIRTY_RECT_ALIGN);
+    x1 = alignUp(x1, DIRTY_RECT_ALIGN, width);
+    y1 = alignUp(y1, DIRTY_RECT_ALIGN, height);
+
+    unsigned char entry[8];
+    putUInt16LE(entry, x0);
+    putUInt16LE(entry + 2, y0);
+    putUInt16LE(entry + 4, x1 - x0);
+    putUInt16LE(entry + 6, y1 - y0);
+
+    body.append(reinterpret_cast<const char*>(entry), sizeof(entry));
+  }
+
+  client->session.dirtyCells.assign(client->session.dirtyCells.size(), 0);
+
+  // Sent right before the frame, which gets the next sequence number.
+  unsigned char header[10];
+  putUInt32LE(header, client->session.sequence + 1);
+  putUInt16LE(header + 4, width);
+  putUInt16LE(header + 6, height);
+  putUInt16LE(header + 8, mRegionRects.size());
+
+  return sendPacket(client, PACKET_DIRTY, header, sizeof(header),
+    reinterpret_cast<const unsigned char*>(body.data()), body.size());
+}
+
+bool
+FrameStreamer::setWatch(Client* client, const ClientMessage& msg) {
+  if (!enablePackets(client)) {
+    return false;
+  }
+
+  if (client->session.streaming) {
+    MCINFO("Client switched to watches only");
+    client->session.streaming = false;
+  }
+
+  if (msg.payload.size() < 5) {
+    MCWARN("Ignoring invalid watch message");
+    return true;
+  }
+
+  const unsigned char* data = reinterpret_cast<const unsigned char*>(msg.payload.data());
+  uint32_t id = getUInt32LE(data);
+  unsigned char kind = data[4];
+
+  if (kind == 0) {
+    client->session.watches.erase(id);
+    return true;
+  }
+
+  if (msg.payload.size() < 13) {
+    MCWARN("Ignoring invalid watch %u", id);
+    return true;
+  }
+
+  RegionWatcher::Watch watch;
+  watch.x = getUInt16LE(data + 5);
+  watch.y = getUInt16LE(data + 7);
+  watch.width = getUInt16LE(data + 9);
+  watch.height = getUInt16LE(data + 11);
+
+  switch (kind) {
+  case RegionWatcher::KIND_CHANGE:
+    break;
+  case RegionWatcher::KIND_MEAN:
+    if (msg.payload.size() < 15 || data[13] > RegionWatcher::CHANNEL_BLUE) {
+      MCWARN("Ignoring invalid watch %u", id);
+      return true;
+    }
+
+    watch.channel = static_cast<RegionWatcher::Channel>(data[13]);
+    watch.threshold = data[14];
+    break;
+  case RegionWatcher::KIND_EQUAL:
+    if (msg.payload.size() < 21) {
+      MCWARN("Ignoring invalid watch %u", id);
+      return true;
+    }
+
+    watch.target = getUInt64LE(data + 13);
+    break;
+  default:
+    MCWARN("Ignoring watch %u of unknown kind %d", id, kind);
+    return true;
+  }
+
+  watch.kind = static_cast<RegionWatcher::Kind>(kind);
+
+  if (watch.width == 0 || watch.height == 0) {
+    MCWARN("Ignoring empty watch %u", id);
+    return true;
+  }
+
+  if (client->session.watches.size() >= MAX_WATCHES && client->session.watches.count(id) == 0) {
+    MCWARN("Ignoring watch %u, too many watches", id);
+    return true;
+  }
+
+  // Replacing a watch starts it over, so its first evaluation fires.
+  client->session.watches[id] = watch;
+
+  return true;
+}
+
+bool
+FrameStreamer::wantsWatches() {
+  for (size_t i = 0; i < mClients.size(); ++i) {
+    if (!mClients[i]->session.watches.empty()) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+void
+FrameStreamer::sendWatchEvents() {
+  for (size_t i = mClients.size(); i-- > 0;) {
+    Client* client = mClients[i].get();
+    std::map<uint32_t, RegionWatcher::Watch>::iterator it;
+
+    for (it = client->session.watches.begin(); it != client->session.watches.end(); ++it) {
+      const RegionWatcher::Watch& watch = it->second;
+
+      if (!watch.fired) {
+        continue;
+      }
+
+      unsigned char event[22];
+      putUInt32LE(event, it->first);
+      putUInt32LE(event + 4, mFrames);
+      event[8] = watch.kind;
+      event[9] = watch.state ? 1 : 0;
+      memcpy(event + 10, watch.mean, 4);
+      putUInt64LE(event + 14, watch.hash);
+
+      if (!sendPacket(client, PACKET_WATCH, event, sizeof(event), NULL, 0)) {
+        MCINFO("Closing client connection");
+        removeClient(i);
+        break;
+      }
+    }
+  }
+}
+
+void
+FrameStreamer::indexScreen(Client* client, const ClientMessage& msg) {
+  if (msg.payload.size() < 4) {
+    MCWARN("Ignoring invalid screen index message");
+    return;
+  }
+
+  const unsigned char* data = reinterpret_cast<const unsigned char*>(msg.payload.data());
+  uint32_t id = getUInt32LE(data);
+
+  client->session.classifying = true;
+
+  if (msg.payload.size() == 4) {
+    client->session.screens.remove(id);
+    return;
+  }
+
+  if (msg.payload.size() != 4 + ScreenFingerprint::BYTES &&
+      msg.payload.size() != 4 + 2 * ScreenFingerprint::BYTES) {
+    MCWARN("Ignoring screen %u with invalid size", id);
+    return;
+  }
+
+  ScreenFingerprint fingerprint;
+  fingerprint.load(data + 4);
+
+  ScreenFingerprint mask;
+
+  if (msg.payload.size() == 4 + 2 * ScreenFingerprint::BYTES) {
+    mask.load(data + 4 + ScreenFingerprint::BYTES);
+  }
+  else {
+    mask.fill();
+  }
+
+  if (!client->session.screens.set(id, fingerprint, mask, MAX_INDEXED_SCREENS)) {
+    MCWARN("Ignoring screen %u, too many screens", id);
+  }
+}
+
+bool
+FrameStreamer::classifyScreen(Client* client, const ClientMessage& msg) {
+  if (!enablePackets(client)) {
+    return false;
+  }
+
+  if (msg.payload.size() < 4) {
+    MCWARN("Ignoring invalid classify message");
+    return true;
+  }
+
+  Clock::time_point start = Clock::now();
+  const unsigned char* data = reinterpret_cast<const unsigned char*>(msg.payload.data());
+  uint32_t id = getUInt32LE(data);
+
+  client->session.classifying = true;
+
+  ScreenIndex::Match matches[2];
+  size_t found = 0;
+  unsigned char status;
+
+  if (!mFingerprinter.hasFingerprint() && !walkSnapshot(&mFingerprinter)) {
+    status = CLASSIFY_NO_FRAME;
+  }
+  else if (client->session.screens.empty()) {
+    status = CLASSIFY_EMPTY_INDEX;
+  }
+  else {
+    found = client->session.screens.classify(mFingerprinter.getFingerprint(), &matches[0], &matches[1]);
+    status = CLASSIFY_OK;
+  }
+
+  uint32_t elapsed = std::chrono::duration_cast<std::chrono::microseconds>(
+    Clock::now() - start).count();
+
+  unsigned char header[14 + ScreenFingerprint::BYTES];
+  putUInt32LE(header, id);
+  putUInt32LE(header + 4, mFingerprinter.hasFingerprint() ? mFingerprintCapture : 0);
+  header[8] = status;
+  header[9] = found;
+  putUInt32LE(header + 10, elapsed);
+
+  // The fingerprint of the frame that was classified, which can go right
+  // into the index if it's a new screen.
+  if (mFingerprinter.hasFingerprint()) {
+    mFingerprinter.getFingerprint().store(header + 14);
+  }
+  else {
+    memset(header + 14, 0, ScreenFingerprint::BYTES);
+  }
+
+  unsigned char body[2 * 8];
+
+  for (size_t i = 0; i < found; ++i) {
+    putUInt32LE(body + i * 8, matches[i].id);
+    putUInt16LE(body + i * 8 + 4, matches[i].distance);
+    putUInt16LE(body + i * 8 + 6, matches[i].bits);
+  }
+
+  return sendPacket(client, PACKET_SCREEN, header, sizeof(header), body, found * 8);
+}
+
+bool
+FrameStreamer::wantsFingerprint() {
+  for (size_t i = 0; i < mClients.size(); ++i) {
+    if (mClients[i]->session.classifying) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+bool
+FrameStreamer::takeFeedback(Client* client, const ClientMessage& msg) {
+  if (msg.payload.size() < 8) {
+    MCWARN("Ignoring short feedback from client");
+    return true;
+  }
+
+  const unsigned char* data = reinterpret_cast<const unsigned char*>(msg.payload.data());
+  uint32_t renderUs = getUInt32LE(data);
+  uint32_t dropped = getUInt32LE(data + 4);
+
+  if (client->session.capacity.report(renderUs, dropped, Clock::now())) {
+    MCINFO("Client renders in %uus, scaling its frames to %d%%", renderUs,
+      static_cast<int>(client->session.capacity.getScale() * 100 + 0.5f));
+  }
+
+  return true;
+}
+
+void
+FrameStreamer::sendDeferredFrames() {
+  Clock::time_point now = Clock::now();
+  Minicap::Frame frame;
+  mSnapshot.getFrame(&frame);
+
+  for (size_t i = mClients.size(); i-- > 0;) {
+    Client* client = mClients[i].get();
+
+    if (!client->frameDeferred || client->output == NULL ||
+        now - client->lastFrameAt < client->session.capacity.getMinInterval()) {
+      continue;
+    }
+
+    // The output still holds the latest frame, scaled or encoded if anyone
+    // needed it that way. Full size comes from the snapshot.
+    if (!encodeOutput(client->output, &frame)) {
+      MCERROR("Unable to encode frame");
+      continue;
+    }
+
+    client->frameDeferred = false;
+    client->lastFrameAt = now;
+
+    if ((client->session.dirtyRects &&
+        !sendDirtyRects(client, client->output->width, client->output->height)) ||
+        !sendFrame(client, client->output)) {
+      MCINFO("Closing client connection");
+      removeClient(i);
+    }
+  }
+}
+
+void
+FrameStreamer::streamRegions(Minicap::Frame* frame, bool newFrame) {
+  const std::vector<unsigned char>& changed = mRegions.getChanged();
+  size_t cells = mRegions.getCellCount();
+  Clock::time_point now = Clock::now();
+
+  if (cells == 0) {
+    return;
+  }
+
+  for (size_t i = mClients.size(); i-- > 0;) {
+    Client* client = mClients[i].get();
+
+    if (!client->session.regions) {
+      continue;
+    }
+
+    if (client->session.pendingCells.size() != cells) {
+      client->session.pendingCells.assign(cells, 1);
+    }
+    else if (newFrame) {
+      for (size_t c = 0; c < cells; ++c) {
+        client->session.pendingCells[c] |= changed[c];
+      }
+    }
+
+    // Active cells always go out, static ones only when they're due. When
+    // they are, everything pending goes out together.
+    bool staticDue = now - client->session.lastStaticUpdate >= client->session.staticInterval;
+    bool haveStatic = false;
+    bool haveAny = false;
+
+    mRegionCells.assign(cells, 0);
+
+    for (size_t c = 0; c < cells; ++c) {
+      if (!client->session.pendingCells[c]) {
+        continue;
+      }
+
+      if (!mRegions.isActive(c)) {
+        if (!staticDue) {
+          continue;
+        }
+
+        haveStatic = true;
+      }
+
+      mRegionCells[c] = 1;
+      client->session.pendingCells[c] = 0;
+      haveAny = true;
+    }
+
+    if (!haveAny) {
+      continue;
+    }
+
+    if (haveStatic) {
+      client->session.lastStaticUpdate = now;
+    }
+
+    if (!sendRegions(client, frame, mRegionCells)) {
+      MCINFO("Closing client connection");
+      removeClient(i);
+    }
+  }
+}
+
+bool
+FrameStreamer::sendRegions(Client* client, Minicap::Frame* frame,
+    const std::vector<unsigned char>& cells) {
+  mRegions.getRects(cells, MAX_REGION_RECTS, mRegionRects);
+
+  // Clients that are in sync get the same rectangles, so each one only
+  // has to be encoded once per frame.
+  if (mRegionCacheGeneration != mSnapshot.getGeneration()) {
+    mRegionCache.clear();
+    mRegionCacheGeneration = mSnapshot.getGeneration();
+  }
+
+  if (!mRegionEncoder.reserveData(frame->width, frame->height)) {
+    MCERROR("Unable to reserve data for JPG encoder");
+    return false;
+  }
+
+  std::string body;
+
+  for (size_t i = 0; i < mRegionRects.size(); ++i) {
+    const RegionTracker::Rect& rect = mRegionRects[i];
+    const QuantTables* tables = client->session.quantTables;
+    size_t index = 0;
+
+    while (index < mRegionCache.size() && (mRegionCache[index].tables != tables ||
+        memcmp(&mRegionCache[index].rect, &rect, sizeof(rect)) != 0)) {
+      index += 1;
+    }
+
+    if (index == mRegionCache.size()) {
+      Minicap::Frame crop = *frame;
+      crop.data = static_cast<const unsigned char*>(frame->data) +
+        (rect.y * frame->stride + rect.x) * frame->bpp;
+      crop.width = rect.width;
+      crop.height = rect.height;
+      crop.size = ((rect.height - 1) * frame->stride + rect.width) * frame->bpp;
+
+      mRegionEncoder.setQuantTables(tables);
+
+      if (!mRegionEncoder.encode(&crop, mQuality)) {
+        MCERROR("Unable to encode region");
+        return false;
+      }
+
+      EncodedRegion encoded;
+      encoded.rect = rect;
+      encoded.tables = tables;
+      encoded.data.assign(reinterpret_cast<const char*>(mRegionEncoder.getEncodedData()),
+        mRegionEncoder.getEncodedSize());
+      mRegionCache.push_back(encoded);
+    }
+
+    const std::string& data = mRegionCache[index].data;
+    unsigned char entry[12];
+    putUInt16LE(entry, rect.x);
+    putUInt16LE(entry + 2, rect.y);
+    putUInt16LE(entry + 4, rect.width);
+    putUInt16LE(entry + 6, rect.height);
+    putUInt32LE(entry + 8, data.size());
+
+    body.append(reinterpret_cast<const char*>(entry), sizeof(entry));
+    body.append(data);
+  }
+
+  client->session.regionSequence += 1;
+
+  unsigned char header[10];
+  putUInt32LE(header, client->session.regionSequence);
+  putUInt16LE(header + 4, frame->width);
+  putUInt16LE(header + 6, frame->height);
+  putUInt16LE(header + 8, mRegionRects.size());
+
+  return sendPacket(client, PACKET_REGIONS, header, sizeof(header),
+    reinterpret_cast<const unsigned char*>(body.data()), body.size());
+}
+
+bool
+FrameStreamer::needsPackedFrame(Minicap::Frame* frame) {
+  if (wantsSnapshot() || wantsLuma() || wantsChanges() || wantsWatches() ||
+      wantsFingerprint() || hasPendingScreenshots()) {
+    return true;
+  }
+
+  for (size_t i = 0; i < mClients.size(); ++i) {
+    Client* client = mClients[i].get();
+
+    if (client->session.streaming && client->session.viewportWidth > 0 &&
+        client->session.viewportHeight > 0 &&
+        (client->session.viewportWidth < frame->width ||
+         client->session.viewportHeight < frame->height)) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+bool
+FrameStreamer::queueScreenshot(Client* client, const ClientMessage& msg) {
+  if (!enablePackets(client)) {
+    return false;
+  }
+
+  if (client->session.streaming) {
+    MCINFO("Client switched to screenshots only");
+    client->session.streaming = false;
+  }
+
+  if (msg.payload.size() < 9) {
+    MCWARN("Ignoring invalid screenshot message");
+    return true;
+  }
+
+  const unsigned char* data = reinterpret_cast<const unsigned char*>(msg.payload.data());
+
+  ScreenshotRequest request;
+  request.id = getUInt32LE(data);
+  request.width = data[4] | (data[5] << 8);
+  request.height = data[6] | (data[7] << 8);
+  request.quality = data[8] > 0 && data[8] <= 100 ? data[8] : mQuality;
+  request.arrivedAt = Clock::now();
+
+  // The first request of a batch decides when the batch is due.
+  if (!hasPendingScreenshots()) {
+    mScreenshotsDue = request.arrivedAt + std::chrono::milliseconds(SCREENSHOT_COALESCE_MS);
+  }
+
+  client->session.screenshots.push_back(request);
+
+  return true;
+}
+
+bool
+FrameStreamer::hasPendingScreenshots() {
+  for (size_t i = 0; i < mClients.size(); ++i) {
+    if (!mClients[i]->session.screenshots.empty()) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+// Works out the size of the frame when fitted into the given box, keeping
+// the aspect ratio and never scaling up. An empty box means full size.
+static void
+fitFrame(const Minicap::Frame* frame, uint32_t boxWidth, uint32_t boxHeight,
+    uint32_t* width, uint32_t* height) {
+  *width = frame->width;
+  *height = frame->height;
+
+  if (!FrameScaler::supportsFormat(frame->format) || boxWidth == 0 || boxHeight == 0) {
+    return;
+  }
+
+  Projection fit;
+  fit.realWidth = frame->width;
+  fit.realHeight = frame->height;
+  fit.virtualWidth = boxWidth;
+  fit.virtualHeight = boxHeight;
+  fit.forceMaximumSize();
+  fit.forceAspectRatio();
+
+  if (fit.valid()) {
+    *width = fit.virtualWidth;
+    *height = fit.virtualHeight;
+  }
+}
+
+bool
+FrameStreamer::serveScreenshots(Minicap::Frame* frame, uint64_t capture) {
+  for (size_t i = 0; i < mScreenshotOutputs.size(); ++i) {
+    mScreenshotOutputs[i]->used = false;
+  }
+
+  // Scale to all requested sizes in one go.
+  mWalker.clearKernels();
+
+  for (size_t i = 0; i < mClients.size(); ++i) {
+    std::vector<ScreenshotRequest>& requests = mClients[i]->session.screenshots;
+
+    for (size_t j = 0; j < requests.size(); ++j) {
+      uint32_t width, height;
+      fitFrame(frame, requests[j].width, requests[j].height, &width, &height);
+
+      Output* output = getOutput(mScreenshotOutputs, width, height, mQuantTables);
+
+      if (output == NULL) {
+        return false;
+      }
+
+      if (!output->used && (width != frame->width || height != frame->height)) {
+        output->scaler.setTargetSize(width, height);
+        mWalker.addKernel(&output->scaler);
+      }
+
+      output->used = true;
+    }
+  }
+
+  for (size_t i = mScreenshotOutputs.size(); i-- > 0;) {
+    if (!mScreenshotOutputs[i]->used) {
+      mScreenshotOutputs.erase(mScreenshotOutputs.begin() + i);
+    }
+  }
+
+  mWalker.walk(frame);
+
+  // Then encode once for each size and quality, and answer everyone who
+  // asked for that combination.
+  unsigned char header[12];
+  putUInt32LE(header + 4, capture);
+
+  for (size_t o = 0; o < mScreenshotOutputs.size(); ++o) {
+    Output* output = mScreenshotOutputs[o].get();
+    Minicap::Frame scaled;
+    Minicap::Frame* source = frame;
+
+    if (output->width != frame->width || output->height != frame->height) {
+      if (!output->scaler.getScaledFrame(&scaled)) {
+        MCERROR("Unable to scale frame to %ux%u", output->width, output->height);
+        return false;
+      }
+
+      source = &scaled;
+    }
+
+    header[8] = output->width & 0xFF;
+    header[9] = output->width >> 8;
+    header[10] = output->height & 0xFF;
+    header[11] = output->height >> 8;
+
+    while (true) {
+      unsigned int quality = 0;
+
+      // Find a quality that someone still needs at this size.
+      for (size_t i = 0; i < mClients.size() && quality == 0; ++i) {
+        std::vector<ScreenshotRequest>& requests = mClients[i]->session.screenshots;
+
+        for (size_t j = 0; j < requests.size(); ++j) {
+          uint32_t width, height;
+          fitFrame(frame, requests[j].width, requests[j].height, &width, &height);
+
+          if (width == output->width && height == output->height) {
+            quality = requests[j].quality;
+            break;
+          }
+        }
+      }
+
+      if (quality == 0) {
+        break;
+      }
+
+      if (!output->encoder.encode(source, quality)) {
+        MCERROR("Unable to encode screenshot");
+        return false;
+      }
+
+      mScreenshotEncodes += 1;
+
+      for (size_t i = mClients.size(); i-- > 0;) {
+        Client* client = mClients[i].get();
+        std::vector<ScreenshotRequest>& requests = client->session.screenshots;
+        bool failed = false;
+
+        for (size_t j = 0; j < requests.size();) {
+          uint32_t width, height;
+          fitFrame(frame, requests[j].width, requests[j].height, &width, &height);
+
+          if (width != output->width || height != output->height ||
+              requests[j].quality != quality) {
+            ++j;
+            continue;
+          }
+
+          putUInt32LE(header, requests[j].id);
+
+          if (!failed && !sendPacket(client, PACKET_SCREENSHOT, header, sizeof(header),
+              output->encoder.getEncodedData(), output->encoder.getEncodedSize())) {
+            failed = true;
+          }
+
+          mScreenshotLatencies.push_back(std::chrono::duration_cast<std::chrono::microseconds>(
+            Clock::now() - requests[j].arrivedAt).count());
+
+          requests.erase(requests.begin() + j);
+        }
+
+        if (failed) {
+          MCINFO("Closing client connection");
+          removeClient(i);
+        }
+      }
+    }
+  }
+
+  if (mScreenshotLatencies.size() >= SCREENSHOT_REPORT_INTERVAL) {
+    reportScreenshotLatencies();
+  }
+
+  return true;
+}
+
+void
+FrameStreamer::reportScreenshotLatencies() {
+  std::vector<uint32_t>& latencies = mScreenshotLatencies;
+  size_t count = latencies.size();
+
+  std::sort(latencies.begin(), latencies.end());
+
+  MCINFO("Screenshot latency over %u requests: p50 %.1fms, p90 %.1fms, p99 %.1fms, max %.1fms; %.2f requests per encode",
+    (unsigned int) count,
+    latencies[count * 50 / 100] / 1000.0,
+    latencies[count * 90 / 100] / 1000.0,
+    latencies[count * 99 / 100] / 1000.0,
+    latencies[count - 1] / 1000.0,
+    (double) count / mScreenshotEncodes);
+
+  latencies.clear();
+  mScreenshotEncodes = 0;
+}
+
+bool
+FrameStreamer::sendPacket(Client* client, unsigned char type, const unsigned char* header,
+    size_t headerSize, const unsigned char* data, size_t size) {
+  unsigned char prefix[5];
+  putUInt32LE(prefix, 1 + headerSize + size);
+  prefix[4] = type;
+
+  struct iovec iov[3];
+  iov[0].iov_base = prefix;
+  iov[0].iov_len = sizeof(prefix);
+  iov[1].iov_base = const_cast<unsigned char*>(header);
+  iov[1].iov_len = headerSize;
+  iov[2].iov_base = const_cast<unsigned char*>(data);
+  iov[2].iov_len = size;
+
+  return pumpsv(client->fd, iov, 3) >= 0;
+}
+
+bool
+FrameStreamer::sendFrame(Client* client, Output* output) {
+  unsigned char* data = output->encoder.getEncodedData();
+  size_t size = output->encoder.getEncodedSize();
+
+  if (!client->packets) {
+    // The encoder leaves room for the size in front of the data.
+    putUInt32LE(data - 4, size);
+    return pumps(client->fd, data - 4, size + 4) >= 0;
+  }
+
+  if (!output->retained) {
+    output->retained = std::make_shared<const std::string>(
+      reinterpret_cast<const char*>(data), size);
+  }
+
+  client->session.sequence += 1;
+  client->session.lastFrame = output->retained;
+
+  unsigned char header[4];
+  putUInt32LE(header, client->session.sequence);
+
+  return sendPacket(client, PACKET_FRAME, header, sizeof(header), data, size);
+}
+
+void
+FrameStreamer::removeClient(size_t index) {
+  Client* client = mClients[index].get();
+
+  close(client->fd);
+
+  // Only clients in packet mode know their sequence numbers, so they're
+  // the only ones that can resume.
+  if (client->packets) {
+    client->session.detachedAt = Clock::now();
+    mDetachedSessions.push_back(std::move(client->session));
+    limitSessions();
+  }
+
+  mClients.erase(mClients.begin() + index);
+  updateUdpTokens();
+}
+
+void
+FrameStreamer::updateUdpTokens() {
+  if (mUdpTransport == NULL) {
+    return;
+  }
+
+  std::vector<uint64_t> tokens;
+
+  for (size_t i = 0; i < mClients.size(); ++i) {
+    // Connections whose session was taken over have none left.
+    if (mClients[i]->session.token != 0) {
+      tokens.push_back(mClients[i]->session.token);
+    }
+  }
+
+  for (size_t i = 0; i < mDetachedSessions.size(); ++i) {
+    tokens.push_back(mDetachedSessions[i].token);
+  }
+
+  mUdpTransport->setTokens(tokens);
+}
+
+FrameStreamer::Output*
+FrameStreamer::getOutput(std::vector<std::unique_ptr<Output>>& outputs, uint32_t width, uint32_t height,
+    const QuantTables* tables) {
+  for (size_t i = 0; i < outputs.size(); ++i) {
+    if (outputs[i]->width == width && outputs[i]->height == height &&
+        outputs[i]->encoder.getQuantTables() == tables) {
+      return outputs[i].get();
+    }
+  }
+
+  std::unique_ptr<Output> output(new Output(width, height, tables));
+
+  if (!output->encoder.reserveData(width, height)) {
+    MCERROR("Unable to reserve data for JPG encoder");
+    return NULL;
+  }
+
+  outputs.push_back(std::move(output));
+
+  return outputs.back().get();
+}
+
+FrameStreamer::Output*
+FrameStreamer::getOutputFor(Client* client, Minicap::Frame* frame) {
+  uint32_t boxWidth = client->session.viewportWidth;
+  uint32_t boxHeight = client->session.viewportHeight;
+  float scale = client->session.capacity.getScale();
+
+  // Clients that can't render what they asked for get less.
+  if (scale < 1) {
+    if (boxWidth == 0 || boxHeight == 0) {
+      boxWidth = frame->width;
+      boxHeight = frame->height;
+    }
+
+    boxWidth = std::max<uint32_t>(boxWidth * scale, 1);
+    boxHeight = std::max<uint32_t>(boxHeight * scale, 1);
+  }
+
+  uint32_t width, height;
+  fitFrame(frame, boxWidth, boxHeight, &width, &height);
+
+  return getOutput(mOutputs, width, height, client->session.quantTables);
+}
+
+bool
+FrameStreamer::encodeOutput(Output* output, Minicap::Frame* frame) {
+  if (output->encoded) {
+    return true;
+  }
+
+  Minicap::Frame* source = frame;
+  Minicap::Frame scaled;
+
+  if (output->width != frame->width || output->height != frame->height) {
+    if (!output->scaler.getScaledFrame(&scaled)) {
+      MCERROR("Unable to scale frame to %ux%u", output->width, output->height);
+      return false;
+    }
+
+    source = &scaled;
+  }
+  else {
+    // The encoder reads the frame itself.
+    mFramePasses += 1;
+  }
+
+  if (!output->encoder.encode(source, mQuality)) {
+    return false;
+  }
+
+  output->encoded = true;
+  output->retained.reset();
+
+  return true;
+}
+
+void
+FrameStreamer::discardFrame() {
+  mSnapshot.reset();
+  mLuma.reset();
+  mFingerprinter.reset();
+}
+
+bool
+FrameStreamer::streamFrame(Minicap::Frame* frame) {
+  Minicap::Frame converted;
+
+  if (FrameConverter::isYuv(frame->format) && needsPackedFrame(frame)) {
+    if (!mConverter.convert(frame, &converted)) {
+      return false;
+    }
+
+    frame = &converted;
+  }
+
+  for (size_t i = 0; i < mOutputs.size(); ++i) {
+    mOutputs[i]->used = false;
+    mOutputs[i]->encoded = false;
+  }
+
+  mFrames += 1;
+
+  // Figure out which outputs we need.
+  for (size_t i = 0; i < mClients.size(); ++i) {
+    Client* client = mClients[i].get();
+
+    if (!client->session.streaming || client->session.regions) {
+      client->output = NULL;
+      continue;
+    }
+
+    if ((client->output = getOutputFor(client, frame)) == NULL) {
+      return false;
+    }
+
+    client->output->used = true;
+  }
+
+  Output* udpOutput = NULL;
+
+  if (mUdpTransport != NULL && mUdpTransport->hasPeers()) {
+    if ((udpOutput = getOutput(mOutputs, frame->width, frame->height, mQuantTables)) == NULL) {
+      return false;
+    }
+
+    udpOutput->used = true;
+  }
+
+  // Free encoders that nobody is interested in anymore.
+  for (size_t i = mOutputs.size(); i-- > 0;) {
+    if (!mOutputs[i]->used) {
+      mOutputs.erase(mOutputs.begin() + i);
+    }
+  }
+
+  // Run all per-frame analyses in a single pass over the frame: scaling
+  // for each distinct viewport, a luma copy for template matching and a
+  // snapshot for screenshots and diffs.
+  mWalker.clearKernels();
+
+  if (wantsSnapshot()) {
+    mWalker.addKernel(&mSnapshot);
+  }
+  else {
+    // It would only get stale.
+    mSnapshot.reset();
+  }
+
+  if (wantsLuma()) {
+    mWalker.addKernel(&mLuma);
+  }
+  else {
+    mLuma.reset();
+  }
+
+  if (wantsChanges()) {
+    mWalker.addKernel(&mRegions);
+  }
+  else {
+    mRegions.reset();
+  }
+
+  // Watches live in their clients, which may come and go between frames.
+  mWatcher.clearWatches();
+
+  for (size_t i = 0; i < mClients.size(); ++i) {
+    std::map<uint32_t, RegionWatcher::Watch>& watches = mClients[i]->session.watches;
+    std::map<uint32_t, RegionWatcher::Watch>::iterator it;
+
+    for (it = watches.begin(); it != watches.end(); ++it) {
+      mWatcher.addWatch(&it->second);
+    }
+  }
+
+  if (mWatcher.hasWatches()) {
+    mWalker.addKernel(&mWatcher);
+  }
+
+  if (wantsFingerprint()) {
+    mWalker.addKernel(&mFingerprinter);
+  }
+  else {
+    mFingerprinter.reset();
+  }
+
+  for (size_t i = 0; i < mOutputs.size(); ++i) {
+    Output* output = mOutputs[i].get();
+
+    if (output->width != frame->width || output->height != frame->height) {
+      output->scaler.setTargetSize(output->width, output->height);
+      mWalker.addKernel(&output->scaler);
+    }
+  }
+
+  uint64_t passes = mWalker.getPasses();
+  mWalker.walk(frame);
+  mFramePasses += mWalker.getPasses() - passes;
+
+  if (mSnapshot.hasFrame()) {
+    mSnapshotCapture = mFrames;
+  }
+
+  if (mLuma.hasImage()) {
+    mLumaCapture = mFrames;
+  }
+
+  if (mFingerprinter.hasFingerprint()) {
+    mFingerprintCapture = mFrames;
+  }
+
+  trackDirtyCells();
+  sendWatchEvents();
+
+  Clock::time_point now = Clock::now();
+
+  for (size_t i = mClients.size(); i-- > 0;) {
+    Client* client = mClients[i].get();
+
+    if (client->output == NULL) {
+      continue;
+    }
+
+    if (client->session.capacity.isLimited() &&
+        now - client->lastFrameAt < client->session.capacity.getMinInterval()) {
+      client->frameDeferred = true;
+      continue;
+    }
+
+    if (!encodeOutput(client->output, frame)) {
+      MCERROR("Unable to encode frame");
+      return false;
+    }
+
+    client->frameDeferred = false;
+    client->lastFrameAt = now;
+
+    if ((client->session.dirtyRects &&
+        !sendDirtyRects(client, client->output->width, client->output->height)) ||
+        !sendFrame(client, client->output)) {
+      MCINFO("Closing client connection");
+      removeClient(i);
+    }
+  }
+
+  streamRegions(frame, true);
+
+  if (udpOutput != NULL) {
+    if (!encodeOutput(udpOutput, frame)) {
+      MCERROR("Unable to encode frame");
+      return false;
+    }
+
+    mUdpTransport->sendFrame(udpOutput->encoder.getEncodedData(),
+      udpOutput->encoder.getEncodedSize());
+  }
+
+  // Screenshots that have been waiting for a frame get this one. With a
+  // snapshot, they're answered once the batch is due instead.
+  if (hasPendingScreenshots() && (!mSnapshot.hasFrame() || Clock::now() >= mScreenshotsDue)) {
+    if (!serveScreenshots(frame, mFrames)) {
+      return false;
+    }
+  }
+
+  if (mFrames % PASS_REPORT_INTERVAL == 0) {
+    MCDEBUG("%.2f passes over frame memory per frame", (double) mFramePasses / PASS_REPORT_INTERVAL);
+    mFramePasses = 0;
+  }
+
+  return true;
+}
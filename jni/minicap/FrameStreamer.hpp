@@ -0,0 +1,455 @@
+#ifndef MINICAP_FRAME_STREAMER_HPP
+#define MINICAP_FRAME_STREAMER_HPP
+
+#include <poll.h>
+
+#include <chrono>
+#include <map>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "Minicap.hpp"
+
+#include "CaptureProbe.hpp"
+#include "CaptureWatchdog.hpp"
+#include "ClientMessage.hpp"
+#include "ClientCapacity.hpp"
+#include "FrameConverter.hpp"
+#include "FrameScaler.hpp"
+#include "FrameSnapshot.hpp"
+#include "JankMonitor.hpp"
+#include "JpgEncoder.hpp"
+#include "LumaImage.hpp"
+#include "QuantTables.hpp"
+#include "RegionTracker.hpp"
+#include "RegionWatcher.hpp"
+#include "ScreenIndex.hpp"
+#include "TemplateMatcher.hpp"
+#include "TileWalker.hpp"
+#include "UdpTransport.hpp"
+#include "VisualDiff.hpp"
+
+// Keeps track of connected clients and streams frames to them. Each client
+// may ask for frames to be scaled down to its own viewport and encoded with
+// its own quantization tables; clients with identical effective viewports
+// and tables share a single encoded frame.
+class FrameStreamer {
+public:
+  // Types of packets sent to clients that have switched to packet mode.
+  enum PacketType {
+    PACKET_FRAME      = 0x01,
+    PACKET_RESUMED    = 0x02,
+    PACKET_MATCHES    = 0x03,
+    PACKET_SCREENSHOT = 0x04,
+    PACKET_DIFF       = 0x05,
+    PACKET_STATS      = 0x06,
+    PACKET_REGIONS    = 0x07,
+    PACKET_DIRTY      = 0x08,
+    PACKET_WATCH      = 0x09,
+    PACKET_SCREEN     = 0x0A,
+  };
+
+  enum MatchStatus {
+    MATCH_OK               = 0x00,
+    MATCH_UNKNOWN_TEMPLATE = 0x01,
+    MATCH_NO_FRAME         = 0x02,
+  };
+
+  enum DiffStatus {
+    DIFF_OK                = 0x00,
+    DIFF_UNKNOWN_REFERENCE = 0x01,
+    DIFF_NO_FRAME          = 0x02,
+    DIFF_SIZE_MISMATCH     = 0x03,
+  };
+
+  enum ClassifyStatus {
+    CLASSIFY_OK            = 0x00,
+    CLASSIFY_EMPTY_INDEX   = 0x01,
+    CLASSIFY_NO_FRAME      = 0x02,
+  };
+
+  FrameStreamer(unsigned int quality);
+
+  ~FrameStreamer();
+
+  // Sets the banner that gets sent to each new client. Each client gets
+  // its own resume token written to the 8 bytes at tokenOffset.
+  void
+  setBanner(const unsigned char* banner, size_t size, size_t tokenOffset);
+
+  // Also streams full size frames to the peers of the given transport.
+  void
+  setUdpTransport(UdpTransport* transport);
+
+  // Includes the monitor's findings in the stats sent to clients. The
+  // monitor must outlive the streamer.
+  void
+  setJankMonitor(JankMonitor* monitor);
+
+  // Includes stalls and recoveries in the stats sent to clients. The
+  // watchdog must outlive the streamer.
+  void
+  setCaptureWatchdog(CaptureWatchdog* watchdog);
+
+  // Names the capture source and method in the stats sent to clients,
+  // along with how each source did when they were tried out at startup.
+  void
+  setCaptureMethod(const std::string& source, const std::string& method,
+    const std::vector<CaptureProbe::Result>& probe);
+
+  // Keeps a copy of the latest frame all the time, not just while some
+  // client needs it, so that the first requests of any client can be
+  // answered right away. Frames should then be passed in even while
+  // nobody is connected.
+  void
+  setKeepSnapshot(bool keep);
+
+  // Sets the quantization tables used for clients that haven't picked a
+  // preset of their own, for screenshots and for UDP peers. NULL means the
+  // standard tables. The tables must outlive the streamer.
+  void
+  setQuantTables(const QuantTables* tables);
+
+  // Sets up and warms the output for full size frames of the given size
+  // ahead of time, since that's what new clients get until they send a
+  // viewport. Call after setQuantTables().
+  bool
+  prepare(uint32_t width, uint32_t height);
+
+  // Sends the banner to a newly accepted client and starts streaming to it.
+  // The descriptor is closed on failure.
+  bool
+  addClient(int fd);
+
+  // Whether anyone at all is connected, including UDP peers.
+  bool
+  hasClients();
+
+  // Whether frames should be passed to streamFrame() at all.
+  bool
+  wantsFrames();
+
+  // Appends a pollfd for each client so that incoming messages can be
+  // picked up by the caller's poll() loop.
+  void
+  fillPollSet(std::vector<struct pollfd>& fds);
+
+  // Reads and handles messages from clients flagged by poll(). The offset
+  // must point to the first entry added by fillPollSet().
+  void
+  handlePollSet(const std::vector<struct pollfd>& fds, size_t offset);
+
+  // Returns the number of milliseconds until a debounced viewport change
+  // takes effect, pending screenshot requests are due or static regions
+  // have to be updated, or the given default if there's nothing to wait
+  // for.
+  int
+  getTimeout(int defaultTimeout);
+
+  // Encodes the frame once for each distinct viewport and sends it to the
+  // clients. Clients that can't be written to are dropped. Returns false
+  // only if encoding fails.
+  bool
+  streamFrame(Minicap::Frame* frame);
+
+  // Tells the streamer that a frame was consumed without being passed in,
+  // so anything kept from earlier frames is out of date.
+  void
+  discardFrame();
+
+private:
+  typedef std::chrono::steady_clock Clock;
+
+  struct ScreenshotRequest {
+    uint32_t id;
+    uint32_t width;
+    uint32_t height;
+    unsigned int quality;
+    Clock::time_point arrivedAt;
+  };
+
+  // Everything that survives a reconnect.
+  struct Session {
+    uint64_t token;
+    uint32_t viewportWidth;
+    uint32_t viewportHeight;
+    const QuantTables* quantTables;
+    // Sequence number of the last frame sent, and the frame itself, which
+    // clients that got the same one share.
+    uint32_t sequence;
+    std::shared_ptr<const std::string> lastFrame;
+    Clock::time_point detachedAt;
+    // Screenshot clients only get what they ask for.
+    bool streaming;
+    std::vector<ScreenshotRequest> screenshots;
+    std::map<uint32_t, TemplateMatcher::Template> templates;
+    std::map<uint32_t, VisualDiff::Reference> references;
+    std::map<uint32_t, RegionWatcher::Watch> watches;
+    // Frames are fingerprinted for clients that ever used the index.
+    bool classifying;
+    ScreenIndex screens;
+    // Region mode sends changed regions instead of frames. Active regions
+    // go out with every frame, the rest at most once per interval.
+    bool regions;
+    uint32_t regionSequence;
+    Clock::duration staticInterval;
+    Clock::time_point lastStaticUpdate;
+    // Cells that changed since they were last sent.
+    std::vector<unsigned char> pendingCells;
+    // Frames come with the rectangles that changed since the client's
+    // previous frame, so that it can repaint just those.
+    bool dirtyRects;
+    std::vector<unsigned char> dirtyCells;
+    // What the client says it can render. Frames that come too soon after
+    // the previous one are held back, and the latest one is sent once the
+    // client is ready for it.
+    ClientCapacity capacity;
+  };
+
+  struct EncodedRegion {
+    RegionTracker::Rect rect;
+    const QuantTables* tables;
+    std::string data;
+  };
+
+  struct Output;
+
+  struct Client {
+    int fd;
+    ClientMessage::Parser parser;
+    ClientMessage message;
+    Session session;
+    uint32_t pendingWidth;
+    uint32_t pendingHeight;
+    bool havePendingViewport;
+    Clock::time_point pendingSince;
+    bool packets;
+    Clock::time_point lastFrameAt;
+    bool frameDeferred;
+    // The output picked for the frame currently being streamed.
+    Output* output;
+  };
+
+  struct Output {
+    uint32_t width;
+    uint32_t height;
+    FrameScaler scaler;
+    JpgEncoder encoder;
+    bool used;
+    bool encoded;
+    // A copy of the encoded frame for the sessions it was sent to, made
+    // at most once per frame.
+    std::shared_ptr<const std::string> retained;
+
+    Output(uint32_t w, uint32_t h, const QuantTables* tables)
+      : width(w), height(h), encoder(4, 0), used(false), encoded(false) {
+      encoder.setQuantTables(tables);
+    }
+  };
+
+  unsigned int mQuality;
+  const QuantTables* mQuantTables;
+  std::string mBanner;
+  size_t mTokenOffset;
+  UdpTransport* mUdpTransport;
+  JankMonitor* mJankMonitor;
+  CaptureWatchdog* mWatchdog;
+  std::string mCaptureSource;
+  std::string mCaptureMethod;
+  std::vector<CaptureProbe::Result> mCaptureProbe;
+  std::mt19937_64 mRandom;
+  std::vector<std::unique_ptr<Client>> mClients;
+  std::vector<std::unique_ptr<Output>> mOutputs;
+  std::vector<std::unique_ptr<Output>> mScreenshotOutputs;
+  std::vector<Session> mDetachedSessions;
+  TileWalker mWalker;
+  FrameConverter mConverter;
+  LumaExtractor mLuma;
+  TemplateMatcher mMatcher;
+  FrameSnapshot mSnapshot;
+  RegionTracker mRegions;
+  RegionWatcher mWatcher;
+  ScreenFingerprinter mFingerprinter;
+  // Capture numbers of the frames the luma copy, the snapshot and the
+  // fingerprint are of, which is what replies about them carry.
+  uint64_t mLumaCapture;
+  uint64_t mSnapshotCapture;
+  uint64_t mFingerprintCapture;
+  JpgEncoder mRegionEncoder;
+  // Encoded regions of the latest frame, which clients in sync share.
+  uint64_t mRegionCacheGeneration;
+  std::vector<EncodedRegion> mRegionCache;
+  std::vector<unsigned char> mRegionCells;
+  std::vector<RegionTracker::Rect> mRegionRects;
+  bool mKeepSnapshot;
+  Clock::time_point mScreenshotsDue;
+  std::vector<uint32_t> mScreenshotLatencies;
+  uint64_t mScreenshotEncodes;
+  uint64_t mFrames;
+  uint64_t mFramePasses;
+
+  bool
+  readClient(Client* client);
+
+  // Returns false if the client should be disconnected.
+  bool
+  handleMessage(Client* client, const ClientMessage& msg);
+
+  void
+  applyPendingViewports();
+
+  // Switches the client to packet mode unless it's already in it.
+  bool
+  enablePackets(Client* client);
+
+  bool
+  resumeSession(Client* client, uint64_t token, uint32_t sequence);
+
+  void
+  expireSessions();
+
+  // Keeps the number of detached sessions and the memory their references
+  // and templates take up within limits.
+  void
+  limitSessions();
+
+  void
+  setTemplate(Client* client, const ClientMessage& msg);
+
+  bool
+  matchTemplate(Client* client, const ClientMessage& msg);
+
+  bool
+  wantsLuma();
+
+  void
+  setReference(Client* client, const ClientMessage& msg);
+
+  bool
+  diffReference(Client* client, const ClientMessage& msg);
+
+  // Whether the latest frame has to be kept. Clients can ask about it at
+  // any time, even when the screen doesn't change.
+  bool
+  wantsSnapshot();
+
+  // Runs the kernel over the snapshot, for requests that need more than
+  // the latest frame's pass made. Returns false if there's no snapshot.
+  bool
+  walkSnapshot(TileKernel* kernel);
+
+  void
+  setClientQuantTables(Client* client, const ClientMessage& msg);
+
+  bool
+  sendStats(Client* client, const ClientMessage& msg);
+
+  bool
+  setRegionMode(Client* client, const ClientMessage& msg);
+
+  bool
+  wantsRegions();
+
+  bool
+  setDirtyRects(Client* client, const ClientMessage& msg);
+
+  // Whether anyone needs to know which cells changed, be it for region
+  // mode or for dirty rectangles.
+  bool
+  wantsChanges();
+
+  // Adds the latest frame's changes to what each dirty rectangle client
+  // hasn't been told about yet.
+  void
+  trackDirtyCells();
+
+  // Announces the parts of the frame about to be sent that changed since
+  // the client's previous one, in output coordinates.
+  bool
+  sendDirtyRects(Client* client, uint32_t width, uint32_t height);
+
+  bool
+  setWatch(Client* client, const ClientMessage& msg);
+
+  bool
+  wantsWatches();
+
+  // Tells clients about the watches that fired on the latest frame.
+  void
+  sendWatchEvents();
+
+  void
+  indexScreen(Client* client, const ClientMessage& msg);
+
+  bool
+  classifyScreen(Client* client, const ClientMessage& msg);
+
+  bool
+  wantsFingerprint();
+
+  bool
+  takeFeedback(Client* client, const ClientMessage& msg);
+
+  // Sends the latest frame to clients that had it held back and are ready
+  // for it now.
+  void
+  sendDeferredFrames();
+
+  // Sends region updates to clients in region mode. With a new frame, its
+  // changes are added to what's pending first; otherwise only static
+  // regions that are due are sent.
+  void
+  streamRegions(Minicap::Frame* frame, bool newFrame);
+
+  bool
+  sendRegions(Client* client, Minicap::Frame* frame, const std::vector<unsigned char>& cells);
+
+  // Whether anything but full size encodes needs this frame, which YUV
+  // frames can't serve without being converted first.
+  bool
+  needsPackedFrame(Minicap::Frame* frame);
+
+  bool
+  queueScreenshot(Client* client, const ClientMessage& msg);
+
+  bool
+  hasPendingScreenshots();
+
+  // Answers all pending screenshot requests from the given frame, with a
+  // single encode for each distinct size and quality.
+  bool
+  serveScreenshots(Minicap::Frame* frame, uint64_t capture);
+
+  void
+  reportScreenshotLatencies();
+
+  bool
+  sendPacket(Client* client, unsigned char type, const unsigned char* header,
+    size_t headerSize, const unsigned char* data, size_t size);
+
+  // Sends the frame the output holds.
+  bool
+  sendFrame(Client* client, Output* output);
+
+  void
+  removeClient(size_t index);
+
+  // Tells the UDP transport which tokens its peers may say hello with,
+  // which are those of connected clients and sessions that can resume.
+  void
+  updateUdpTokens();
+
+  Output*
+  getOutput(std::vector<std::unique_ptr<Output>>& outputs, uint32_t width, uint32_t height,
+    const QuantTables* tables);
+
+  Output*
+  getOutputFor(Client* client, Minicap::Frame* frame);
+
+  bool
+  encodeOutput(Output* output, Minicap::Frame* frame);
+};
+
+#endif
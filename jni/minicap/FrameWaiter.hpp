@@ -0,0 +1,150 @@
+#ifndef MINICAP_FRAME_WAITER_HPP
+#define MINICAP_FRAME_WAITER_HPP
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+
+#include <Minicap.hpp>
+
+#include "JankMonitor.hpp"
+
+// Counts frames announced by the capture backend, which may happen on any
+// thread, and lets the main loop wait for them either directly or through
+// a pipe that can be added to a poll() set.
+class FrameWaiter: public Minicap::FrameAvailableListener {
+public:
+  FrameWaiter()
+    : mTimeout(std::chrono::milliseconds(100)),
+      mPendingFrames(0),
+      mStopped(false),
+      mJankMonitor(NULL) {
+    // Lets poll() loops wake up when a frame arrives.
+    if (pipe(mWakeFds) == 0) {
+      fcntl(mWakeFds[0], F_SETFL, O_NONBLOCK);
+      fcntl(mWakeFds[1], F_SETFL, O_NONBLOCK);
+    }
+    else {
+      mWakeFds[0] = mWakeFds[1] = -1;
+    }
+  }
+
+  int
+  waitForFrame() {
+    std::unique_lock<std::mutex> lock(mMutex);
+
+    while (!mStopped) {
+      if (mCondition.wait_for(lock, mTimeout, [this]{return mPendingFrames > 0;})) {
+        return mPendingFrames--;
+      }
+    }
+
+    return 0;
+  }
+
+  // Non-blocking version of waitForFrame().
+  int
+  tryWaitForFrame() {
+    std::unique_lock<std::mutex> lock(mMutex);
+
+    if (mPendingFrames > 0) {
+      return mPendingFrames--;
+    }
+
+    return 0;
+  }
+
+  bool
+  hasPendingFrames() {
+    std::unique_lock<std::mutex> lock(mMutex);
+    return mPendingFrames > 0;
+  }
+
+  // Becomes readable when a frame arrives or when stopped. Call drain()
+  // after it has been signaled.
+  int
+  getWakeFd() {
+    return mWakeFds[0];
+  }
+
+  void
+  drain() {
+    char buf[64];
+    while (read(mWakeFds[0], buf, sizeof(buf)) > 0);
+  }
+
+  // Also reports every arrival to the monitor, before anything else
+  // happens to the frame.
+  void
+  setJankMonitor(JankMonitor* monitor) {
+    mJankMonitor = monitor;
+  }
+
+  void
+  reportExtraConsumption(int count) {
+    std::unique_lock<std::mutex> lock(mMutex);
+    mPendingFrames -= count;
+  }
+
+  void
+  onFrameAvailable() {
+    if (mJankMonitor != NULL) {
+      mJankMonitor->onFrame();
+    }
+
+    std::unique_lock<std::mutex> lock(mMutex);
+    mPendingFrames += 1;
+    mCondition.notify_one();
+    wake();
+  }
+
+  // Forgets about frames announced so far, for when the backend that
+  // announced them is gone.
+  void
+  reset() {
+    std::unique_lock<std::mutex> lock(mMutex);
+    mPendingFrames = 0;
+  }
+
+  void
+  stop() {
+    mStopped = true;
+    wake();
+  }
+
+  // Lets a stopped waiter wait again, forgetting about earlier frames.
+  void
+  restart() {
+    std::unique_lock<std::mutex> lock(mMutex);
+    mPendingFrames = 0;
+    mStopped = false;
+  }
+
+  bool
+  isStopped() {
+    return mStopped;
+  }
+
+private:
+  std::mutex mMutex;
+  std::condition_variable mCondition;
+  std::chrono::milliseconds mTimeout;
+  int mPendingFrames;
+  bool mStopped;
+  int mWakeFds[2];
+  JankMonitor* mJankMonitor;
+
+  void
+  wake() {
+    // Also called from the signal handler, write() is safe there.
+    if (mWakeFds[1] >= 0) {
+      char c = 0;
+      write(mWakeFds[1], &c, 1);
+    }
+  }
+};
+
+#endif
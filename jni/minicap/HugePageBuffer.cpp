@@ -0,0 +1,147 @@
+#include "HugePageBuffer.hpp"
+
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "util/debug.h"
+
+// Older NDK platform headers are missing these, but the kernel knows them.
+#ifndef MAP_HUGETLB
+#define MAP_HUGETLB 0x40000
+#endif
+
+#ifndef MADV_HUGEPAGE
+#define MADV_HUGEPAGE 14
+#endif
+
+// The huge page size on all of our architectures.
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+// Anything smaller than this wouldn't fill even a single huge page, and
+// isn't worth an mmap() of its own either.
+#define MIN_HUGE_SIZE (HUGE_PAGE_SIZE / 2)
+
+HugePageBuffer::HugePageBuffer()
+  : mData(NULL),
+    mCapacity(0),
+    mBacking(BACKING_NONE)
+{
+}
+
+HugePageBuffer::~HugePageBuffer() {
+  release();
+}
+
+bool
+HugePageBuffer::reserve(size_t size) {
+  if (size <= mCapacity) {
+    return true;
+  }
+
+  release();
+
+  if (size < MIN_HUGE_SIZE) {
+    mData = static_cast<unsigned char*>(malloc(size));
+
+    if (mData == NULL) {
+      return false;
+    }
+
+    mCapacity = size;
+    mBacking = BACKING_REGULAR;
+
+    return true;
+  }
+
+  size_t length = (size + HUGE_PAGE_SIZE - 1) & ~((size_t) HUGE_PAGE_SIZE - 1);
+  void* addr;
+
+  // Explicit huge pages only work if the system has reserved some, which
+  // is rare on phones but cheap to try.
+  addr = mmap(NULL, length, PROT_READ | PROT_WRITE,
+    MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+
+  if (addr != MAP_FAILED) {
+    mBacking = BACKING_HUGETLB;
+  }
+  else {
+    addr = mmap(NULL, length, PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (addr == MAP_FAILED) {
+      return false;
+    }
+
+    // Fails harmlessly if transparent huge pages are disabled.
+    mBacking = madvise(addr, length, MADV_HUGEPAGE) == 0
+      ? BACKING_THP : BACKING_REGULAR;
+  }
+
+  mData = static_cast<unsigned char*>(addr);
+  mCapacity = length;
+
+  MCINFO("Mapped %ld bytes backed by %s", (long) length, backingName(mBacking));
+
+  return true;
+}
+
+void
+HugePageBuffer::prefault() {
+  size_t pageSize = sysconf(_SC_PAGESIZE);
+
+  // Writing is what counts; a read would only map the shared zero page.
+  // Stepping by the base page size is wasteful for huge pages, but still
+  // cheap next to the faults it saves.
+  for (size_t offset = 0; offset < mCapacity; offset += pageSize) {
+    reinterpret_cast<volatile unsigned char*>(mData)[offset] = 0;
+  }
+}
+
+unsigned char*
+HugePageBuffer::data() {
+  return mData;
+}
+
+size_t
+HugePageBuffer::capacity() {
+  return mCapacity;
+}
+
+HugePageBuffer::Backing
+HugePageBuffer::getBacking() {
+  return mBacking;
+}
+
+const char*
+HugePageBuffer::backingName(Backing backing) {
+  switch (backing) {
+  case BACKING_HUGETLB:
+    return "explicit huge pages";
+  case BACKING_THP:
+    return "transparent huge pages";
+  case BACKING_REGULAR:
+    return "regular pages";
+  case BACKING_NONE:
+  default:
+    return "nothing";
+  }
+}
+
+void
+HugePageBuffer::release() {
+  if (mData == NULL) {
+    return;
+  }
+
+  if (mCapacity >= MIN_HUGE_SIZE) {
+    munmap(mData, mCapacity);
+  }
+  else {
+    free(mData);
+  }
+
+  mData = NULL;
+  mCapacity = 0;
+  mBacking = BACKING_NONE;
+}
@@ -0,0 +1,57 @@
+#ifndef MINICAP_HUGE_PAGE_BUFFER_HPP
+#define MINICAP_HUGE_PAGE_BUFFER_HPP
+
+#include <stddef.h>
+
+// A large, page aligned buffer that tries to live on huge pages so that
+// full frame passes don't keep missing the TLB. Explicit huge pages
+// (MAP_HUGETLB) are tried first, then transparent huge pages
+// (MADV_HUGEPAGE), and finally we settle for regular pages.
+class HugePageBuffer {
+public:
+  enum Backing {
+    BACKING_NONE      = 0,
+    BACKING_HUGETLB   = 1,
+    BACKING_THP       = 2,
+    BACKING_REGULAR   = 3,
+  };
+
+  HugePageBuffer();
+
+  ~HugePageBuffer();
+
+  // Makes sure that at least size bytes are available. The contents are
+  // not preserved if the buffer needs to grow.
+  bool
+  reserve(size_t size);
+
+  // Touches every page of the buffer, so that the first real pass over it
+  // doesn't have to stop for page faults.
+  void
+  prefault();
+
+  unsigned char*
+  data();
+
+  size_t
+  capacity();
+
+  Backing
+  getBacking();
+
+  static const char*
+  backingName(Backing backing);
+
+private:
+  unsigned char* mData;
+  size_t mCapacity;
+  Backing mBacking;
+
+  void
+  release();
+
+  HugePageBuffer(const HugePageBuffer&);
+  HugePageBuffer& operator=(const HugePageBuffer&);
+};
+
+#endif
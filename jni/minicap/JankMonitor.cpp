@@ -0,0 +1,118 @@
+#include "JankMonitor.hpp"
+
+#include <algorithm>
+#include <vector>
+
+static uint32_t
+percentile(const std::vector<uint32_t>& sorted, int p) {
+  if (sorted.empty()) {
+    return 0;
+  }
+
+  return sorted[(sorted.size() - 1) * p / 100];
+}
+
+JankMonitor::JankMonitor(float refreshRate)
+  : mRefreshRate(refreshRate > 0 ? refreshRate : 60),
+    mPeriodUs(1000000 / mRefreshRate),
+    mHaveLast(false),
+    mFrames(0),
+    mJankyFrames(0),
+    mDroppedFrames(0),
+    mIdleGaps(0),
+    mBursts(0),
+    mBurst(0),
+    mLongestBurst(0),
+    mIntervalCount(0),
+    mNextInterval(0)
+{
+}
+
+void
+JankMonitor::onFrame() {
+  onFrame(std::chrono::steady_clock::now());
+}
+
+void
+JankMonitor::onFrame(std::chrono::steady_clock::time_point time) {
+  std::lock_guard<std::mutex> lock(mMutex);
+
+  mFrames += 1;
+
+  if (!mHaveLast) {
+    mHaveLast = true;
+    mLast = time;
+    return;
+  }
+
+  uint64_t interval = std::chrono::duration_cast<std::chrono::microseconds>(
+    time - mLast).count();
+
+  mLast = time;
+
+  if (interval > IDLE_INTERVAL_US) {
+    mIdleGaps += 1;
+    mBurst = 0;
+    return;
+  }
+
+  mIntervals[mNextInterval] = interval;
+  mNextInterval = (mNextInterval + 1) % WINDOW;
+  mIntervalCount = std::min(mIntervalCount + 1, WINDOW);
+
+  if (interval * 2 <= mPeriodUs * 3) {
+    mBurst = 0;
+    return;
+  }
+
+  mJankyFrames += 1;
+  mDroppedFrames += (interval + mPeriodUs / 2) / mPeriodUs - 1;
+  mBurst += 1;
+
+  if (mBurst == 2) {
+    mBursts += 1;
+  }
+
+  mLongestBurst = std::max(mLongestBurst, mBurst);
+}
+
+void
+JankMonitor::getStats(Stats* stats, bool reset) {
+  std::vector<uint32_t> sorted;
+
+  {
+    std::lock_guard<std::mutex> lock(mMutex);
+
+    stats->refreshRate = mRefreshRate;
+    stats->frames = mFrames;
+    stats->jankyFrames = mJankyFrames;
+    stats->droppedFrames = mDroppedFrames;
+    stats->idleGaps = mIdleGaps;
+    stats->bursts = mBursts;
+    stats->longestBurst = mLongestBurst;
+
+    sorted.assign(mIntervals, mIntervals + mIntervalCount);
+
+    if (reset) {
+      mFrames = 0;
+      mJankyFrames = 0;
+      mDroppedFrames = 0;
+      mIdleGaps = 0;
+      mBursts = 0;
+      mBurst = 0;
+      mLongestBurst = 0;
+      mIntervalCount = 0;
+      mNextInterval = 0;
+    }
+  }
+
+  // Sorting happens outside of the lock so that frames don't have to wait.
+  std::sort(sorted.begin(), sorted.end());
+
+  stats->intervals = sorted.size();
+  stats->p50 = percentile(sorted, 50);
+  stats->p90 = percentile(sorted, 90);
+  stats->p95 = percentile(sorted, 95);
+  stats->p99 = percentile(sorted, 99);
+  stats->max = percentile(sorted, 100);
+}
@@ -0,0 +1,78 @@
+#ifndef MINICAP_JANK_MONITOR_HPP
+#define MINICAP_JANK_MONITOR_HPP
+
+#include <stdint.h>
+
+#include <chrono>
+#include <mutex>
+
+// Tells how smoothly the app under test renders from nothing but the times
+// at which frames arrive. Every arrival is a composition, so an interval of
+// more than one and a half refresh periods means frames were missed. Much
+// longer intervals are the screen sitting still rather than a stall, and
+// are left out. Recording an arrival is a timestamp and a few additions, so
+// it's cheap enough to do for every frame on the backend's thread, whether
+// the frame gets encoded or not.
+class JankMonitor {
+public:
+  // Percentiles are computed over this many of the most recent intervals.
+  static const uint32_t WINDOW = 1024;
+
+  // Intervals longer than this are idle gaps.
+  static const uint32_t IDLE_INTERVAL_US = 250000;
+
+  struct Stats {
+    float refreshRate;
+    uint64_t frames;
+    // Intervals that missed at least one refresh, and the number of
+    // refreshes missed in total.
+    uint64_t jankyFrames;
+    uint64_t droppedFrames;
+    uint64_t idleGaps;
+    // Runs of at least two janky intervals in a row, and the longest run.
+    uint64_t bursts;
+    uint32_t longestBurst;
+    // Percentiles of the intervals in the window, in microseconds.
+    uint32_t intervals;
+    uint32_t p50;
+    uint32_t p90;
+    uint32_t p95;
+    uint32_t p99;
+    uint32_t max;
+  };
+
+  JankMonitor(float refreshRate);
+
+  // Records a frame arrival now.
+  void
+  onFrame();
+
+  // Records a frame arrival at the given steady clock time.
+  void
+  onFrame(std::chrono::steady_clock::time_point time);
+
+  // Fills in the stats so far, and optionally starts over afterwards.
+  void
+  getStats(Stats* stats, bool reset);
+
+private:
+  std::mutex mMutex;
+  float mRefreshRate;
+  uint32_t mPeriodUs;
+  bool mHaveLast;
+  std::chrono::steady_clock::time_point mLast;
+
+  uint64_t mFrames;
+  uint64_t mJankyFrames;
+  uint64_t mDroppedFrames;
+  uint64_t mIdleGaps;
+  uint64_t mBursts;
+  uint32_t mBurst;
+  uint32_t mLongestBurst;
+
+  uint32_t mIntervals[WINDOW];
+  uint32_t mIntervalCount;
+  uint32_t mNextInterval;
+};
+
+#endif
@@ -1,27 +1,130 @@
+#include <setjmp.h>
+#include <stdio.h>
+#include <string.h>
+
 #include <stdexcept>
+#include <vector>
+
+#include <jpeglib.h>
+#include <jerror.h>
 
 #include "JpgEncoder.hpp"
 #include "util/debug.h"
 
+// Encoded rows are handed to libjpeg in batches of this many.
+#define ROW_BATCH 16
+
+// Size of the dummy frame used to warm up the encoder.
+#define WARM_UP_SIZE 64
+
+struct ErrorManager {
+  struct jpeg_error_mgr pub;
+  jmp_buf jump;
+};
+
+static void
+onError(j_common_ptr cinfo) {
+  char message[JMSG_LENGTH_MAX];
+  (*cinfo->err->format_message)(cinfo, message);
+  MCERROR("libjpeg: %s", message);
+  longjmp(reinterpret_cast<ErrorManager*>(cinfo->err)->jump, 1);
+}
+
+static void
+initDestination(j_compress_ptr /* cinfo */) {
+}
+
+static boolean
+emptyOutputBuffer(j_compress_ptr cinfo) {
+  // Same as TJFLAG_NOREALLOC; we've reserved enough for the worst case.
+  ERREXIT(cinfo, JERR_BUFFER_SIZE);
+  return FALSE;
+}
+
+static void
+termDestination(j_compress_ptr /* cinfo */) {
+}
+
+static bool
+isYuv(Minicap::Format format) {
+  switch (format) {
+  case Minicap::FORMAT_NV12:
+  case Minicap::FORMAT_NV21:
+  case Minicap::FORMAT_I420:
+    return true;
+  default:
+    return false;
+  }
+}
+
+static J_COLOR_SPACE
+convertColorSpace(Minicap::Format format) {
+  switch (format) {
+  case Minicap::FORMAT_RGBA_8888:
+    return JCS_EXT_RGBA;
+  case Minicap::FORMAT_RGBX_8888:
+    return JCS_EXT_RGBX;
+  case Minicap::FORMAT_RGB_888:
+    return JCS_EXT_RGB;
+  case Minicap::FORMAT_BGRA_8888:
+    return JCS_EXT_BGRA;
+  case Minicap::FORMAT_NV12:
+  case Minicap::FORMAT_NV21:
+  case Minicap::FORMAT_I420:
+    return JCS_YCbCr;
+  default:
+    throw std::runtime_error("Unsupported pixel format");
+  }
+}
+
 JpgEncoder::JpgEncoder(unsigned int prePadding, unsigned int postPadding)
   : mTjHandle(tjInitCompress()),
     mSubsampling(TJSAMP_420),
-    mEncodedData(NULL),
     mPrePadding(prePadding),
     mPostPadding(postPadding),
     mMaxWidth(0),
-    mMaxHeight(0)
+    mMaxHeight(0),
+    mEncodedSize(0),
+    mQuantTables(NULL)
 {
 }
 
 JpgEncoder::~JpgEncoder() {
-  tjFree(mEncodedData);
+  tjDestroy(mTjHandle);
 }
 
 bool
 JpgEncoder::encode(Minicap::Frame* frame, unsigned int quality) {
+  if (mQuantTables != NULL) {
+    return encodeWithTables(frame, quality);
+  }
+
   unsigned char* offset = getEncodedData();
 
+  if (isYuv(frame->format)) {
+    const unsigned char* planes[3];
+    int strides[3];
+
+    if (!getYuvPlanes(frame, planes, strides)) {
+      return false;
+    }
+
+    // The vendored turbojpeg 1.4 declares the planes non-const (1.5 fixed
+    // that), but only ever reads from them.
+    return 0 == tjCompressFromYUVPlanes(
+      mTjHandle,
+      const_cast<unsigned char**>(planes),
+      frame->width,
+      strides,
+      frame->height,
+      mSubsampling,
+      &offset,
+      &mEncodedSize,
+      quality,
+      TJFLAG_FASTDCT | TJFLAG_NOREALLOC
+    );
+  }
+
   return 0 == tjCompress2(
     mTjHandle,
     (unsigned char*) frame->data,
@@ -37,6 +140,164 @@ JpgEncoder::encode(Minicap::Frame* frame, unsigned int quality) {
   );
 }
 
+bool
+JpgEncoder::encodeWithTables(Minicap::Frame* frame, unsigned int quality) {
+  struct jpeg_compress_struct cinfo;
+  struct jpeg_destination_mgr dest;
+  ErrorManager err;
+  size_t capacity = tjBufSize(mMaxWidth, mMaxHeight, mSubsampling);
+  const unsigned char* planes[3];
+  int strides[3];
+
+  // Whatever can fail on our side has to happen before libjpeg is set up.
+  if (isYuv(frame->format) && (!getYuvPlanes(frame, planes, strides) ||
+      !mLastRows.reserve((frame->width + ROW_BATCH) * 3))) {
+    return false;
+  }
+
+  cinfo.err = jpeg_std_error(&err.pub);
+  err.pub.error_exit = onError;
+
+  if (setjmp(err.jump)) {
+    jpeg_destroy_compress(&cinfo);
+    return false;
+  }
+
+  jpeg_create_compress(&cinfo);
+
+  dest.next_output_byte = getEncodedData();
+  dest.free_in_buffer = capacity;
+  dest.init_destination = initDestination;
+  dest.empty_output_buffer = emptyOutputBuffer;
+  dest.term_destination = termDestination;
+  cinfo.dest = &dest;
+
+  cinfo.image_width = frame->width;
+  cinfo.image_height = frame->height;
+  cinfo.input_components = isYuv(frame->format) ? 3 : frame->bpp;
+  cinfo.in_color_space = convertColorSpace(frame->format);
+
+  // The defaults already give us 4:2:0 like mSubsampling, with tables 0
+  // for luma and 1 for both chroma components.
+  jpeg_set_defaults(&cinfo);
+  cinfo.dct_method = JDCT_IFAST;
+  cinfo.raw_data_in = isYuv(frame->format);
+
+  int scale = jpeg_quality_scaling(quality);
+  jpeg_add_quant_table(&cinfo, 0, mQuantTables->luma, scale, TRUE);
+  jpeg_add_quant_table(&cinfo, 1, mQuantTables->chroma, scale, TRUE);
+
+  jpeg_start_compress(&cinfo, TRUE);
+
+  if (cinfo.raw_data_in) {
+    // Raw data goes in one row of MCUs at a time: 16 rows of luma and 8 of
+    // each chroma plane. Rows past the end repeat the last one.
+    JSAMPROW rows[3][ROW_BATCH];
+    JSAMPARRAY components[3] = { rows[0], rows[1], rows[2] };
+    JDIMENSION chromaHeight = (frame->height + 1) / 2;
+    JDIMENSION heights[3] = { frame->height, chromaHeight, chromaHeight };
+    JDIMENSION widths[3] = { frame->width, (frame->width + 1) / 2, (frame->width + 1) / 2 };
+
+    // libjpeg reads whole blocks, so it may read past the end of a row.
+    // Those samples end up outside of the image, but they must still be
+    // inside the buffer, which isn't a given for the very last row. The
+    // copies are a member so that a longjmp() can't leak them.
+    unsigned char* lastRows[3];
+
+    for (int i = 0; i < 3; ++i) {
+      const unsigned char* last = planes[i] + (heights[i] - 1) * strides[i];
+      lastRows[i] = mLastRows.data() + (frame->width + ROW_BATCH) * i;
+      memcpy(lastRows[i], last, widths[i]);
+      memset(lastRows[i] + widths[i], last[widths[i] - 1], ROW_BATCH);
+    }
+
+    while (cinfo.next_scanline < cinfo.image_height) {
+      for (int c = 0; c < 3; ++c) {
+        JDIMENSION count = c == 0 ? ROW_BATCH : ROW_BATCH / 2;
+        JDIMENSION first = c == 0 ? cinfo.next_scanline : cinfo.next_scanline / 2;
+
+        for (JDIMENSION i = 0; i < count; ++i) {
+          JDIMENSION y = first + i;
+          rows[c][i] = y < heights[c] - 1
+            ? (JSAMPROW) planes[c] + y * strides[c]
+            : lastRows[c];
+        }
+      }
+
+      jpeg_write_raw_data(&cinfo, components, ROW_BATCH);
+    }
+  }
+  else {
+    JSAMPROW rows[ROW_BATCH];
+    unsigned char* data = (unsigned char*) frame->data;
+    size_t rowSize = frame->stride * frame->bpp;
+
+    while (cinfo.next_scanline < cinfo.image_height) {
+      JDIMENSION count = 0;
+
+      while (count < ROW_BATCH && cinfo.next_scanline + count < cinfo.image_height) {
+        rows[count] = data + (cinfo.next_scanline + count) * rowSize;
+        count += 1;
+      }
+
+      jpeg_write_scanlines(&cinfo, rows, count);
+    }
+  }
+
+  jpeg_finish_compress(&cinfo);
+  jpeg_destroy_compress(&cinfo);
+
+  mEncodedSize = capacity - dest.free_in_buffer;
+
+  return true;
+}
+
+bool
+JpgEncoder::getYuvPlanes(Minicap::Frame* frame, const unsigned char* planes[3], int strides[3]) {
+  planes[0] = static_cast<const unsigned char*>(frame->planes[0]);
+  strides[0] = frame->strides[0];
+
+  if (frame->format == Minicap::FORMAT_I420) {
+    for (int i = 1; i < 3; ++i) {
+      planes[i] = static_cast<const unsigned char*>(frame->planes[i]);
+      strides[i] = frame->strides[i];
+    }
+
+    return true;
+  }
+
+  // turbojpeg only takes separate planes. Splitting them is a pass over a
+  // quarter of the pixels, which is still far less than color conversion.
+  uint32_t chromaWidth = (frame->width + 1) / 2;
+  uint32_t chromaHeight = (frame->height + 1) / 2;
+  size_t planeSize = chromaWidth * chromaHeight;
+
+  if (!mChroma.reserve(planeSize * 2)) {
+    return false;
+  }
+
+  unsigned char* cb = mChroma.data();
+  unsigned char* cr = cb + planeSize;
+  int cbOffset = frame->format == Minicap::FORMAT_NV12 ? 0 : 1;
+
+  for (uint32_t y = 0; y < chromaHeight; ++y) {
+    const unsigned char* row = static_cast<const unsigned char*>(frame->planes[1]) +
+      y * frame->strides[1];
+
+    for (uint32_t x = 0; x < chromaWidth; ++x) {
+      cb[y * chromaWidth + x] = row[x * 2 + cbOffset];
+      cr[y * chromaWidth + x] = row[x * 2 + 1 - cbOffset];
+    }
+  }
+
+  planes[1] = cb;
+  planes[2] = cr;
+  strides[1] = chromaWidth;
+  strides[2] = chromaWidth;
+
+  return true;
+}
+
 int
 JpgEncoder::getEncodedSize() {
   return mEncodedSize;
@@ -44,17 +305,23 @@ JpgEncoder::getEncodedSize() {
 
 unsigned char*
 JpgEncoder::getEncodedData() {
-  return mEncodedData + mPrePadding;
+  return mEncodedData.data() + mPrePadding;
+}
+
+Minicap::Format
+JpgEncoder::getPreferredFormat() {
+  // There's no alpha in a JPG. With RGBX, the compositor is told that it
+  // doesn't have to produce any either, and turbojpeg reads it just as fast
+  // as RGBA.
+  return Minicap::FORMAT_RGBX_8888;
 }
 
 bool
 JpgEncoder::reserveData(uint32_t width, uint32_t height) {
   if (width == mMaxWidth && height == mMaxHeight) {
-    return 0;
+    return true;
   }
 
-  tjFree(mEncodedData);
-
   unsigned long maxSize = mPrePadding + mPostPadding + tjBufSize(
     width,
     height,
@@ -63,9 +330,9 @@ JpgEncoder::reserveData(uint32_t width, uint32_t height) {
 
   MCINFO("Allocating %ld bytes for JPG encoder", maxSize);
 
-  mEncodedData = tjAlloc(maxSize);
-
-  if (mEncodedData == NULL) {
+  // We never let turbojpeg reallocate the buffer, so it doesn't have to
+  // come from tjAlloc().
+  if (!mEncodedData.reserve(maxSize)) {
     return false;
   }
 
@@ -75,6 +342,41 @@ JpgEncoder::reserveData(uint32_t width, uint32_t height) {
   return true;
 }
 
+bool
+JpgEncoder::warmUp() {
+  if (mMaxWidth < WARM_UP_SIZE || mMaxHeight < WARM_UP_SIZE) {
+    return true;
+  }
+
+  mEncodedData.prefault();
+
+  std::vector<unsigned char> pixels(WARM_UP_SIZE * WARM_UP_SIZE * 4, 0x80);
+
+  Minicap::Frame frame;
+  frame.data = pixels.data();
+  frame.format = getPreferredFormat();
+  frame.width = WARM_UP_SIZE;
+  frame.height = WARM_UP_SIZE;
+  frame.stride = WARM_UP_SIZE;
+  frame.bpp = 4;
+  frame.size = pixels.size();
+
+  bool ok = encode(&frame, 80);
+  mEncodedSize = 0;
+
+  return ok;
+}
+
+void
+JpgEncoder::setQuantTables(const QuantTables* tables) {
+  mQuantTables = tables;
+}
+
+const QuantTables*
+JpgEncoder::getQuantTables() {
+  return mQuantTables;
+}
+
 int
 JpgEncoder::convertFormat(Minicap::Format format) {
   switch (format) {
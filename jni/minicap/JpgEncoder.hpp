@@ -5,12 +5,17 @@
 
 #include "Minicap.hpp"
 
+#include "HugePageBuffer.hpp"
+#include "QuantTables.hpp"
+
 class JpgEncoder {
 public:
   JpgEncoder(unsigned int prePadding, unsigned int postPadding);
 
   ~JpgEncoder();
 
+  // Takes RGBA, RGBX, BGRA and RGB_888 frames, as well as YUV frames,
+  // which skip color conversion altogether.
   bool
   encode(Minicap::Frame* frame, unsigned int quality);
 
@@ -23,6 +28,25 @@ public:
   bool
   reserveData(uint32_t width, uint32_t height);
 
+  // Prefaults the reserved buffer and runs a tiny encode, so that the
+  // first real frame doesn't pay for cold pages and first-use setup in
+  // libjpeg. Needs reserveData() first.
+  bool
+  warmUp();
+
+  // The capture format the encoder takes most cheaply, to ask the backend
+  // for. Other supported formats work just as well.
+  static Minicap::Format
+  getPreferredFormat();
+
+  // Uses custom quantization tables instead of the standard ones, or goes
+  // back to the standard ones if NULL. The tables must outlive the encoder.
+  void
+  setQuantTables(const QuantTables* tables);
+
+  const QuantTables*
+  getQuantTables();
+
 private:
   tjhandle mTjHandle;
   int mSubsampling;
@@ -30,8 +54,24 @@ private:
   unsigned int mPostPadding;
   unsigned int mMaxWidth;
   unsigned int mMaxHeight;
-  unsigned char* mEncodedData;
+  HugePageBuffer mEncodedData;
   unsigned long mEncodedSize;
+  const QuantTables* mQuantTables;
+  // Deinterleaved chroma of NV12 and NV21 frames.
+  HugePageBuffer mChroma;
+  // Padded copies of the last row of each YUV plane, for libjpeg.
+  HugePageBuffer mLastRows;
+
+  // turbojpeg can't take custom tables, so they go through the libjpeg API
+  // instead.
+  bool
+  encodeWithTables(Minicap::Frame* frame, unsigned int quality);
+
+  // Points planes and strides at the Y, Cb and Cr planes of a YUV frame,
+  // splitting up interleaved chroma first if necessary. Returns false if
+  // there's no memory for that.
+  bool
+  getYuvPlanes(Minicap::Frame* frame, const unsigned char* planes[3], int strides[3]);
 
   static int
   convertFormat(Minicap::Format format);
@@ -0,0 +1,97 @@
+#include "LumaImage.hpp"
+
+void
+LumaImage::halve(const LumaImage& src, LumaImage& dst) {
+  dst.resize(src.width / 2, src.height / 2);
+
+  for (uint32_t y = 0; y < dst.height; ++y) {
+    const unsigned char* top = src.data.data() + (y * 2) * src.width;
+    const unsigned char* bottom = top + src.width;
+    unsigned char* out = dst.data.data() + y * dst.width;
+
+    for (uint32_t x = 0; x < dst.width; ++x) {
+      out[x] = (top[x * 2] + top[x * 2 + 1] + bottom[x * 2] + bottom[x * 2 + 1] + 2) >> 2;
+    }
+  }
+}
+
+LumaExtractor::LumaExtractor()
+  : mRed(0),
+    mBlue(2),
+    mValid(false),
+    mGeneration(0)
+{
+}
+
+bool
+LumaExtractor::supportsFormat(Minicap::Format format) {
+  switch (format) {
+  case Minicap::FORMAT_RGBA_8888:
+  case Minicap::FORMAT_RGBX_8888:
+  case Minicap::FORMAT_RGB_888:
+  case Minicap::FORMAT_BGRA_8888:
+    return true;
+  default:
+    return false;
+  }
+}
+
+bool
+LumaExtractor::hasImage() {
+  return mValid;
+}
+
+void
+LumaExtractor::reset() {
+  mValid = false;
+}
+
+const LumaImage&
+LumaExtractor::getImage() {
+  return mImage;
+}
+
+uint64_t
+LumaExtractor::getGeneration() {
+  return mGeneration;
+}
+
+bool
+LumaExtractor::beginFrame(const Minicap::Frame* frame) {
+  mValid = false;
+
+  if (!supportsFormat(frame->format)) {
+    return false;
+  }
+
+  bool bgr = frame->format == Minicap::FORMAT_BGRA_8888;
+  mRed = bgr ? 2 : 0;
+  mBlue = bgr ? 0 : 2;
+
+  mImage.resize(frame->width, frame->height);
+
+  return true;
+}
+
+void
+LumaExtractor::processTile(const Minicap::Frame* frame, uint32_t y0, uint32_t y1) {
+  const unsigned char* source = static_cast<const unsigned char*>(frame->data);
+  uint32_t bpp = frame->bpp;
+
+  for (uint32_t y = y0; y < y1; ++y) {
+    const unsigned char* row = source + y * frame->stride * bpp;
+    unsigned char* out = mImage.data.data() + y * mImage.width;
+
+    // BT.601 weights in 8-bit fixed point.
+    for (uint32_t x = 0; x < mImage.width; ++x) {
+      const unsigned char* pixel = row + x * bpp;
+      out[x] = (77 * pixel[mRed] + 150 * pixel[1] + 29 * pixel[mBlue] + 128) >> 8;
+    }
+  }
+}
+
+void
+LumaExtractor::endFrame(const Minicap::Frame* /* frame */) {
+  mValid = true;
+  mGeneration += 1;
+}
@@ -0,0 +1,75 @@
+#ifndef MINICAP_LUMA_IMAGE_HPP
+#define MINICAP_LUMA_IMAGE_HPP
+
+#include <stdint.h>
+
+#include <vector>
+
+#include "Minicap.hpp"
+
+#include "TileWalker.hpp"
+
+// A tightly packed 8-bit grayscale image.
+struct LumaImage {
+  uint32_t width;
+  uint32_t height;
+  std::vector<unsigned char> data;
+
+  LumaImage(): width(0), height(0) {
+  }
+
+  void
+  resize(uint32_t w, uint32_t h) {
+    width = w;
+    height = h;
+    data.resize(static_cast<size_t>(w) * h);
+  }
+
+  // Makes dst half the size of src, averaging 2x2 blocks. An odd last row
+  // or column is dropped.
+  static void
+  halve(const LumaImage& src, LumaImage& dst);
+};
+
+// Keeps a luma copy of the latest frame. Runs as a TileWalker kernel so
+// that it shares its pass over the frame with everything else.
+class LumaExtractor: public TileKernel {
+public:
+  LumaExtractor();
+
+  static bool
+  supportsFormat(Minicap::Format format);
+
+  // Whether there's an image of the latest frame.
+  bool
+  hasImage();
+
+  // Forgets the image, for when frames are no longer being extracted.
+  void
+  reset();
+
+  const LumaImage&
+  getImage();
+
+  // Increases every time a new frame has been extracted.
+  uint64_t
+  getGeneration();
+
+  virtual bool
+  beginFrame(const Minicap::Frame* frame);
+
+  virtual void
+  processTile(const Minicap::Frame* frame, uint32_t y0, uint32_t y1);
+
+  virtual void
+  endFrame(const Minicap::Frame* frame);
+
+private:
+  LumaImage mImage;
+  uint32_t mRed;
+  uint32_t mBlue;
+  bool mValid;
+  uint64_t mGeneration;
+};
+
+#endif
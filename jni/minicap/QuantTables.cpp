@@ -0,0 +1,170 @@
+#include "QuantTables.hpp"
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "util/debug.h"
+
+static const QuantTables presets[] = {
+  // Much flatter than the standard tables, so that high frequencies (that
+  // is, edges) survive. Costs more bytes at the same quality, but text
+  // stays crisp even at fairly low qualities.
+  {
+    "text-sharp",
+    {
+      10,  12,  14,  16,  18,  20,  22,  24,
+      12,  14,  16,  18,  20,  22,  24,  26,
+      14,  16,  18,  20,  22,  24,  26,  28,
+      16,  18,  20,  22,  24,  26,  28,  30,
+      18,  20,  22,  24,  26,  28,  30,  32,
+      20,  22,  24,  26,  28,  30,  32,  34,
+      22,  24,  26,  28,  30,  32,  34,  36,
+      24,  26,  28,  30,  32,  34,  36,  38,
+    },
+    {
+      14,  18,  22,  26,  30,  34,  38,  42,
+      18,  22,  26,  30,  34,  38,  42,  46,
+      22,  26,  30,  34,  38,  42,  46,  50,
+      26,  30,  34,  38,  42,  46,  50,  54,
+      30,  34,  38,  42,  46,  50,  54,  58,
+      34,  38,  42,  46,  50,  54,  58,  62,
+      38,  42,  46,  50,  54,  58,  62,  66,
+      42,  46,  50,  54,  58,  62,  66,  70,
+    },
+  },
+  // Keeps flat areas and gradients clean but gives up on fine detail
+  // quickly, chroma in particular. Meant for slow links where a readable
+  // frame now beats a pretty frame later.
+  {
+    "bandwidth-saver",
+    {
+      16,  18,  22,  30,  42,  56,  74,  94,
+      18,  22,  30,  42,  56,  74,  94, 118,
+      22,  30,  42,  56,  74,  94, 118, 146,
+      30,  42,  56,  74,  94, 118, 146, 176,
+      42,  56,  74,  94, 118, 146, 176, 210,
+      56,  74,  94, 118, 146, 176, 210, 246,
+      74,  94, 118, 146, 176, 210, 246, 255,
+      94, 118, 146, 176, 210, 246, 255, 255,
+    },
+    {
+      24,  27,  36,  51,  72,  99, 132, 171,
+      27,  36,  51,  72,  99, 132, 171, 216,
+      36,  51,  72,  99, 132, 171, 216, 255,
+      51,  72,  99, 132, 171, 216, 255, 255,
+      72,  99, 132, 171, 216, 255, 255, 255,
+      99, 132, 171, 216, 255, 255, 255, 255,
+     132, 171, 216, 255, 255, 255, 255, 255,
+     171, 216, 255, 255, 255, 255, 255, 255,
+    },
+  },
+};
+
+#define PRESET_COUNT (sizeof(presets) / sizeof(presets[0]))
+
+bool
+QuantTables::findPreset(const std::string& name, const QuantTables** tables) {
+  if (name == "default") {
+    *tables = NULL;
+    return true;
+  }
+
+  for (size_t i = 0; i < PRESET_COUNT; ++i) {
+    if (presets[i].name == name) {
+      *tables = &presets[i];
+      return true;
+    }
+  }
+
+  return false;
+}
+
+std::string
+QuantTables::listPresets() {
+  std::string list = "default";
+
+  for (size_t i = 0; i < PRESET_COUNT; ++i) {
+    list += ", " + presets[i].name;
+  }
+
+  return list;
+}
+
+bool
+QuantTables::load(const char* path, QuantTables* tables) {
+  FILE* file = fopen(path, "r");
+
+  if (file == NULL) {
+    MCERROR("Unable to open quantization tables '%s'", path);
+    return false;
+  }
+
+  uint32_t count = 0;
+  bool comment = false;
+  bool ok = true;
+  long value = -1;
+  int c;
+
+  do {
+    c = fgetc(file);
+
+    if (comment) {
+      comment = c != '\n';
+      continue;
+    }
+
+    if (c != EOF && isdigit(c)) {
+      value = (value < 0 ? 0 : value * 10) + (c - '0');
+
+      if (value > 255) {
+        MCERROR("Quantization table values must be 1-255");
+        ok = false;
+        break;
+      }
+
+      continue;
+    }
+
+    if (value >= 0) {
+      if (value == 0 || count >= SIZE * 2) {
+        MCERROR("Quantization tables must have %u values of 1-255", SIZE * 2);
+        ok = false;
+        break;
+      }
+
+      if (count < SIZE) {
+        tables->luma[count] = value;
+      }
+      else {
+        tables->chroma[count - SIZE] = value;
+      }
+
+      count += 1;
+      value = -1;
+    }
+
+    if (c == '#') {
+      comment = true;
+    }
+    else if (c != EOF && c != ',' && !isspace(c)) {
+      MCERROR("Unexpected character '%c' in quantization tables", c);
+      ok = false;
+      break;
+    }
+  }
+  while (c != EOF);
+
+  fclose(file);
+
+  if (ok && count != SIZE * 2) {
+    MCERROR("Quantization tables must have %u values, got %u", SIZE * 2, count);
+    ok = false;
+  }
+
+  if (ok) {
+    tables->name = path;
+  }
+
+  return ok;
+}
@@ -0,0 +1,36 @@
+#ifndef MINICAP_QUANT_TABLES_HPP
+#define MINICAP_QUANT_TABLES_HPP
+
+#include <stdint.h>
+
+#include <string>
+
+// A pair of JPG quantization tables. The standard IJG tables that libjpeg
+// uses by default were tuned for photographs, and smear the sharp edges of
+// text and UI elements long before they save many bytes. Like the standard
+// tables, these are scaled by the JPG quality, so -Q keeps working.
+struct QuantTables {
+  static const uint32_t SIZE = 64;
+
+  std::string name;
+  // Both tables are in natural (row major) order, not zigzag.
+  unsigned int luma[SIZE];
+  unsigned int chroma[SIZE];
+
+  // Looks up a preset by name. The "default" preset exists but has no
+  // tables, which is signaled by setting tables to NULL.
+  static bool
+  findPreset(const std::string& name, const QuantTables** tables);
+
+  // Returns a comma separated list of preset names for usage messages.
+  static std::string
+  listPresets();
+
+  // Loads tables from a text file holding 64 luma values followed by 64
+  // chroma values, separated by whitespace or commas. Anything after a #
+  // is a comment.
+  static bool
+  load(const char* path, QuantTables* tables);
+};
+
+#endif
@@ -0,0 +1,177 @@
+#include "RegionTracker.hpp"
+
+#include <algorithm>
+
+#include "util/hash.hpp"
+
+static inline int
+countBits(unsigned char value) {
+  int count = 0;
+
+  for (; value != 0; value &= value - 1) {
+    count += 1;
+  }
+
+  return count;
+}
+
+RegionTracker::RegionTracker()
+  : mWidth(0),
+    mHeight(0),
+    mColumns(0),
+    mRows(0),
+    mHavePrevious(false)
+{
+}
+
+void
+RegionTracker::reset() {
+  mWidth = 0;
+  mHeight = 0;
+  mColumns = 0;
+  mRows = 0;
+  mHavePrevious = false;
+  mHashes.clear();
+  mPrevious.clear();
+  mChanged.clear();
+  mHistory.clear();
+}
+
+uint32_t
+RegionTracker::getWidth() {
+  return mWidth;
+}
+
+uint32_t
+RegionTracker::getHeight() {
+  return mHeight;
+}
+
+size_t
+RegionTracker::getCellCount() {
+  return mChanged.size();
+}
+
+const std::vector<unsigned char>&
+RegionTracker::getChanged() {
+  return mChanged;
+}
+
+bool
+RegionTracker::isActive(size_t cell) {
+  return countBits(mHistory[cell]) >= ACTIVE_CHANGES;
+}
+
+void
+RegionTracker::getRects(const std::vector<unsigned char>& cells, size_t maxRects,
+    std::vector<Rect>& rects) {
+  rects.clear();
+
+  // Indexes of the rectangles that reach down to the previous row.
+  std::vector<size_t> open;
+  std::vector<size_t> next;
+  uint32_t minX = mWidth, minY = mHeight, maxX = 0, maxY = 0;
+
+  for (uint32_t row = 0; row < mRows; ++row) {
+    uint32_t y = row * CELL_SIZE;
+    uint32_t height = std::min(y + CELL_SIZE, mHeight) - y;
+
+    next.clear();
+
+    for (uint32_t column = 0; column < mColumns;) {
+      if (!cells[row * mColumns + column]) {
+        column += 1;
+        continue;
+      }
+
+      uint32_t end = column;
+
+      while (end < mColumns && cells[row * mColumns + end]) {
+        end += 1;
+      }
+
+      uint32_t x = column * CELL_SIZE;
+      uint32_t width = std::min(end * CELL_SIZE, mWidth) - x;
+      bool merged = false;
+
+      for (size_t i = 0; i < open.size(); ++i) {
+        Rect& rect = rects[open[i]];
+
+        if (rect.x == x && rect.width == width) {
+          rect.height += height;
+          next.push_back(open[i]);
+          merged = true;
+          break;
+        }
+      }
+
+      if (!merged) {
+        Rect rect = { x, y, width, height };
+        rects.push_back(rect);
+        next.push_back(rects.size() - 1);
+      }
+
+      minX = std::min(minX, x);
+      minY = std::min(minY, y);
+      maxX = std::max(maxX, x + width);
+      maxY = std::max(maxY, y + height);
+
+      column = end;
+    }
+
+    open.swap(next);
+  }
+
+  if (rects.size() > maxRects) {
+    Rect box = { minX, minY, maxX - minX, maxY - minY };
+    rects.assign(1, box);
+  }
+}
+
+bool
+RegionTracker::beginFrame(const Minicap::Frame* frame) {
+  if (frame->width != mWidth || frame->height != mHeight) {
+    mWidth = frame->width;
+    mHeight = frame->height;
+    mColumns = (mWidth + CELL_SIZE - 1) / CELL_SIZE;
+    mRows = (mHeight + CELL_SIZE - 1) / CELL_SIZE;
+    mHavePrevious = false;
+    mHistory.assign(mColumns * mRows, 0);
+  }
+
+  mHashes.assign(mColumns * mRows, 0);
+
+  return true;
+}
+
+void
+RegionTracker::processTile(const Minicap::Frame* frame, uint32_t y0, uint32_t y1) {
+  size_t rowSize = frame->stride * frame->bpp;
+  size_t cellBytes = CELL_SIZE * frame->bpp;
+  size_t lastBytes = (mWidth - (mColumns - 1) * CELL_SIZE) * frame->bpp;
+
+  for (uint32_t y = y0; y < y1; ++y) {
+    const unsigned char* row = static_cast<const unsigned char*>(frame->data) + y * rowSize;
+    uint64_t* hashes = mHashes.data() + (y / CELL_SIZE) * mColumns;
+
+    for (uint32_t column = 0; column < mColumns; ++column) {
+      size_t size = column + 1 < mColumns ? cellBytes : lastBytes;
+      hashes[column] = hashBytes(hashes[column], row + column * cellBytes, size);
+    }
+  }
+}
+
+void
+RegionTracker::endFrame(const Minicap::Frame* /* frame */) {
+  size_t cells = mHashes.size();
+
+  mChanged.resize(cells);
+
+  for (size_t i = 0; i < cells; ++i) {
+    mChanged[i] = !mHavePrevious || mHashes[i] != mPrevious[i];
+    mHistory[i] = (mHistory[i] << 1) | mChanged[i];
+  }
+
+  mPrevious.swap(mHashes);
+  mHavePrevious = true;
+}
@@ -0,0 +1,82 @@
+#ifndef MINICAP_REGION_TRACKER_HPP
+#define MINICAP_REGION_TRACKER_HPP
+
+#include <stdint.h>
+
+#include <vector>
+
+#include "Minicap.hpp"
+
+#include "TileWalker.hpp"
+
+// Keeps track of which parts of the screen change and how often, so that
+// a small video on an otherwise static screen doesn't force full frames.
+// The frame is cut into a grid of cells, each of which gets hashed as part
+// of the shared pass over the frame. A cell that changed in at least half
+// of the last 8 frames is active.
+class RegionTracker: public TileKernel {
+public:
+  static const uint32_t CELL_SIZE = 64;
+  static const int ACTIVE_CHANGES = 4;
+
+  struct Rect {
+    uint32_t x;
+    uint32_t y;
+    uint32_t width;
+    uint32_t height;
+  };
+
+  RegionTracker();
+
+  // Forgets everything, so that all cells count as changed next time.
+  void
+  reset();
+
+  uint32_t
+  getWidth();
+
+  uint32_t
+  getHeight();
+
+  // One entry per cell, row major. Zero if nothing has been tracked yet.
+  size_t
+  getCellCount();
+
+  // Whether each cell changed in the latest frame. After a size change,
+  // all of them did.
+  const std::vector<unsigned char>&
+  getChanged();
+
+  bool
+  isActive(size_t cell);
+
+  // Covers the set cells of a mask with rectangles in frame coordinates,
+  // merging runs of cells on a row with identical runs on the rows above.
+  // If that takes more than maxRects, the bounding box is used instead.
+  void
+  getRects(const std::vector<unsigned char>& cells, size_t maxRects, std::vector<Rect>& rects);
+
+  virtual bool
+  beginFrame(const Minicap::Frame* frame);
+
+  virtual void
+  processTile(const Minicap::Frame* frame, uint32_t y0, uint32_t y1);
+
+  virtual void
+  endFrame(const Minicap::Frame* frame);
+
+private:
+  uint32_t mWidth;
+  uint32_t mHeight;
+  uint32_t mColumns;
+  uint32_t mRows;
+  bool mHavePrevious;
+  std::vector<uint64_t> mHashes;
+  std::vector<uint64_t> mPrevious;
+  std::vector<unsigned char> mChanged;
+  // The change history of each cell over the last 8 frames, one bit per
+  // frame, newest in the lowest bit.
+  std::vector<unsigned char> mHistory;
+};
+
+#endif
@@ -0,0 +1,202 @@
+#include "RegionWatcher.hpp"
+
+#include <string.h>
+
+#include <algorithm>
+
+#include "util/hash.hpp"
+
+RegionWatcher::Watch::Watch()
+  : kind(KIND_CHANGE),
+    x(0),
+    y(0),
+    width(0),
+    height(0),
+    channel(CHANNEL_LUMA),
+    threshold(0),
+    target(0),
+    evaluated(false),
+    fired(false),
+    state(false),
+    hash(0),
+    x0(0),
+    y0(0),
+    x1(0),
+    y1(0),
+    partialHash(0)
+{
+  memset(mean, 0, sizeof(mean));
+  memset(sums, 0, sizeof(sums));
+}
+
+RegionWatcher::RegionWatcher()
+  : mRed(0),
+    mBlue(2)
+{
+}
+
+void
+RegionWatcher::clearWatches() {
+  mWatches.clear();
+}
+
+void
+RegionWatcher::addWatch(Watch* watch) {
+  mWatches.push_back(watch);
+}
+
+bool
+RegionWatcher::hasWatches() {
+  return !mWatches.empty();
+}
+
+bool
+RegionWatcher::beginFrame(const Minicap::Frame* frame) {
+  for (size_t i = 0; i < mWatches.size(); ++i) {
+    mWatches[i]->fired = false;
+  }
+
+  switch (frame->format) {
+  case Minicap::FORMAT_RGBA_8888:
+  case Minicap::FORMAT_RGBX_8888:
+  case Minicap::FORMAT_RGB_888:
+    mRed = 0;
+    mBlue = 2;
+    break;
+  case Minicap::FORMAT_BGRA_8888:
+    mRed = 2;
+    mBlue = 0;
+    break;
+  default:
+    return false;
+  }
+
+  for (size_t i = 0; i < mWatches.size(); ++i) {
+    Watch* watch = mWatches[i];
+
+    watch->x0 = std::min(watch->x, frame->width);
+    watch->y0 = std::min(watch->y, frame->height);
+    watch->x1 = std::min(watch->x + watch->width, frame->width);
+    watch->y1 = std::min(watch->y + watch->height, frame->height);
+    watch->partialHash = 0;
+    memset(watch->sums, 0, sizeof(watch->sums));
+  }
+
+  return true;
+}
+
+// Sums up the first three channels of a row of 4 byte pixels. Picking
+// every fourth byte doesn't vectorize, so each pixel is taken as a little
+// endian word instead. Channels 0 and 2 are masked out together and summed
+// in the 16-bit halves of one word, and channel 1 on its own, which does
+// vectorize. Flushing every 256 pixels keeps the halves from overflowing
+// into each other.
+static void
+sumChannels4(const unsigned char* row, uint32_t width, uint32_t channels[3]) {
+  const uint32_t* words = reinterpret_cast<const uint32_t*>(row);
+
+  for (uint32_t start = 0; start < width; start += 256) {
+    uint32_t end = std::min(start + 256, width);
+    uint32_t outer = 0;
+    uint32_t inner = 0;
+
+    for (uint32_t x = start; x < end; ++x) {
+      outer += words[x] & 0x00FF00FF;
+      inner += (words[x] >> 8) & 0x000000FF;
+    }
+
+    channels[0] += outer & 0xFFFF;
+    channels[1] += inner;
+    channels[2] += outer >> 16;
+  }
+}
+
+void
+RegionWatcher::processTile(const Minicap::Frame* frame, uint32_t y0, uint32_t y1) {
+  const unsigned char* source = static_cast<const unsigned char*>(frame->data);
+  uint32_t bpp = frame->bpp;
+
+  for (size_t i = 0; i < mWatches.size(); ++i) {
+    Watch* watch = mWatches[i];
+    uint32_t top = std::max(y0, watch->y0);
+    uint32_t bottom = std::min(y1, watch->y1);
+
+    if (top >= bottom || watch->x0 >= watch->x1) {
+      continue;
+    }
+
+    size_t rowBytes = (watch->x1 - watch->x0) * bpp;
+    uint64_t red = 0, green = 0, blue = 0;
+
+    for (uint32_t y = top; y < bottom; ++y) {
+      const unsigned char* row = source + (y * frame->stride + watch->x0) * bpp;
+
+      watch->partialHash = hashBytes(watch->partialHash, row, rowBytes);
+
+      // Per-row sums fit in 32 bits even on the widest screens.
+      uint32_t channels[3] = { 0, 0, 0 };
+
+      if (bpp == 4) {
+        sumChannels4(row, watch->x1 - watch->x0, channels);
+      }
+      else {
+        for (size_t offset = 0; offset < rowBytes; offset += bpp) {
+          channels[0] += row[offset];
+          channels[1] += row[offset + 1];
+          channels[2] += row[offset + 2];
+        }
+      }
+
+      red += channels[mRed];
+      green += channels[1];
+      blue += channels[mBlue];
+    }
+
+    watch->sums[0] += red;
+    watch->sums[1] += green;
+    watch->sums[2] += blue;
+  }
+}
+
+void
+RegionWatcher::endFrame(const Minicap::Frame* /* frame */) {
+  for (size_t i = 0; i < mWatches.size(); ++i) {
+    Watch* watch = mWatches[i];
+    uint64_t pixels = static_cast<uint64_t>(watch->x1 - watch->x0) * (watch->y1 - watch->y0);
+
+    // Nothing of it is on screen at this size, e.g. after a rotation.
+    if (pixels == 0) {
+      continue;
+    }
+
+    for (int c = 0; c < 3; ++c) {
+      watch->mean[c] = (watch->sums[c] + pixels / 2) / pixels;
+    }
+
+    // BT.601 weights in 8-bit fixed point, like LumaExtractor.
+    watch->mean[3] = (77 * watch->mean[0] + 150 * watch->mean[1] + 29 * watch->mean[2] + 128) >> 8;
+
+    bool changed = !watch->evaluated || watch->partialHash != watch->hash;
+    bool state = true;
+
+    switch (watch->kind) {
+    case KIND_MEAN:
+      state = watch->mean[watch->channel == CHANNEL_LUMA ? 3 : watch->channel - 1] >= watch->threshold;
+      break;
+    case KIND_EQUAL:
+      if (watch->target == 0) {
+        watch->target = watch->partialHash;
+      }
+
+      state = watch->partialHash == watch->target;
+      break;
+    case KIND_CHANGE:
+      break;
+    }
+
+    watch->fired = watch->kind == KIND_CHANGE ? changed : !watch->evaluated || state != watch->state;
+    watch->state = state;
+    watch->hash = watch->partialHash;
+    watch->evaluated = true;
+  }
+}
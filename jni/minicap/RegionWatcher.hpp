@@ -0,0 +1,97 @@
+#ifndef MINICAP_REGION_WATCHER_HPP
+#define MINICAP_REGION_WATCHER_HPP
+
+#include <stdint.h>
+
+#include <vector>
+
+#include "Minicap.hpp"
+
+#include "TileWalker.hpp"
+
+// Evaluates conditions on small parts of the frame as part of the shared
+// pass over it, so that clients waiting for something to happen on screen
+// can be told when it does instead of polling with screenshots. Only the
+// rows and columns of each watched rectangle are read.
+class RegionWatcher: public TileKernel {
+public:
+  enum Kind {
+    // Fires whenever the pixels of the rectangle change.
+    KIND_CHANGE = 1,
+    // Fires when the mean of a channel crosses a threshold, either way.
+    KIND_MEAN   = 2,
+    // Fires when the rectangle becomes equal to a given state, or stops
+    // being equal to it.
+    KIND_EQUAL  = 3,
+  };
+
+  enum Channel {
+    CHANNEL_LUMA  = 0,
+    CHANNEL_RED   = 1,
+    CHANNEL_GREEN = 2,
+    CHANNEL_BLUE  = 3,
+  };
+
+  struct Watch {
+    Kind kind;
+    uint32_t x;
+    uint32_t y;
+    uint32_t width;
+    uint32_t height;
+    // For KIND_MEAN.
+    Channel channel;
+    unsigned char threshold;
+    // For KIND_EQUAL, the hash of the state to wait for. Zero takes the
+    // state at the first evaluation.
+    uint64_t target;
+
+    // Results of the latest evaluation. Every watch fires on its first
+    // evaluation, to report the initial state.
+    bool evaluated;
+    bool fired;
+    bool state;
+    uint64_t hash;
+    // Red, green, blue and luma.
+    unsigned char mean[4];
+
+    // The rectangle clipped to the frame being walked, and what has been
+    // collected of it so far.
+    uint32_t x0;
+    uint32_t y0;
+    uint32_t x1;
+    uint32_t y1;
+    uint64_t partialHash;
+    uint64_t sums[3];
+
+    Watch();
+  };
+
+  RegionWatcher();
+
+  // Watches are owned by the caller and have to stay put until the frame
+  // has been walked.
+  void
+  clearWatches();
+
+  void
+  addWatch(Watch* watch);
+
+  bool
+  hasWatches();
+
+  virtual bool
+  beginFrame(const Minicap::Frame* frame);
+
+  virtual void
+  processTile(const Minicap::Frame* frame, uint32_t y0, uint32_t y1);
+
+  virtual void
+  endFrame(const Minicap::Frame* frame);
+
+private:
+  std::vector<Watch*> mWatches;
+  uint32_t mRed;
+  uint32_t mBlue;
+};
+
+#endif
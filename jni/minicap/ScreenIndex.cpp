@@ -0,0 +1,250 @@
+#include "ScreenIndex.hpp"
+
+#include <string.h>
+
+static inline uint32_t
+countBits(uint64_t value) {
+  return __builtin_popcountll(value);
+}
+
+void
+ScreenFingerprint::load(const unsigned char* data) {
+  for (uint32_t w = 0; w < WORDS; ++w) {
+    uint64_t word = 0;
+
+    for (int b = 7; b >= 0; --b) {
+      word = (word << 8) | data[w * 8 + b];
+    }
+
+    words[w] = word;
+  }
+}
+
+void
+ScreenFingerprint::store(unsigned char* data) const {
+  for (uint32_t w = 0; w < WORDS; ++w) {
+    for (int b = 0; b < 8; ++b) {
+      data[w * 8 + b] = (words[w] >> (b * 8)) & 0xFF;
+    }
+  }
+}
+
+void
+ScreenFingerprint::fill() {
+  memset(words, 0xFF, sizeof(words));
+}
+
+uint32_t
+ScreenFingerprint::count() const {
+  uint32_t bits = 0;
+
+  for (uint32_t w = 0; w < WORDS; ++w) {
+    bits += countBits(words[w]);
+  }
+
+  return bits;
+}
+
+bool
+ScreenIndex::set(uint32_t id, const ScreenFingerprint& fingerprint,
+    const ScreenFingerprint& mask, size_t maxEntries) {
+  Entry entry;
+  entry.id = id;
+  entry.mask = mask;
+  entry.bits = mask.count();
+
+  // Masked out bits never differ, which keeps the lookup to one AND.
+  for (uint32_t w = 0; w < ScreenFingerprint::WORDS; ++w) {
+    entry.fingerprint.words[w] = fingerprint.words[w] & mask.words[w];
+  }
+
+  for (size_t i = 0; i < mEntries.size(); ++i) {
+    if (mEntries[i].id == id) {
+      mEntries[i] = entry;
+      return true;
+    }
+  }
+
+  if (mEntries.size() >= maxEntries) {
+    return false;
+  }
+
+  mEntries.push_back(entry);
+
+  return true;
+}
+
+void
+ScreenIndex::remove(uint32_t id) {
+  for (size_t i = 0; i < mEntries.size(); ++i) {
+    if (mEntries[i].id == id) {
+      mEntries.erase(mEntries.begin() + i);
+      return;
+    }
+  }
+}
+
+bool
+ScreenIndex::empty() const {
+  return mEntries.empty();
+}
+
+// Whether a differs less than b, relative to the bits compared.
+static bool
+isCloser(const ScreenIndex::Match& a, const ScreenIndex::Match& b) {
+  uint64_t left = static_cast<uint64_t>(a.distance) * b.bits;
+  uint64_t right = static_cast<uint64_t>(b.distance) * a.bits;
+
+  if (left != right) {
+    return left < right;
+  }
+
+  // The same share on more bits is more telling.
+  return a.bits > b.bits;
+}
+
+size_t
+ScreenIndex::classify(const ScreenFingerprint& fingerprint, Match* best, Match* second) const {
+  size_t found = 0;
+
+  for (size_t i = 0; i < mEntries.size(); ++i) {
+    const Entry& entry = mEntries[i];
+
+    // A mask without any bits matches anything and says nothing.
+    if (entry.bits == 0) {
+      continue;
+    }
+
+    Match match;
+    match.id = entry.id;
+    match.distance = 0;
+    match.bits = entry.bits;
+
+    for (uint32_t w = 0; w < ScreenFingerprint::WORDS; ++w) {
+      match.distance += countBits((fingerprint.words[w] & entry.mask.words[w]) ^
+        entry.fingerprint.words[w]);
+    }
+
+    if (found == 0 || isCloser(match, *best)) {
+      if (found > 0) {
+        *second = *best;
+      }
+
+      *best = match;
+      found = found < 2 ? found + 1 : 2;
+    }
+    else if (found == 1 || isCloser(match, *second)) {
+      *second = match;
+      found = 2;
+    }
+  }
+
+  return found;
+}
+
+ScreenFingerprinter::ScreenFingerprinter()
+  : mValid(false),
+    mRed(0),
+    mBlue(2)
+{
+  memset(&mFingerprint, 0, sizeof(mFingerprint));
+}
+
+bool
+ScreenFingerprinter::hasFingerprint() {
+  return mValid;
+}
+
+void
+ScreenFingerprinter::reset() {
+  mValid = false;
+}
+
+const ScreenFingerprint&
+ScreenFingerprinter::getFingerprint() {
+  return mFingerprint;
+}
+
+bool
+ScreenFingerprinter::beginFrame(const Minicap::Frame* frame) {
+  mValid = false;
+
+  switch (frame->format) {
+  case Minicap::FORMAT_RGBA_8888:
+  case Minicap::FORMAT_RGBX_8888:
+  case Minicap::FORMAT_RGB_888:
+    mRed = 0;
+    mBlue = 2;
+    break;
+  case Minicap::FORMAT_BGRA_8888:
+    mRed = 2;
+    mBlue = 0;
+    break;
+  default:
+    return false;
+  }
+
+  uint32_t columns = ScreenFingerprint::COLUMNS + 1;
+  uint32_t samples = (frame->width + SAMPLE_STEP - 1) / SAMPLE_STEP;
+
+  mColumnOf.resize(samples);
+
+  for (uint32_t s = 0; s < samples; ++s) {
+    mColumnOf[s] = static_cast<uint64_t>(s * SAMPLE_STEP) * columns / frame->width;
+  }
+
+  mSums.assign(columns * ScreenFingerprint::ROWS, 0);
+  mCounts.assign(columns * ScreenFingerprint::ROWS, 0);
+
+  return true;
+}
+
+void
+ScreenFingerprinter::processTile(const Minicap::Frame* frame, uint32_t y0, uint32_t y1) {
+  const unsigned char* source = static_cast<const unsigned char*>(frame->data);
+  uint32_t bpp = frame->bpp;
+  uint32_t columns = ScreenFingerprint::COLUMNS + 1;
+  uint32_t step = SAMPLE_STEP * bpp;
+  uint32_t samples = mColumnOf.size();
+
+  // Sampled rows are the same whichever tile they fall in.
+  for (uint32_t y = (y0 + SAMPLE_STEP - 1) / SAMPLE_STEP * SAMPLE_STEP; y < y1; y += SAMPLE_STEP) {
+    const unsigned char* pixel = source + y * frame->stride * bpp;
+    uint32_t row = static_cast<uint64_t>(y) * ScreenFingerprint::ROWS / frame->height;
+    uint32_t* sums = mSums.data() + row * columns;
+    uint32_t* counts = mCounts.data() + row * columns;
+
+    // BT.601 weights in 8-bit fixed point, like LumaExtractor.
+    for (uint32_t s = 0; s < samples; ++s, pixel += step) {
+      uint32_t luma = (77 * pixel[mRed] + 150 * pixel[1] + 29 * pixel[mBlue] + 128) >> 8;
+      sums[mColumnOf[s]] += luma;
+      counts[mColumnOf[s]] += 1;
+    }
+  }
+}
+
+void
+ScreenFingerprinter::endFrame(const Minicap::Frame* /* frame */) {
+  uint32_t columns = ScreenFingerprint::COLUMNS + 1;
+
+  memset(&mFingerprint, 0, sizeof(mFingerprint));
+
+  for (uint32_t row = 0; row < ScreenFingerprint::ROWS; ++row) {
+    const uint32_t* sums = mSums.data() + row * columns;
+    const uint32_t* counts = mCounts.data() + row * columns;
+
+    for (uint32_t column = 0; column < ScreenFingerprint::COLUMNS; ++column) {
+      // Compares the means without dividing. Blocks of tiny frames may
+      // not have any samples, and never count as brighter.
+      uint64_t left = static_cast<uint64_t>(sums[column]) * counts[column + 1];
+      uint64_t right = static_cast<uint64_t>(sums[column + 1]) * counts[column];
+
+      if (counts[column] > 0 && counts[column + 1] > 0 && right > left) {
+        uint32_t n = row * ScreenFingerprint::COLUMNS + column;
+        mFingerprint.words[n / 64] |= 1ULL << (n % 64);
+      }
+    }
+  }
+
+  mValid = true;
+}
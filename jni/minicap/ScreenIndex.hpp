@@ -0,0 +1,123 @@
+#ifndef MINICAP_SCREEN_INDEX_HPP
+#define MINICAP_SCREEN_INDEX_HPP
+
+#include <stdint.h>
+
+#include <vector>
+
+#include "Minicap.hpp"
+
+#include "TileWalker.hpp"
+
+// A perceptual fingerprint of a whole frame. The frame is cut into a grid
+// of 17 by 16 blocks and each bit says whether a block is brighter than
+// the one to its left, which survives compression, scaling and small
+// color shifts but not a different layout.
+struct ScreenFingerprint {
+  static const uint32_t COLUMNS = 16;
+  static const uint32_t ROWS = 16;
+  static const uint32_t BITS = COLUMNS * ROWS;
+  static const uint32_t WORDS = BITS / 64;
+  static const uint32_t BYTES = BITS / 8;
+
+  // Bit n is bit n % 64 of word n / 64, with n = row * COLUMNS + column.
+  uint64_t words[WORDS];
+
+  // In bytes, bit n is bit n % 8 of byte n / 8.
+  void
+  load(const unsigned char* data);
+
+  void
+  store(unsigned char* data) const;
+
+  // All bits set, for comparing everything.
+  void
+  fill();
+
+  uint32_t
+  count() const;
+};
+
+// Known screens by their fingerprints, each with a mask of the bits that
+// count, so that a clock or a notification icon doesn't get in the way.
+// Lookups compare against every entry, which takes a few instructions per
+// entry and stays well below a millisecond even for thousands of screens.
+class ScreenIndex {
+public:
+  struct Match {
+    uint32_t id;
+    // Differing bits, out of the bits the entry's mask compares.
+    uint32_t distance;
+    uint32_t bits;
+  };
+
+  // Returns false if the index is full and the ID isn't in it yet.
+  bool
+  set(uint32_t id, const ScreenFingerprint& fingerprint, const ScreenFingerprint& mask,
+    size_t maxEntries);
+
+  void
+  remove(uint32_t id);
+
+  bool
+  empty() const;
+
+  // Finds the closest and the second closest entry, by the share of
+  // compared bits that differ. Returns the number of matches filled in.
+  size_t
+  classify(const ScreenFingerprint& fingerprint, Match* best, Match* second) const;
+
+private:
+  struct Entry {
+    uint32_t id;
+    ScreenFingerprint fingerprint;
+    ScreenFingerprint mask;
+    uint32_t bits;
+  };
+
+  std::vector<Entry> mEntries;
+};
+
+// Fingerprints every frame as part of the shared pass over it. Only every
+// other pixel of every other row is sampled, which is plenty for block
+// means.
+class ScreenFingerprinter: public TileKernel {
+public:
+  static const uint32_t SAMPLE_STEP = 2;
+
+  ScreenFingerprinter();
+
+  // Whether there's a fingerprint of the latest frame.
+  bool
+  hasFingerprint();
+
+  // Forgets the fingerprint, for when frames are no longer fingerprinted.
+  void
+  reset();
+
+  const ScreenFingerprint&
+  getFingerprint();
+
+  virtual bool
+  beginFrame(const Minicap::Frame* frame);
+
+  virtual void
+  processTile(const Minicap::Frame* frame, uint32_t y0, uint32_t y1);
+
+  virtual void
+  endFrame(const Minicap::Frame* frame);
+
+private:
+  ScreenFingerprint mFingerprint;
+  bool mValid;
+  uint32_t mRed;
+  uint32_t mBlue;
+  // The block column of each sampled column.
+  std::vector<unsigned char> mColumnOf;
+  // Luma sums and sample counts of each block, with one more column than
+  // the fingerprint has bits per row.
+  std::vector<uint32_t> mSums;
+  std::vector<uint32_t> mCounts;
+};
+
+#endif
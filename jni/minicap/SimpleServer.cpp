@@ -8,11 +8,13 @@
 #include <unistd.h>
 #include <string.h>
 
-SimpleServer::SimpleServer(): mFd(0) {
+#include "util/vsock.hpp"
+
+SimpleServer::SimpleServer(): mFd(-1) {
 }
 
 SimpleServer::~SimpleServer() {
-  if (mFd > 0) {
+  if (mFd >= 0) {
     ::close(mFd);
   }
 }
@@ -36,7 +38,33 @@ SimpleServer::start(const char* sockname) {
     return -1;
   }
 
-  ::listen(sfd, 1);
+  ::listen(sfd, 8);
+
+  mFd = sfd;
+
+  return mFd;
+}
+
+int
+SimpleServer::startVsock(unsigned int port) {
+  int sfd = socket(AF_VSOCK, SOCK_STREAM, 0);
+
+  if (sfd < 0) {
+    return sfd;
+  }
+
+  struct sockaddr_vm addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.svm_family = AF_VSOCK;
+  addr.svm_port = port;
+  addr.svm_cid = VMADDR_CID_ANY;
+
+  if (::bind(sfd, (struct sockaddr*) &addr, sizeof(addr)) < 0) {
+    ::close(sfd);
+    return -1;
+  }
+
+  ::listen(sfd, 8);
 
   mFd = sfd;
 
@@ -45,7 +73,12 @@ SimpleServer::start(const char* sockname) {
 
 int
 SimpleServer::accept() {
-  struct sockaddr_un addr;
+  struct sockaddr_storage addr;
   socklen_t addr_len = sizeof(addr);
   return ::accept(mFd, (struct sockaddr *) &addr, &addr_len);
 }
+
+int
+SimpleServer::getFd() {
+  return mFd;
+}
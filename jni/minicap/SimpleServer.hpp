@@ -9,8 +9,17 @@ public:
   int
   start(const char* sockname);
 
+  // Listens on an AF_VSOCK port instead, so that when Android runs in a
+  // VM, the host can connect directly without going through adb forward.
+  int
+  startVsock(unsigned int port);
+
   int accept();
 
+  // Returns -1 if the server hasn't been started.
+  int
+  getFd();
+
 private:
   int mFd;
 };
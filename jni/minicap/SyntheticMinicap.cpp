@@ -0,0 +1,329 @@
+#include "SyntheticMinicap.hpp"
+
+#include <errno.h>
+#include <string.h>
+
+#include <chrono>
+
+#include "util/debug.h"
+
+SyntheticMinicap::SyntheticMinicap(float fps, bool watermark)
+  : mFps(fps),
+    mWatermark(watermark),
+    mWidth(0),
+    mHeight(0),
+    mFormat(FORMAT_RGBA_8888),
+    mBpp(4),
+    mStallAfter(0),
+    mListener(NULL),
+    mRunning(false),
+    mTicks(0),
+    mSequence(0),
+    mDropped(0)
+{
+}
+
+SyntheticMinicap::~SyntheticMinicap() {
+  release();
+}
+
+int
+SyntheticMinicap::applyConfigChanges() {
+  release();
+
+  if (mWidth == 0 || mHeight == 0 || mFps <= 0) {
+    return -EINVAL;
+  }
+
+  if (mWatermark && (mWidth < Watermark::WIDTH || mHeight < Watermark::HEIGHT)) {
+    MCERROR("Frames are too small for a watermark");
+    return -EINVAL;
+  }
+
+  if (isYuv()) {
+    // A full size luma plane and two quarter size chroma planes.
+    uint32_t chromaSize = ((mWidth + 1) / 2) * ((mHeight + 1) / 2);
+    mData.resize(mWidth * mHeight + chromaSize * 2);
+  }
+  else {
+    mData.resize(mWidth * mHeight * mBpp);
+  }
+  mQueue.clear();
+
+  mRunning = true;
+  mThread = std::thread(&SyntheticMinicap::run, this);
+
+  return 0;
+}
+
+int
+SyntheticMinicap::consumePendingFrame(Minicap::Frame* frame) {
+  Watermark::Code code;
+
+  {
+    std::lock_guard<std::mutex> lock(mMutex);
+
+    if (mQueue.empty()) {
+      return -EAGAIN;
+    }
+
+    code = mQueue.front();
+    mQueue.pop_front();
+  }
+
+  frame->data = mData.data();
+  frame->format = mFormat;
+  frame->width = mWidth;
+  frame->height = mHeight;
+  frame->stride = mWidth;
+  frame->bpp = mBpp;
+  frame->size = mData.size();
+
+  if (isYuv()) {
+    uint32_t chromaWidth = (mWidth + 1) / 2;
+    uint32_t chromaSize = chromaWidth * ((mHeight + 1) / 2);
+    unsigned char* chroma = mData.data() + mWidth * mHeight;
+
+    frame->planes[0] = mData.data();
+    frame->strides[0] = mWidth;
+
+    if (mFormat == FORMAT_I420) {
+      frame->planes[1] = chroma;
+      frame->planes[2] = chroma + chromaSize;
+      frame->strides[1] = chromaWidth;
+      frame->strides[2] = chromaWidth;
+    }
+    else {
+      frame->planes[1] = chroma;
+      frame->planes[2] = NULL;
+      frame->strides[1] = chromaWidth * 2;
+      frame->strides[2] = 0;
+    }
+
+    renderYuv(code);
+  }
+  else {
+    render(code);
+  }
+
+  return 0;
+}
+
+Minicap::Format
+SyntheticMinicap::getCaptureFormat() {
+  return mFormat;
+}
+
+Minicap::CaptureMethod
+SyntheticMinicap::getCaptureMethod() {
+  return METHOD_SYNTHETIC;
+}
+
+int32_t
+SyntheticMinicap::getDisplayId() {
+  return 0;
+}
+
+void
+SyntheticMinicap::release() {
+  mRunning = false;
+
+  if (mThread.joinable()) {
+    mThread.join();
+  }
+
+  if (mDropped > 0) {
+    MCINFO("Synthetic backend dropped %u unconsumed frames", mDropped);
+    mDropped = 0;
+  }
+}
+
+void
+SyntheticMinicap::setStallAfter(uint32_t frames) {
+  mStallAfter = frames;
+}
+
+uint64_t
+SyntheticMinicap::getTicks() {
+  return mTicks;
+}
+
+void
+SyntheticMinicap::releaseConsumedFrame(Minicap::Frame* /* frame */) {
+}
+
+int
+SyntheticMinicap::setDesiredInfo(const Minicap::DisplayInfo& info) {
+  mWidth = info.width;
+  mHeight = info.height;
+  return 0;
+}
+
+void
+SyntheticMinicap::setFrameAvailableListener(Minicap::FrameAvailableListener* listener) {
+  mListener = listener;
+}
+
+int
+SyntheticMinicap::setPreferredFormat(Minicap::Format format) {
+  // Like a real backend, anything we can't make is quietly ignored.
+  switch (format) {
+  case FORMAT_RGBA_8888:
+  case FORMAT_RGBX_8888:
+  case FORMAT_BGRA_8888:
+    mFormat = format;
+    mBpp = 4;
+    break;
+  case FORMAT_RGB_888:
+    mFormat = format;
+    mBpp = 3;
+    break;
+  case FORMAT_NV12:
+  case FORMAT_NV21:
+  case FORMAT_I420:
+    mFormat = format;
+    mBpp = 1;
+    break;
+  default:
+    break;
+  }
+
+  return 0;
+}
+
+int
+SyntheticMinicap::setRealInfo(const Minicap::DisplayInfo& /* info */) {
+  return 0;
+}
+
+void
+SyntheticMinicap::run() {
+  std::chrono::steady_clock::duration interval = std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+    std::chrono::duration<float>(1.0f / mFps));
+  std::chrono::steady_clock::time_point next = std::chrono::steady_clock::now();
+  uint32_t produced = 0;
+
+  while (mRunning) {
+    next += interval;
+    std::this_thread::sleep_until(next);
+
+    mTicks += 1;
+
+    if (mStallAfter > 0 && produced >= mStallAfter) {
+      continue;
+    }
+
+    produced += 1;
+
+    bool dropped = false;
+
+    {
+      std::lock_guard<std::mutex> lock(mMutex);
+
+      Watermark::Code code;
+      code.sequence = ++mSequence;
+      code.time = Watermark::now();
+
+      if (mQueue.size() >= MAX_QUEUED_FRAMES) {
+        mQueue.pop_front();
+        mDropped += 1;
+        dropped = true;
+      }
+
+      mQueue.push_back(code);
+    }
+
+    // A dropped frame was already announced, and the replacement takes
+    // its place in line.
+    if (!dropped && mListener != NULL) {
+      mListener->onFrameAvailable();
+    }
+  }
+}
+
+void
+SyntheticMinicap::render(const Watermark::Code& code) {
+  // A diagonal gradient with a bar sweeping across it, so that there's
+  // always something changing for the encoder to chew on.
+  uint32_t bar = (code.sequence * 8) % mWidth;
+  bool bgr = mFormat == FORMAT_BGRA_8888;
+
+  for (uint32_t y = 0; y < mHeight; ++y) {
+    unsigned char* row = mData.data() + y * mWidth * mBpp;
+
+    for (uint32_t x = 0; x < mWidth; ++x) {
+      unsigned char* pixel = row + x * mBpp;
+      bool inBar = x >= bar && x < bar + 32;
+      pixel[bgr ? 2 : 0] = inBar ? 0xFF : (x + y) & 0xFF;
+      pixel[1] = inBar ? 0xFF : (y * 255 / mHeight) & 0xFF;
+      pixel[bgr ? 0 : 2] = inBar ? 0xFF : (x * 255 / mWidth) & 0xFF;
+
+      if (mBpp == 4) {
+        pixel[3] = 0xFF;
+      }
+    }
+  }
+
+  if (mWatermark) {
+    Watermark::paint(code, mData.data(), mWidth, mBpp);
+  }
+}
+
+void
+SyntheticMinicap::renderYuv(const Watermark::Code& code) {
+  uint32_t bar = (code.sequence * 8) % mWidth;
+  uint32_t chromaWidth = (mWidth + 1) / 2;
+  uint32_t chromaHeight = (mHeight + 1) / 2;
+  unsigned char* luma = mData.data();
+  unsigned char* chroma = luma + mWidth * mHeight;
+  unsigned char* cb = chroma;
+  unsigned char* cr = chroma + chromaWidth * chromaHeight;
+  uint32_t step = 1;
+
+  if (mFormat == FORMAT_NV12) {
+    cr = chroma + 1;
+    step = 2;
+  }
+  else if (mFormat == FORMAT_NV21) {
+    cb = chroma + 1;
+    cr = chroma;
+    step = 2;
+  }
+
+  // Full range BT.601, the same as JPG. Each 2x2 block takes its chroma
+  // from its top left pixel.
+  for (uint32_t y = 0; y < mHeight; ++y) {
+    for (uint32_t x = 0; x < mWidth; ++x) {
+      bool inBar = x >= bar && x < bar + 32;
+      int r = inBar ? 0xFF : (x + y) & 0xFF;
+      int g = inBar ? 0xFF : (y * 255 / mHeight) & 0xFF;
+      int b = inBar ? 0xFF : (x * 255 / mWidth) & 0xFF;
+
+      luma[y * mWidth + x] = (77 * r + 150 * g + 29 * b + 128) >> 8;
+
+      if ((x & 1) == 0 && (y & 1) == 0) {
+        uint32_t offset = ((y / 2) * chromaWidth + x / 2) * step;
+        cb[offset] = (-43 * r - 84 * g + 127 * b + 32896) >> 8;
+        cr[offset] = (127 * r - 106 * g - 21 * b + 32896) >> 8;
+      }
+    }
+  }
+
+  if (mWatermark) {
+    Watermark::paint(code, luma, mWidth, 1);
+
+    // Black and white have no color.
+    for (uint32_t y = 0; y < Watermark::HEIGHT / 2; ++y) {
+      for (uint32_t x = 0; x < Watermark::WIDTH / 2; ++x) {
+        uint32_t offset = (y * chromaWidth + x) * step;
+        cb[offset] = 128;
+        cr[offset] = 128;
+      }
+    }
+  }
+}
+
+bool
+SyntheticMinicap::isYuv() {
+  return mFormat == FORMAT_NV12 || mFormat == FORMAT_NV21 || mFormat == FORMAT_I420;
+}
@@ -0,0 +1,106 @@
+#ifndef MINICAP_SYNTHETIC_MINICAP_HPP
+#define MINICAP_SYNTHETIC_MINICAP_HPP
+
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "Minicap.hpp"
+
+#include "Watermark.hpp"
+
+// A capture backend that makes up its own frames at a fixed rate instead
+// of looking at the screen. Useful for benchmarking the rest of the
+// pipeline, with or without a device. Like a real buffer queue, it only
+// holds on to a few frames; if they're not consumed in time, the oldest
+// ones are dropped. Frames come in any of the 8-bit formats the rest of
+// the pipeline handles, so that format negotiation can be tried out too.
+class SyntheticMinicap: public Minicap {
+public:
+  static const size_t MAX_QUEUED_FRAMES = 3;
+
+  SyntheticMinicap(float fps, bool watermark);
+
+  virtual
+  ~SyntheticMinicap();
+
+  virtual int
+  applyConfigChanges();
+
+  virtual int
+  consumePendingFrame(Minicap::Frame* frame);
+
+  virtual Minicap::Format
+  getCaptureFormat();
+
+  virtual Minicap::CaptureMethod
+  getCaptureMethod();
+
+  virtual int32_t
+  getDisplayId();
+
+  virtual void
+  release();
+
+  virtual void
+  releaseConsumedFrame(Minicap::Frame* frame);
+
+  virtual int
+  setDesiredInfo(const Minicap::DisplayInfo& info);
+
+  virtual void
+  setFrameAvailableListener(Minicap::FrameAvailableListener* listener);
+
+  virtual int
+  setPreferredFormat(Minicap::Format format);
+
+  virtual int
+  setRealInfo(const Minicap::DisplayInfo& info);
+
+  // Stops producing frames after this many, until the next
+  // applyConfigChanges(), like a virtual display that SurfaceFlinger has
+  // lost track of. 0 never stops.
+  void
+  setStallAfter(uint32_t frames);
+
+  // Counts the frames the made up display has shown, including the ones
+  // that never arrived because of a stall.
+  uint64_t
+  getTicks();
+
+private:
+  float mFps;
+  bool mWatermark;
+  uint32_t mWidth;
+  uint32_t mHeight;
+  Minicap::Format mFormat;
+  uint32_t mBpp;
+  uint32_t mStallAfter;
+  Minicap::FrameAvailableListener* mListener;
+  std::vector<unsigned char> mData;
+
+  std::thread mThread;
+  std::atomic<bool> mRunning;
+  std::atomic<uint64_t> mTicks;
+  std::mutex mMutex;
+  std::deque<Watermark::Code> mQueue;
+  uint32_t mSequence;
+  uint32_t mDropped;
+
+  void
+  run();
+
+  void
+  render(const Watermark::Code& code);
+
+  // Same picture as render(), in one of the YUV layouts.
+  void
+  renderYuv(const Watermark::Code& code);
+
+  bool
+  isYuv();
+};
+
+#endif
@@ -0,0 +1,428 @@
+#include "TemplateMatcher.hpp"
+
+#include <math.h>
+#include <string.h>
+
+#include <algorithm>
+
+// How many of the best coarse positions get refined, at most.
+#define MAX_CANDIDATES 64
+
+// How far around the projected position to look on each finer level.
+#define REFINE_RADIUS 2
+
+static bool
+compareScores(const TemplateMatcher::Match& a, const TemplateMatcher::Match& b) {
+  return a.score > b.score;
+}
+
+bool
+TemplateMatcher::Template::set(const unsigned char* data, uint32_t width, uint32_t height) {
+  if (width < MIN_TEMPLATE_SIZE || height < MIN_TEMPLATE_SIZE) {
+    return false;
+  }
+
+  std::vector<Level> levels;
+  LumaImage image;
+  LumaImage half;
+
+  image.resize(width, height);
+  std::copy(data, data + image.data.size(), image.data.begin());
+
+  while (levels.size() < MAX_LEVELS) {
+    Level level;
+    size_t count = image.data.size();
+    int64_t total = 0;
+
+    for (size_t i = 0; i < count; ++i) {
+      total += image.data[i];
+    }
+
+    int16_t mean = (total + count / 2) / count;
+    int64_t sumSq = 0;
+
+    level.width = image.width;
+    level.height = image.height;
+    level.values.resize(count);
+    level.sum = 0;
+
+    for (size_t i = 0; i < count; ++i) {
+      int16_t value = image.data[i] - mean;
+      level.values[i] = value;
+      level.sum += value;
+      sumSq += value * value;
+    }
+
+    level.variance = sumSq - static_cast<double>(level.sum) * level.sum / count;
+
+    // A flat level can't be correlated with anything. Fine details may
+    // well vanish on coarser levels, so only the first one has to have
+    // some contrast.
+    if (level.variance < 1.0) {
+      if (levels.empty()) {
+        return false;
+      }
+      break;
+    }
+
+    levels.push_back(level);
+
+    uint32_t halfWidth = image.width / 2;
+    uint32_t halfHeight = image.height / 2;
+
+    if (halfWidth < MIN_TEMPLATE_SIZE || halfHeight < MIN_TEMPLATE_SIZE ||
+        halfWidth * halfHeight < MIN_TEMPLATE_PIXELS) {
+      break;
+    }
+
+    LumaImage::halve(image, half);
+    std::swap(image, half);
+  }
+
+  mLevels.swap(levels);
+
+  return true;
+}
+
+uint32_t
+TemplateMatcher::Template::getWidth() const {
+  return mLevels.empty() ? 0 : mLevels[0].width;
+}
+
+uint32_t
+TemplateMatcher::Template::getHeight() const {
+  return mLevels.empty() ? 0 : mLevels[0].height;
+}
+
+size_t
+TemplateMatcher::Template::getMemoryUsage() const {
+  size_t size = 0;
+
+  for (size_t i = 0; i < mLevels.size(); ++i) {
+    size += mLevels[i].values.capacity() * sizeof(int16_t);
+  }
+
+  return size;
+}
+
+TemplateMatcher::TemplateMatcher()
+  : mImage(NULL),
+    mGeneration(0),
+    mBuiltLevels(0)
+{
+}
+
+void
+TemplateMatcher::setImage(const LumaImage* image, uint64_t generation) {
+  if (image != mImage || generation != mGeneration) {
+    mImage = image;
+    mGeneration = generation;
+    mBuiltLevels = 0;
+  }
+}
+
+const LumaImage&
+TemplateMatcher::getLevel(size_t level) {
+  if (level == 0) {
+    return *mImage;
+  }
+
+  if (mLevels.size() < MAX_LEVELS) {
+    mLevels.resize(MAX_LEVELS);
+  }
+
+  while (mBuiltLevels < level) {
+    mBuiltLevels += 1;
+    LumaImage::halve(mBuiltLevels == 1 ? *mImage : mLevels[mBuiltLevels - 1],
+      mLevels[mBuiltLevels]);
+  }
+
+  return mLevels[level];
+}
+
+// Works out the range of template positions on the given level that keep
+// the template inside the region. Returns false if there are none.
+static bool
+getBounds(const TemplateMatcher::Region& region, size_t level, uint32_t width,
+    uint32_t height, int64_t* x0, int64_t* y0, int64_t* x1, int64_t* y1) {
+  *x0 = region.x >> level;
+  *y0 = region.y >> level;
+  *x1 = static_cast<int64_t>((region.x + region.width) >> level) - width;
+  *y1 = static_cast<int64_t>((region.y + region.height) >> level) - height;
+
+  return *x1 >= *x0 && *y1 >= *y0;
+}
+
+float
+TemplateMatcher::correlate(uint64_t sum, uint64_t sumSq, int64_t dot, const Template::Level& tmpl) {
+  double count = static_cast<double>(tmpl.width) * tmpl.height;
+  double variance = sumSq - static_cast<double>(sum) * sum / count;
+
+  if (variance < 1.0) {
+    return 0;
+  }
+
+  double covariance = dot - static_cast<double>(sum) * tmpl.sum / count;
+
+  return covariance / sqrt(variance * tmpl.variance);
+}
+
+float
+TemplateMatcher::score(const LumaImage& image, const Template::Level& tmpl, uint32_t x, uint32_t y) {
+  uint64_t sum = 0;
+  uint64_t sumSq = 0;
+  int64_t dot = 0;
+
+  for (uint32_t r = 0; r < tmpl.height; ++r) {
+    const unsigned char* row = image.data.data() + (y + r) * image.width + x;
+    const int16_t* values = tmpl.values.data() + r * tmpl.width;
+    uint32_t rowSum = 0;
+    uint32_t rowSumSq = 0;
+    int32_t rowDot = 0;
+
+    // Only runs for the few positions refine() looks at. GCC vectorizes
+    // it 16 pixels at a time, so the coarse levels of small templates,
+    // which are narrower than that, never get past the scalar remainder.
+    for (uint32_t i = 0; i < tmpl.width; ++i) {
+      uint32_t value = row[i];
+      rowSum += value;
+      rowSumSq += value * value;
+      rowDot += static_cast<int32_t>(value) * values[i];
+    }
+
+    sum += rowSum;
+    sumSq += rowSumSq;
+    dot += rowDot;
+  }
+
+  return correlate(sum, sumSq, dot, tmpl);
+}
+
+void
+TemplateMatcher::scan(const LumaImage& image, const Template::Level& tmpl, int64_t x0, int64_t y0,
+    int64_t cols, int64_t rows, float* scores) {
+  size_t span = cols + tmpl.width - 1;
+  const unsigned char* origin = image.data.data() + y0 * image.width + x0;
+
+  mDots.resize(cols);
+  mRowDots.resize(cols);
+  mColumnSums.assign(span, 0);
+  mColumnSquares.assign(span, 0);
+
+  int64_t* dots = mDots.data();
+  int32_t* rowDots = mRowDots.data();
+  uint32_t* columnSums = mColumnSums.data();
+  uint32_t* columnSquares = mColumnSquares.data();
+
+  // Sums over each column of the template's height, moved down a row at a
+  // time. Wrapping around in between is fine, the results never do.
+  for (uint32_t r = 0; r < tmpl.height; ++r) {
+    const unsigned char* row = origin + r * image.width;
+
+    for (size_t x = 0; x < span; ++x) {
+      columnSums[x] += row[x];
+      columnSquares[x] += row[x] * row[x];
+    }
+  }
+
+  for (int64_t y = 0; y < rows; ++y) {
+    const unsigned char* top = origin + y * image.width;
+
+    if (y > 0) {
+      const unsigned char* removed = top - image.width;
+      const unsigned char* added = top + (tmpl.height - 1) * image.width;
+
+      for (size_t x = 0; x < span; ++x) {
+        columnSums[x] += added[x] - removed[x];
+        columnSquares[x] += added[x] * added[x] - removed[x] * removed[x];
+      }
+    }
+
+    // The products for a whole row of positions at once, one template
+    // pixel at a time. Unlike going position by position, the inner loop
+    // runs over the row of positions, however narrow the template is.
+    memset(dots, 0, cols * sizeof(int64_t));
+
+    for (uint32_t r = 0; r < tmpl.height; ++r) {
+      const unsigned char* row = top + r * image.width;
+      const int16_t* values = tmpl.values.data() + r * tmpl.width;
+
+      memset(rowDots, 0, cols * sizeof(int32_t));
+
+      for (uint32_t i = 0; i < tmpl.width; ++i) {
+        const unsigned char* pixels = row + i;
+        int32_t value = values[i];
+
+        for (int64_t x = 0; x < cols; ++x) {
+          rowDots[x] += pixels[x] * value;
+        }
+      }
+
+      for (int64_t x = 0; x < cols; ++x) {
+        dots[x] += rowDots[x];
+      }
+    }
+
+    uint64_t sum = 0;
+    uint64_t sumSq = 0;
+
+    for (uint32_t x = 0; x + 1 < tmpl.width; ++x) {
+      sum += columnSums[x];
+      sumSq += columnSquares[x];
+    }
+
+    for (int64_t x = 0; x < cols; ++x) {
+      sum += columnSums[x + tmpl.width - 1];
+      sumSq += columnSquares[x + tmpl.width - 1];
+
+      scores[y * cols + x] = correlate(sum, sumSq, dots[x], tmpl);
+
+      sum -= columnSums[x];
+      sumSq -= columnSquares[x];
+    }
+  }
+}
+
+void
+TemplateMatcher::refine(const LumaImage& image, const Template::Level& tmpl, int64_t x0, int64_t y0,
+    int64_t x1, int64_t y1, Match& best) {
+  best.score = -2;
+
+  for (int64_t y = y0; y <= y1; ++y) {
+    for (int64_t x = x0; x <= x1; ++x) {
+      float value = score(image, tmpl, x, y);
+
+      if (value > best.score) {
+        best.x = x;
+        best.y = y;
+        best.score = value;
+      }
+    }
+  }
+}
+
+void
+TemplateMatcher::match(const Template& tmpl, Region region, float minScore, size_t maxResults,
+    std::vector<Match>& matches) {
+  matches.clear();
+
+  if (mImage == NULL || tmpl.mLevels.empty() || maxResults == 0) {
+    return;
+  }
+
+  if (region.width == 0 || region.height == 0) {
+    region.x = 0;
+    region.y = 0;
+    region.width = mImage->width;
+    region.height = mImage->height;
+  }
+
+  if (region.x >= mImage->width || region.y >= mImage->height) {
+    return;
+  }
+
+  region.width = std::min(region.width, mImage->width - region.x);
+  region.height = std::min(region.height, mImage->height - region.y);
+
+  // Start on the coarsest level that the region still has room for.
+  size_t top = tmpl.mLevels.size() - 1;
+  int64_t x0, y0, x1, y1;
+
+  while (!getBounds(region, top, tmpl.mLevels[top].width, tmpl.mLevels[top].height,
+      &x0, &y0, &x1, &y1)) {
+    if (top == 0) {
+      return;
+    }
+    top -= 1;
+  }
+
+  // Score every position on the coarse level.
+  const LumaImage& coarse = getLevel(top);
+  const Template::Level& coarseTmpl = tmpl.mLevels[top];
+  int64_t cols = x1 - x0 + 1;
+  int64_t rows = y1 - y0 + 1;
+
+  mScores.resize(cols * rows);
+  scan(coarse, coarseTmpl, x0, y0, cols, rows, mScores.data());
+
+  // Local maxima are our candidates.
+  std::vector<Match> candidates;
+
+  for (int64_t y = 0; y < rows; ++y) {
+    for (int64_t x = 0; x < cols; ++x) {
+      float value = mScores[y * cols + x];
+      bool peak = value > 0;
+
+      for (int64_t ny = std::max<int64_t>(y - 1, 0); peak && ny <= std::min(y + 1, rows - 1); ++ny) {
+        for (int64_t nx = std::max<int64_t>(x - 1, 0); nx <= std::min(x + 1, cols - 1); ++nx) {
+          if (mScores[ny * cols + nx] > value) {
+            peak = false;
+            break;
+          }
+        }
+      }
+
+      if (peak) {
+        Match candidate;
+        candidate.x = x0 + x;
+        candidate.y = y0 + y;
+        candidate.score = value;
+        candidates.push_back(candidate);
+      }
+    }
+  }
+
+  // There are usually thousands of them, but only the best few matter.
+  size_t keep = std::min<size_t>(std::max<size_t>(16, maxResults * 4), MAX_CANDIDATES);
+  keep = std::min(keep, candidates.size());
+
+  std::partial_sort(candidates.begin(), candidates.begin() + keep, candidates.end(),
+    compareScores);
+  candidates.resize(keep);
+
+  // Follow each candidate down to full resolution.
+  for (size_t i = 0; i < candidates.size(); ++i) {
+    Match& candidate = candidates[i];
+
+    for (size_t level = top; level-- > 0;) {
+      const Template::Level& levelTmpl = tmpl.mLevels[level];
+
+      getBounds(region, level, levelTmpl.width, levelTmpl.height, &x0, &y0, &x1, &y1);
+
+      int64_t cx = static_cast<int64_t>(candidate.x) * 2;
+      int64_t cy = static_cast<int64_t>(candidate.y) * 2;
+
+      refine(getLevel(level), levelTmpl,
+        std::max(cx - REFINE_RADIUS, x0), std::max(cy - REFINE_RADIUS, y0),
+        std::min(cx + REFINE_RADIUS, x1), std::min(cy + REFINE_RADIUS, y1),
+        candidate);
+    }
+  }
+
+  std::sort(candidates.begin(), candidates.end(), compareScores);
+
+  // Several candidates may well have ended up on the same spot.
+  uint32_t width = tmpl.getWidth();
+  uint32_t height = tmpl.getHeight();
+
+  for (size_t i = 0; i < candidates.size() && matches.size() < maxResults; ++i) {
+    const Match& candidate = candidates[i];
+    bool overlaps = false;
+
+    if (candidate.score < minScore) {
+      break;
+    }
+
+    for (size_t j = 0; j < matches.size(); ++j) {
+      if (std::abs(static_cast<int64_t>(matches[j].x) - candidate.x) < width / 2 &&
+          std::abs(static_cast<int64_t>(matches[j].y) - candidate.y) < height / 2) {
+        overlaps = true;
+        break;
+      }
+    }
+
+    if (!overlaps) {
+      matches.push_back(candidate);
+    }
+  }
+}
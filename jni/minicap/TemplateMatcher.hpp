@@ -0,0 +1,119 @@
+#ifndef MINICAP_TEMPLATE_MATCHER_HPP
+#define MINICAP_TEMPLATE_MATCHER_HPP
+
+#include <stdint.h>
+
+#include <vector>
+
+#include "LumaImage.hpp"
+
+// Finds occurrences of small grayscale templates in a frame using
+// normalized cross-correlation. The whole search area is only scanned on
+// a coarse level of an image pyramid; candidates found there are then
+// refined level by level in small windows.
+class TemplateMatcher {
+public:
+  static const uint32_t MAX_LEVELS = 5;
+
+  // Templates are shrunk for the coarse levels, but they have to keep at
+  // least this many pixels (and a few on each side) to still say something.
+  static const uint32_t MIN_TEMPLATE_SIZE = 4;
+  static const uint32_t MIN_TEMPLATE_PIXELS = 64;
+
+  class Template {
+  public:
+    // Returns false if the template is too small or completely flat, in
+    // which case the correlation would be meaningless.
+    bool
+    set(const unsigned char* data, uint32_t width, uint32_t height);
+
+    uint32_t
+    getWidth() const;
+
+    uint32_t
+    getHeight() const;
+
+    // Bytes held for all levels.
+    size_t
+    getMemoryUsage() const;
+
+  private:
+    friend class TemplateMatcher;
+
+    struct Level {
+      uint32_t width;
+      uint32_t height;
+      // Pixel values minus their (rounded) mean, which keeps the products
+      // small and the inner loop in 16 bits.
+      std::vector<int16_t> values;
+      int64_t sum;
+      double variance;
+    };
+
+    std::vector<Level> mLevels;
+  };
+
+  struct Region {
+    uint32_t x;
+    uint32_t y;
+    uint32_t width;
+    uint32_t height;
+  };
+
+  struct Match {
+    uint32_t x;
+    uint32_t y;
+    float score;
+  };
+
+  TemplateMatcher();
+
+  // Sets the image to search in. Coarser levels are only rebuilt when the
+  // generation changes. The image must stay alive while it's being used.
+  void
+  setImage(const LumaImage* image, uint64_t generation);
+
+  // Looks for the template within the region, which is clipped to the
+  // image. Up to maxResults non-overlapping matches scoring at least
+  // minScore (-1.0 to 1.0) are returned, best first.
+  void
+  match(const Template& tmpl, Region region, float minScore, size_t maxResults,
+    std::vector<Match>& matches);
+
+private:
+  const LumaImage* mImage;
+  uint64_t mGeneration;
+  std::vector<LumaImage> mLevels;
+  size_t mBuiltLevels;
+  std::vector<float> mScores;
+
+  // Per row scratch space for scan().
+  std::vector<int64_t> mDots;
+  std::vector<int32_t> mRowDots;
+  std::vector<uint32_t> mColumnSums;
+  std::vector<uint32_t> mColumnSquares;
+
+  const LumaImage&
+  getLevel(size_t level);
+
+  // The correlation from the sums over the image pixels under the template.
+  static float
+  correlate(uint64_t sum, uint64_t sumSq, int64_t dot, const Template::Level& tmpl);
+
+  static float
+  score(const LumaImage& image, const Template::Level& tmpl, uint32_t x, uint32_t y);
+
+  // Scores the template at all positions in [x0, x0 + cols) x [y0, y0 + rows)
+  // into scores, with the same results as score() for each of them.
+  void
+  scan(const LumaImage& image, const Template::Level& tmpl, int64_t x0, int64_t y0,
+    int64_t cols, int64_t rows, float* scores);
+
+  // Scores the template at all positions in [x0, x1] x [y0, y1] and keeps
+  // the best one.
+  void
+  refine(const LumaImage& image, const Template::Level& tmpl, int64_t x0, int64_t y0,
+    int64_t x1, int64_t y1, Match& best);
+};
+
+#endif
@@ -0,0 +1,84 @@
+#include "TileWalker.hpp"
+
+// Small enough to stay in L2 on the little cores of most phones, even
+// with kernels keeping some state of their own.
+#define DEFAULT_TILE_SIZE (64 * 1024)
+
+TileWalker::TileWalker()
+  : mTileSize(DEFAULT_TILE_SIZE),
+    mPasses(0)
+{
+}
+
+void
+TileWalker::addKernel(TileKernel* kernel) {
+  mKernels.push_back(kernel);
+}
+
+void
+TileWalker::clearKernels() {
+  mKernels.clear();
+}
+
+bool
+TileWalker::hasKernels() {
+  return !mKernels.empty();
+}
+
+void
+TileWalker::setTileSize(size_t bytes) {
+  mTileSize = bytes;
+}
+
+uint64_t
+TileWalker::getPasses() {
+  return mPasses;
+}
+
+void
+TileWalker::walk(const Minicap::Frame* frame, bool fused) {
+  mActive.clear();
+
+  for (size_t i = 0; i < mKernels.size(); ++i) {
+    if (mKernels[i]->beginFrame(frame)) {
+      mActive.push_back(mKernels[i]);
+    }
+  }
+
+  if (mActive.empty()) {
+    return;
+  }
+
+  if (fused) {
+    walkTiles(frame, mActive.data(), mActive.size());
+  }
+  else {
+    for (size_t i = 0; i < mActive.size(); ++i) {
+      walkTiles(frame, &mActive[i], 1);
+    }
+  }
+
+  for (size_t i = 0; i < mActive.size(); ++i) {
+    mActive[i]->endFrame(frame);
+  }
+}
+
+void
+TileWalker::walkTiles(const Minicap::Frame* frame, TileKernel** kernels, size_t count) {
+  size_t rowSize = frame->stride * frame->bpp;
+  uint32_t rows = rowSize > 0 ? mTileSize / rowSize : 0;
+
+  if (rows == 0) {
+    rows = 1;
+  }
+
+  for (uint32_t y0 = 0; y0 < frame->height; y0 += rows) {
+    uint32_t y1 = y0 + rows < frame->height ? y0 + rows : frame->height;
+
+    for (size_t i = 0; i < count; ++i) {
+      kernels[i]->processTile(frame, y0, y1);
+    }
+  }
+
+  mPasses += 1;
+}
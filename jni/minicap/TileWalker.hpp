@@ -0,0 +1,71 @@
+#ifndef MINICAP_TILE_WALKER_HPP
+#define MINICAP_TILE_WALKER_HPP
+
+#include <vector>
+
+#include "Minicap.hpp"
+
+// A per-frame analysis that can be run by TileWalker.
+class TileKernel {
+public:
+  virtual
+  ~TileKernel() {}
+
+  // Called before the first tile of a frame. Returning false leaves the
+  // kernel out for this frame.
+  virtual bool
+  beginFrame(const Minicap::Frame* frame) = 0;
+
+  // Processes rows [y0, y1) of the frame. Tiles are always passed in order,
+  // top to bottom, and together they cover the whole frame.
+  virtual void
+  processTile(const Minicap::Frame* frame, uint32_t y0, uint32_t y1) = 0;
+
+  // Called after the last tile of a frame.
+  virtual void
+  endFrame(const Minicap::Frame* /* frame */) {
+  }
+};
+
+// Runs all registered kernels over a frame in a single pass. The frame is
+// cut into full-width tiles small enough to stay in cache, and every kernel
+// processes a tile before moving on to the next one. This way frame memory
+// is only streamed in from DRAM once, however many kernels there are.
+class TileWalker {
+public:
+  TileWalker();
+
+  void
+  addKernel(TileKernel* kernel);
+
+  void
+  clearKernels();
+
+  bool
+  hasKernels();
+
+  // Walks the frame once for all kernels. If fused is false, each kernel
+  // walks the frame separately instead, which is only useful to measure
+  // the difference.
+  void
+  walk(const Minicap::Frame* frame, bool fused = true);
+
+  // Target size of a tile in bytes.
+  void
+  setTileSize(size_t bytes);
+
+  // Total number of full passes over frame memory made so far.
+  uint64_t
+  getPasses();
+
+private:
+  std::vector<TileKernel*> mKernels;
+  std::vector<TileKernel*> mActive;
+  size_t mTileSize;
+  uint64_t mPasses;
+
+  void
+  walkTiles(const Minicap::Frame* frame, TileKernel** kernels, size_t count);
+};
+
+#endif
@@ -0,0 +1,380 @@
+#include "UdpTransport.hpp"
+
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "util/debug.h"
+#include "util/pump.hpp"
+
+// Peers have to say hello at least this often or they'll be forgotten.
+#define PEER_TIMEOUT_MS 5000
+
+// How many datagrams to hand to the kernel at once.
+#define SEND_BATCH_SIZE 64
+
+// Older NDK platform headers don't know about sendmmsg() even though the
+// kernel has supported it for ages, so we bring our own.
+struct udp_mmsghdr {
+  struct msghdr msg_hdr;
+  unsigned int msg_len;
+};
+
+static int
+send_multiple(int fd, struct udp_mmsghdr* msgs, unsigned int count) {
+#ifdef __NR_sendmmsg
+  int sent = syscall(__NR_sendmmsg, fd, msgs, count, MSG_NOSIGNAL);
+  if (sent >= 0 || errno != ENOSYS) {
+    return sent;
+  }
+#endif
+
+  for (unsigned int i = 0; i < count; ++i) {
+    if (sendmsg(fd, &msgs[i].msg_hdr, MSG_NOSIGNAL) < 0) {
+      return i > 0 ? i : -1;
+    }
+  }
+
+  return count;
+}
+
+static void
+send_all(int fd, struct udp_mmsghdr* msgs, unsigned int count) {
+  while (count > 0) {
+    int sent = send_multiple(fd, msgs, count);
+
+    if (sent < 0) {
+      MCWARN("Unable to send UDP fragments");
+      return;
+    }
+
+    msgs += sent;
+    count -= sent;
+  }
+}
+
+UdpTransport::UdpTransport()
+  : mFd(-1),
+    mPayloadSize(DEFAULT_MTU - HEADER_SIZE),
+    mFecGroup(0),
+    mLossRate(0),
+    mSequence(0)
+{
+}
+
+UdpTransport::~UdpTransport() {
+  if (mFd >= 0) {
+    ::close(mFd);
+  }
+}
+
+bool
+UdpTransport::start(const char* address, uint16_t port, unsigned int mtu, unsigned int fecGroup) {
+  if (mtu <= HEADER_SIZE || mtu > 65507 || fecGroup > 255) {
+    return false;
+  }
+
+  int sfd = socket(AF_INET, SOCK_DGRAM, 0);
+
+  if (sfd < 0) {
+    return false;
+  }
+
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+
+  if (inet_pton(AF_INET, address, &addr.sin_addr) != 1) {
+    ::close(sfd);
+    return false;
+  }
+
+  if (::bind(sfd, (struct sockaddr*) &addr, sizeof(addr)) < 0) {
+    ::close(sfd);
+    return false;
+  }
+
+  // A whole frame goes out in one burst, so make room for it.
+  int sndbuf = 4 * 1024 * 1024;
+  setsockopt(sfd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+
+  mFd = sfd;
+  mPayloadSize = mtu - HEADER_SIZE;
+  mFecGroup = fecGroup;
+
+  return true;
+}
+
+int
+UdpTransport::getFd() {
+  return mFd;
+}
+
+void
+UdpTransport::setBanner(const unsigned char* banner, size_t size) {
+  mBanner.assign(1, (char) PACKET_BANNER);
+  mBanner.append(reinterpret_cast<const char*>(banner), size);
+}
+
+void
+UdpTransport::setLossRate(unsigned int percent) {
+  mLossRate = percent > 100 ? 100 : percent;
+}
+
+void
+UdpTransport::setTokens(const std::vector<uint64_t>& tokens) {
+  mTokens = tokens;
+
+  for (size_t i = mPeers.size(); i-- > 0;) {
+    if (!isValidToken(mPeers[i].token)) {
+      MCINFO("UDP peer %s:%d lost its session", inet_ntoa(mPeers[i].addr.sin_addr),
+        ntohs(mPeers[i].addr.sin_port));
+      mPeers.erase(mPeers.begin() + i);
+    }
+  }
+}
+
+bool
+UdpTransport::hasPeers() {
+  expirePeers();
+  return !mPeers.empty();
+}
+
+void
+UdpTransport::handleReadable() {
+  unsigned char buffer[2048];
+  struct sockaddr_in addr;
+  socklen_t addrLen;
+  ssize_t len;
+
+  while (addrLen = sizeof(addr), (len = recvfrom(mFd, buffer, sizeof(buffer), MSG_DONTWAIT,
+      (struct sockaddr*) &addr, &addrLen)) > 0) {
+    Peer* peer = findPeer(addr);
+
+    switch (buffer[0]) {
+    case PACKET_HELLO:
+      // Hellos without a valid token are dropped without an answer, as
+      // the source address could be anyone's.
+      if (len < (ssize_t) HELLO_SIZE || !isValidToken(getUInt64LE(buffer + 4))) {
+        break;
+      }
+
+      if (peer == NULL) {
+        MCINFO("New UDP peer %s:%d", inet_ntoa(addr.sin_addr), ntohs(addr.sin_port));
+        Peer newPeer;
+        newPeer.addr = addr;
+        mPeers.push_back(newPeer);
+        peer = &mPeers.back();
+      }
+
+      peer->token = getUInt64LE(buffer + 4);
+      peer->lastSeen = Clock::now();
+
+      // Every hello gets a banner so that a lost one doesn't matter.
+      sendBanner(addr);
+      break;
+    case PACKET_NACK:
+      if (peer != NULL) {
+        peer->lastSeen = Clock::now();
+        handleNack(addr, buffer, len);
+      }
+      break;
+    case PACKET_BYE:
+      if (peer != NULL) {
+        MCINFO("UDP peer %s:%d said bye", inet_ntoa(addr.sin_addr), ntohs(addr.sin_port));
+        mPeers.erase(mPeers.begin() + (peer - mPeers.data()));
+      }
+      break;
+    default:
+      break;
+    }
+  }
+}
+
+void
+UdpTransport::sendFrame(const unsigned char* data, size_t size) {
+  mSequence += 1;
+  mFrame.assign(reinterpret_cast<const char*>(data), size);
+
+  uint16_t count = getFragmentCount();
+  std::vector<uint16_t> indexes;
+
+  // Interleave the parity fragments so that each one directly follows the
+  // group it protects. That way a receiver can repair a group as soon as
+  // possible.
+  if (mFecGroup > 0) {
+    computeParity();
+  }
+
+  for (uint16_t i = 0; i < count; ++i) {
+    indexes.push_back(i);
+
+    if (mFecGroup > 0 && ((i + 1) % mFecGroup == 0 || i + 1 == count)) {
+      indexes.push_back(count + i / mFecGroup);
+    }
+  }
+
+  std::vector<struct sockaddr_in> peers;
+  for (size_t i = 0; i < mPeers.size(); ++i) {
+    peers.push_back(mPeers[i].addr);
+  }
+
+  sendFragments(indexes, peers.data(), peers.size());
+}
+
+UdpTransport::Peer*
+UdpTransport::findPeer(const struct sockaddr_in& addr) {
+  for (size_t i = 0; i < mPeers.size(); ++i) {
+    if (mPeers[i].addr.sin_addr.s_addr == addr.sin_addr.s_addr &&
+        mPeers[i].addr.sin_port == addr.sin_port) {
+      return &mPeers[i];
+    }
+  }
+
+  return NULL;
+}
+
+void
+UdpTransport::expirePeers() {
+  Clock::time_point now = Clock::now();
+  Clock::duration timeout = std::chrono::milliseconds(PEER_TIMEOUT_MS);
+
+  for (size_t i = mPeers.size(); i-- > 0;) {
+    if (now - mPeers[i].lastSeen > timeout) {
+      MCINFO("UDP peer %s:%d timed out", inet_ntoa(mPeers[i].addr.sin_addr),
+        ntohs(mPeers[i].addr.sin_port));
+      mPeers.erase(mPeers.begin() + i);
+    }
+  }
+}
+
+bool
+UdpTransport::isValidToken(uint64_t token) {
+  return std::find(mTokens.begin(), mTokens.end(), token) != mTokens.end();
+}
+
+void
+UdpTransport::sendBanner(const struct sockaddr_in& addr) {
+  sendto(mFd, mBanner.data(), mBanner.size(), MSG_NOSIGNAL,
+    (const struct sockaddr*) &addr, sizeof(addr));
+}
+
+void
+UdpTransport::handleNack(const struct sockaddr_in& addr, const unsigned char* data, size_t size) {
+  if (size < 12) {
+    return;
+  }
+
+  // Only the newest frame is worth repairing. By the time a NACK for an
+  // older one arrives, the client is better off waiting for the next frame.
+  if (getUInt32LE(data + 4) != mSequence || mFrame.empty()) {
+    return;
+  }
+
+  uint16_t count = getFragmentCount();
+  uint16_t missing = getUInt16LE(data + 8);
+  std::vector<uint16_t> indexes;
+
+  for (uint16_t i = 0; i < missing && 12 + i * 2 + 2 <= (int) size; ++i) {
+    uint16_t index = getUInt16LE(data + 12 + i * 2);
+    if (index < count) {
+      indexes.push_back(index);
+    }
+  }
+
+  sendFragments(indexes, &addr, 1);
+}
+
+uint16_t
+UdpTransport::getFragmentCount() {
+  size_t count = (mFrame.size() + mPayloadSize - 1) / mPayloadSize;
+  return count > 0xFFFF ? 0xFFFF : count;
+}
+
+void
+UdpTransport::computeParity() {
+  uint16_t count = getFragmentCount();
+  size_t groups = (count + mFecGroup - 1) / mFecGroup;
+  const unsigned char* frame = reinterpret_cast<const unsigned char*>(mFrame.data());
+
+  mParity.assign(groups * mPayloadSize, 0);
+
+  for (uint16_t i = 0; i < count; ++i) {
+    unsigned char* parity = mParity.data() + (i / mFecGroup) * mPayloadSize;
+    size_t offset = i * mPayloadSize;
+    size_t length = std::min(mPayloadSize, mFrame.size() - offset);
+
+    for (size_t j = 0; j < length; ++j) {
+      parity[j] ^= frame[offset + j];
+    }
+  }
+}
+
+void
+UdpTransport::sendFragments(const std::vector<uint16_t>& indexes, const struct sockaddr_in* peers, size_t peerCount) {
+  uint16_t count = getFragmentCount();
+  const unsigned char* frame = reinterpret_cast<const unsigned char*>(mFrame.data());
+
+  // Each datagram is a header plus a pointer into the frame (or parity)
+  // data, so payloads are never copied.
+  mHeaders.resize(indexes.size() * HEADER_SIZE);
+  mIovecs.resize(indexes.size() * 2);
+
+  for (size_t i = 0; i < indexes.size(); ++i) {
+    uint16_t index = indexes[i];
+    bool parity = index >= count;
+    unsigned char* header = mHeaders.data() + i * HEADER_SIZE;
+
+    header[0] = parity ? PACKET_PARITY : PACKET_FRAGMENT;
+    header[1] = mFecGroup;
+    putUInt16LE(header + 2, parity ? index - count : index);
+    putUInt32LE(header + 4, mSequence);
+    putUInt16LE(header + 8, count);
+    putUInt16LE(header + 10, mPayloadSize);
+    putUInt32LE(header + 12, mFrame.size());
+
+    mIovecs[i * 2].iov_base = header;
+    mIovecs[i * 2].iov_len = HEADER_SIZE;
+
+    if (parity) {
+      mIovecs[i * 2 + 1].iov_base = mParity.data() + (index - count) * mPayloadSize;
+      mIovecs[i * 2 + 1].iov_len = mPayloadSize;
+    }
+    else {
+      size_t offset = index * mPayloadSize;
+      mIovecs[i * 2 + 1].iov_base = const_cast<unsigned char*>(frame + offset);
+      mIovecs[i * 2 + 1].iov_len = std::min(mPayloadSize, mFrame.size() - offset);
+    }
+  }
+
+  struct udp_mmsghdr msgs[SEND_BATCH_SIZE];
+  unsigned int batched = 0;
+
+  for (size_t p = 0; p < peerCount; ++p) {
+    for (size_t i = 0; i < indexes.size(); ++i) {
+      if (mLossRate > 0 && mRandom() % 100 < mLossRate) {
+        continue;
+      }
+
+      struct udp_mmsghdr* msg = &msgs[batched++];
+      memset(msg, 0, sizeof(*msg));
+      msg->msg_hdr.msg_name = (void*) &peers[p];
+      msg->msg_hdr.msg_namelen = sizeof(peers[p]);
+      msg->msg_hdr.msg_iov = &mIovecs[i * 2];
+      msg->msg_hdr.msg_iovlen = 2;
+
+      if (batched == SEND_BATCH_SIZE) {
+        send_all(mFd, msgs, batched);
+        batched = 0;
+      }
+    }
+  }
+
+  if (batched > 0) {
+    send_all(mFd, msgs, batched);
+  }
+}
@@ -0,0 +1,125 @@
+#ifndef MINICAP_UDP_TRANSPORT_HPP
+#define MINICAP_UDP_TRANSPORT_HPP
+
+#include <netinet/in.h>
+#include <sys/uio.h>
+
+#include <chrono>
+#include <random>
+#include <string>
+#include <vector>
+
+// An optional, lossy alternative to the stream socket. Each encoded frame
+// is split into MTU-sized datagrams. Clients may ask for lost fragments of
+// the newest frame to be sent again, but anything older than that is given
+// up on, so a single lost packet can never stall the stream for long.
+// Only peers that know the token of a stream socket session are answered,
+// so that spoofed hellos can't turn us into a traffic amplifier.
+class UdpTransport {
+public:
+  enum PacketType {
+    PACKET_BANNER   = 0x01,
+    PACKET_FRAGMENT = 0x02,
+    PACKET_PARITY   = 0x03,
+    PACKET_HELLO    = 0x10,
+    PACKET_NACK     = 0x11,
+    PACKET_BYE      = 0x12,
+  };
+
+  static const size_t HEADER_SIZE = 16;
+  static const size_t HELLO_SIZE = 12;
+  static const unsigned int DEFAULT_MTU = 1400;
+
+  UdpTransport();
+
+  ~UdpTransport();
+
+  // Binds to the given IPv4 address and port. Fragments are sized so that
+  // whole datagrams, including our header, fit into the given MTU. If
+  // fecGroup is non-zero, an XOR parity fragment is sent after every
+  // fecGroup fragments.
+  bool
+  start(const char* address, uint16_t port, unsigned int mtu, unsigned int fecGroup);
+
+  int
+  getFd();
+
+  void
+  setBanner(const unsigned char* banner, size_t size);
+
+  // Drops the given percentage of outgoing datagrams on purpose. Only
+  // useful for testing loss recovery.
+  void
+  setLossRate(unsigned int percent);
+
+  // Sets the session tokens that hellos are accepted with. Peers that
+  // registered with a token that's no longer among them are forgotten.
+  void
+  setTokens(const std::vector<uint64_t>& tokens);
+
+  bool
+  hasPeers();
+
+  // Handles incoming datagrams. Call when getFd() is readable.
+  void
+  handleReadable();
+
+  // Fragments the frame and sends it to all peers.
+  void
+  sendFrame(const unsigned char* data, size_t size);
+
+private:
+  typedef std::chrono::steady_clock Clock;
+
+  struct Peer {
+    struct sockaddr_in addr;
+    uint64_t token;
+    Clock::time_point lastSeen;
+  };
+
+  int mFd;
+  size_t mPayloadSize;
+  unsigned int mFecGroup;
+  unsigned int mLossRate;
+  std::minstd_rand mRandom;
+  std::string mBanner;
+  std::vector<uint64_t> mTokens;
+  std::vector<Peer> mPeers;
+
+  // The newest frame, kept around for retransmission.
+  uint32_t mSequence;
+  std::string mFrame;
+  std::vector<unsigned char> mParity;
+
+  // Scratch space for building batches of datagrams.
+  std::vector<unsigned char> mHeaders;
+  std::vector<struct iovec> mIovecs;
+
+  Peer*
+  findPeer(const struct sockaddr_in& addr);
+
+  void
+  expirePeers();
+
+  bool
+  isValidToken(uint64_t token);
+
+  void
+  sendBanner(const struct sockaddr_in& addr);
+
+  void
+  handleNack(const struct sockaddr_in& addr, const unsigned char* data, size_t size);
+
+  uint16_t
+  getFragmentCount();
+
+  void
+  computeParity();
+
+  // Sends the given fragments (indexes >= getFragmentCount() refer to
+  // parity fragments) of the newest frame to a set of peers.
+  void
+  sendFragments(const std::vector<uint16_t>& indexes, const struct sockaddr_in* peers, size_t peerCount);
+};
+
+#endif
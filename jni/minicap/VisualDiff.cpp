@@ -0,0 +1,221 @@
+#include "VisualDiff.hpp"
+
+#include <string.h>
+
+#include <algorithm>
+
+VisualDiff::Reference::Reference()
+  : mWidth(0),
+    mHeight(0),
+    mReceived(0),
+    mFormat(Minicap::FORMAT_NONE)
+{
+}
+
+void
+VisualDiff::Reference::begin(uint32_t width, uint32_t height) {
+  mWidth = width;
+  mHeight = height;
+  mReceived = 0;
+  mRgb.resize(width * height * 3);
+  mFormat = Minicap::FORMAT_NONE;
+  mPixels.clear();
+}
+
+bool
+VisualDiff::Reference::append(uint32_t offset, const unsigned char* data, size_t size) {
+  if (offset != mReceived || size > mRgb.size() - mReceived) {
+    return false;
+  }
+
+  memcpy(mRgb.data() + mReceived, data, size);
+  mReceived += size;
+
+  return true;
+}
+
+bool
+VisualDiff::Reference::isComplete() const {
+  return mWidth > 0 && mReceived == mRgb.size();
+}
+
+uint32_t
+VisualDiff::Reference::getWidth() const {
+  return mWidth;
+}
+
+uint32_t
+VisualDiff::Reference::getHeight() const {
+  return mHeight;
+}
+
+size_t
+VisualDiff::Reference::getMemoryUsage() const {
+  return mRgb.capacity() + mPixels.capacity();
+}
+
+bool
+VisualDiff::Reference::prepare(Minicap::Format format, uint32_t bpp) {
+  if (format == mFormat) {
+    return true;
+  }
+
+  if (!supportsFormat(format)) {
+    return false;
+  }
+
+  bool bgr = format == Minicap::FORMAT_BGRA_8888;
+  size_t pixels = static_cast<size_t>(mWidth) * mHeight;
+
+  mPixels.resize(pixels * bpp);
+
+  for (size_t i = 0; i < pixels; ++i) {
+    const unsigned char* in = mRgb.data() + i * 3;
+    unsigned char* out = mPixels.data() + i * bpp;
+    out[0] = in[bgr ? 2 : 0];
+    out[1] = in[1];
+    out[2] = in[bgr ? 0 : 2];
+
+    // Alpha is never compared.
+    if (bpp == 4) {
+      out[3] = 0xFF;
+    }
+  }
+
+  mFormat = format;
+
+  return true;
+}
+
+bool
+VisualDiff::supportsFormat(Minicap::Format format) {
+  switch (format) {
+  case Minicap::FORMAT_RGBA_8888:
+  case Minicap::FORMAT_RGBX_8888:
+  case Minicap::FORMAT_RGB_888:
+  case Minicap::FORMAT_BGRA_8888:
+    return true;
+  default:
+    return false;
+  }
+}
+
+bool
+VisualDiff::compare(Reference& ref, const Minicap::Frame* frame, Region region,
+    unsigned char tolerance, uint32_t cellSize, Result* result) {
+  if (ref.mWidth != frame->width || ref.mHeight != frame->height ||
+      !ref.isComplete() || !ref.prepare(frame->format, frame->bpp)) {
+    return false;
+  }
+
+  if (region.width == 0 || region.height == 0) {
+    region.x = 0;
+    region.y = 0;
+    region.width = frame->width;
+    region.height = frame->height;
+  }
+
+  region.x = std::min(region.x, frame->width);
+  region.y = std::min(region.y, frame->height);
+  region.width = std::min(region.width, frame->width - region.x);
+  region.height = std::min(region.height, frame->height - region.y);
+
+  uint32_t bpp = frame->bpp;
+  uint32_t minX = region.width;
+  uint32_t maxX = 0;
+  uint32_t minY = region.height;
+  uint32_t maxY = 0;
+
+  result->mismatched = 0;
+  result->compared = region.width * region.height;
+
+  if (cellSize > 0) {
+    result->maskColumns = (region.width + cellSize - 1) / cellSize;
+    result->maskRows = (region.height + cellSize - 1) / cellSize;
+  }
+  else {
+    result->maskColumns = 0;
+    result->maskRows = 0;
+  }
+
+  result->mask.assign((result->maskColumns * result->maskRows + 7) / 8, 0);
+
+  // Flag every byte that's out of tolerance first, in a byte for byte loop
+  // that GCC vectorizes 16 bytes at a time. Combining the channels of each
+  // pixel happens afterwards.
+  std::vector<unsigned char> flags(region.width * bpp);
+  std::vector<unsigned char> hits(region.width);
+
+  for (uint32_t y = 0; y < region.height; ++y) {
+    size_t offset = ((region.y + y) * frame->stride + region.x) * bpp;
+    const unsigned char* a = static_cast<const unsigned char*>(frame->data) + offset;
+    const unsigned char* b = ref.mPixels.data() +
+      ((region.y + y) * static_cast<size_t>(frame->width) + region.x) * bpp;
+    unsigned char* f = flags.data();
+    size_t bytes = flags.size();
+
+    for (size_t i = 0; i < bytes; ++i) {
+      unsigned char diff = a[i] > b[i] ? a[i] - b[i] : b[i] - a[i];
+      f[i] = diff > tolerance;
+    }
+
+    uint32_t count = 0;
+    unsigned char* h = hits.data();
+
+    // Reading every third or fourth flag doesn't vectorize. With 4 bytes
+    // per pixel, the flags of a pixel are a little endian word instead, and
+    // masking out alpha does.
+    if (bpp == 4) {
+      const uint32_t* words = reinterpret_cast<const uint32_t*>(f);
+
+      for (uint32_t x = 0; x < region.width; ++x) {
+        h[x] = (words[x] & 0x00FFFFFF) != 0;
+        count += h[x];
+      }
+    }
+    else {
+      for (uint32_t x = 0; x < region.width; ++x) {
+        const unsigned char* p = f + x * bpp;
+        h[x] = p[0] | p[1] | p[2];
+        count += h[x];
+      }
+    }
+
+    if (count == 0) {
+      continue;
+    }
+
+    result->mismatched += count;
+    minY = std::min(minY, y);
+    maxY = y;
+
+    for (uint32_t x = 0; x < region.width; ++x) {
+      if (!hits[x]) {
+        continue;
+      }
+
+      minX = std::min(minX, x);
+      maxX = std::max(maxX, x);
+
+      if (cellSize > 0) {
+        uint32_t bit = (y / cellSize) * result->maskColumns + x / cellSize;
+        result->mask[bit / 8] |= 1 << (bit % 8);
+      }
+    }
+  }
+
+  if (result->mismatched > 0) {
+    result->x = region.x + minX;
+    result->y = region.y + minY;
+    result->width = maxX - minX + 1;
+    result->height = maxY - minY + 1;
+  }
+  else {
+    result->x = 0;
+    result->y = 0;
+    result->width = 0;
+    result->height = 0;
+  }
+
+  return true;
+}
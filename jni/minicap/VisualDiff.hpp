@@ -0,0 +1,96 @@
+#ifndef MINICAP_VISUAL_DIFF_HPP
+#define MINICAP_VISUAL_DIFF_HPP
+
+#include <stdint.h>
+
+#include <vector>
+
+#include "Minicap.hpp"
+
+// Compares frames against reference images with a per-channel tolerance,
+// so that visual regression checks can pass or fail without transferring
+// any frames. Besides the number of mismatching pixels, the result holds
+// their bounding box and optionally a coarse mask of where they are.
+class VisualDiff {
+public:
+  class Reference {
+  public:
+    Reference();
+
+    // Starts a new upload of RGB888 pixels.
+    void
+    begin(uint32_t width, uint32_t height);
+
+    // Appends pixel data, which must arrive in order. Returns false if the
+    // offset doesn't continue where the previous chunk ended or the data
+    // doesn't fit.
+    bool
+    append(uint32_t offset, const unsigned char* data, size_t size);
+
+    bool
+    isComplete() const;
+
+    uint32_t
+    getWidth() const;
+
+    uint32_t
+    getHeight() const;
+
+    // Bytes held for the pixels, in both layouts.
+    size_t
+    getMemoryUsage() const;
+
+  private:
+    friend class VisualDiff;
+
+    uint32_t mWidth;
+    uint32_t mHeight;
+    uint32_t mReceived;
+    std::vector<unsigned char> mRgb;
+
+    // The pixels converted to the layout of the frames we compare against,
+    // so that the comparison is a straight byte for byte loop. Rebuilt
+    // only when the format changes.
+    Minicap::Format mFormat;
+    std::vector<unsigned char> mPixels;
+
+    bool
+    prepare(Minicap::Format format, uint32_t bpp);
+  };
+
+  struct Region {
+    uint32_t x;
+    uint32_t y;
+    uint32_t width;
+    uint32_t height;
+  };
+
+  struct Result {
+    uint32_t mismatched;
+    uint32_t compared;
+    // Bounding box of the mismatching pixels, all zero if there are none.
+    uint32_t x;
+    uint32_t y;
+    uint32_t width;
+    uint32_t height;
+    // One bit per cell of cellSize x cellSize pixels of the region, set if
+    // any pixel in it mismatches. Row major, least significant bit first.
+    uint32_t maskColumns;
+    uint32_t maskRows;
+    std::vector<unsigned char> mask;
+  };
+
+  static bool
+  supportsFormat(Minicap::Format format);
+
+  // Compares the region (clipped to the frame, or all of it if empty) of a
+  // packed frame against the same region of the reference. A pixel
+  // mismatches if any of its color channels differs by more than the
+  // tolerance. A cell size of 0 skips the mask. The reference must have the
+  // same size as the frame.
+  static bool
+  compare(Reference& ref, const Minicap::Frame* frame, Region region,
+    unsigned char tolerance, uint32_t cellSize, Result* result);
+};
+
+#endif
@@ -0,0 +1,107 @@
+#include "Watermark.hpp"
+
+#include <string.h>
+#include <time.h>
+
+#define BITS 72
+
+static unsigned char
+crc8(const unsigned char* data, size_t size) {
+  unsigned char crc = 0;
+
+  for (size_t i = 0; i < size; ++i) {
+    crc ^= data[i];
+
+    for (int bit = 0; bit < 8; ++bit) {
+      crc = crc & 0x80 ? (crc << 1) ^ 0x07 : crc << 1;
+    }
+  }
+
+  return crc;
+}
+
+static void
+pack(const Watermark::Code& code, unsigned char* bytes) {
+  for (int i = 0; i < 4; ++i) {
+    bytes[i] = (code.sequence >> (i * 8)) & 0xFF;
+    bytes[4 + i] = (code.time >> (i * 8)) & 0xFF;
+  }
+
+  bytes[8] = crc8(bytes, 8);
+}
+
+void
+Watermark::paint(const Code& code, unsigned char* data, uint32_t stride, uint32_t bpp) {
+  unsigned char bytes[9];
+  pack(code, bytes);
+
+  for (uint32_t bit = 0; bit < BITS; ++bit) {
+    unsigned char value = (bytes[bit / 8] >> (bit % 8)) & 1 ? 0xFF : 0x00;
+    uint32_t x0 = (bit % COLUMNS) * CELL_SIZE;
+    uint32_t y0 = (bit / COLUMNS) * CELL_SIZE;
+
+    for (uint32_t y = y0; y < y0 + CELL_SIZE; ++y) {
+      unsigned char* row = data + (y * stride + x0) * bpp;
+      memset(row, value, CELL_SIZE * bpp);
+    }
+  }
+}
+
+bool
+Watermark::read(const unsigned char* data, uint32_t width, uint32_t height, uint32_t stride,
+    float scale, Code* code) {
+  if (WIDTH * scale > width || HEIGHT * scale > height) {
+    return false;
+  }
+
+  // Average a small area in the middle of each cell, away from the edges
+  // that compression and scaling smear.
+  int radius = CELL_SIZE * scale / 4;
+  unsigned char bytes[9];
+
+  memset(bytes, 0, sizeof(bytes));
+
+  for (uint32_t bit = 0; bit < BITS; ++bit) {
+    int cx = ((bit % COLUMNS) * CELL_SIZE + CELL_SIZE / 2) * scale;
+    int cy = ((bit / COLUMNS) * CELL_SIZE + CELL_SIZE / 2) * scale;
+    uint32_t sum = 0;
+    uint32_t count = 0;
+
+    for (int y = cy - radius; y <= cy + radius; ++y) {
+      for (int x = cx - radius; x <= cx + radius; ++x) {
+        sum += data[y * stride + x];
+        count += 1;
+      }
+    }
+
+    if (sum / count >= 128) {
+      bytes[bit / 8] |= 1 << (bit % 8);
+    }
+  }
+
+  if (crc8(bytes, 8) != bytes[8]) {
+    return false;
+  }
+
+  code->sequence = 0;
+  code->time = 0;
+
+  for (int i = 0; i < 4; ++i) {
+    code->sequence |= static_cast<uint32_t>(bytes[i]) << (i * 8);
+    code->time |= static_cast<uint32_t>(bytes[4 + i]) << (i * 8);
+  }
+
+  return true;
+}
+
+uint32_t
+Watermark::now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return static_cast<uint64_t>(ts.tv_sec) * 1000 + ts.tv_nsec / 1000000;
+}
+
+int32_t
+Watermark::elapsed(uint32_t then, uint32_t now) {
+  return static_cast<int32_t>(now - then);
+}
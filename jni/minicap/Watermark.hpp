@@ -0,0 +1,49 @@
+#ifndef MINICAP_WATERMARK_HPP
+#define MINICAP_WATERMARK_HPP
+
+#include <stdint.h>
+
+// A machine readable code painted into the top left corner of synthetic
+// frames. It carries the frame's sequence number and the time it was
+// produced, and is made of large black and white cells so that it can be
+// read back after scaling and JPG compression. Together, that allows
+// measuring true end-to-end latency and spotting dropped or reordered
+// frames without trusting the protocol.
+class Watermark {
+public:
+  // The code is a grid of COLUMNS x ROWS cells, each CELL_SIZE pixels wide
+  // at full resolution. The bits are the sequence number, the time and a
+  // CRC-8 of both, least significant bit first.
+  static const uint32_t CELL_SIZE = 16;
+  static const uint32_t COLUMNS = 12;
+  static const uint32_t ROWS = 6;
+  static const uint32_t WIDTH = CELL_SIZE * COLUMNS;
+  static const uint32_t HEIGHT = CELL_SIZE * ROWS;
+
+  struct Code {
+    uint32_t sequence;
+    // Milliseconds of CLOCK_REALTIME, truncated to 32 bits.
+    uint32_t time;
+  };
+
+  // Paints the code onto an image with 8-bit channels. The image must be
+  // at least WIDTH x HEIGHT pixels.
+  static void
+  paint(const Code& code, unsigned char* data, uint32_t stride, uint32_t bpp);
+
+  // Reads the code back from a grayscale image that has been scaled by the
+  // given factor. Returns false if there's no valid code.
+  static bool
+  read(const unsigned char* data, uint32_t width, uint32_t height, uint32_t stride,
+    float scale, Code* code);
+
+  // The current time in the same format as Code::time.
+  static uint32_t
+  now();
+
+  // Milliseconds from then until now, correctly handling wraparound.
+  static int32_t
+  elapsed(uint32_t then, uint32_t now);
+};
+
+#endif
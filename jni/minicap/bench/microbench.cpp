@@ -0,0 +1,823 @@
+#include <getopt.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <Minicap.hpp>
+
+#include "util/debug.h"
+#include "util/pump.hpp"
+#include "Banner.hpp"
+#include "FrameConverter.hpp"
+#include "FrameScaler.hpp"
+#include "FrameWaiter.hpp"
+#include "JankMonitor.hpp"
+#include "JpgEncoder.hpp"
+#include "Projection.hpp"
+#include "RegionWatcher.hpp"
+#include "TemplateMatcher.hpp"
+#include "VisualDiff.hpp"
+
+#define DEFAULT_REPETITIONS 50
+#define DEFAULT_WARMUP 5
+#define DEFAULT_SAMPLE_US 2000
+
+// Microbenchmarks for the small pieces on the hot path, so that regressions
+// show up without having to look at end-to-end numbers. Each benchmark is
+// an operation that gets timed in samples of as many iterations as fit into
+// the sample time; the first few samples are thrown away as warmup. All
+// times in the JSON output are nanoseconds per operation.
+
+static void
+usage(const char* pname) {
+  fprintf(stderr,
+    "Usage: %s [-h] [-r <count>] [-w <count>] [-t <us>] [-f <filter>]\n"
+    "  -r <count>:    Number of samples to take. (%d)\n"
+    "  -w <count>:    Number of warmup samples to throw away. (%d)\n"
+    "  -t <us>:       Minimum duration of a sample. (%d)\n"
+    "  -f <filter>:   Only run benchmarks whose name contains this.\n"
+    "  -h:            Show help.\n",
+    pname, DEFAULT_REPETITIONS, DEFAULT_WARMUP, DEFAULT_SAMPLE_US
+  );
+}
+
+// Keeps the compiler from optimizing away work whose result isn't used.
+template <typename T>
+static inline void
+keep(const T& value) {
+  asm volatile("" : : "r,m"(value) : "memory");
+}
+
+typedef std::chrono::steady_clock Clock;
+
+struct Options {
+  unsigned int repetitions;
+  unsigned int warmup;
+  unsigned int sampleUs;
+  std::string filter;
+};
+
+class Suite {
+public:
+  Suite(const Options& options)
+    : mOptions(options), mFirst(true) {
+  }
+
+  bool
+  wants(const std::string& name) {
+    return mOptions.filter.empty() || name.find(mOptions.filter) != std::string::npos;
+  }
+
+  // Times op, which performs a single operation. Bytes is the amount of
+  // data an operation moves, if any, for throughput.
+  void
+  run(const std::string& name, size_t bytes, const std::function<void()>& op) {
+    if (!wants(name)) {
+      return;
+    }
+
+    // Find out how many operations fit into a sample.
+    uint64_t batch = 1;
+
+    while (true) {
+      Clock::time_point start = Clock::now();
+      for (uint64_t i = 0; i < batch; ++i) {
+        op();
+      }
+      uint64_t ns = elapsed(start);
+      uint64_t target = mOptions.sampleUs * static_cast<uint64_t>(1000);
+
+      if (ns >= target || batch >= (static_cast<uint64_t>(1) << 30)) {
+        break;
+      }
+
+      // Aim a little over the target, but grow at least twofold so that
+      // timer resolution can't keep us here for long.
+      batch = ns > 0 ? std::max(batch * 2, batch * target / ns + 1) : batch * 16;
+    }
+
+    std::vector<double> samples;
+
+    for (unsigned int s = 0; s < mOptions.warmup + mOptions.repetitions; ++s) {
+      Clock::time_point start = Clock::now();
+      for (uint64_t i = 0; i < batch; ++i) {
+        op();
+      }
+      double ns = static_cast<double>(elapsed(start)) / batch;
+
+      if (s >= mOptions.warmup) {
+        samples.push_back(ns);
+      }
+    }
+
+    report(name, bytes, batch, samples);
+  }
+
+  // Like run(), but op times itself and returns the nanoseconds spent, for
+  // operations that involve other threads. Every operation is a sample of
+  // its own, as many as fit into the sample time make a repetition.
+  void
+  runTimed(const std::string& name, const std::function<uint64_t()>& op) {
+    if (!wants(name)) {
+      return;
+    }
+
+    std::vector<double> samples;
+    uint64_t target = mOptions.sampleUs * static_cast<uint64_t>(1000);
+
+    for (unsigned int s = 0; s < mOptions.warmup + mOptions.repetitions; ++s) {
+      Clock::time_point start = Clock::now();
+
+      do {
+        uint64_t ns = op();
+
+        if (s >= mOptions.warmup) {
+          samples.push_back(ns);
+        }
+      }
+      while (elapsed(start) < target);
+    }
+
+    report(name, 0, samples.size() / mOptions.repetitions, samples);
+  }
+
+  void
+  begin() {
+    std::cout << "{" << std::endl
+              << "    \"repetitions\": " << mOptions.repetitions << "," << std::endl
+              << "    \"warmup\": " << mOptions.warmup << "," << std::endl
+              << "    \"benchmarks\": [";
+  }
+
+  void
+  end() {
+    std::cout << std::endl
+              << "    ]" << std::endl
+              << "}" << std::endl;
+  }
+
+private:
+  Options mOptions;
+  bool mFirst;
+
+  static uint64_t
+  elapsed(Clock::time_point start) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+  }
+
+  static double
+  percentile(const std::vector<double>& sorted, int p) {
+    return sorted[(sorted.size() - 1) * p / 100];
+  }
+
+  void
+  report(const std::string& name, size_t bytes, uint64_t batch, std::vector<double>& samples) {
+    std::sort(samples.begin(), samples.end());
+
+    double sum = 0;
+    for (size_t i = 0; i < samples.size(); ++i) {
+      sum += samples[i];
+    }
+
+    double mean = sum / samples.size();
+    double median = percentile(samples, 50);
+
+    std::cout.precision(1);
+    std::cout.setf(std::ios_base::fixed, std::ios_base::floatfield);
+
+    std::cout << (mFirst ? "" : ",") << std::endl
+              << "        {"
+              << " \"name\": \"" << name << "\""
+              << ", \"batch\": " << batch
+              << ", \"mean\": " << mean
+              << ", \"min\": " << samples.front()
+              << ", \"p50\": " << median
+              << ", \"p90\": " << percentile(samples, 90)
+              << ", \"p99\": " << percentile(samples, 99)
+              << ", \"max\": " << samples.back();
+
+    if (bytes > 0) {
+      std::cout << ", \"mb_per_s\": " << bytes * 1000.0 / median;
+    }
+
+    std::cout << " }";
+
+    mFirst = false;
+  }
+};
+
+// Round trips through a pair of waiters, so that the reported time is two
+// notify to wake latencies. The main loop waits on the wake pipe with
+// poll(), while the blocking wait is what -s and -t use.
+static void
+bench_frame_waiter(Suite& suite) {
+  for (int viaPoll = 0; viaPoll < 2; ++viaPoll) {
+    std::string name = viaPoll ? "frame_waiter.poll.round_trip" : "frame_waiter.wait.round_trip";
+
+    if (!suite.wants(name)) {
+      continue;
+    }
+
+    FrameWaiter ping;
+    FrameWaiter pong;
+    std::atomic<bool> running(true);
+
+    auto wait = [viaPoll](FrameWaiter& waiter) {
+      if (!viaPoll) {
+        waiter.waitForFrame();
+        return;
+      }
+
+      struct pollfd fds = { waiter.getWakeFd(), POLLIN, 0 };
+
+      while (waiter.tryWaitForFrame() <= 0) {
+        poll(&fds, 1, 100);
+        waiter.drain();
+      }
+    };
+
+    std::thread echo([&]() {
+      while (true) {
+        wait(ping);
+        if (!running) {
+          break;
+        }
+        pong.onFrameAvailable();
+      }
+    });
+
+    suite.runTimed(name, [&]() -> uint64_t {
+      Clock::time_point start = Clock::now();
+      ping.onFrameAvailable();
+      wait(pong);
+      return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+    });
+
+    running = false;
+    ping.onFrameAvailable();
+    echo.join();
+  }
+}
+
+// What monitoring jank adds to every frame arrival, including taking the
+// timestamp. Arrivals come much faster than any refresh here, so they all
+// take the common, smooth path.
+static void
+bench_jank_monitor(Suite& suite) {
+  JankMonitor monitor(60);
+
+  suite.run("jank_monitor.on_frame", 0, [&]() {
+    monitor.onFrame();
+  });
+
+  JankMonitor::Stats stats;
+
+  suite.run("jank_monitor.get_stats", 0, [&]() {
+    monitor.getStats(&stats, false);
+    keep(stats);
+  });
+}
+
+static void
+bench_pumps(Suite& suite) {
+  static const size_t sizes[] = { 4 * 1024, 64 * 1024, 512 * 1024 };
+
+  for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); ++s) {
+    size_t size = sizes[s];
+    char suffix[16];
+    snprintf(suffix, sizeof(suffix), "%uk", static_cast<unsigned int>(size / 1024));
+
+    std::string pumpsName = std::string("pumps.") + suffix;
+    std::string pumpsvName = std::string("pumpsv.packet.") + suffix;
+
+    if (!suite.wants(pumpsName) && !suite.wants(pumpsvName)) {
+      continue;
+    }
+
+    int fds[2];
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+      MCERROR("Unable to create socket pair");
+      return;
+    }
+
+    std::atomic<bool> running(true);
+
+    // Drains the other end as fast as possible, like a well behaved client.
+    std::thread reader([&]() {
+      std::vector<unsigned char> buf(256 * 1024);
+      while (running && recv(fds[1], buf.data(), buf.size(), 0) > 0);
+    });
+
+    std::vector<unsigned char> data(size, 0xAB);
+
+    suite.run(pumpsName, size, [&]() {
+      pumps(fds[0], data.data(), data.size());
+    });
+
+    // Same as a FRAME packet: size and type, sequence number, frame.
+    uint32_t sequence = 0;
+
+    suite.run(pumpsvName, size, [&]() {
+      unsigned char prefix[5];
+      unsigned char header[4];
+      putUInt32LE(prefix, 1 + sizeof(header) + data.size());
+      prefix[4] = 0x01;
+      putUInt32LE(header, ++sequence);
+
+      struct iovec iov[3];
+      iov[0].iov_base = prefix;
+      iov[0].iov_len = sizeof(prefix);
+      iov[1].iov_base = header;
+      iov[1].iov_len = sizeof(header);
+      iov[2].iov_base = data.data();
+      iov[2].iov_len = data.size();
+
+      pumpsv(fds[0], iov, 3);
+    });
+
+    running = false;
+    shutdown(fds[0], SHUT_RDWR);
+    reader.join();
+    close(fds[0]);
+    close(fds[1]);
+  }
+}
+
+static void
+bench_serialization(Suite& suite) {
+  Minicap::DisplayInfo realInfo;
+  Minicap::DisplayInfo desiredInfo;
+  unsigned char banner[Banner::SIZE];
+  uint32_t pid = getpid();
+
+  memset(&realInfo, 0, sizeof(realInfo));
+  realInfo.width = 1080;
+  realInfo.height = 1920;
+  desiredInfo = realInfo;
+  desiredInfo.width = 540;
+  desiredInfo.height = 960;
+
+  suite.run("serialize.banner", 0, [&]() {
+    Banner::write(banner, pid, realInfo, desiredInfo, 0);
+    keep(banner);
+  });
+
+  unsigned char header[13];
+  uint32_t size = 0;
+
+  suite.run("serialize.packet_header", 0, [&]() {
+    putUInt32LE(header, ++size);
+    header[4] = 0x01;
+    putUInt32LE(header + 5, size);
+    putUInt32LE(header + 9, size);
+    keep(header);
+  });
+
+  suite.run("serialize.resume_token", 0, [&]() {
+    putUInt64LE(banner + Banner::TOKEN_OFFSET, ++size * 0x9E3779B97F4A7C15ull);
+    keep(getUInt64LE(banner + Banner::TOKEN_OFFSET));
+  });
+}
+
+static void
+bench_jpg_encoder(Suite& suite) {
+  struct Resolution {
+    uint32_t width;
+    uint32_t height;
+  };
+
+  struct Format {
+    const char* name;
+    Minicap::Format format;
+    uint32_t bpp;
+  };
+
+  static const Resolution resolutions[] = {
+    { 480, 800 },
+    { 720, 1280 },
+    { 1080, 1920 },
+  };
+
+  static const Format formats[] = {
+    { "rgba", Minicap::FORMAT_RGBA_8888, 4 },
+    { "bgra", Minicap::FORMAT_BGRA_8888, 4 },
+    { "rgb", Minicap::FORMAT_RGB_888, 3 },
+  };
+
+  for (size_t r = 0; r < sizeof(resolutions) / sizeof(resolutions[0]); ++r) {
+    for (size_t f = 0; f < sizeof(formats) / sizeof(formats[0]); ++f) {
+      const Resolution& res = resolutions[r];
+      const Format& fmt = formats[f];
+      // std::to_string() is missing from gnustl.
+      char name[64];
+      snprintf(name, sizeof(name), "jpg_encoder.%ux%u.%s", res.width, res.height, fmt.name);
+
+      if (!suite.wants(name)) {
+        continue;
+      }
+
+      // Something that looks a bit like a UI: flat panels, a gradient and
+      // some sharp edges, so that the encoder has a realistic amount of
+      // work to do.
+      std::vector<unsigned char> pixels(res.width * res.height * fmt.bpp);
+
+      for (uint32_t y = 0; y < res.height; ++y) {
+        for (uint32_t x = 0; x < res.width; ++x) {
+          unsigned char* p = pixels.data() + (y * res.width + x) * fmt.bpp;
+          bool text = (y % 40) < 16 && (x % 12) < 2;
+          unsigned char v = y < res.height / 8 ? 0x40 : text ? 0x10 : (y > res.height / 2 ? x * 255 / res.width : 0xF0);
+          p[0] = v;
+          p[1] = v;
+          p[2] = y < res.height / 8 ? 0xC0 : v;
+          if (fmt.bpp == 4) {
+            p[3] = 0xFF;
+          }
+        }
+      }
+
+      Minicap::Frame frame;
+      frame.data = pixels.data();
+      frame.format = fmt.format;
+      frame.width = res.width;
+      frame.height = res.height;
+      frame.stride = res.width;
+      frame.bpp = fmt.bpp;
+      frame.size = pixels.size();
+
+      JpgEncoder encoder(4, 0);
+
+      if (!encoder.reserveData(res.width, res.height)) {
+        MCERROR("Unable to reserve data for JPG encoder");
+        continue;
+      }
+
+      suite.run(name, pixels.size(), [&]() {
+        encoder.encode(&frame, 80);
+      });
+    }
+  }
+}
+
+// Synthetic wide gamut frames down to RGBX_8888. The pixel values don't
+// matter to the kernels, but a gradient keeps the FP16 table lookups from
+// all hitting the same cache line.
+static void
+bench_frame_converter(Suite& suite) {
+  struct Format {
+    const char* name;
+    Minicap::Format format;
+    uint32_t bpp;
+  };
+
+  static const Format formats[] = {
+    { "rgba_1010102", Minicap::FORMAT_RGBA_1010102, 4 },
+    { "rgba_fp16", Minicap::FORMAT_RGBA_FP16, 8 },
+  };
+
+  static const uint32_t width = 1080;
+  static const uint32_t height = 1920;
+
+  for (size_t f = 0; f < sizeof(formats) / sizeof(formats[0]); ++f) {
+    const Format& fmt = formats[f];
+    char name[64];
+    snprintf(name, sizeof(name), "frame_converter.%ux%u.%s", width, height, fmt.name);
+
+    if (!suite.wants(name)) {
+      continue;
+    }
+
+    std::vector<unsigned char> pixels(width * height * fmt.bpp);
+
+    for (uint32_t y = 0; y < height; ++y) {
+      for (uint32_t x = 0; x < width; ++x) {
+        unsigned char* p = pixels.data() + (y * width + x) * fmt.bpp;
+        uint32_t v = (x + y) & 0x3FF;
+
+        if (fmt.format == Minicap::FORMAT_RGBA_1010102) {
+          uint32_t word = v | (v << 10) | ((1023 - v) << 20) | (3u << 30);
+          memcpy(p, &word, 4);
+        }
+        else {
+          // Half floats from 0 to a little under 1.
+          uint16_t half[4] = {
+            static_cast<uint16_t>(0x2000 + v * 7),
+            static_cast<uint16_t>(0x2000 + v * 7),
+            static_cast<uint16_t>(0x3BFF - v * 7),
+            0x3C00,
+          };
+          memcpy(p, half, 8);
+        }
+      }
+    }
+
+    Minicap::Frame frame;
+    frame.data = pixels.data();
+    frame.format = fmt.format;
+    frame.width = width;
+    frame.height = height;
+    frame.stride = width;
+    frame.bpp = fmt.bpp;
+    frame.size = pixels.size();
+
+    FrameConverter converter;
+    Minicap::Frame converted;
+
+    suite.run(name, pixels.size(), [&]() {
+      converter.convert(&frame, &converted);
+      keep(converted.data);
+    });
+  }
+}
+
+// Box filter from a 1080p frame to a 720p viewport, the most common way
+// down. Every source byte goes through the row sum loop once.
+static void
+bench_frame_scaler(Suite& suite) {
+  static const uint32_t width = 1080;
+  static const uint32_t height = 1920;
+  char name[64];
+  snprintf(name, sizeof(name), "frame_scaler.%ux%u.720x1280.rgba", width, height);
+
+  if (!suite.wants(name)) {
+    return;
+  }
+
+  std::vector<unsigned char> pixels(width * height * 4);
+
+  for (size_t i = 0; i < pixels.size(); ++i) {
+    pixels[i] = i * 7 + (i >> 12);
+  }
+
+  Minicap::Frame frame;
+  frame.data = pixels.data();
+  frame.format = Minicap::FORMAT_RGBA_8888;
+  frame.width = width;
+  frame.height = height;
+  frame.stride = width;
+  frame.bpp = 4;
+  frame.size = pixels.size();
+
+  FrameScaler scaler;
+  Minicap::Frame scaled;
+  scaler.setTargetSize(720, 1280);
+
+  suite.run(name, pixels.size(), [&]() {
+    scaler.scale(&frame, &scaled);
+    keep(scaled.data);
+  });
+}
+
+// Finds a template cut out of a 720p luma image, from scratch every time:
+// a new generation makes the matcher rebuild its pyramid, as it has to for
+// every new frame. The image is blotchy enough that only one place fits.
+static void
+bench_template_matcher(Suite& suite) {
+  struct Size {
+    uint32_t width;
+    uint32_t height;
+  };
+
+  static const Size sizes[] = {
+    { 40, 30 },
+    { 120, 90 },
+  };
+
+  LumaImage image;
+  image.resize(720, 1280);
+
+  for (uint32_t y = 0; y < image.height; ++y) {
+    for (uint32_t x = 0; x < image.width; ++x) {
+      uint32_t cell = (y / 6) * 977 + (x / 5) * 131;
+      image.data[y * image.width + x] = (cell * cell + x * 3) >> 4;
+    }
+  }
+
+  for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+    const Size& size = sizes[i];
+    char name[64];
+    snprintf(name, sizeof(name), "template_matcher.720x1280.%ux%u", size.width, size.height);
+
+    if (!suite.wants(name)) {
+      continue;
+    }
+
+    std::vector<unsigned char> pixels(size.width * size.height);
+
+    for (uint32_t y = 0; y < size.height; ++y) {
+      memcpy(pixels.data() + y * size.width,
+        image.data.data() + (y + 777) * image.width + 333, size.width);
+    }
+
+    TemplateMatcher::Template tmpl;
+    tmpl.set(pixels.data(), size.width, size.height);
+
+    TemplateMatcher matcher;
+    TemplateMatcher::Region region = { 0, 0, 0, 0 };
+    std::vector<TemplateMatcher::Match> matches;
+    uint64_t generation = 0;
+
+    suite.run(name, 0, [&]() {
+      matcher.setImage(&image, ++generation);
+      matcher.match(tmpl, region, 0.9, 1, matches);
+      keep(matches.data());
+    });
+  }
+}
+
+// Compares a 720p frame with a reference that differs in a few small
+// places, with a mask, as a visual regression check would. Most rows match
+// completely, and the ones that don't mostly match too.
+static void
+bench_visual_diff(Suite& suite) {
+  static const uint32_t width = 720;
+  static const uint32_t height = 1280;
+  char name[64];
+  snprintf(name, sizeof(name), "visual_diff.%ux%u.rgba", width, height);
+
+  if (!suite.wants(name)) {
+    return;
+  }
+
+  std::vector<unsigned char> rgb(width * height * 3);
+  std::vector<unsigned char> pixels(width * height * 4);
+
+  for (uint32_t y = 0; y < height; ++y) {
+    for (uint32_t x = 0; x < width; ++x) {
+      unsigned char* in = rgb.data() + (y * width + x) * 3;
+      unsigned char* p = pixels.data() + (y * width + x) * 4;
+      bool changed = (y % 160) < 20 && (x % 240) < 30;
+
+      in[0] = x;
+      in[1] = y;
+      in[2] = 0x80;
+
+      // Within the tolerance everywhere but in the changed spots.
+      p[0] = in[0] ^ (changed ? 0x40 : 0x03);
+      p[1] = in[1];
+      p[2] = in[2];
+      p[3] = 0xFF;
+    }
+  }
+
+  VisualDiff::Reference ref;
+  ref.begin(width, height);
+  ref.append(0, rgb.data(), rgb.size());
+
+  Minicap::Frame frame;
+  frame.data = pixels.data();
+  frame.format = Minicap::FORMAT_RGBA_8888;
+  frame.width = width;
+  frame.height = height;
+  frame.stride = width;
+  frame.bpp = 4;
+  frame.size = pixels.size();
+
+  VisualDiff::Region region = { 0, 0, 0, 0 };
+  VisualDiff::Result result;
+
+  suite.run(name, pixels.size(), [&]() {
+    VisualDiff::compare(ref, &frame, region, 8, 16, &result);
+    keep(result.mismatched);
+  });
+}
+
+// A watch on a whole 720p frame, for the cost per byte of hashing and
+// summing the channels. Real watches are usually much smaller.
+static void
+bench_region_watcher(Suite& suite) {
+  static const uint32_t width = 720;
+  static const uint32_t height = 1280;
+  char name[64];
+  snprintf(name, sizeof(name), "region_watcher.%ux%u.rgba", width, height);
+
+  if (!suite.wants(name)) {
+    return;
+  }
+
+  std::vector<unsigned char> pixels(width * height * 4);
+
+  for (size_t i = 0; i < pixels.size(); ++i) {
+    pixels[i] = i * 7 + (i >> 12);
+  }
+
+  Minicap::Frame frame;
+  frame.data = pixels.data();
+  frame.format = Minicap::FORMAT_RGBA_8888;
+  frame.width = width;
+  frame.height = height;
+  frame.stride = width;
+  frame.bpp = 4;
+  frame.size = pixels.size();
+
+  RegionWatcher watcher;
+  RegionWatcher::Watch watch;
+  watch.kind = RegionWatcher::KIND_MEAN;
+  watch.width = width;
+  watch.height = height;
+  watch.threshold = 0x80;
+  watcher.addWatch(&watch);
+
+  suite.run(name, pixels.size(), [&]() {
+    watcher.beginFrame(&frame);
+    watcher.processTile(&frame, 0, height);
+    watcher.endFrame(&frame);
+    keep(watch.mean[3]);
+  });
+}
+
+static void
+bench_projection(Suite& suite) {
+  static const char input[] = "1080x1920@720x1280/90";
+
+  suite.run("projection.parse", 0, [&]() {
+    Projection proj;
+    Projection::Parser parser;
+    keep(parser.parse(proj, input, input + sizeof(input) - 1));
+    keep(proj);
+  });
+
+  uint32_t n = 0;
+
+  suite.run("projection.geometry", 0, [&]() {
+    Projection proj;
+    proj.realWidth = 1080;
+    proj.realHeight = 1920;
+    proj.virtualWidth = 10000 + (++n & 0xFF);
+    proj.virtualHeight = 900 + (n & 0x7F);
+    proj.rotation = 0;
+    proj.forceMaximumSize();
+    proj.forceAspectRatio();
+    keep(proj.valid());
+    keep(proj);
+  });
+}
+
+int
+main(int argc, char* argv[]) {
+  const char* pname = argv[0];
+  Options options;
+  options.repetitions = DEFAULT_REPETITIONS;
+  options.warmup = DEFAULT_WARMUP;
+  options.sampleUs = DEFAULT_SAMPLE_US;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "r:w:t:f:h")) != -1) {
+    switch (opt) {
+    case 'r':
+      options.repetitions = atoi(optarg);
+      break;
+    case 'w':
+      options.warmup = atoi(optarg);
+      break;
+    case 't':
+      options.sampleUs = atoi(optarg);
+      break;
+    case 'f':
+      options.filter = optarg;
+      break;
+    case 'h':
+      usage(pname);
+      return EXIT_SUCCESS;
+    case '?':
+    default:
+      usage(pname);
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (options.repetitions == 0 || options.sampleUs == 0) {
+    usage(pname);
+    return EXIT_FAILURE;
+  }
+
+  Suite suite(options);
+
+  suite.begin();
+  bench_frame_waiter(suite);
+  bench_jank_monitor(suite);
+  bench_pumps(suite);
+  bench_serialization(suite);
+  bench_jpg_encoder(suite);
+  bench_frame_converter(suite);
+  bench_frame_scaler(suite);
+  bench_template_matcher(suite);
+  bench_visual_diff(suite);
+  bench_region_watcher(suite);
+  bench_projection(suite);
+  suite.end();
+
+  return EXIT_SUCCESS;
+}
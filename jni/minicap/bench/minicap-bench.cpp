@@ -0,0 +1,327 @@
+#include <arpa/inet.h>
+#include <getopt.h>
+#include <netinet/in.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <turbojpeg.h>
+
+#include "util/debug.h"
+#include "util/pump.hpp"
+#include "util/vsock.hpp"
+#include "Watermark.hpp"
+
+#define DEFAULT_SOCKET_NAME "minicap"
+#define DEFAULT_FRAME_COUNT 300
+
+// Connects to a running minicap that uses the synthetic backend with a
+// watermark (-X <fps> -W), decodes every frame it receives and reads the
+// watermark back. Since it runs on the same device as minicap, both share
+// the same clock, so the difference is the true latency from the moment
+// the frame was produced until it has been decoded here.
+//
+// It can also connect over TCP (e.g. through adb forward) or AF_VSOCK to
+// compare transports. Latencies are then only meaningful if both clocks
+// agree, which is usually the case for emulators, but throughput always is.
+
+static void
+usage(const char* pname) {
+  fprintf(stderr,
+    "Usage: %s [-h] [-n <name> | -T [<address>:]<port> | -V <cid>:<port>] [-c <count>] [-v <w>x<h>]\n"
+    "  -n <name>:     Name of the abstract unix domain socket. (%s)\n"
+    "  -T <value>:    Connect over TCP instead, e.g. to an adb forward.\n"
+    "  -V <value>:    Connect over AF_VSOCK instead.\n"
+    "  -c <count>:    Number of frames to receive. (%d)\n"
+    "  -v <w>x<h>:    Ask for frames to be scaled to fit this viewport.\n"
+    "  -h:            Show help.\n",
+    pname, DEFAULT_SOCKET_NAME, DEFAULT_FRAME_COUNT
+  );
+}
+
+static int
+connect_tcp(const std::string& address, int port) {
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+  if (fd < 0) {
+    return -1;
+  }
+
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+
+  if (inet_pton(AF_INET, address.c_str(), &addr.sin_addr) != 1 ||
+      connect(fd, (struct sockaddr*) &addr, sizeof(addr)) < 0) {
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+static int
+connect_vsock(unsigned int cid, unsigned int port) {
+  int fd = socket(AF_VSOCK, SOCK_STREAM, 0);
+
+  if (fd < 0) {
+    return -1;
+  }
+
+  struct sockaddr_vm addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.svm_family = AF_VSOCK;
+  addr.svm_port = port;
+  addr.svm_cid = cid;
+
+  if (connect(fd, (struct sockaddr*) &addr, sizeof(addr)) < 0) {
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+static int
+connect_to(const char* sockname) {
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+  if (fd < 0) {
+    return -1;
+  }
+
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(&addr.sun_path[1], sockname, sizeof(addr.sun_path) - 2);
+
+  if (connect(fd, (struct sockaddr*) &addr,
+      sizeof(sa_family_t) + strlen(sockname) + 1) < 0) {
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+static bool
+read_fully(int fd, unsigned char* data, size_t size) {
+  while (size > 0) {
+    ssize_t len = recv(fd, data, size, 0);
+
+    if (len <= 0) {
+      return false;
+    }
+
+    data += len;
+    size -= len;
+  }
+
+  return true;
+}
+
+static double
+percentile(const std::vector<int32_t>& sorted, int p) {
+  return sorted.empty() ? 0 : sorted[(sorted.size() - 1) * p / 100];
+}
+
+int
+main(int argc, char* argv[]) {
+  const char* pname = argv[0];
+  const char* sockname = DEFAULT_SOCKET_NAME;
+  unsigned int count = DEFAULT_FRAME_COUNT;
+  std::string viewport;
+  std::string tcpAddress = "127.0.0.1";
+  int tcpPort = 0;
+  unsigned int vsockCid = 0;
+  unsigned int vsockPort = 0;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "n:T:V:c:v:h")) != -1) {
+    switch (opt) {
+    case 'n':
+      sockname = optarg;
+      break;
+    case 'T': {
+      std::string value = optarg;
+      size_t colon = value.rfind(':');
+      if (colon != std::string::npos) {
+        tcpAddress = value.substr(0, colon);
+        value = value.substr(colon + 1);
+      }
+      tcpPort = atoi(value.c_str());
+      break;
+    }
+    case 'V':
+      if (sscanf(optarg, "%u:%u", &vsockCid, &vsockPort) != 2) {
+        usage(pname);
+        return EXIT_FAILURE;
+      }
+      break;
+    case 'c':
+      count = atoi(optarg);
+      break;
+    case 'v':
+      viewport = optarg;
+      viewport += "/0";
+      break;
+    case 'h':
+      usage(pname);
+      return EXIT_SUCCESS;
+    case '?':
+    default:
+      usage(pname);
+      return EXIT_FAILURE;
+    }
+  }
+
+  const char* transport;
+  int fd;
+
+  if (vsockPort > 0) {
+    transport = "vsock";
+    fd = connect_vsock(vsockCid, vsockPort);
+  }
+  else if (tcpPort > 0) {
+    transport = "tcp";
+    fd = connect_tcp(tcpAddress, tcpPort);
+  }
+  else {
+    transport = "unix";
+    fd = connect_to(sockname);
+  }
+
+  if (fd < 0) {
+    MCERROR("Unable to connect over %s", transport);
+    return EXIT_FAILURE;
+  }
+
+  unsigned char banner[256];
+
+  if (!read_fully(fd, banner, 2) || !read_fully(fd, banner + 2, banner[1] - 2) || banner[1] < 22) {
+    MCERROR("Unable to read banner");
+    return EXIT_FAILURE;
+  }
+
+  uint32_t virtualWidth = getUInt32LE(banner + 14);
+
+  if (!viewport.empty()) {
+    std::string msg(5, '\0');
+    putUInt32LE(reinterpret_cast<unsigned char*>(&msg[0]), 1 + viewport.size());
+    msg[4] = 0x01;
+    msg += viewport;
+
+    if (pumps(fd, reinterpret_cast<const unsigned char*>(msg.data()), msg.size()) < 0) {
+      MCERROR("Unable to send viewport");
+      return EXIT_FAILURE;
+    }
+  }
+
+  tjhandle tj = tjInitDecompress();
+  std::vector<unsigned char> jpg;
+  std::vector<unsigned char> gray;
+  std::vector<int32_t> latencies;
+  unsigned int received = 0;
+  uint64_t bytes = 0;
+  unsigned int unreadable = 0;
+  unsigned int dropped = 0;
+  unsigned int reordered = 0;
+  uint32_t lastSequence = 0;
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+  while (received < count) {
+    unsigned char header[4];
+
+    if (!read_fully(fd, header, 4)) {
+      MCERROR("Connection closed");
+      break;
+    }
+
+    uint32_t size = getUInt32LE(header);
+
+    // Only the packet mode marker can be empty, and we never ask for it.
+    if (size == 0) {
+      continue;
+    }
+
+    jpg.resize(size);
+
+    if (!read_fully(fd, jpg.data(), size)) {
+      MCERROR("Connection closed");
+      break;
+    }
+
+    received += 1;
+    bytes += 4 + size;
+
+    int width, height, subsampling, colorspace;
+
+    if (tjDecompressHeader3(tj, jpg.data(), size, &width, &height, &subsampling, &colorspace) != 0) {
+      unreadable += 1;
+      continue;
+    }
+
+    gray.resize(width * height);
+
+    if (tjDecompress2(tj, jpg.data(), size, gray.data(), width, width, height, TJPF_GRAY, 0) != 0) {
+      unreadable += 1;
+      continue;
+    }
+
+    Watermark::Code code;
+
+    if (!Watermark::read(gray.data(), width, height, width, (float) width / virtualWidth, &code)) {
+      unreadable += 1;
+      continue;
+    }
+
+    latencies.push_back(Watermark::elapsed(code.time, Watermark::now()));
+
+    if (lastSequence != 0 && code.sequence <= lastSequence) {
+      reordered += 1;
+      continue;
+    }
+
+    if (lastSequence != 0) {
+      dropped += code.sequence - lastSequence - 1;
+    }
+
+    lastSequence = code.sequence;
+  }
+
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  tjDestroy(tj);
+  close(fd);
+
+  std::sort(latencies.begin(), latencies.end());
+
+  std::cout.precision(2);
+  std::cout.setf(std::ios_base::fixed, std::ios_base::floatfield);
+
+  std::cout << "{"                                                          << std::endl
+            << "    \"transport\": \""   << transport                 << "\"," << std::endl
+            << "    \"frames\": "       << received                  << "," << std::endl
+            << "    \"unreadable\": "   << unreadable                << "," << std::endl
+            << "    \"dropped\": "      << dropped                   << "," << std::endl
+            << "    \"reordered\": "    << reordered                 << "," << std::endl
+            << "    \"fps\": "          << received / seconds        << "," << std::endl
+            << "    \"mb_per_s\": "     << bytes / seconds / 1e6     << "," << std::endl
+            << "    \"latency\": {"                                         << std::endl
+            << "        \"p50\": "      << percentile(latencies, 50) << "," << std::endl
+            << "        \"p90\": "      << percentile(latencies, 90) << "," << std::endl
+            << "        \"p99\": "      << percentile(latencies, 99) << "," << std::endl
+            << "        \"max\": "      << percentile(latencies, 100)       << std::endl
+            << "    }"                                                      << std::endl
+            << "}"                                                          << std::endl;
+
+  return received == count ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,375 @@
+#include <ctype.h>
+#include <getopt.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <turbojpeg.h>
+
+#include "util/debug.h"
+#include "JpgEncoder.hpp"
+#include "QuantTables.hpp"
+
+#define DEFAULT_QUALITIES "30,50,70,80,90"
+
+// Compares the rate-distortion behavior of the quantization table presets
+// (and optionally a table file) against the standard tables on a corpus
+// of screenshots. Each image is encoded exactly the way minicap would at
+// each quality, decoded again, and compared against the original. Since
+// the input should be as close to lossless as possible, take the corpus
+// with -s -Q 100 or use binary PPM files.
+
+static void
+usage(const char* pname) {
+  fprintf(stderr,
+    "Usage: %s [-h] [-q <qualities>] [-J <file>] <image>...\n"
+    "  -q <values>:   Comma separated JPEG qualities to try. (%s)\n"
+    "  -J <file>:     Also try the quantization tables in this file.\n"
+    "  -h:            Show help.\n"
+    "Images may be JPG or binary PPM (P6) files.\n",
+    pname, DEFAULT_QUALITIES
+  );
+}
+
+struct Image {
+  std::string path;
+  uint32_t width;
+  uint32_t height;
+  std::vector<unsigned char> rgba;
+};
+
+struct Point {
+  unsigned int quality;
+  uint64_t bytes;
+  double psnr;
+};
+
+struct Curve {
+  const QuantTables* tables;
+  std::string name;
+  std::vector<Point> points;
+};
+
+static bool
+read_file(const char* path, std::vector<unsigned char>& data) {
+  FILE* file = fopen(path, "rb");
+
+  if (file == NULL) {
+    return false;
+  }
+
+  unsigned char chunk[65536];
+  size_t len;
+
+  while ((len = fread(chunk, 1, sizeof(chunk), file)) > 0) {
+    data.insert(data.end(), chunk, chunk + len);
+  }
+
+  fclose(file);
+
+  return true;
+}
+
+static bool
+parse_ppm(const std::vector<unsigned char>& data, Image* image) {
+  size_t pos = 2;
+  unsigned int values[3];
+
+  // The header is P6 followed by width, height and maxval, separated by
+  // whitespace and possibly comments, and a single whitespace character.
+  for (int i = 0; i < 3; ++i) {
+    while (pos < data.size() && (isspace(data[pos]) || data[pos] == '#')) {
+      if (data[pos] == '#') {
+        while (pos < data.size() && data[pos] != '\n') {
+          pos += 1;
+        }
+      }
+      else {
+        pos += 1;
+      }
+    }
+
+    values[i] = 0;
+
+    while (pos < data.size() && isdigit(data[pos])) {
+      values[i] = values[i] * 10 + (data[pos++] - '0');
+    }
+  }
+
+  pos += 1;
+
+  if (values[2] != 255 || pos + values[0] * values[1] * 3 > data.size()) {
+    return false;
+  }
+
+  image->width = values[0];
+  image->height = values[1];
+  image->rgba.resize(image->width * image->height * 4);
+
+  for (size_t i = 0; i < image->width * image->height; ++i) {
+    image->rgba[i * 4 + 0] = data[pos + i * 3 + 0];
+    image->rgba[i * 4 + 1] = data[pos + i * 3 + 1];
+    image->rgba[i * 4 + 2] = data[pos + i * 3 + 2];
+    image->rgba[i * 4 + 3] = 0xFF;
+  }
+
+  return true;
+}
+
+static bool
+load_image(tjhandle tj, const char* path, Image* image) {
+  std::vector<unsigned char> data;
+
+  if (!read_file(path, data) || data.size() < 2) {
+    return false;
+  }
+
+  image->path = path;
+
+  if (data[0] == 'P' && data[1] == '6') {
+    return parse_ppm(data, image);
+  }
+
+  int width, height, subsampling, colorspace;
+
+  if (tjDecompressHeader3(tj, data.data(), data.size(), &width, &height, &subsampling, &colorspace) != 0) {
+    return false;
+  }
+
+  image->width = width;
+  image->height = height;
+  image->rgba.resize(width * height * 4);
+
+  return tjDecompress2(tj, data.data(), data.size(), image->rgba.data(),
+    width, width * 4, height, TJPF_RGBA, 0) == 0;
+}
+
+// Log-linear interpolation of the bytes a curve needs to reach the given
+// PSNR, or 0 if the PSNR is outside of the curve.
+static double
+bytes_at(const Curve& curve, double psnr) {
+  for (size_t i = 1; i < curve.points.size(); ++i) {
+    const Point& a = curve.points[i - 1];
+    const Point& b = curve.points[i];
+
+    if ((psnr >= a.psnr && psnr <= b.psnr) || (psnr >= b.psnr && psnr <= a.psnr)) {
+      if (a.psnr == b.psnr) {
+        return a.bytes;
+      }
+
+      double t = (psnr - a.psnr) / (b.psnr - a.psnr);
+      return exp(log(a.bytes) + t * (log(b.bytes) - log(a.bytes)));
+    }
+  }
+
+  return 0;
+}
+
+int
+main(int argc, char* argv[]) {
+  const char* pname = argv[0];
+  std::string qualityList = DEFAULT_QUALITIES;
+  QuantTables customTables;
+  bool haveCustomTables = false;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "q:J:h")) != -1) {
+    switch (opt) {
+    case 'q':
+      qualityList = optarg;
+      break;
+    case 'J':
+      if (!QuantTables::load(optarg, &customTables)) {
+        return EXIT_FAILURE;
+      }
+      haveCustomTables = true;
+      break;
+    case 'h':
+      usage(pname);
+      return EXIT_SUCCESS;
+    case '?':
+    default:
+      usage(pname);
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (optind >= argc) {
+    usage(pname);
+    return EXIT_FAILURE;
+  }
+
+  std::vector<unsigned int> qualities;
+
+  for (size_t pos = 0; pos < qualityList.size();) {
+    size_t comma = qualityList.find(',', pos);
+    if (comma == std::string::npos) {
+      comma = qualityList.size();
+    }
+
+    unsigned int quality = atoi(qualityList.substr(pos, comma - pos).c_str());
+    if (quality == 0 || quality > 100) {
+      MCERROR("Invalid quality in -q");
+      return EXIT_FAILURE;
+    }
+
+    qualities.push_back(quality);
+    pos = comma + 1;
+  }
+
+  tjhandle tj = tjInitDecompress();
+  std::vector<Image> images;
+  uint64_t pixels = 0;
+  uint32_t maxWidth = 0;
+  uint32_t maxHeight = 0;
+
+  for (int i = optind; i < argc; ++i) {
+    Image image;
+
+    if (!load_image(tj, argv[i], &image)) {
+      MCERROR("Unable to load '%s'", argv[i]);
+      return EXIT_FAILURE;
+    }
+
+    pixels += image.width * image.height;
+    maxWidth = std::max(maxWidth, image.width);
+    maxHeight = std::max(maxHeight, image.height);
+    images.push_back(image);
+  }
+
+  // The standard tables come first so that the others can be compared
+  // against them.
+  std::vector<Curve> curves;
+  std::string presets = QuantTables::listPresets();
+
+  for (size_t pos = 0; pos < presets.size();) {
+    size_t comma = presets.find(", ", pos);
+    if (comma == std::string::npos) {
+      comma = presets.size();
+    }
+
+    Curve curve;
+    curve.name = presets.substr(pos, comma - pos);
+    QuantTables::findPreset(curve.name, &curve.tables);
+    curves.push_back(curve);
+    pos = comma + 2;
+  }
+
+  if (haveCustomTables) {
+    Curve curve;
+    curve.name = customTables.name;
+    curve.tables = &customTables;
+    curves.push_back(curve);
+  }
+
+  // Reserve enough for the largest image so that the encoder buffer
+  // never has to be reallocated.
+  JpgEncoder encoder(0, 0);
+  std::vector<unsigned char> decoded;
+
+  if (!encoder.reserveData(maxWidth, maxHeight)) {
+    MCERROR("Unable to reserve data for JPG encoder");
+    return EXIT_FAILURE;
+  }
+
+  for (size_t c = 0; c < curves.size(); ++c) {
+    encoder.setQuantTables(curves[c].tables);
+
+    for (size_t q = 0; q < qualities.size(); ++q) {
+      Point point;
+      double squaredError = 0;
+
+      point.quality = qualities[q];
+      point.bytes = 0;
+
+      for (size_t i = 0; i < images.size(); ++i) {
+        Image& image = images[i];
+        Minicap::Frame frame;
+
+        frame.data = image.rgba.data();
+        frame.format = Minicap::FORMAT_RGBA_8888;
+        frame.width = image.width;
+        frame.height = image.height;
+        frame.stride = image.width;
+        frame.bpp = 4;
+        frame.size = image.rgba.size();
+
+        if (!encoder.encode(&frame, qualities[q])) {
+          MCERROR("Unable to encode '%s'", image.path.c_str());
+          return EXIT_FAILURE;
+        }
+
+        decoded.resize(image.rgba.size());
+
+        if (tjDecompress2(tj, encoder.getEncodedData(), encoder.getEncodedSize(), decoded.data(),
+            image.width, image.width * 4, image.height, TJPF_RGBA, 0) != 0) {
+          MCERROR("Unable to decode '%s'", image.path.c_str());
+          return EXIT_FAILURE;
+        }
+
+        for (size_t p = 0; p < decoded.size(); p += 4) {
+          for (int ch = 0; ch < 3; ++ch) {
+            double diff = static_cast<int>(decoded[p + ch]) - image.rgba[p + ch];
+            squaredError += diff * diff;
+          }
+        }
+
+        point.bytes += encoder.getEncodedSize();
+      }
+
+      double mse = squaredError / (pixels * 3);
+      point.psnr = mse > 0 ? 10 * log10(255.0 * 255.0 / mse) : 99;
+
+      curves[c].points.push_back(point);
+    }
+  }
+
+  tjDestroy(tj);
+
+  std::cout.precision(3);
+  std::cout.setf(std::ios_base::fixed, std::ios_base::floatfield);
+
+  std::cout << "{" << std::endl
+            << "    \"images\": " << images.size() << "," << std::endl
+            << "    \"pixels\": " << pixels << "," << std::endl
+            << "    \"tables\": [" << std::endl;
+
+  for (size_t c = 0; c < curves.size(); ++c) {
+    std::cout << "        {" << std::endl
+              << "            \"name\": \"" << curves[c].name << "\"," << std::endl
+              << "            \"points\": [" << std::endl;
+
+    for (size_t q = 0; q < curves[c].points.size(); ++q) {
+      const Point& point = curves[c].points[q];
+
+      // How many more or fewer bytes the standard tables would need for
+      // the same PSNR, if that's within their range.
+      double reference = bytes_at(curves[0], point.psnr);
+
+      std::cout << "                {"
+                << " \"quality\": " << point.quality
+                << ", \"bytes\": " << point.bytes
+                << ", \"bpp\": " << point.bytes * 8.0 / pixels
+                << ", \"psnr\": " << point.psnr;
+
+      if (c > 0 && reference > 0) {
+        std::cout << ", \"savings\": " << 1 - point.bytes / reference;
+      }
+
+      std::cout << " }" << (q + 1 < curves[c].points.size() ? "," : "") << std::endl;
+    }
+
+    std::cout << "            ]" << std::endl
+              << "        }" << (c + 1 < curves.size() ? "," : "") << std::endl;
+  }
+
+  std::cout << "    ]" << std::endl
+            << "}" << std::endl;
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,144 @@
+#ifndef LIBMINICAP_H
+#define LIBMINICAP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Embeds minicap's capture and encoding in another process, without the
+// socket in between. A session captures one display and hands each frame
+// to a callback as a lease on minicap's own buffer, so nothing is copied
+// on the way. The API is plain C and only ever grows; check
+// minicap_api_version() against MINICAP_API_VERSION if it matters.
+//
+// Functions that can fail return 0 or a negative errno.
+
+#define MINICAP_API_VERSION 2
+
+#define MINICAP_QUANT_TABLE_SIZE 64
+
+typedef struct minicap_session minicap_session;
+
+typedef enum {
+  // Frames as the capture method delivers them, 8 bits per channel. Wide
+  // gamut and HDR frames are converted, everything else is the capture
+  // buffer itself.
+  MINICAP_CODEC_RAW   = 0,
+  // JPG, encoded straight from the capture buffer.
+  MINICAP_CODEC_JPEG  = 1,
+} minicap_codec;
+
+// Same values as Minicap::Format.
+typedef enum {
+  MINICAP_FORMAT_JPEG       = 0x00,
+  MINICAP_FORMAT_RGBA_8888  = 0x06,
+  MINICAP_FORMAT_RGBX_8888  = 0x07,
+  MINICAP_FORMAT_RGB_888    = 0x08,
+  MINICAP_FORMAT_RGB_565    = 0x09,
+  MINICAP_FORMAT_BGRA_8888  = 0x0a,
+  MINICAP_FORMAT_NV12       = 0x0f,
+  MINICAP_FORMAT_NV21       = 0x10,
+  MINICAP_FORMAT_I420       = 0x11,
+} minicap_format;
+
+typedef struct {
+  // Encoded data for JPEG, or the pixels of the first plane for RAW.
+  const void* data;
+  size_t size;
+  int format;
+  uint32_t width;
+  uint32_t height;
+  // In pixels, for RAW frames that aren't YUV.
+  uint32_t stride;
+  uint32_t bpp;
+  // Y, then CbCr or CrCb for NV12 and NV21, or Y, Cb and Cr for I420,
+  // with strides in bytes. Unused otherwise.
+  const void* planes[3];
+  uint32_t strides[3];
+  // Counts every frame the session has delivered, starting at 1.
+  uint64_t sequence;
+  // CLOCK_MONOTONIC when the frame was taken from the capture method.
+  int64_t timestamp_ns;
+} minicap_frame;
+
+// Called on the session's own thread with a leased frame. The frame stays
+// valid until it's passed to minicap_frame_release(), which may happen
+// later and from any thread. No further frames are delivered while a lease
+// is out; frames that arrive in the meantime are skipped, so a slow
+// consumer always gets the latest one next.
+typedef void (*minicap_frame_callback)(minicap_session* session,
+  const minicap_frame* frame, void* user);
+
+int
+minicap_api_version(void);
+
+// Returns NULL if there's no way to capture the display.
+minicap_session*
+minicap_session_create(uint32_t display_id);
+
+// Captures the display with another build of minicap.so, as with -M.
+// Since API version 2.
+minicap_session*
+minicap_session_create_library(const char* path, uint32_t display_id);
+
+// Generates frames at the given rate instead of capturing the display,
+// optionally with a sequence and time code painted in. For testing.
+minicap_session*
+minicap_session_create_synthetic(float fps, int watermark);
+
+// Stops the session first if necessary, so the same goes as for
+// minicap_session_stop().
+void
+minicap_session_destroy(minicap_session* session);
+
+// The size of the display and the size and rotation (0, 90, 180 or 270)
+// of the frames to produce, as with -P. Frames keep the aspect ratio of
+// the display and are never larger than it. Must be set before starting.
+int
+minicap_session_set_projection(minicap_session* session,
+  uint32_t real_width, uint32_t real_height,
+  uint32_t virtual_width, uint32_t virtual_height, uint32_t rotation);
+
+// Quality only applies to JPEG. Can be changed while running.
+int
+minicap_session_set_codec(minicap_session* session, minicap_codec codec, int quality);
+
+// JPG quantization tables in natural order, MINICAP_QUANT_TABLE_SIZE
+// values of 1-255 each, as with -J. They're scaled by the quality like the
+// standard tables, which NULL for both goes back to. Must be set before
+// starting. Since API version 2.
+int
+minicap_session_set_quant_tables(minicap_session* session,
+  const unsigned int* luma, const unsigned int* chroma);
+
+// The format to ask the capture method for, which mostly matters for
+// MINICAP_CODEC_RAW. Capture methods that can't deliver it keep their own.
+// Defaults to whatever the JPG encoder takes most cheaply. Must be set
+// before starting. Since API version 2.
+int
+minicap_session_set_capture_format(minicap_session* session, minicap_format format);
+
+// Starts capturing and delivering frames to the callback. Needs a
+// projection first. A stopped session can be started again.
+int
+minicap_session_start(minicap_session* session,
+  minicap_frame_callback callback, void* user);
+
+// Blocks until the session's thread has finished. A lease that's still out
+// is cancelled: its frame can't be used once this returns, though passing
+// it to minicap_frame_release() afterwards is harmless. Returns -EDEADLK
+// when called from the callback, which runs on the session's thread.
+int
+minicap_session_stop(minicap_session* session);
+
+void
+minicap_frame_release(minicap_session* session, const minicap_frame* frame);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,427 @@
+#include "libminicap.h"
+
+#include <time.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#include <Minicap.hpp>
+
+#include "util/debug.h"
+#include "CaptureSession.hpp"
+#include "FrameWaiter.hpp"
+#include "JpgEncoder.hpp"
+#include "Projection.hpp"
+#include "QuantTables.hpp"
+
+#define DEFAULT_JPG_QUALITY 80
+
+static_assert(static_cast<int>(MINICAP_FORMAT_RGBA_8888) == Minicap::FORMAT_RGBA_8888 &&
+  static_cast<int>(MINICAP_FORMAT_BGRA_8888) == Minicap::FORMAT_BGRA_8888 &&
+  static_cast<int>(MINICAP_FORMAT_I420) == Minicap::FORMAT_I420,
+  "minicap_format out of sync with Minicap::Format");
+
+static_assert(MINICAP_QUANT_TABLE_SIZE == QuantTables::SIZE,
+  "MINICAP_QUANT_TABLE_SIZE out of sync with QuantTables");
+
+struct minicap_session {
+  CaptureSession capture;
+  FrameWaiter waiter;
+  JpgEncoder encoder;
+  Projection proj;
+  std::atomic<int> codec;
+  std::atomic<int> quality;
+  QuantTables quantTables;
+  Minicap::Format preferredFormat;
+  minicap_frame_callback callback;
+  void* user;
+  std::thread worker;
+  bool started;
+  uint64_t sequence;
+
+  // Guards the lease, which the consumer may return from any thread. A
+  // release only counts for the frame that's currently out, so that one
+  // from before a restart can't end a later lease.
+  std::mutex mutex;
+  std::condition_variable released;
+  bool leased;
+  bool stopping;
+  uint64_t leasedSequence;
+
+  minicap_session()
+    : encoder(0, 0),
+      codec(MINICAP_CODEC_JPEG),
+      quality(DEFAULT_JPG_QUALITY),
+      preferredFormat(JpgEncoder::getPreferredFormat()),
+      callback(NULL),
+      user(NULL),
+      started(false),
+      sequence(0),
+      leased(false),
+      stopping(false),
+      leasedSequence(0)
+  {
+  }
+};
+
+static int64_t
+monotonic_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<int64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+// Hands the frame to the callback and waits until it comes back, or until
+// the session stops and cancels the lease.
+static void
+lease_frame(minicap_session* session, minicap_frame* frame) {
+  {
+    std::unique_lock<std::mutex> lock(session->mutex);
+
+    if (session->stopping) {
+      return;
+    }
+
+    session->leased = true;
+    session->leasedSequence = frame->sequence;
+  }
+
+  session->callback(session, frame, session->user);
+
+  std::unique_lock<std::mutex> lock(session->mutex);
+  session->released.wait(lock, [session]{return !session->leased || session->stopping;});
+  session->leased = false;
+}
+
+static void
+run_session(minicap_session* session) {
+  Minicap::Frame frame;
+  Minicap::Frame normalized;
+  int pending, err;
+
+  // Gets the encoder ready while the capture method delivers its first
+  // frame, which takes a while anyway.
+  if (session->codec == MINICAP_CODEC_JPEG) {
+    if (!session->encoder.reserveData(session->proj.virtualWidth, session->proj.virtualHeight) ||
+        !session->encoder.warmUp()) {
+      MCWARN("Unable to warm up encoder");
+    }
+  }
+
+  while ((pending = session->waiter.waitForFrame()) > 0) {
+    // Whatever arrived while the last lease was out is stale by now.
+    if (pending > 1) {
+      session->waiter.reportExtraConsumption(pending - 1);
+
+      while (--pending >= 1) {
+        if ((err = session->capture.consume(&frame)) != 0) {
+          break;
+        }
+
+        session->capture.release(&frame);
+      }
+    }
+
+    if ((err = session->capture.consume(&frame)) != 0) {
+      if (err == -EINTR) {
+        continue;
+      }
+
+      MCERROR("Unable to consume pending frame");
+      break;
+    }
+
+    minicap_frame out;
+    memset(&out, 0, sizeof(out));
+    out.timestamp_ns = monotonic_ns();
+    out.sequence = ++session->sequence;
+
+    if (!session->capture.normalize(&frame, &normalized)) {
+      session->capture.release(&frame);
+      break;
+    }
+
+    bool raw = session->codec == MINICAP_CODEC_RAW;
+
+    if (raw) {
+      out.data = normalized.data;
+      out.size = normalized.size;
+      out.format = normalized.format;
+      out.width = normalized.width;
+      out.height = normalized.height;
+      out.stride = normalized.stride;
+      out.bpp = normalized.bpp;
+
+      for (int i = 0; i < 3; ++i) {
+        out.planes[i] = normalized.planes[i];
+        out.strides[i] = normalized.strides[i];
+      }
+    }
+    else {
+      if (!session->encoder.reserveData(normalized.width, normalized.height) ||
+          !session->encoder.encode(&normalized, session->quality)) {
+        MCERROR("Unable to encode frame");
+        session->capture.release(&frame);
+        break;
+      }
+
+      // The encoded copy is all the consumer needs, so the capture buffer
+      // can go back right away.
+      session->capture.release(&frame);
+
+      out.data = session->encoder.getEncodedData();
+      out.size = session->encoder.getEncodedSize();
+      out.format = MINICAP_FORMAT_JPEG;
+      out.width = normalized.width;
+      out.height = normalized.height;
+    }
+
+    lease_frame(session, &out);
+
+    if (raw) {
+      session->capture.release(&frame);
+    }
+  }
+}
+
+static minicap_session*
+create_session(uint32_t displayId, const CaptureSession::Source& source) {
+  static std::once_flag threadPool;
+
+  // Android's thread pool serves the requests of the capture methods, and
+  // only needs starting once per process.
+  if (source.syntheticFps <= 0) {
+    std::call_once(threadPool, minicap_start_thread_pool);
+  }
+
+  minicap_session* session = new minicap_session();
+
+  if (!session->capture.create(displayId, source)) {
+    delete session;
+    return NULL;
+  }
+
+  return session;
+}
+
+extern "C" {
+
+int
+minicap_api_version(void) {
+  return MINICAP_API_VERSION;
+}
+
+minicap_session*
+minicap_session_create(uint32_t display_id) {
+  return create_session(display_id, CaptureSession::Source());
+}
+
+minicap_session*
+minicap_session_create_library(const char* path, uint32_t display_id) {
+  if (path == NULL || *path == '\0') {
+    return NULL;
+  }
+
+  CaptureSession::Source source;
+  source.library = path;
+
+  return create_session(display_id, source);
+}
+
+minicap_session*
+minicap_session_create_synthetic(float fps, int watermark) {
+  if (fps <= 0) {
+    return NULL;
+  }
+
+  CaptureSession::Source source;
+  source.syntheticFps = fps;
+  source.watermark = watermark != 0;
+
+  return create_session(0, source);
+}
+
+void
+minicap_session_destroy(minicap_session* session) {
+  if (session == NULL) {
+    return;
+  }
+
+  minicap_session_stop(session);
+  delete session;
+}
+
+int
+minicap_session_set_projection(minicap_session* session,
+    uint32_t real_width, uint32_t real_height,
+    uint32_t virtual_width, uint32_t virtual_height, uint32_t rotation) {
+  if (session->started) {
+    return -EBUSY;
+  }
+
+  if (rotation != 0 && rotation != 90 && rotation != 180 && rotation != 270) {
+    return -EINVAL;
+  }
+
+  if (real_width == 0 || real_height == 0) {
+    return -EINVAL;
+  }
+
+  Projection& proj = session->proj;
+  proj.realWidth = real_width;
+  proj.realHeight = real_height;
+  proj.virtualWidth = virtual_width;
+  proj.virtualHeight = virtual_height;
+  proj.rotation = rotation;
+  proj.forceMaximumSize();
+  proj.forceAspectRatio();
+
+  // Left invalid on purpose, so that starting fails too.
+  if (!proj.valid()) {
+    return -EINVAL;
+  }
+
+  return 0;
+}
+
+int
+minicap_session_set_codec(minicap_session* session, minicap_codec codec, int quality) {
+  if (codec != MINICAP_CODEC_RAW && codec != MINICAP_CODEC_JPEG) {
+    return -EINVAL;
+  }
+
+  if (quality < 0 || quality > 100) {
+    return -EINVAL;
+  }
+
+  session->codec = codec;
+  session->quality = quality;
+
+  return 0;
+}
+
+int
+minicap_session_set_quant_tables(minicap_session* session,
+    const unsigned int* luma, const unsigned int* chroma) {
+  if (session->started) {
+    return -EBUSY;
+  }
+
+  if ((luma == NULL) != (chroma == NULL)) {
+    return -EINVAL;
+  }
+
+  if (luma == NULL) {
+    session->encoder.setQuantTables(NULL);
+    return 0;
+  }
+
+  for (uint32_t i = 0; i < QuantTables::SIZE; ++i) {
+    if (luma[i] < 1 || luma[i] > 255 || chroma[i] < 1 || chroma[i] > 255) {
+      return -EINVAL;
+    }
+  }
+
+  memcpy(session->quantTables.luma, luma, sizeof(session->quantTables.luma));
+  memcpy(session->quantTables.chroma, chroma, sizeof(session->quantTables.chroma));
+  session->encoder.setQuantTables(&session->quantTables);
+
+  return 0;
+}
+
+int
+minicap_session_set_capture_format(minicap_session* session, minicap_format format) {
+  if (session->started) {
+    return -EBUSY;
+  }
+
+  switch (format) {
+  case MINICAP_FORMAT_RGBA_8888:
+  case MINICAP_FORMAT_RGBX_8888:
+  case MINICAP_FORMAT_RGB_888:
+  case MINICAP_FORMAT_RGB_565:
+  case MINICAP_FORMAT_BGRA_8888:
+  case MINICAP_FORMAT_NV12:
+  case MINICAP_FORMAT_NV21:
+  case MINICAP_FORMAT_I420:
+    session->preferredFormat = static_cast<Minicap::Format>(format);
+    return 0;
+  default:
+    return -EINVAL;
+  }
+}
+
+int
+minicap_session_start(minicap_session* session,
+    minicap_frame_callback callback, void* user) {
+  if (session->started) {
+    return -EALREADY;
+  }
+
+  if (callback == NULL || !session->proj.valid()) {
+    return -EINVAL;
+  }
+
+  Minicap::DisplayInfo realInfo;
+  realInfo.width = session->proj.realWidth;
+  realInfo.height = session->proj.realHeight;
+
+  Minicap::DisplayInfo desiredInfo;
+  desiredInfo.width = session->proj.virtualWidth;
+  desiredInfo.height = session->proj.virtualHeight;
+  desiredInfo.orientation = session->proj.rotation;
+
+  session->waiter.restart();
+
+  if (!session->capture.configure(realInfo, desiredInfo,
+      session->preferredFormat, &session->waiter)) {
+    return -EIO;
+  }
+
+  session->callback = callback;
+  session->user = user;
+  session->stopping = false;
+  session->started = true;
+  session->worker = std::thread(run_session, session);
+
+  return 0;
+}
+
+int
+minicap_session_stop(minicap_session* session) {
+  if (!session->started) {
+    return 0;
+  }
+
+  // The session's own thread would end up waiting for itself.
+  if (std::this_thread::get_id() == session->worker.get_id()) {
+    return -EDEADLK;
+  }
+
+  {
+    std::unique_lock<std::mutex> lock(session->mutex);
+    session->stopping = true;
+    session->released.notify_one();
+  }
+
+  session->waiter.stop();
+  session->worker.join();
+  session->capture.stop();
+  session->started = false;
+
+  return 0;
+}
+
+void
+minicap_frame_release(minicap_session* session, const minicap_frame* frame) {
+  std::unique_lock<std::mutex> lock(session->mutex);
+
+  if (session->leased && frame->sequence == session->leasedSequence) {
+    session->leased = false;
+    session->released.notify_one();
+  }
+}
+
+}
@@ -1,38 +1,48 @@
 #include <fcntl.h>
 #include <getopt.h>
 #include <linux/fb.h>
+#include <poll.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <signal.h>
 #include <sys/socket.h>
 
 #include <cmath>
-#include <condition_variable>
 #include <chrono>
+#include <condition_variable>
 #include <future>
 #include <iostream>
 #include <mutex>
+#include <sstream>
+#include <string>
 #include <thread>
+#include <vector>
 
 #include <Minicap.hpp>
 
 #include "util/debug.h"
+#include "util/phases.hpp"
+#include "util/pump.hpp"
+#include "Banner.hpp"
+#include "CaptureProbe.hpp"
+#include "CaptureSession.hpp"
+#include "CaptureWatchdog.hpp"
+#include "FrameConverter.hpp"
+#include "FrameStreamer.hpp"
+#include "FrameWaiter.hpp"
+#include "JankMonitor.hpp"
 #include "JpgEncoder.hpp"
 #include "SimpleServer.hpp"
+#include "libminicap.h"
+#include "QuantTables.hpp"
 #include "Projection.hpp"
-
-#define BANNER_VERSION 1
-#define BANNER_SIZE 24
+#include "UdpTransport.hpp"
 
 #define DEFAULT_SOCKET_NAME "minicap"
 #define DEFAULT_DISPLAY_ID 0
 #define DEFAULT_JPG_QUALITY 80
-
-enum {
-  QUIRK_DUMB            = 1,
-  QUIRK_ALWAYS_UPRIGHT  = 2,
-  QUIRK_TEAR            = 4,
-};
+#define DEFAULT_UDP_ADDRESS "127.0.0.1"
+#define PROBE_DURATION_MS 500
 
 static void
 usage(const char* pname) {
@@ -42,111 +52,99 @@ usage(const char* pname) {
     "  -n <name>:     Change the name of the abtract unix domain socket. (%s)\n"
     "  -P <value>:    Display projection (<w>x<h>@<w>x<h>/{0|90|180|270}).\n"
     "  -Q <value>:    JPEG quality (0-100).\n"
+    "  -J <value>:    JPEG quantization tables, a preset (%s) or a file.\n"
     "  -s:            Take a screenshot and output it to stdout. Needs -P.\n"
+    "  -R:            With -s, output raw pixels in the capture format instead of a JPG.\n"
     "  -S:            Skip frames when they cannot be consumed quickly enough.\n"
+    "  -K:            Always keep the latest frame, even while nobody is connected.\n"
+    "  -j <value>:    Monitor app jank from frame arrivals at this refresh rate.\n"
     "  -t:            Attempt to get the capture method running, then exit.\n"
+    "  -w <value>:    Rebuild the capture method after this many ms without frames.\n"
+    "  -X <value>:    Generate synthetic frames at this rate instead of capturing.\n"
+    "  -W:            Paint a sequence and time code into synthetic frames.\n"
+    "  -M <value>:    Try out these capture sources and use the best one, comma\n"
+    "                 separated: default, synthetic:<fps> or the path of a minicap.so.\n"
+    "  -Z <value>:    With -X, stop producing frames after this many, to try out -w.\n"
+    "  -Y <value>:    Ask for YUV frames (nv12, nv21 or i420). Only -X can make them.\n"
+    "  -V <value>:    Also listen on this AF_VSOCK port, for devices running in a VM.\n"
+    "  -U <value>:    Also stream over UDP on [<ipv4 address>:]<port>. (%s)\n"
+    "  -F <value>:    Send one XOR parity packet per this many UDP fragments.\n"
+    "  -L <value>:    Drop this percentage of UDP packets on purpose, for testing.\n"
     "  -i:            Get display information in JSON format. May segfault.\n"
     "  -h:            Show help.\n",
-    pname, DEFAULT_DISPLAY_ID, DEFAULT_SOCKET_NAME
+    pname, DEFAULT_DISPLAY_ID, DEFAULT_SOCKET_NAME,
+    QuantTables::listPresets().c_str(), DEFAULT_UDP_ADDRESS
   );
 }
 
-class FrameWaiter: public Minicap::FrameAvailableListener {
-public:
-  FrameWaiter()
-    : mPendingFrames(0),
-      mTimeout(std::chrono::milliseconds(100)),
-      mStopped(false) {
+static const char*
+format_name(Minicap::Format format) {
+  switch (format) {
+  case Minicap::FORMAT_RGBA_8888:
+    return "RGBA_8888";
+  case Minicap::FORMAT_RGBX_8888:
+    return "RGBX_8888";
+  case Minicap::FORMAT_RGB_888:
+    return "RGB_888";
+  case Minicap::FORMAT_RGB_565:
+    return "RGB_565";
+  case Minicap::FORMAT_BGRA_8888:
+    return "BGRA_8888";
+  case Minicap::FORMAT_RGBA_5551:
+    return "RGBA_5551";
+  case Minicap::FORMAT_RGBA_4444:
+    return "RGBA_4444";
+  case Minicap::FORMAT_RGBA_1010102:
+    return "RGBA_1010102";
+  case Minicap::FORMAT_RGBA_FP16:
+    return "RGBA_FP16";
+  case Minicap::FORMAT_NV12:
+    return "NV12";
+  case Minicap::FORMAT_NV21:
+    return "NV21";
+  case Minicap::FORMAT_I420:
+    return "I420";
+  case Minicap::FORMAT_UNKNOWN:
+    return "unknown";
+  default:
+    return "other";
   }
+}
 
-  int
-  waitForFrame() {
-    std::unique_lock<std::mutex> lock(mMutex);
-
-    while (!mStopped) {
-      if (mCondition.wait_for(lock, mTimeout, [this]{return mPendingFrames > 0;})) {
-        return mPendingFrames--;
+// Writes the rows of a frame to a file without their padding. YUV frames
+// are written plane by plane.
+static int
+pump_raw_frame(int fd, const Minicap::Frame* frame) {
+  if (!FrameConverter::isYuv(frame->format)) {
+    const unsigned char* data = static_cast<const unsigned char*>(frame->data);
+    size_t rowSize = frame->width * frame->bpp;
+
+    for (uint32_t y = 0; y < frame->height; ++y) {
+      if (pumpf(fd, data + y * frame->stride * frame->bpp, rowSize) < 0) {
+        return -1;
       }
     }
 
     return 0;
   }
 
-  void
-  reportExtraConsumption(int count) {
-    std::unique_lock<std::mutex> lock(mMutex);
-    mPendingFrames -= count;
-  }
+  int planes = frame->format == Minicap::FORMAT_I420 ? 3 : 2;
 
-  void
-  onFrameAvailable() {
-    std::unique_lock<std::mutex> lock(mMutex);
-    mPendingFrames += 1;
-    mCondition.notify_one();
-  }
+  for (int p = 0; p < planes; ++p) {
+    const unsigned char* data = static_cast<const unsigned char*>(frame->planes[p]);
+    uint32_t rows = p == 0 ? frame->height : (frame->height + 1) / 2;
+    size_t rowSize = p == 0 ? frame->width : (frame->width + 1) / 2 * (planes == 2 ? 2 : 1);
 
-  void
-  stop() {
-    mStopped = true;
-  }
-
-  bool
-  isStopped() {
-    return mStopped;
-  }
-
-private:
-  std::mutex mMutex;
-  std::condition_variable mCondition;
-  std::chrono::milliseconds mTimeout;
-  int mPendingFrames;
-  bool mStopped;
-};
-
-static int
-pumps(int fd, unsigned char* data, size_t length) {
-  do {
-    // Make sure that we don't generate a SIGPIPE even if the socket doesn't
-    // exist anymore. We'll still get an EPIPE which is perfect.
-    int wrote = send(fd, data, length, MSG_NOSIGNAL);
-
-    if (wrote < 0) {
-      return wrote;
-    }
-
-    data += wrote;
-    length -= wrote;
-  }
-  while (length > 0);
-
-  return 0;
-}
-
-static int
-pumpf(int fd, unsigned char* data, size_t length) {
-  do {
-    int wrote = write(fd, data, length);
-
-    if (wrote < 0) {
-      return wrote;
+    for (uint32_t y = 0; y < rows; ++y) {
+      if (pumpf(fd, data + y * frame->strides[p], rowSize) < 0) {
+        return -1;
+      }
     }
-
-    data += wrote;
-    length -= wrote;
   }
-  while (length > 0);
 
   return 0;
 }
 
-static int
-putUInt32LE(unsigned char* data, int value) {
-  data[0] = (value & 0x000000FF) >> 0;
-  data[1] = (value & 0x0000FF00) >> 8;
-  data[2] = (value & 0x00FF0000) >> 16;
-  data[3] = (value & 0xFF000000) >> 24;
-}
-
 static int
 try_get_framebuffer_display_info(uint32_t displayId, Minicap::DisplayInfo* info) {
   char path[64];
@@ -186,6 +184,90 @@ try_get_framebuffer_display_info(uint32_t displayId, Minicap::DisplayInfo* info)
 
 static FrameWaiter gWaiter;
 
+// Screenshots are taken through libminicap, like any other process
+// embedding it would.
+struct Screenshot {
+  std::mutex mutex;
+  std::condition_variable done;
+  bool finished;
+  int err;
+
+  Screenshot()
+    : finished(false),
+      err(0)
+  {
+  }
+};
+
+static void
+on_screenshot(minicap_session* session, const minicap_frame* frame, void* user) {
+  Screenshot* screenshot = static_cast<Screenshot*>(user);
+
+  std::unique_lock<std::mutex> lock(screenshot->mutex);
+
+  // Another frame may well arrive before the session is stopped.
+  if (!screenshot->finished) {
+    if (pumpf(STDOUT_FILENO, static_cast<const unsigned char*>(frame->data), frame->size) < 0) {
+      MCERROR("Unable to output encoded frame data");
+      screenshot->err = -EIO;
+    }
+
+    screenshot->finished = true;
+    screenshot->done.notify_one();
+  }
+
+  minicap_frame_release(session, frame);
+}
+
+static int
+take_screenshot(uint32_t displayId, const CaptureSession::Source& source,
+    const Projection& proj, unsigned int quality, const QuantTables* quantTables,
+    Minicap::Format preferredFormat) {
+  minicap_session* session;
+  Screenshot screenshot;
+  int err;
+
+  if (source.syntheticFps > 0) {
+    session = minicap_session_create_synthetic(source.syntheticFps, source.watermark);
+  }
+  else if (!source.library.empty()) {
+    session = minicap_session_create_library(source.library.c_str(), displayId);
+  }
+  else {
+    session = minicap_session_create(displayId);
+  }
+
+  if (session == NULL) {
+    return -ENODEV;
+  }
+
+  if ((err = minicap_session_set_projection(session, proj.realWidth, proj.realHeight,
+      proj.virtualWidth, proj.virtualHeight, proj.rotation)) != 0 ||
+      (err = minicap_session_set_codec(session, MINICAP_CODEC_JPEG, quality)) != 0 ||
+      (err = minicap_session_set_capture_format(session,
+        static_cast<minicap_format>(preferredFormat))) != 0 ||
+      (quantTables != NULL && (err = minicap_session_set_quant_tables(session,
+        quantTables->luma, quantTables->chroma)) != 0) ||
+      (err = minicap_session_start(session, on_screenshot, &screenshot)) != 0) {
+    minicap_session_destroy(session);
+    return err;
+  }
+
+  // Also gives up on SIGINT and SIGTERM, which only stop gWaiter.
+  {
+    std::unique_lock<std::mutex> lock(screenshot.mutex);
+    while (!screenshot.finished && !gWaiter.isStopped()) {
+      screenshot.done.wait_for(lock, std::chrono::milliseconds(100));
+    }
+
+    err = screenshot.finished ? screenshot.err : -EINTR;
+  }
+
+  minicap_session_destroy(session);
+
+  return err;
+}
+
 static void
 signal_handler(int signum) {
   switch (signum) {
@@ -205,18 +287,35 @@ signal_handler(int signum) {
 
 int
 main(int argc, char* argv[]) {
+  PhaseTimer startup;
   const char* pname = argv[0];
   const char* sockname = DEFAULT_SOCKET_NAME;
   uint32_t displayId = DEFAULT_DISPLAY_ID;
   unsigned int quality = DEFAULT_JPG_QUALITY;
+  const QuantTables* quantTables = NULL;
+  QuantTables customQuantTables;
   bool showInfo = false;
   bool takeScreenshot = false;
+  bool rawScreenshot = false;
   bool skipFrames = false;
   bool testOnly = false;
+  bool keepSnapshot = false;
+  float jankRefreshRate = 0;
+  float syntheticFps = 0;
+  unsigned int syntheticStall = 0;
+  unsigned int stallTimeout = 0;
+  std::vector<CaptureSession::Source> sources;
+  bool watermark = false;
+  Minicap::Format preferredFormat = JpgEncoder::getPreferredFormat();
+  std::string udpAddress = DEFAULT_UDP_ADDRESS;
+  int udpPort = 0;
+  int vsockPort = 0;
+  unsigned int udpFecGroup = 0;
+  unsigned int udpLossRate = 0;
   Projection proj;
 
   int opt;
-  while ((opt = getopt(argc, argv, "d:n:P:Q:siSth")) != -1) {
+  while ((opt = getopt(argc, argv, "d:n:P:Q:J:sRiSKj:tw:X:WM:Z:Y:V:U:F:L:h")) != -1) {
     switch (opt) {
     case 'd':
       displayId = atoi(optarg);
@@ -235,18 +334,111 @@ main(int argc, char* argv[]) {
     case 'Q':
       quality = atoi(optarg);
       break;
+    case 'J':
+      if (!QuantTables::findPreset(optarg, &quantTables)) {
+        if (!QuantTables::load(optarg, &customQuantTables)) {
+          std::cerr << "ERROR: -J needs a known preset or a valid table file" << std::endl;
+          return EXIT_FAILURE;
+        }
+        quantTables = &customQuantTables;
+      }
+      break;
     case 's':
       takeScreenshot = true;
       break;
+    case 'R':
+      rawScreenshot = true;
+      break;
     case 'i':
       showInfo = true;
       break;
     case 'S':
       skipFrames = true;
       break;
+    case 'K':
+      keepSnapshot = true;
+      break;
+    case 'j':
+      jankRefreshRate = atof(optarg);
+      if (jankRefreshRate <= 0) {
+        std::cerr << "ERROR: invalid refresh rate for -j" << std::endl;
+        return EXIT_FAILURE;
+      }
+      break;
     case 't':
       testOnly = true;
       break;
+    case 'w':
+      stallTimeout = atoi(optarg);
+      break;
+    case 'X':
+      syntheticFps = atof(optarg);
+      if (syntheticFps <= 0) {
+        std::cerr << "ERROR: invalid frame rate for -X" << std::endl;
+        return EXIT_FAILURE;
+      }
+      break;
+    case 'W':
+      watermark = true;
+      break;
+    case 'M': {
+      std::istringstream list(optarg);
+      std::string value;
+      while (std::getline(list, value, ',')) {
+        CaptureSession::Source source;
+        if (!source.parse(value)) {
+          std::cerr << "ERROR: invalid capture source '" << value << "' for -M" << std::endl;
+          return EXIT_FAILURE;
+        }
+        sources.push_back(source);
+      }
+      break;
+    }
+    case 'Z':
+      syntheticStall = atoi(optarg);
+      break;
+    case 'Y':
+      if (strcmp(optarg, "nv12") == 0) {
+        preferredFormat = Minicap::FORMAT_NV12;
+      }
+      else if (strcmp(optarg, "nv21") == 0) {
+        preferredFormat = Minicap::FORMAT_NV21;
+      }
+      else if (strcmp(optarg, "i420") == 0) {
+        preferredFormat = Minicap::FORMAT_I420;
+      }
+      else {
+        std::cerr << "ERROR: -Y needs nv12, nv21 or i420" << std::endl;
+        return EXIT_FAILURE;
+      }
+      break;
+    case 'V':
+      vsockPort = atoi(optarg);
+      if (vsockPort <= 0) {
+        std::cerr << "ERROR: invalid port for -V" << std::endl;
+        return EXIT_FAILURE;
+      }
+      break;
+    case 'U': {
+      std::string value = optarg;
+      size_t colon = value.rfind(':');
+      if (colon != std::string::npos) {
+        udpAddress = value.substr(0, colon);
+        value = value.substr(colon + 1);
+      }
+      udpPort = atoi(value.c_str());
+      if (udpPort <= 0 || udpPort > 65535) {
+        std::cerr << "ERROR: invalid port for -U" << std::endl;
+        return EXIT_FAILURE;
+      }
+      break;
+    }
+    case 'F':
+      udpFecGroup = atoi(optarg);
+      break;
+    case 'L':
+      udpLossRate = atoi(optarg);
+      break;
     case 'h':
       usage(pname);
       return EXIT_SUCCESS;
@@ -267,6 +459,7 @@ main(int argc, char* argv[]) {
 
   // Start Android's thread pool so that it will be able to serve our requests.
   minicap_start_thread_pool();
+  startup.mark("thread pool");
 
   if (showInfo) {
     Minicap::DisplayInfo info;
@@ -338,57 +531,115 @@ main(int argc, char* argv[]) {
   desiredInfo.height = proj.virtualHeight;
   desiredInfo.orientation = proj.rotation;
 
-  // Leave a 4-byte padding to the encoder so that we can inject the size
-  // to the same buffer.
-  JpgEncoder encoder(4, 0);
   Minicap::Frame frame;
+  Minicap::Frame converted;
+  CaptureSession capture;
+  CaptureSession::Source source;
+  CaptureProbe probe(displayId, PROBE_DURATION_MS);
+  unsigned char quirks = 0;
   bool haveFrame = false;
+  bool sentFrame = false;
 
   // Server config.
   SimpleServer server;
+  SimpleServer vsockServer;
+  FrameStreamer streamer(quality);
+  UdpTransport udp;
+  JankMonitor jankMonitor(jankRefreshRate);
+  CaptureWatchdog watchdog(stallTimeout);
+  std::vector<struct pollfd> pollFds;
+
+  streamer.setQuantTables(quantTables);
+
+  // Get the encoder ready on another thread while the capture method starts
+  // up, which is by far the slowest part. Nothing else touches the streamer
+  // until we've waited for it. Screenshots have their own encoder.
+  std::future<bool> encoderReady;
+  if (!testOnly && !takeScreenshot) {
+    PhaseTimer::Clock::time_point origin = startup.getOrigin();
+    encoderReady = std::async(std::launch::async, [&, origin]() {
+      PhaseTimer timer(origin);
+      bool ok = streamer.prepare(desiredInfo.width, desiredInfo.height);
+      timer.mark("encoder warm up");
+      return ok;
+    });
+  }
 
-  // Set up minicap.
-  Minicap* minicap = minicap_create(displayId);
-  if (minicap == NULL) {
-    return EXIT_FAILURE;
+  // Without -M, frames come from the minicap.so we're linked against, or
+  // are made up with -X.
+  source.syntheticFps = syntheticFps;
+
+  if (sources.size() == 1) {
+    source = sources[0];
   }
+  else if (sources.size() > 1) {
+    for (size_t i = 0; i < sources.size(); ++i) {
+      probe.run(sources[i], realInfo, desiredInfo, preferredFormat);
+    }
 
-  // Figure out the quirks the current capture method has.
-  unsigned char quirks = 0;
-  switch (minicap->getCaptureMethod()) {
-  case Minicap::METHOD_FRAMEBUFFER:
-    quirks |= QUIRK_DUMB | QUIRK_TEAR;
-    break;
-  case Minicap::METHOD_SCREENSHOT:
-    quirks |= QUIRK_DUMB;
-    break;
-  case Minicap::METHOD_VIRTUAL_DISPLAY:
-    quirks |= QUIRK_ALWAYS_UPRIGHT;
-    break;
+    int best = CaptureProbe::pick(probe.getResults());
+    if (best < 0) {
+      MCERROR("None of the capture sources delivered any frames");
+      return EXIT_FAILURE;
+    }
+
+    source = sources[best];
+    startup.mark("probe capture");
   }
 
-  if (minicap->setRealInfo(realInfo) != 0) {
-    MCERROR("Minicap did not accept real display info");
-    goto disaster;
+  source.watermark = watermark;
+
+  // Raw screenshots are wanted in the capture format, which libminicap
+  // doesn't hand out for wide gamut and HDR frames.
+  if (takeScreenshot && !rawScreenshot) {
+    int err = take_screenshot(displayId, source, proj, quality, quantTables, preferredFormat);
+    if (err != 0) {
+      MCERROR("Unable to take screenshot (%s)", strerror(-err));
+      return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
   }
 
-  if (minicap->setDesiredInfo(desiredInfo) != 0) {
-    MCERROR("Minicap did not accept desired display info");
-    goto disaster;
+  // Set up minicap.
+  if (!capture.create(displayId, source)) {
+    return EXIT_FAILURE;
   }
 
-  minicap->setFrameAvailableListener(&gWaiter);
+  MCINFO("Using capture source '%s' (%s)", source.getName().c_str(), capture.getMethodName());
 
-  if (minicap->applyConfigChanges() != 0) {
-    MCERROR("Unable to start minicap with current config");
-    goto disaster;
+  if (syntheticStall > 0 && !capture.simulateStall(syntheticStall)) {
+    MCWARN("Only synthetic frames can stall on purpose, ignoring -Z");
   }
 
-  if (!encoder.reserveData(realInfo.width, realInfo.height)) {
-    MCERROR("Unable to reserve data for JPG encoder");
+  startup.mark("create capture");
+
+  // Figure out the quirks the current capture method has.
+  quirks = capture.getQuirks();
+
+  // Dumb capture methods announce a frame whenever we're ready for one,
+  // which says nothing about the app.
+  if (jankRefreshRate > 0 && (quirks & CaptureSession::QUIRK_DUMB)) {
+    MCWARN("Capture method doesn't report real frame arrivals, ignoring -j");
+    jankRefreshRate = 0;
+  }
+
+  if (jankRefreshRate > 0) {
+    gWaiter.setJankMonitor(&jankMonitor);
+  }
+
+  // Ask for the format the encoder takes most cheaply, unless told
+  // otherwise.
+  if (!capture.configure(realInfo, desiredInfo, preferredFormat, &gWaiter)) {
     goto disaster;
   }
 
+  startup.mark("configure capture");
+
+  MCINFO("Preferred capture format %s, backend delivers %s",
+    format_name(preferredFormat),
+    format_name(capture.getCaptureFormat()));
+
   if (takeScreenshot) {
     if (!gWaiter.waitForFrame()) {
       MCERROR("Unable to wait for frame");
@@ -396,18 +647,16 @@ main(int argc, char* argv[]) {
     }
 
     int err;
-    if ((err = minicap->consumePendingFrame(&frame)) != 0) {
+    if ((err = capture.consume(&frame)) != 0) {
       MCERROR("Unable to consume pending frame");
       goto disaster;
     }
 
-    if (!encoder.encode(&frame, quality)) {
-      MCERROR("Unable to encode frame");
-      goto disaster;
-    }
+    MCINFO("Raw screenshot is %ux%u %s with %u bytes per pixel",
+      frame.width, frame.height, format_name(frame.format), frame.bpp);
 
-    if (pumpf(STDOUT_FILENO, encoder.getEncodedData(), encoder.getEncodedSize()) < 0) {
-      MCERROR("Unable to output encoded frame data");
+    if (pump_raw_frame(STDOUT_FILENO, &frame) < 0) {
+      MCERROR("Unable to output raw frame data");
       goto disaster;
     }
 
@@ -421,117 +670,241 @@ main(int argc, char* argv[]) {
       return EXIT_FAILURE;
     }
 
-    minicap_free(minicap);
     std::cout << "OK" << std::endl;
     return EXIT_SUCCESS;
   }
 
-  if (!server.start(sockname)) {
+  if (server.start(sockname) < 0) {
     MCERROR("Unable to start server on namespace '%s'", sockname);
     goto disaster;
   }
 
+  if (vsockPort > 0 && vsockServer.startVsock(vsockPort) < 0) {
+    MCERROR("Unable to start server on vsock port %d", vsockPort);
+    goto disaster;
+  }
+
+  startup.mark("start servers");
+
+  if (!encoderReady.get()) {
+    MCERROR("Unable to reserve data for JPG encoder");
+    goto disaster;
+  }
+
+  startup.mark("wait for encoder");
+
   // Prepare banner for clients.
-  unsigned char banner[BANNER_SIZE];
-  banner[0] = (unsigned char) BANNER_VERSION;
-  banner[1] = (unsigned char) BANNER_SIZE;
-  putUInt32LE(banner + 2, getpid());
-  putUInt32LE(banner + 6,  realInfo.width);
-  putUInt32LE(banner + 10,  realInfo.height);
-  putUInt32LE(banner + 14, desiredInfo.width);
-  putUInt32LE(banner + 18, desiredInfo.height);
-  banner[22] = (unsigned char) desiredInfo.orientation;
-  banner[23] = quirks;
-
-  int fd;
-  while (!gWaiter.isStopped() && (fd = server.accept()) > 0) {
-    MCINFO("New client connection");
-
-    if (pumps(fd, banner, BANNER_SIZE) < 0) {
-      close(fd);
-      continue;
+  unsigned char banner[Banner::SIZE];
+  Banner::write(banner, getpid(), realInfo, desiredInfo, quirks);
+
+  streamer.setBanner(banner, Banner::SIZE, Banner::TOKEN_OFFSET);
+  streamer.setKeepSnapshot(keepSnapshot);
+
+  if (jankRefreshRate > 0) {
+    streamer.setJankMonitor(&jankMonitor);
+  }
+
+  if (watchdog.isEnabled()) {
+    streamer.setCaptureWatchdog(&watchdog);
+  }
+
+  streamer.setCaptureMethod(source.getName(), capture.getMethodName(), probe.getResults());
+
+  if (udpPort > 0) {
+    if (!udp.start(udpAddress.c_str(), udpPort, UdpTransport::DEFAULT_MTU, udpFecGroup)) {
+      MCERROR("Unable to start UDP transport on %s:%d", udpAddress.c_str(), udpPort);
+      goto disaster;
     }
 
+    udp.setBanner(banner, Banner::SIZE);
+    udp.setLossRate(udpLossRate);
+    streamer.setUdpTransport(&udp);
+  }
+
+  while (!gWaiter.isStopped()) {
     int pending, err;
-    while (!gWaiter.isStopped() && (pending = gWaiter.waitForFrame()) > 0) {
-      if (skipFrames && pending > 1) {
-        // Skip frames if we have too many. Not particularly thread safe,
-        // but this loop should be the only consumer anyway (i.e. nothing
-        // else decreases the frame count).
-        gWaiter.reportExtraConsumption(pending - 1);
-
-        while (--pending >= 1) {
-          if ((err = minicap->consumePendingFrame(&frame)) != 0) {
-            if (err == -EINTR) {
-              MCINFO("Frame consumption interrupted by EINTR");
-              goto close;
-            }
-            else {
-              MCERROR("Unable to skip pending frame");
-              goto disaster;
-            }
-          }
 
-          minicap->releaseConsumedFrame(&frame);
-        }
+    // Wait for new clients, client messages and frames all at once. Frames
+    // are only consumed while someone is connected, unless we're keeping a
+    // snapshot. While monitoring jank, they're released right away
+    // otherwise, so that the buffers keep flowing.
+    pollFds.clear();
+    pollFds.push_back({ server.getFd(), POLLIN, 0 });
+    pollFds.push_back({ gWaiter.getWakeFd(), POLLIN, 0 });
+    pollFds.push_back({ udp.getFd(), POLLIN, 0 });
+    pollFds.push_back({ vsockServer.getFd(), POLLIN, 0 });
+    streamer.fillPollSet(pollFds);
+
+    bool wantsFrames = streamer.wantsFrames();
+    bool drainFrames = !wantsFrames && jankRefreshRate > 0;
+
+    int timeout = (wantsFrames || drainFrames) && gWaiter.hasPendingFrames()
+      ? 0 : streamer.getTimeout(100);
+
+    if (wantsFrames) {
+      timeout = watchdog.getTimeout(CaptureWatchdog::Clock::now(), timeout);
+    }
+
+    if (poll(pollFds.data(), pollFds.size(), timeout) < 0) {
+      if (errno == EINTR) {
+        continue;
       }
 
-      if ((err = minicap->consumePendingFrame(&frame)) != 0) {
+      MCERROR("Unable to poll for events");
+      goto disaster;
+    }
+
+    if (pollFds[1].revents & POLLIN) {
+      gWaiter.drain();
+    }
+
+    if (pollFds[2].revents & POLLIN) {
+      udp.handleReadable();
+    }
+
+    streamer.handlePollSet(pollFds, 4);
+
+    if (pollFds[0].revents & POLLIN) {
+      int fd = server.accept();
+
+      if (fd >= 0) {
+        MCINFO("New client connection");
+        streamer.addClient(fd);
+      }
+    }
+
+    if (pollFds[3].revents & POLLIN) {
+      int fd = vsockServer.accept();
+
+      if (fd >= 0) {
+        MCINFO("New vsock client connection");
+        streamer.addClient(fd);
+      }
+    }
+
+    if (streamer.wantsFrames() && watchdog.wantsDisplayActivity(CaptureWatchdog::Clock::now())) {
+      watchdog.onDisplayActivity(CaptureWatchdog::Clock::now(), capture.getDisplayActivity());
+    }
+
+    // Clients keep their connections while the capture method is rebuilt
+    // under them. Nothing is consumed at this point.
+    if (!streamer.wantsFrames()) {
+      watchdog.onIdle(CaptureWatchdog::Clock::now());
+    }
+    else if (watchdog.isStalled(CaptureWatchdog::Clock::now())) {
+      CaptureWatchdog::Clock::time_point stalledAt = CaptureWatchdog::Clock::now();
+
+      MCWARN("Capture stalled, display is active but no frames arrive, rebuilding it");
+
+      if (!capture.rebuild()) {
+        MCERROR("Unable to rebuild capture");
+        goto disaster;
+      }
+
+      watchdog.onRebuilt(stalledAt);
+
+      CaptureWatchdog::Stats stats;
+      watchdog.getStats(&stats);
+      MCINFO("Capture rebuilt after %ums without frames, rebuild took %.2fms",
+        stats.lastStallMs, std::chrono::duration_cast<std::chrono::microseconds>(
+          CaptureWatchdog::Clock::now() - stalledAt).count() / 1000.0);
+      continue;
+    }
+
+    if (!streamer.wantsFrames() && jankRefreshRate > 0 && gWaiter.tryWaitForFrame() > 0) {
+      if ((err = capture.consume(&frame)) != 0) {
         if (err == -EINTR) {
           MCINFO("Frame consumption interrupted by EINTR");
-          goto close;
+          goto next;
         }
         else {
-          MCERROR("Unable to consume pending frame");
+          MCERROR("Unable to drain pending frame");
           goto disaster;
         }
       }
 
-      haveFrame = true;
+      capture.release(&frame);
+      streamer.discardFrame();
+      continue;
+    }
 
-      // Encode the frame.
-      if (!encoder.encode(&frame, quality)) {
-        MCERROR("Unable to encode frame");
-        goto disaster;
-      }
+    if (!streamer.wantsFrames() || (pending = gWaiter.tryWaitForFrame()) <= 0) {
+      continue;
+    }
 
-      // Push it out synchronously because it's fast and we don't care
-      // about other clients.
-      unsigned char* data = encoder.getEncodedData() - 4;
-      size_t size = encoder.getEncodedSize();
+    if (skipFrames && pending > 1) {
+      // Skip frames if we have too many. Not particularly thread safe,
+      // but this loop should be the only consumer anyway (i.e. nothing
+      // else decreases the frame count).
+      gWaiter.reportExtraConsumption(pending - 1);
+
+      while (--pending >= 1) {
+        if ((err = capture.consume(&frame)) != 0) {
+          if (err == -EINTR) {
+            MCINFO("Frame consumption interrupted by EINTR");
+            goto next;
+          }
+          else {
+            MCERROR("Unable to skip pending frame");
+            goto disaster;
+          }
+        }
 
-      putUInt32LE(data, size);
+        capture.release(&frame);
+      }
+    }
 
-      if (pumps(fd, data, size + 4) < 0) {
-        break;
+    if ((err = capture.consume(&frame)) != 0) {
+      if (err == -EINTR) {
+        MCINFO("Frame consumption interrupted by EINTR");
+        goto next;
+      }
+      else {
+        MCERROR("Unable to consume pending frame");
+        goto disaster;
       }
+    }
 
-      // This will call onFrameAvailable() on older devices, so we have
-      // to do it here or the loop will stop.
-      minicap->releaseConsumedFrame(&frame);
-      haveFrame = false;
+    haveFrame = true;
+
+    if (watchdog.onFrame(CaptureWatchdog::Clock::now())) {
+      CaptureWatchdog::Stats stats;
+      watchdog.getStats(&stats);
+      MCINFO("Capture recovered, first frame %ums after the stall was detected",
+        stats.lastRecoveryMs);
     }
 
-close:
-    MCINFO("Closing client connection");
-    close(fd);
+    // Everything downstream wants 8 bits per channel.
+    if (!capture.normalize(&frame, &converted)) {
+      goto disaster;
+    }
 
-    // Have we consumed one frame but are still holding it?
-    if (haveFrame) {
-      minicap->releaseConsumedFrame(&frame);
+    // Encode once per distinct viewport and push it out synchronously
+    // because it's fast.
+    if (!streamer.streamFrame(&converted)) {
+      goto disaster;
+    }
+
+    if (!sentFrame && streamer.hasClients()) {
+      MCINFO("First frame sent %.2fms after start", startup.elapsed());
+      sentFrame = true;
     }
-  }
 
-  minicap_free(minicap);
+    // This will call onFrameAvailable() on older devices, so we have
+    // to do it here or the loop will stop.
+    capture.release(&frame);
+    haveFrame = false;
+
+next:
+    continue;
+  }
 
   return EXIT_SUCCESS;
 
 disaster:
   if (haveFrame) {
-    minicap->releaseConsumedFrame(&frame);
+    capture.release(&frame);
   }
 
-  minicap_free(minicap);
-
   return EXIT_FAILURE;
 }
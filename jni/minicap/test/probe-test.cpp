@@ -0,0 +1,154 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <string>
+#include <vector>
+
+#include <Minicap.hpp>
+
+#include "CaptureProbe.hpp"
+#include "CaptureSession.hpp"
+
+// Checks which capture source CaptureProbe::pick() settles on. The results
+// are what the probe measures for the capture methods of real devices,
+// with the numbers a mock backend would produce. A short probe of
+// synthetic sources checks the whole way from run() to pick() at the end.
+
+static CaptureProbe::Result
+mock(const char* name, unsigned char quirks, uint32_t frames, float fps,
+    float firstFrameMs, float frameMs) {
+  CaptureProbe::Result result;
+  result.name = name;
+  result.method = "mock";
+  result.ok = frames > 0;
+  result.quirks = quirks;
+  result.frames = frames;
+  result.fps = fps;
+  result.firstFrameMs = firstFrameMs;
+  result.frameMs = frameMs;
+  return result;
+}
+
+struct Case {
+  const char* description;
+  std::vector<CaptureProbe::Result> results;
+  std::string expected;
+};
+
+static std::vector<Case>
+cases() {
+  const unsigned char dumb = CaptureSession::QUIRK_DUMB;
+  const unsigned char upright = CaptureSession::QUIRK_ALWAYS_UPRIGHT;
+  std::vector<Case> cases;
+
+  {
+    Case c;
+    c.description = "static screen, virtual display only sends its first frame";
+    c.results.push_back(mock("virtual", upright, 1, 2, 35, 0.4f));
+    c.results.push_back(mock("screenshot", dumb, 24, 48, 30, 20));
+    c.expected = "virtual";
+    cases.push_back(c);
+  }
+
+  {
+    Case c;
+    c.description = "moving screen, virtual display at the refresh rate";
+    c.results.push_back(mock("screenshot", dumb, 24, 48, 30, 20));
+    c.results.push_back(mock("virtual", upright, 30, 60, 35, 0.4f));
+    c.expected = "virtual";
+    cases.push_back(c);
+  }
+
+  {
+    Case c;
+    c.description = "virtual display that is slow to hand over frames";
+    c.results.push_back(mock("virtual", upright, 12, 24, 35, 45));
+    c.results.push_back(mock("screenshot", dumb, 24, 48, 30, 20));
+    c.expected = "screenshot";
+    cases.push_back(c);
+  }
+
+  {
+    Case c;
+    c.description = "dumb methods go by frame rate";
+    c.results.push_back(mock("framebuffer", dumb, 10, 20, 5, 2));
+    c.results.push_back(mock("screenshot", dumb, 24, 48, 30, 20));
+    c.expected = "screenshot";
+    cases.push_back(c);
+  }
+
+  {
+    Case c;
+    c.description = "close enough, the faster start wins";
+    c.results.push_back(mock("slow start", upright, 1, 2, 80, 0.40f));
+    c.results.push_back(mock("fast start", upright, 1, 2, 20, 0.42f));
+    c.expected = "fast start";
+    cases.push_back(c);
+  }
+
+  {
+    Case c;
+    c.description = "sources without frames never win";
+    c.results.push_back(mock("broken", upright, 0, 0, 0, 0));
+    c.results.push_back(mock("screenshot", dumb, 2, 4, 300, 250));
+    c.expected = "screenshot";
+    cases.push_back(c);
+  }
+
+  {
+    Case c;
+    c.description = "nothing works";
+    c.results.push_back(mock("broken", upright, 0, 0, 0, 0));
+    c.expected = "";
+    cases.push_back(c);
+  }
+
+  return cases;
+}
+
+int
+main() {
+  int failures = 0;
+
+  std::vector<Case> all = cases();
+  for (size_t i = 0; i < all.size(); ++i) {
+    const Case& c = all[i];
+    int best = CaptureProbe::pick(c.results);
+    std::string picked = best < 0 ? "" : c.results[best].name;
+
+    if (picked != c.expected) {
+      fprintf(stderr, "FAIL: %s: picked '%s' instead of '%s'\n",
+        c.description, picked.c_str(), c.expected.c_str());
+      failures += 1;
+    }
+  }
+
+  Minicap::DisplayInfo realInfo;
+  realInfo.width = 720;
+  realInfo.height = 1280;
+
+  Minicap::DisplayInfo desiredInfo;
+  desiredInfo.width = 360;
+  desiredInfo.height = 640;
+  desiredInfo.orientation = 0;
+
+  CaptureProbe probe(0, 200);
+  CaptureSession::Source missing;
+  CaptureSession::Source synthetic;
+  missing.parse("/nonexistent/minicap.so");
+  synthetic.parse("synthetic:30");
+  probe.run(missing, realInfo, desiredInfo, Minicap::FORMAT_RGBA_8888);
+  probe.run(synthetic, realInfo, desiredInfo, Minicap::FORMAT_RGBA_8888);
+
+  if (CaptureProbe::pick(probe.getResults()) != 1) {
+    fprintf(stderr, "FAIL: probe did not pick the only working source\n");
+    failures += 1;
+  }
+
+  if (failures > 0) {
+    return EXIT_FAILURE;
+  }
+
+  printf("OK\n");
+  return EXIT_SUCCESS;
+}
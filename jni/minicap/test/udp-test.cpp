@@ -0,0 +1,274 @@
+#include <arpa/inet.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "UdpTransport.hpp"
+#include "util/pump.hpp"
+
+// Talks to a UdpTransport over loopback the way a peer would. Checks that
+// hellos need a session token, and that frames can be put back together
+// from their fragments, with parity making up for a lost fragment and
+// NACKs for more.
+
+#define FRAME_SIZE 10000
+#define FEC_GROUP 4
+#define TOKEN 0x0123456789abcdefULL
+
+static int failures = 0;
+
+static void
+check(bool ok, const char* description) {
+  if (!ok) {
+    fprintf(stderr, "FAIL: %s\n", description);
+    failures += 1;
+  }
+}
+
+// A frame as it's being put back together from datagrams.
+struct Reassembly {
+  uint32_t sequence;
+  uint16_t count;
+  uint16_t payloadSize;
+  uint32_t size;
+  std::map<uint16_t, std::string> fragments;
+  std::map<uint16_t, std::string> parity;
+
+  Reassembly()
+    : sequence(0),
+      count(0),
+      payloadSize(0),
+      size(0)
+  {
+  }
+
+  void
+  add(const unsigned char* data, size_t len) {
+    uint16_t index = getUInt16LE(data + 2);
+    std::string payload(reinterpret_cast<const char*>(data) + UdpTransport::HEADER_SIZE,
+      len - UdpTransport::HEADER_SIZE);
+
+    sequence = getUInt32LE(data + 4);
+    count = getUInt16LE(data + 8);
+    payloadSize = getUInt16LE(data + 10);
+    size = getUInt32LE(data + 12);
+
+    if (data[0] == UdpTransport::PACKET_PARITY) {
+      parity[index] = payload;
+    }
+    else {
+      fragments[index] = payload;
+    }
+  }
+
+  // Rebuilds single missing fragments of a group from its parity.
+  void
+  repair() {
+    for (std::map<uint16_t, std::string>::iterator it = parity.begin(); it != parity.end(); ++it) {
+      uint16_t first = it->first * FEC_GROUP;
+      uint16_t missing = count;
+      int missingCount = 0;
+
+      for (uint16_t i = first; i < first + FEC_GROUP && i < count; ++i) {
+        if (fragments.find(i) == fragments.end()) {
+          missing = i;
+          missingCount += 1;
+        }
+      }
+
+      if (missingCount != 1) {
+        continue;
+      }
+
+      std::string rebuilt = it->second;
+
+      for (uint16_t i = first; i < first + FEC_GROUP && i < count; ++i) {
+        const std::string& fragment = fragments[i];
+        for (size_t j = 0; j < fragment.size(); ++j) {
+          rebuilt[j] ^= fragment[j];
+        }
+      }
+
+      // Only the last fragment is shorter, and the parity is padded.
+      size_t length = missing + 1 == count ? size - missing * payloadSize : payloadSize;
+      fragments[missing] = rebuilt.substr(0, length);
+    }
+  }
+
+  std::vector<uint16_t>
+  getMissing() {
+    std::vector<uint16_t> missing;
+    for (uint16_t i = 0; i < count; ++i) {
+      if (fragments.find(i) == fragments.end()) {
+        missing.push_back(i);
+      }
+    }
+    return missing;
+  }
+
+  std::string
+  getFrame() {
+    std::string frame;
+    for (uint16_t i = 0; i < count; ++i) {
+      frame += fragments[i];
+    }
+    return frame;
+  }
+};
+
+static std::vector<std::string>
+receive(int fd) {
+  std::vector<std::string> datagrams;
+  struct pollfd pfd = { fd, POLLIN, 0 };
+
+  while (poll(&pfd, 1, 200) > 0) {
+    char buffer[2048];
+    ssize_t len = recv(fd, buffer, sizeof(buffer), 0);
+
+    if (len <= 0) {
+      break;
+    }
+
+    datagrams.push_back(std::string(buffer, len));
+  }
+
+  return datagrams;
+}
+
+static void
+sendHello(int fd, uint64_t token) {
+  unsigned char hello[UdpTransport::HELLO_SIZE] = { UdpTransport::PACKET_HELLO };
+  putUInt64LE(hello + 4, token);
+  send(fd, hello, sizeof(hello), 0);
+}
+
+static void
+sendNack(int fd, uint32_t sequence, const std::vector<uint16_t>& indexes) {
+  std::vector<unsigned char> nack(12 + indexes.size() * 2, 0);
+  nack[0] = UdpTransport::PACKET_NACK;
+  putUInt32LE(nack.data() + 4, sequence);
+  putUInt16LE(nack.data() + 8, indexes.size());
+
+  for (size_t i = 0; i < indexes.size(); ++i) {
+    putUInt16LE(nack.data() + 12 + i * 2, indexes[i]);
+  }
+
+  send(fd, nack.data(), nack.size(), 0);
+}
+
+int
+main() {
+  UdpTransport transport;
+
+  if (!transport.start("127.0.0.1", 0, UdpTransport::DEFAULT_MTU, FEC_GROUP)) {
+    fprintf(stderr, "Unable to start UDP transport\n");
+    return EXIT_FAILURE;
+  }
+
+  unsigned char banner[8] = { 1, 8, 0, 0, 0, 0, 0, 0 };
+  transport.setBanner(banner, sizeof(banner));
+
+  struct sockaddr_in addr;
+  socklen_t addrLen = sizeof(addr);
+  getsockname(transport.getFd(), (struct sockaddr*) &addr, &addrLen);
+
+  int peer = socket(AF_INET, SOCK_DGRAM, 0);
+  if (peer < 0 || connect(peer, (struct sockaddr*) &addr, sizeof(addr)) < 0) {
+    fprintf(stderr, "Unable to connect to UDP transport\n");
+    return EXIT_FAILURE;
+  }
+
+  // Hellos without the token of a session go unanswered.
+  unsigned char bare = UdpTransport::PACKET_HELLO;
+  send(peer, &bare, 1, 0);
+  sendHello(peer, TOKEN);
+  transport.handleReadable();
+  check(receive(peer).empty(), "hello without a valid token was answered");
+  check(!transport.hasPeers(), "hello without a valid token registered a peer");
+
+  std::vector<uint64_t> tokens;
+  tokens.push_back(TOKEN);
+  transport.setTokens(tokens);
+  sendHello(peer, TOKEN);
+  transport.handleReadable();
+
+  std::vector<std::string> datagrams = receive(peer);
+  check(datagrams.size() == 1 && datagrams[0].size() == 1 + sizeof(banner) &&
+    datagrams[0][0] == UdpTransport::PACKET_BANNER, "hello with the token got no banner");
+  check(transport.hasPeers(), "hello with the token registered no peer");
+
+  std::string frame(FRAME_SIZE, 0);
+  for (size_t i = 0; i < frame.size(); ++i) {
+    frame[i] = (i * 7919) >> 3;
+  }
+
+  // Lose the second fragment of every group, which parity makes up for.
+  transport.sendFrame(reinterpret_cast<const unsigned char*>(frame.data()), frame.size());
+  datagrams = receive(peer);
+
+  Reassembly first;
+  for (size_t i = 0; i < datagrams.size(); ++i) {
+    const unsigned char* data = reinterpret_cast<const unsigned char*>(datagrams[i].data());
+    if (data[0] == UdpTransport::PACKET_FRAGMENT && getUInt16LE(data + 2) % FEC_GROUP == 1) {
+      continue;
+    }
+    first.add(data, datagrams[i].size());
+  }
+
+  first.repair();
+  check(first.getMissing().empty(), "parity did not make up for lost fragments");
+  check(first.getFrame() == frame, "frame repaired with parity is different");
+
+  // Lose two fragments of the first group, which only a NACK helps with.
+  transport.sendFrame(reinterpret_cast<const unsigned char*>(frame.data()), frame.size());
+  datagrams = receive(peer);
+
+  Reassembly second;
+  for (size_t i = 0; i < datagrams.size(); ++i) {
+    const unsigned char* data = reinterpret_cast<const unsigned char*>(datagrams[i].data());
+    if (data[0] == UdpTransport::PACKET_FRAGMENT && getUInt16LE(data + 2) < 2) {
+      continue;
+    }
+    second.add(data, datagrams[i].size());
+  }
+
+  second.repair();
+  std::vector<uint16_t> missing = second.getMissing();
+  check(missing.size() == 2, "parity repaired a group with two lost fragments");
+
+  // NACKs for anything but the newest frame are ignored.
+  sendNack(peer, first.sequence, missing);
+  transport.handleReadable();
+  check(receive(peer).empty(), "NACK for an old frame was answered");
+
+  sendNack(peer, second.sequence, missing);
+  transport.handleReadable();
+  datagrams = receive(peer);
+  check(datagrams.size() == missing.size(), "NACK did not resend just the missing fragments");
+
+  for (size_t i = 0; i < datagrams.size(); ++i) {
+    second.add(reinterpret_cast<const unsigned char*>(datagrams[i].data()), datagrams[i].size());
+  }
+
+  check(second.getMissing().empty(), "NACK did not fill in the lost fragments");
+  check(second.getFrame() == frame, "frame repaired with a NACK is different");
+
+  // Peers go away with their session.
+  transport.setTokens(std::vector<uint64_t>());
+  check(!transport.hasPeers(), "peer outlived its session");
+
+  close(peer);
+
+  if (failures > 0) {
+    return EXIT_FAILURE;
+  }
+
+  printf("OK\n");
+  return EXIT_SUCCESS;
+}
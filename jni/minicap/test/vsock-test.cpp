@@ -0,0 +1,160 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <string>
+#include <thread>
+
+#include "SimpleServer.hpp"
+#include "util/pump.hpp"
+#include "util/vsock.hpp"
+
+// Connects to a SimpleServer's vsock port through the loopback (CID 1), the
+// way the host connects to a guest, and checks that frame sized writes come
+// through intact. The same transfer over the abstract socket, which is
+// where adb forward's relay ends up on the device, gives a baseline. Needs
+// the vsock_loopback module; without it, there's nothing to test.
+
+#define PORT 1313
+#define SOCKNAME "minicap-vsock-test"
+#define FRAME_SIZE 100000
+#define FRAME_COUNT 500
+
+static int failures = 0;
+
+static void
+check(bool ok, const char* description) {
+  if (!ok) {
+    fprintf(stderr, "FAIL: %s\n", description);
+    failures += 1;
+  }
+}
+
+static void
+fillFrame(std::string& frame, uint32_t index) {
+  for (size_t i = 0; i < frame.size(); ++i) {
+    frame[i] = (i * 7919 + index * 31) >> 3;
+  }
+}
+
+// Writes FRAME_COUNT frames to one end and reads them back from the other.
+// Returns the throughput in MB/s, or a negative value if anything got lost
+// or changed on the way.
+static double
+transfer(int writer, int reader) {
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  bool written = true;
+
+  std::thread thread([&]() {
+    std::string frame(FRAME_SIZE, 0);
+
+    for (uint32_t n = 0; n < FRAME_COUNT && written; ++n) {
+      fillFrame(frame, n);
+      written = pumps(writer, reinterpret_cast<const unsigned char*>(frame.data()),
+        frame.size()) >= 0;
+    }
+  });
+
+  std::string expected(FRAME_SIZE, 0);
+  std::string frame(FRAME_SIZE, 0);
+  bool intact = true;
+
+  for (uint32_t n = 0; n < FRAME_COUNT && intact; ++n) {
+    size_t received = 0;
+
+    while (received < frame.size()) {
+      ssize_t len = recv(reader, &frame[received], frame.size() - received, 0);
+
+      if (len <= 0) {
+        intact = false;
+        break;
+      }
+
+      received += len;
+    }
+
+    fillFrame(expected, n);
+    intact = intact && frame == expected;
+  }
+
+  thread.join();
+
+  if (!written || !intact) {
+    return -1;
+  }
+
+  double seconds = std::chrono::duration_cast<std::chrono::microseconds>(
+    std::chrono::steady_clock::now() - start).count() / 1000000.0;
+
+  return static_cast<double>(FRAME_SIZE) * FRAME_COUNT / seconds / 1000000;
+}
+
+int
+main() {
+  SimpleServer vsockServer;
+
+  if (vsockServer.startVsock(PORT) < 0) {
+    printf("SKIP: unable to listen on vsock port %d (%s)\n", PORT, strerror(errno));
+    return EXIT_SUCCESS;
+  }
+
+  struct sockaddr_vm vaddr;
+  memset(&vaddr, 0, sizeof(vaddr));
+  vaddr.svm_family = AF_VSOCK;
+  vaddr.svm_port = PORT;
+  vaddr.svm_cid = VMADDR_CID_LOCAL;
+
+  int vsockClient = socket(AF_VSOCK, SOCK_STREAM, 0);
+  if (vsockClient < 0 || connect(vsockClient, (struct sockaddr*) &vaddr, sizeof(vaddr)) < 0) {
+    printf("SKIP: no vsock loopback, is vsock_loopback loaded? (%s)\n", strerror(errno));
+    return EXIT_SUCCESS;
+  }
+
+  int vsockPeer = vsockServer.accept();
+  check(vsockPeer >= 0, "vsock server did not accept the connection");
+
+  double vsockRate = vsockPeer >= 0 ? transfer(vsockPeer, vsockClient) : -1;
+  check(vsockRate > 0, "frames did not come through vsock intact");
+
+  SimpleServer unixServer;
+
+  if (unixServer.start(SOCKNAME) < 0) {
+    fprintf(stderr, "Unable to listen on abstract socket '%s'\n", SOCKNAME);
+    return EXIT_FAILURE;
+  }
+
+  struct sockaddr_un uaddr;
+  memset(&uaddr, 0, sizeof(uaddr));
+  uaddr.sun_family = AF_UNIX;
+  memcpy(&uaddr.sun_path[1], SOCKNAME, strlen(SOCKNAME));
+
+  int unixClient = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (unixClient < 0 || connect(unixClient, (struct sockaddr*) &uaddr,
+      sizeof(sa_family_t) + strlen(SOCKNAME) + 1) < 0) {
+    fprintf(stderr, "Unable to connect to abstract socket '%s'\n", SOCKNAME);
+    return EXIT_FAILURE;
+  }
+
+  int unixPeer = unixServer.accept();
+  double unixRate = unixPeer >= 0 ? transfer(unixPeer, unixClient) : -1;
+  check(unixRate > 0, "frames did not come through the abstract socket intact");
+
+  printf("vsock loopback %.0f MB/s, abstract socket %.0f MB/s\n", vsockRate, unixRate);
+
+  close(vsockClient);
+  close(vsockPeer);
+  close(unixClient);
+  close(unixPeer);
+
+  if (failures > 0) {
+    return EXIT_FAILURE;
+  }
+
+  printf("OK\n");
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,47 @@
+#ifndef MINICAP_UTIL_HASH_HPP
+#define MINICAP_UTIL_HASH_HPP
+
+#include <stdint.h>
+#include <string.h>
+
+#define HASH_PRIME 0x9E3779B97F4A7C15ULL
+
+inline uint64_t
+hashMix(uint64_t h, uint64_t value) {
+  h = (h ^ value) * HASH_PRIME;
+  return h ^ (h >> 29);
+}
+
+inline uint64_t
+hashRotate(uint64_t value, int bits) {
+  return (value << bits) | (value >> (64 - bits));
+}
+
+// Continues a hash with more bytes, e.g. the next row of a region of
+// pixels. Four independent lanes keep the multiplier busy instead of
+// waiting on a single chain.
+inline uint64_t
+hashBytes(uint64_t seed, const unsigned char* data, size_t size) {
+  uint64_t h0 = seed;
+  uint64_t h1 = seed ^ 0x2545F4914F6CDD1DULL;
+  uint64_t h2 = seed ^ 0xD6E8FEB86659FD93ULL;
+  uint64_t h3 = seed ^ 0x94D049BB133111EBULL;
+  size_t i = 0;
+
+  for (; i + 32 <= size; i += 32) {
+    uint64_t words[4];
+    memcpy(words, data + i, sizeof(words));
+    h0 = hashMix(h0, words[0]);
+    h1 = hashMix(h1, words[1]);
+    h2 = hashMix(h2, words[2]);
+    h3 = hashMix(h3, words[3]);
+  }
+
+  for (; i < size; ++i) {
+    h0 = hashMix(h0, data[i]);
+  }
+
+  return hashMix(h0, hashRotate(h1, 17) ^ hashRotate(h2, 31) ^ hashRotate(h3, 47));
+}
+
+#endif
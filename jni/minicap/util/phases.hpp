@@ -0,0 +1,57 @@
+#ifndef MINICAP_UTIL_PHASES_HPP
+#define MINICAP_UTIL_PHASES_HPP
+
+#include <chrono>
+
+#include "debug.h"
+
+// Logs how long each phase of something takes, and when it ends relative
+// to a common origin. Phases that run on other threads get a timer of
+// their own with the same origin, so that all of the lines add up.
+class PhaseTimer {
+public:
+  typedef std::chrono::steady_clock Clock;
+
+  PhaseTimer()
+    : mOrigin(Clock::now()),
+      mLast(mOrigin)
+  {
+  }
+
+  PhaseTimer(Clock::time_point origin)
+    : mOrigin(origin),
+      mLast(Clock::now())
+  {
+  }
+
+  Clock::time_point
+  getOrigin() const {
+    return mOrigin;
+  }
+
+  // Milliseconds since the origin.
+  double
+  elapsed() const {
+    return toMillis(Clock::now() - mOrigin);
+  }
+
+  // Ends the current phase and starts the next one.
+  void
+  mark(const char* phase) {
+    Clock::time_point now = Clock::now();
+    MCINFO("Startup phase '%s' took %.2fms, done at %.2fms", phase,
+      toMillis(now - mLast), toMillis(now - mOrigin));
+    mLast = now;
+  }
+
+private:
+  Clock::time_point mOrigin;
+  Clock::time_point mLast;
+
+  static double
+  toMillis(Clock::duration duration) {
+    return std::chrono::duration_cast<std::chrono::microseconds>(duration).count() / 1000.0;
+  }
+};
+
+#endif
@@ -0,0 +1,117 @@
+#ifndef MINICAP_UTIL_PUMP_HPP
+#define MINICAP_UTIL_PUMP_HPP
+
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+// Writes all of the data to a socket.
+inline int
+pumps(int fd, const unsigned char* data, size_t length) {
+  do {
+    // Make sure that we don't generate a SIGPIPE even if the socket doesn't
+    // exist anymore. We'll still get an EPIPE which is perfect.
+    int wrote = send(fd, data, length, MSG_NOSIGNAL);
+
+    if (wrote < 0) {
+      return wrote;
+    }
+
+    data += wrote;
+    length -= wrote;
+  }
+  while (length > 0);
+
+  return 0;
+}
+
+// Writes all of the buffers to a socket, in order.
+inline int
+pumpsv(int fd, struct iovec* iov, int count) {
+  while (count > 0) {
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = count;
+
+    ssize_t wrote = sendmsg(fd, &msg, MSG_NOSIGNAL);
+
+    if (wrote < 0) {
+      return wrote;
+    }
+
+    // Skip whatever got written completely and adjust the rest.
+    while (count > 0 && (size_t) wrote >= iov->iov_len) {
+      wrote -= iov->iov_len;
+      iov += 1;
+      count -= 1;
+    }
+
+    if (count > 0) {
+      iov->iov_base = static_cast<unsigned char*>(iov->iov_base) + wrote;
+      iov->iov_len -= wrote;
+    }
+  }
+
+  return 0;
+}
+
+// Writes all of the data to a regular file descriptor.
+inline int
+pumpf(int fd, const unsigned char* data, size_t length) {
+  do {
+    int wrote = write(fd, data, length);
+
+    if (wrote < 0) {
+      return wrote;
+    }
+
+    data += wrote;
+    length -= wrote;
+  }
+  while (length > 0);
+
+  return 0;
+}
+
+inline void
+putUInt16LE(unsigned char* data, uint16_t value) {
+  data[0] = (value & 0x00FF) >> 0;
+  data[1] = (value & 0xFF00) >> 8;
+}
+
+inline uint16_t
+getUInt16LE(const unsigned char* data) {
+  return (uint16_t) data[0] | ((uint16_t) data[1] << 8);
+}
+
+inline void
+putUInt32LE(unsigned char* data, uint32_t value) {
+  data[0] = (value & 0x000000FF) >> 0;
+  data[1] = (value & 0x0000FF00) >> 8;
+  data[2] = (value & 0x00FF0000) >> 16;
+  data[3] = (value & 0xFF000000) >> 24;
+}
+
+inline uint32_t
+getUInt32LE(const unsigned char* data) {
+  return (uint32_t) data[0] |
+      ((uint32_t) data[1] << 8) |
+      ((uint32_t) data[2] << 16) |
+      ((uint32_t) data[3] << 24);
+}
+
+inline void
+putUInt64LE(unsigned char* data, uint64_t value) {
+  putUInt32LE(data, value & 0xFFFFFFFF);
+  putUInt32LE(data + 4, value >> 32);
+}
+
+inline uint64_t
+getUInt64LE(const unsigned char* data) {
+  return (uint64_t) getUInt32LE(data) | ((uint64_t) getUInt32LE(data + 4) << 32);
+}
+
+#endif
@@ -0,0 +1,47 @@
+#ifndef MINICAP_UTIL_VSOCK_HPP
+#define MINICAP_UTIL_VSOCK_HPP
+
+#include <sys/socket.h>
+
+// Older NDK platforms don't ship <linux/vm_sockets.h>, so we bring our own
+// definitions where it's missing, under the same names. The layout is fixed
+// by the kernel ABI. Compilers that can't tell whether the header exists
+// get ours, unless the real one has already been included.
+#if defined(__has_include)
+#if __has_include(<linux/vm_sockets.h>)
+#include <linux/vm_sockets.h>
+#endif
+#endif
+
+#if !defined(_VM_SOCKETS_H) && !defined(_UAPI_VM_SOCKETS_H)
+#define _VM_SOCKETS_H
+
+struct sockaddr_vm {
+  sa_family_t svm_family;
+  unsigned short svm_reserved1;
+  unsigned int svm_port;
+  unsigned int svm_cid;
+  unsigned char svm_zero[sizeof(struct sockaddr) - sizeof(sa_family_t) -
+    sizeof(unsigned short) - sizeof(unsigned int) - sizeof(unsigned int)];
+};
+#endif
+
+#ifndef AF_VSOCK
+#define AF_VSOCK 40
+#endif
+
+// Any CID when listening; the host is always 2, and 1 is the loopback
+// (if the vsock_loopback module is loaded). Older headers lack some.
+#ifndef VMADDR_CID_ANY
+#define VMADDR_CID_ANY 0xFFFFFFFFU
+#endif
+
+#ifndef VMADDR_CID_LOCAL
+#define VMADDR_CID_LOCAL 1
+#endif
+
+#ifndef VMADDR_CID_HOST
+#define VMADDR_CID_HOST 2
+#endif
+
+#endif